@@ -0,0 +1,155 @@
+// Echo and sink server for the benchmarks. Everything received on the echo port is sent back, everything
+// received on the sink port is discarded. Both ports accept IPv4 and IPv6 connections.
+
+#include <errno.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define ECHO_BUFFER_SIZE (64 * 1024)
+#define MAX_EVENTS 256
+
+struct EchoConnection {
+    int fd;
+    int sink;
+    size_t length;
+    size_t sent;
+    char buffer[ECHO_BUFFER_SIZE];
+};
+
+// The listening sockets are registered with these markers as their data, instead of a connection.
+static int echoListenerMarker;
+static int sinkListenerMarker;
+
+static int createListener(int port) {
+    int fd = socket(AF_INET6, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        perror("socket()");
+        exit(1);
+    }
+
+    int yes = 1, no = 0;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+    setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &no, sizeof(no));
+
+    struct sockaddr_in6 address;
+    memset(&address, 0, sizeof(address));
+    address.sin6_family = AF_INET6;
+    address.sin6_addr = in6addr_any;
+    address.sin6_port = htons(port);
+    if (bind(fd, (struct sockaddr*)&address, sizeof(address)) != 0 || listen(fd, SOMAXCONN) != 0) {
+        perror("bind()");
+        exit(1);
+    }
+
+    return fd;
+}
+
+static void closeConnection(int epollFd, struct EchoConnection* conn) {
+    epoll_ctl(epollFd, EPOLL_CTL_DEL, conn->fd, NULL);
+    close(conn->fd);
+    free(conn);
+}
+
+static void acceptAll(int epollFd, int listener, int sink) {
+    int fd;
+    while ((fd = accept4(listener, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+        struct EchoConnection* conn = malloc(sizeof(struct EchoConnection));
+        if (conn == NULL) {
+            close(fd);
+            continue;
+        }
+
+        conn->fd = fd;
+        conn->sink = sink;
+        conn->length = 0;
+        conn->sent = 0;
+
+        struct epoll_event ev = {.events = EPOLLIN, .data.ptr = conn};
+        if (epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+            close(fd);
+            free(conn);
+        }
+    }
+}
+
+/**
+ * Reads from the connection and echoes (or discards) it. While the peer doesn't take the echoed data, we stop
+ * reading from it.
+ */
+static void handleConnection(int epollFd, struct EchoConnection* conn, uint32_t events) {
+    while (1) {
+        if (conn->sent < conn->length) {
+            ssize_t sent = send(conn->fd, conn->buffer + conn->sent, conn->length - conn->sent, MSG_NOSIGNAL);
+            if (sent < 0) {
+                if (errno == EAGAIN) {
+                    struct epoll_event ev = {.events = EPOLLOUT, .data.ptr = conn};
+                    epoll_ctl(epollFd, EPOLL_CTL_MOD, conn->fd, &ev);
+                    return;
+                }
+                closeConnection(epollFd, conn);
+                return;
+            }
+
+            conn->sent += sent;
+            continue;
+        }
+
+        if (conn->length != 0 && (events & EPOLLOUT)) {
+            struct epoll_event ev = {.events = EPOLLIN, .data.ptr = conn};
+            epoll_ctl(epollFd, EPOLL_CTL_MOD, conn->fd, &ev);
+            events = EPOLLIN;
+        }
+        conn->length = 0;
+        conn->sent = 0;
+
+        ssize_t received = recv(conn->fd, conn->buffer, ECHO_BUFFER_SIZE, 0);
+        if (received < 0 && errno == EAGAIN)
+            return;
+        if (received <= 0) {
+            closeConnection(epollFd, conn);
+            return;
+        }
+
+        if (!conn->sink)
+            conn->length = received;
+    }
+}
+
+int main(int argc, char* argv[]) {
+    if (argc != 3) {
+        fprintf(stderr, "Usage: %s <echo port> <sink port>\n", argv[0]);
+        return 1;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+
+    int epollFd = epoll_create1(EPOLL_CLOEXEC);
+    int echoListener = createListener(atoi(argv[1]));
+    int sinkListener = createListener(atoi(argv[2]));
+
+    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = &echoListenerMarker};
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, echoListener, &ev);
+    ev.data.ptr = &sinkListenerMarker;
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, sinkListener, &ev);
+
+    struct epoll_event events[MAX_EVENTS];
+    while (1) {
+        int count = epoll_wait(epollFd, events, MAX_EVENTS, -1);
+        for (int i = 0; i < count; i++) {
+            if (events[i].data.ptr == &echoListenerMarker)
+                acceptAll(epollFd, echoListener, 0);
+            else if (events[i].data.ptr == &sinkListenerMarker)
+                acceptAll(epollFd, sinkListener, 1);
+            else
+                handleConnection(epollFd, events[i].data.ptr, events[i].events);
+        }
+    }
+
+    return 0;
+}
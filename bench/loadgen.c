@@ -0,0 +1,428 @@
+// SOCKS5 load generator for the benchmarks. Each thread drives one connection at a time through the proxy with
+// blocking sockets, so the concurrency is the amount of threads. The result of the run is printed as a single
+// JSON object.
+//
+// Scenarios:
+//   churn  Open a tunnel, send one small message, wait for its echo and close, over and over. Measures
+//          handshakes per second and time to first byte (from connect() to the first echoed byte).
+//   rpc    Keep one tunnel per thread and ping-pong small messages through it. Measures round trip latency.
+//   bulk   Keep one tunnel per thread to the sink port and stream data into it. Measures throughput.
+//   idle   Open many tunnels and leave them idle. Measures the proxy's RSS growth per 1000 tunnels.
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <getopt.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_MESSAGE_SIZE (64 * 1024)
+#define BULK_CHUNK_SIZE (256 * 1024)
+
+struct Options {
+    const char* scenario;
+    const char* atyp;
+    int threads;
+    double duration;
+    int size;
+    int proxyPort;
+    int echoPort;
+    int sinkPort;
+    int proxyPid;
+    int tunnels;
+};
+
+// Latency samples, in microseconds.
+struct Samples {
+    uint32_t* values;
+    size_t length;
+    size_t capacity;
+};
+
+struct ThreadState {
+    const struct Options* options;
+    pthread_t thread;
+    uint64_t operations;
+    uint64_t errors;
+    uint64_t bytes;
+    struct Samples samples;
+};
+
+static struct Options options = {
+    .scenario = "churn",
+    .atyp = "ipv4",
+    .threads = 4,
+    .duration = 5,
+    .size = 64,
+    .proxyPort = 1080,
+    .echoPort = 9000,
+    .sinkPort = 9001,
+    .proxyPid = 0,
+    .tunnels = 1000,
+};
+
+static uint64_t nowMicros() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static void addSample(struct Samples* samples, uint64_t value) {
+    if (samples->length == samples->capacity) {
+        size_t capacity = samples->capacity == 0 ? 4096 : samples->capacity * 2;
+        uint32_t* values = realloc(samples->values, capacity * sizeof(uint32_t));
+        if (values == NULL)
+            return;
+        samples->values = values;
+        samples->capacity = capacity;
+    }
+
+    samples->values[samples->length++] = value > UINT32_MAX ? UINT32_MAX : (uint32_t)value;
+}
+
+static int sendAll(int fd, const void* data, size_t length) {
+    size_t sent = 0;
+    while (sent < length) {
+        ssize_t result = send(fd, (const char*)data + sent, length - sent, MSG_NOSIGNAL);
+        if (result < 0 && errno == EINTR)
+            continue;
+        if (result <= 0)
+            return -1;
+        sent += result;
+    }
+    return 0;
+}
+
+static int recvAll(int fd, void* data, size_t length) {
+    size_t received = 0;
+    while (received < length) {
+        ssize_t result = recv(fd, (char*)data + received, length - received, 0);
+        if (result < 0 && errno == EINTR)
+            continue;
+        if (result <= 0)
+            return -1;
+        received += result;
+    }
+    return 0;
+}
+
+/**
+ * Opens a tunnel through the proxy to the given port on the loopback, using the address type from the options.
+ * Returns the connected socket, or -1 if anything failed.
+ */
+static int openTunnel(int port) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -1;
+
+    int yes = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+
+    struct sockaddr_in proxy;
+    memset(&proxy, 0, sizeof(proxy));
+    proxy.sin_family = AF_INET;
+    proxy.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    proxy.sin_port = htons(options.proxyPort);
+    if (connect(fd, (struct sockaddr*)&proxy, sizeof(proxy)) != 0) {
+        close(fd);
+        return -1;
+    }
+
+    uint8_t request[4 + 1 + 255 + 2] = {5, 1, 0};
+    size_t length = 4;
+    if (strcmp(options.atyp, "ipv6") == 0) {
+        request[3] = 4;
+        memcpy(request + 4, &in6addr_loopback, 16);
+        length += 16;
+    } else if (strcmp(options.atyp, "domain") == 0) {
+        request[3] = 3;
+        request[4] = strlen("localhost");
+        memcpy(request + 5, "localhost", request[4]);
+        length += 1 + request[4];
+    } else {
+        request[3] = 1;
+        uint32_t loopback = htonl(INADDR_LOOPBACK);
+        memcpy(request + 4, &loopback, 4);
+        length += 4;
+    }
+    request[length++] = port >> 8;
+    request[length++] = port & 0xFF;
+
+    // Greeting with "no authentication required", then the request once the proxy answered it.
+    uint8_t reply[4 + 16 + 2];
+    if (sendAll(fd, "\x05\x01\x00", 3) != 0 || recvAll(fd, reply, 2) != 0 || reply[1] != 0 || sendAll(fd, request, length) != 0 || recvAll(fd, reply, 4) != 0 || reply[1] != 0 || recvAll(fd, reply + 4, reply[3] == 4 ? 16 + 2 : 4 + 2) != 0) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+static void* churnThread(void* arg) {
+    struct ThreadState* state = arg;
+    char message[MAX_MESSAGE_SIZE];
+    memset(message, 'x', state->options->size);
+    uint64_t deadline = nowMicros() + (uint64_t)(state->options->duration * 1e6);
+
+    while (nowMicros() < deadline) {
+        uint64_t start = nowMicros();
+        int fd = openTunnel(state->options->echoPort);
+        if (fd < 0 || sendAll(fd, message, state->options->size) != 0 || recvAll(fd, message, 1) != 0) {
+            state->errors++;
+            if (fd >= 0)
+                close(fd);
+            continue;
+        }
+
+        addSample(&state->samples, nowMicros() - start);
+        if (recvAll(fd, message + 1, state->options->size - 1) != 0)
+            state->errors++;
+        else
+            state->operations++;
+        close(fd);
+    }
+
+    return NULL;
+}
+
+static void* rpcThread(void* arg) {
+    struct ThreadState* state = arg;
+    char message[MAX_MESSAGE_SIZE];
+    memset(message, 'x', state->options->size);
+
+    int fd = openTunnel(state->options->echoPort);
+    if (fd < 0) {
+        state->errors++;
+        return NULL;
+    }
+
+    uint64_t deadline = nowMicros() + (uint64_t)(state->options->duration * 1e6);
+    while (nowMicros() < deadline) {
+        uint64_t start = nowMicros();
+        if (sendAll(fd, message, state->options->size) != 0 || recvAll(fd, message, state->options->size) != 0) {
+            state->errors++;
+            break;
+        }
+
+        addSample(&state->samples, nowMicros() - start);
+        state->operations++;
+    }
+
+    close(fd);
+    return NULL;
+}
+
+static void* bulkThread(void* arg) {
+    struct ThreadState* state = arg;
+    char* chunk = calloc(1, BULK_CHUNK_SIZE);
+    int fd = openTunnel(state->options->sinkPort);
+    if (fd < 0 || chunk == NULL) {
+        state->errors++;
+        free(chunk);
+        return NULL;
+    }
+
+    uint64_t deadline = nowMicros() + (uint64_t)(state->options->duration * 1e6);
+    while (nowMicros() < deadline) {
+        ssize_t sent = send(fd, chunk, BULK_CHUNK_SIZE, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR)
+            continue;
+        if (sent <= 0) {
+            state->errors++;
+            break;
+        }
+        state->bytes += sent;
+    }
+
+    close(fd);
+    free(chunk);
+    return NULL;
+}
+
+/**
+ * Returns the resident set size of a process, in KiB, or -1 if it couldn't be read.
+ */
+static long readRssKib(int pid) {
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/status", pid);
+    FILE* file = fopen(path, "r");
+    if (file == NULL)
+        return -1;
+
+    char line[256];
+    long rss = -1;
+    while (fgets(line, sizeof(line), file) != NULL) {
+        if (sscanf(line, "VmRSS: %ld kB", &rss) == 1)
+            break;
+    }
+
+    fclose(file);
+    return rss;
+}
+
+static int compareSamples(const void* a, const void* b) {
+    uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+static uint32_t percentile(const struct Samples* samples, double p) {
+    if (samples->length == 0)
+        return 0;
+    size_t index = (size_t)(p * (samples->length - 1) + 0.5);
+    return samples->values[index];
+}
+
+static void runIdle() {
+    int* fds = malloc(options.tunnels * sizeof(int));
+    if (fds == NULL) {
+        perror("malloc()");
+        exit(1);
+    }
+
+    long rssBefore = readRssKib(options.proxyPid);
+    int opened = 0;
+    uint64_t errors = 0;
+    char byte = 'x';
+    for (int i = 0; i < options.tunnels; i++) {
+        // A round trip makes sure the tunnel is fully set up on the proxy's side.
+        int fd = openTunnel(options.echoPort);
+        if (fd < 0 || sendAll(fd, &byte, 1) != 0 || recvAll(fd, &byte, 1) != 0) {
+            errors++;
+            if (fd >= 0)
+                close(fd);
+            continue;
+        }
+        fds[opened++] = fd;
+    }
+
+    sleep(1);
+    long rssAfter = readRssKib(options.proxyPid);
+    double perThousand = opened == 0 || rssBefore < 0 || rssAfter < 0 ? 0 : (rssAfter - rssBefore) * 1000.0 / opened;
+
+    printf("{\"scenario\": \"idle\", \"atyp\": \"%s\", \"tunnels\": %d, \"errors\": %lu, \"rss_before_kib\": %ld, \"rss_after_kib\": %ld, \"rss_kib_per_1k_tunnels\": %.1f, \"rss_bytes_per_tunnel\": %.0f}\n", options.atyp, opened, (unsigned long)errors, rssBefore, rssAfter, perThousand, perThousand * 1024 / 1000);
+
+    for (int i = 0; i < opened; i++)
+        close(fds[i]);
+    free(fds);
+}
+
+static void runThreads(void* (*threadFunction)(void*)) {
+    struct ThreadState* states = calloc(options.threads, sizeof(struct ThreadState));
+    if (states == NULL) {
+        perror("calloc()");
+        exit(1);
+    }
+
+    uint64_t start = nowMicros();
+    for (int i = 0; i < options.threads; i++) {
+        states[i].options = &options;
+        pthread_create(&states[i].thread, NULL, threadFunction, &states[i]);
+    }
+
+    struct Samples samples = {0};
+    uint64_t operations = 0, errors = 0, bytes = 0;
+    for (int i = 0; i < options.threads; i++) {
+        pthread_join(states[i].thread, NULL);
+        operations += states[i].operations;
+        errors += states[i].errors;
+        bytes += states[i].bytes;
+        for (size_t j = 0; j < states[i].samples.length; j++)
+            addSample(&samples, states[i].samples.values[j]);
+        free(states[i].samples.values);
+    }
+    double elapsed = (nowMicros() - start) / 1e6;
+    qsort(samples.values, samples.length, sizeof(uint32_t), compareSamples);
+
+    printf("{\"scenario\": \"%s\", \"atyp\": \"%s\", \"threads\": %d, \"duration_s\": %.2f, \"message_size\": %d, \"operations\": %lu, \"errors\": %lu", options.scenario, options.atyp, options.threads, elapsed, options.size, (unsigned long)operations, (unsigned long)errors);
+    if (strcmp(options.scenario, "churn") == 0)
+        printf(", \"handshakes_per_s\": %.0f, \"ttfb_us\": {\"p50\": %u, \"p99\": %u, \"p999\": %u}", operations / elapsed, percentile(&samples, 0.5), percentile(&samples, 0.99), percentile(&samples, 0.999));
+    else if (strcmp(options.scenario, "rpc") == 0)
+        printf(", \"requests_per_s\": %.0f, \"rtt_us\": {\"p50\": %u, \"p99\": %u, \"p999\": %u}", operations / elapsed, percentile(&samples, 0.5), percentile(&samples, 0.99), percentile(&samples, 0.999));
+    else
+        printf(", \"bytes\": %lu, \"gbit_per_s\": %.3f", (unsigned long)bytes, bytes * 8 / elapsed / 1e9);
+    printf("}\n");
+
+    free(samples.values);
+    free(states);
+}
+
+static void printUsage(const char* programName) {
+    printf("Usage: %s [OPTIONS]\n"
+           "\n"
+           "Options:\n"
+           "  --scenario <s>     churn, rpc, bulk or idle (default: churn).\n"
+           "  --atyp <a>         Address type of the requests: ipv4, ipv6 or domain (default: ipv4).\n"
+           "  --threads <n>      Amount of threads, each driving one connection at a time (default: 4).\n"
+           "  --duration <s>     Seconds to run the scenario for (default: 5).\n"
+           "  --size <n>         Size of the churn and rpc messages, in bytes (default: 64).\n"
+           "  --proxy-port <p>   Port of the proxy on 127.0.0.1 (default: 1080).\n"
+           "  --echo-port <p>    Port of the echo server on the loopback (default: 9000).\n"
+           "  --sink-port <p>    Port of the sink server on the loopback (default: 9001).\n"
+           "  --proxy-pid <pid>  Process id of the proxy, to measure its RSS in the idle scenario.\n"
+           "  --tunnels <n>      Amount of tunnels to open in the idle scenario (default: 1000).\n",
+           programName);
+}
+
+int main(int argc, char* argv[]) {
+    static const struct option longOptions[] = {
+        {"scenario", required_argument, NULL, 's'},
+        {"atyp", required_argument, NULL, 'a'},
+        {"threads", required_argument, NULL, 't'},
+        {"duration", required_argument, NULL, 'd'},
+        {"size", required_argument, NULL, 'z'},
+        {"proxy-port", required_argument, NULL, 'p'},
+        {"echo-port", required_argument, NULL, 'e'},
+        {"sink-port", required_argument, NULL, 'k'},
+        {"proxy-pid", required_argument, NULL, 'i'},
+        {"tunnels", required_argument, NULL, 'n'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0}};
+
+    int c;
+    while ((c = getopt_long(argc, argv, "h", longOptions, NULL)) != -1) {
+        switch (c) {
+            case 's': options.scenario = optarg; break;
+            case 'a': options.atyp = optarg; break;
+            case 't': options.threads = atoi(optarg); break;
+            case 'd': options.duration = atof(optarg); break;
+            case 'z': options.size = atoi(optarg); break;
+            case 'p': options.proxyPort = atoi(optarg); break;
+            case 'e': options.echoPort = atoi(optarg); break;
+            case 'k': options.sinkPort = atoi(optarg); break;
+            case 'i': options.proxyPid = atoi(optarg); break;
+            case 'n': options.tunnels = atoi(optarg); break;
+            case 'h': printUsage(argv[0]); return 0;
+            default: printUsage(argv[0]); return 1;
+        }
+    }
+
+    if (options.threads < 1 || options.size < 1 || options.size > MAX_MESSAGE_SIZE || options.tunnels < 1) {
+        fprintf(stderr, "Invalid options\n");
+        return 1;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+
+    if (strcmp(options.scenario, "churn") == 0)
+        runThreads(churnThread);
+    else if (strcmp(options.scenario, "rpc") == 0)
+        runThreads(rpcThread);
+    else if (strcmp(options.scenario, "bulk") == 0)
+        runThreads(bulkThread);
+    else if (strcmp(options.scenario, "idle") == 0)
+        runIdle();
+    else {
+        printUsage(argv[0]);
+        return 1;
+    }
+
+    return 0;
+}
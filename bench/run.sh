@@ -0,0 +1,54 @@
+#!/bin/sh
+# Runs the benchmark scenarios against the optimized build of the proxy, over the loopback, and writes the
+# results as JSON to $BENCH_OUTPUT (bin/bench.json by default) as well as to stdout.
+#
+# Environment variables:
+#   BENCH_DURATION  Seconds each scenario runs for (default: 5).
+#   BENCH_THREADS   Load generator threads, which is also the amount of concurrent connections (default: 4).
+#   BENCH_TUNNELS   Tunnels opened by the idle scenario (default: 1000).
+#   BENCH_IO_ENGINE Event loop engine of the proxy: epoll or io_uring (default: epoll).
+#   BENCH_OUTPUT    File the JSON results are written to (default: <bin>/bench.json).
+
+BIN=${1:-./bin}
+DURATION=${BENCH_DURATION:-5}
+THREADS=${BENCH_THREADS:-4}
+TUNNELS=${BENCH_TUNNELS:-1000}
+IO_ENGINE=${BENCH_IO_ENGINE:-epoll}
+OUTPUT=${BENCH_OUTPUT:-$BIN/bench.json}
+ECHO_PORT=9000
+SINK_PORT=9001
+
+# The idle scenario alone needs two sockets per tunnel in the proxy.
+ulimit -n 65536 2>/dev/null || ulimit -n "$(ulimit -Hn)"
+
+"$BIN/echo" $ECHO_PORT $SINK_PORT &
+ECHO_PID=$!
+"$BIN/medias-bench" --log-level error --io-engine "$IO_ENGINE" &
+PROXY_PID=$!
+trap 'kill $ECHO_PID $PROXY_PID 2>/dev/null' EXIT INT TERM
+sleep 1
+
+run() {
+    "$BIN/loadgen" --proxy-pid $PROXY_PID --echo-port $ECHO_PORT --sink-port $SINK_PORT --duration "$DURATION" --threads "$THREADS" "$@"
+}
+
+# The idle scenario goes first, so the RSS it measures isn't affected by memory left over from other scenarios.
+RESULTS=$(
+    run --scenario idle --tunnels "$TUNNELS"
+    run --scenario churn --atyp ipv4
+    run --scenario churn --atyp ipv6
+    run --scenario churn --atyp domain
+    run --scenario rpc --atyp ipv4 --size 64
+    run --scenario rpc --atyp ipv6 --size 1024
+    run --scenario bulk --atyp ipv4
+    run --scenario bulk --atyp domain
+)
+
+COMMIT=$(git rev-parse --short HEAD 2>/dev/null || echo unknown)
+{
+    printf '{\n  "commit": "%s",\n  "date": "%s",\n  "cpus": %s,\n  "io_engine": "%s",\n  "results": [\n' "$COMMIT" "$(date -u +%Y-%m-%dT%H:%M:%SZ)" "$(nproc)" "$IO_ENGINE"
+    echo "$RESULTS" | sed 's/^/    /; $!s/$/,/'
+    printf '  ]\n}\n'
+} > "$OUTPUT"
+
+cat "$OUTPUT"
@@ -0,0 +1,304 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "accounting.h"
+#include "logger.h"
+
+// How long the writer thread sleeps between draining the rings.
+#define ACCOUNTING_DRAIN_INTERVAL_MILLIS 10
+
+// After failing to start a file, how long to drop records before trying again.
+#define ACCOUNTING_RETRY_MILLIS 1000
+
+/**
+ * A single-producer single-consumer ring of records, like the logger's: the worker writes records at head and the
+ * writer thread reads them from tail.
+ */
+struct AccountingRing {
+    struct AccountingRecord records[ACCOUNTING_RING_RECORDS];
+    _Atomic uint64_t head;
+    _Atomic uint64_t tail;
+    _Atomic uint64_t dropped;
+    struct AccountingRing* next;
+};
+
+static struct {
+    const char* path;
+    uint64_t fileSize;
+    int enabled;
+
+    // Every ring ever created. As with the logger's, they're never freed.
+    struct AccountingRing* rings;
+    pthread_mutex_t ringsLock;
+
+    // Only one thread drains the rings at a time (the writer thread, or the process exiting).
+    pthread_mutex_t drainLock;
+    int stopped;
+
+    // The file being written, mapped at header (or -1 and NULL if there's none), how many records it holds and how
+    // many fit in it. The last file name's milliseconds are kept so the next one is always named after a later time.
+    int fd;
+    struct AccountingHeader* header;
+    uint64_t recordCount;
+    uint64_t capacity;
+    uint64_t lastFileMillis;
+    uint64_t retryAt;
+    uint64_t dropped;
+} accounting = {.ringsLock = PTHREAD_MUTEX_INITIALIZER, .drainLock = PTHREAD_MUTEX_INITIALIZER, .fd = -1};
+
+static _Thread_local struct AccountingRing* threadRing = NULL;
+
+uint64_t accountingNow() {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+int accountingEnabled() {
+    return accounting.enabled;
+}
+
+void accountingSetAddress(struct AccountingAddress* to, const struct sockaddr* address) {
+    memset(to, 0, sizeof(*to));
+    if (address->sa_family == AF_INET) {
+        const struct sockaddr_in* address4 = (const struct sockaddr_in*)address;
+        to->family = 4;
+        to->port = ntohs(address4->sin_port);
+        memcpy(to->address, &address4->sin_addr, 4);
+    } else if (address->sa_family == AF_INET6) {
+        const struct sockaddr_in6* address6 = (const struct sockaddr_in6*)address;
+        to->family = 6;
+        to->port = ntohs(address6->sin6_port);
+        memcpy(to->address, &address6->sin6_addr, 16);
+    }
+}
+
+/**
+ * Returns the calling thread's ring, creating it the first time.
+ */
+static struct AccountingRing* getThreadRing() {
+    if (threadRing != NULL)
+        return threadRing;
+
+    struct AccountingRing* ring = calloc(1, sizeof(struct AccountingRing));
+    if (ring == NULL)
+        return NULL;
+
+    pthread_mutex_lock(&accounting.ringsLock);
+    ring->next = accounting.rings;
+    accounting.rings = ring;
+    pthread_mutex_unlock(&accounting.ringsLock);
+
+    threadRing = ring;
+    return ring;
+}
+
+void accountingSubmit(const struct AccountingRecord* record) {
+    struct AccountingRing* ring = getThreadRing();
+    if (ring == NULL)
+        return;
+
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    if (head - tail == ACCOUNTING_RING_RECORDS) {
+        atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+        return;
+    }
+
+    ring->records[head % ACCOUNTING_RING_RECORDS] = *record;
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+/**
+ * Finishes the file being written: marks it as closed, and gives back the space it reserved past its records.
+ */
+static void finishFile() {
+    if (accounting.header == NULL)
+        return;
+
+    accounting.header->recordCount = accounting.recordCount;
+    accounting.header->closed = 1;
+    if (msync(accounting.header, accounting.fileSize, MS_SYNC) != 0)
+        logErrno(LOG_LEVEL_WARN, "Failed to msync() the accounting log");
+    munmap(accounting.header, accounting.fileSize);
+    if (ftruncate(accounting.fd, sizeof(struct AccountingHeader) + accounting.recordCount * sizeof(struct AccountingRecord)) != 0)
+        logErrno(LOG_LEVEL_WARN, "Failed to truncate the accounting log");
+    close(accounting.fd);
+
+    accounting.fd = -1;
+    accounting.header = NULL;
+}
+
+/**
+ * Starts a new file, with all of its space reserved up front so writing to the mapping can't fail for lack of disk
+ * space. Returns 0 if successful, or -1 if an error occurred.
+ */
+static int startFile() {
+    uint64_t now = accountingNow();
+    uint64_t millis = now / 1000;
+    if (millis <= accounting.lastFileMillis)
+        millis = accounting.lastFileMillis + 1;
+
+    char name[4096];
+    int fd;
+    do {
+        snprintf(name, sizeof(name), "%s.%lu", accounting.path, (unsigned long)millis++);
+        fd = open(name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    } while (fd < 0 && errno == EEXIST);
+    accounting.lastFileMillis = millis - 1;
+
+    if (fd < 0) {
+        logError("Failed to create accounting log %s: %s", name, strerror(errno));
+        return -1;
+    }
+
+    int error = posix_fallocate(fd, 0, accounting.fileSize);
+    if (error != 0) {
+        logError("Failed to reserve space for accounting log %s: %s", name, strerror(error));
+        close(fd);
+        unlink(name);
+        return -1;
+    }
+
+    void* mapping = mmap(NULL, accounting.fileSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (mapping == MAP_FAILED) {
+        logError("Failed to map accounting log %s: %s", name, strerror(errno));
+        close(fd);
+        unlink(name);
+        return -1;
+    }
+
+    accounting.fd = fd;
+    accounting.header = mapping;
+    accounting.recordCount = 0;
+    memcpy(accounting.header->magic, ACCOUNTING_MAGIC, sizeof(accounting.header->magic));
+    accounting.header->version = ACCOUNTING_VERSION;
+    accounting.header->recordSize = sizeof(struct AccountingRecord);
+    accounting.header->createdAt = now;
+    logInfo("Writing accounting log %s", name);
+    return 0;
+}
+
+/**
+ * Appends a record to the file, starting a new one if there's none or it's full. Returns 0 if successful, or -1 if
+ * there's no file to append it to.
+ */
+static int appendRecord(const struct AccountingRecord* record) {
+    if (accounting.header != NULL && accounting.recordCount == accounting.capacity)
+        finishFile();
+
+    if (accounting.header == NULL) {
+        uint64_t now = accountingNow() / 1000;
+        if (now < accounting.retryAt)
+            return -1;
+        if (startFile() != 0) {
+            accounting.retryAt = now + ACCOUNTING_RETRY_MILLIS;
+            return -1;
+        }
+    }
+
+    struct AccountingRecord* records = (struct AccountingRecord*)(accounting.header + 1);
+    records[accounting.recordCount++] = *record;
+    return 0;
+}
+
+/**
+ * Moves every pending record from all the rings into the file. Returns the amount of records found.
+ */
+static size_t drainRings() {
+    size_t drained = 0;
+
+    pthread_mutex_lock(&accounting.drainLock);
+    if (accounting.stopped) {
+        pthread_mutex_unlock(&accounting.drainLock);
+        return 0;
+    }
+
+    pthread_mutex_lock(&accounting.ringsLock);
+    struct AccountingRing* ring = accounting.rings;
+    pthread_mutex_unlock(&accounting.ringsLock);
+
+    for (; ring != NULL; ring = ring->next) {
+        uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        for (; tail != head; tail++) {
+            if (appendRecord(&ring->records[tail % ACCOUNTING_RING_RECORDS]) != 0)
+                accounting.dropped++;
+            drained++;
+            atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+        }
+
+        accounting.dropped += atomic_exchange_explicit(&ring->dropped, 0, memory_order_relaxed);
+    }
+
+    // The header only counts the records once they're all in, so a reader never sees one half written.
+    if (accounting.header != NULL)
+        __atomic_store_n(&accounting.header->recordCount, accounting.recordCount, __ATOMIC_RELEASE);
+
+    if (accounting.dropped != 0) {
+        logWarn("Accounting log couldn't keep up, dropped %lu records", (unsigned long)accounting.dropped);
+        accounting.dropped = 0;
+    }
+
+    pthread_mutex_unlock(&accounting.drainLock);
+    return drained;
+}
+
+static void* accountingWriterThread(void* arg) {
+    struct timespec interval = {.tv_sec = 0, .tv_nsec = ACCOUNTING_DRAIN_INTERVAL_MILLIS * 1000000L};
+    // Unlike the logger, we sleep after every drain, so records are moved in batches even under load. The rings hold
+    // enough records for a worker accepting 100k connections a second.
+    while (1) {
+        drainRings();
+        nanosleep(&interval, NULL);
+    }
+
+    return NULL;
+}
+
+void accountingDrain() {
+    drainRings();
+}
+
+/**
+ * Writes out the records left when the process exits, and finishes the file.
+ */
+static void accountingFinish() {
+    drainRings();
+
+    pthread_mutex_lock(&accounting.drainLock);
+    finishFile();
+    accounting.stopped = 1;
+    pthread_mutex_unlock(&accounting.drainLock);
+}
+
+int accountingInit(const char* path, uint64_t fileSize) {
+    accounting.path = path;
+    accounting.fileSize = fileSize;
+    accounting.capacity = (fileSize - sizeof(struct AccountingHeader)) / sizeof(struct AccountingRecord);
+
+    // The first file is started right away, so a path we can't write to is found at startup.
+    if (startFile() != 0)
+        return -1;
+
+    pthread_t thread;
+    int error = pthread_create(&thread, NULL, accountingWriterThread, NULL);
+    if (error != 0) {
+        logError("Failed to create accounting writer thread: %s", strerror(error));
+        return -1;
+    }
+
+    pthread_detach(thread);
+    accounting.enabled = 1;
+    atexit(accountingFinish);
+    return 0;
+}
@@ -0,0 +1,155 @@
+#ifndef _ACCOUNTING_H_
+#define _ACCOUNTING_H_
+
+#include <stdint.h>
+#include <sys/socket.h>
+
+/**
+ * The accounting log keeps a record of every client connection, for billing and capacity planning: who the client
+ * was, what it asked for, where it got connected to, how long each phase took, how many bytes went each way and how
+ * it ended. Records have a fixed binary layout, so writing one is a copy, and reading them back needs no parsing.
+ *
+ * Like the logger, each worker hands its records to a background thread through its own single-producer ring, so
+ * accounting takes no locks and no system calls on the workers. The background thread drains the rings every few
+ * milliseconds, copying the records straight into the log file, which is mapped into memory. A file takes records
+ * until it reaches its size limit, and then the next one is started. Each file is named after the time it was
+ * started (as '<path>.<unix milliseconds>'), so files are never renamed, and processes handing over in a hot upgrade
+ * never write to the same file.
+ *
+ * A file starts with a header, followed by the records. The header's record count is updated after every batch of
+ * records, so the records it counts are complete even while the file is being written. Once the file is finished,
+ * it's truncated to the records it holds and marked as closed. Everything is in the host's byte order.
+ */
+
+#define ACCOUNTING_MAGIC "MEDIASAC"
+#define ACCOUNTING_VERSION 1
+
+#define ACCOUNTING_HOST_LENGTH 255
+#define ACCOUNTING_USER_LENGTH 255
+
+// The REP code of connections that never got a reply to their request.
+#define ACCOUNTING_NO_REPLY 0xff
+
+// The parent of tunnels that didn't go through one.
+#define ACCOUNTING_NO_PARENT 0xff
+
+// How many records each thread's ring holds until the writer thread moves them into the log.
+#define ACCOUNTING_RING_RECORDS 1024
+
+/**
+ * How a connection ended.
+ */
+enum AccountingCloseReason {
+    // The tunnel (or the handshake, if it was turned down with a reply) finished normally.
+    ACCOUNTING_CLOSE_DONE,
+    // A socket failed, or the client left in the middle of its handshake.
+    ACCOUNTING_CLOSE_ERROR,
+    ACCOUNTING_CLOSE_HANDSHAKE_TIMEOUT,
+    ACCOUNTING_CLOSE_IDLE_TIMEOUT,
+    // The server closed it while shutting down.
+    ACCOUNTING_CLOSE_SHUTDOWN,
+    ACCOUNTING_CLOSE_REASON_COUNT
+};
+
+/**
+ * The phases of a connection, as in the metrics: auth negotiation, request, DNS, connect and relay.
+ */
+#define ACCOUNTING_PHASES 5
+
+/**
+ * An IPv4 or IPv6 address and port. The family is 0 if there's no address.
+ */
+struct AccountingAddress {
+    uint8_t family;
+    uint8_t reserved;
+    uint16_t port;
+    uint8_t address[16];
+};
+
+struct AccountingHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t recordSize;
+    // When the file was started, in microseconds since the epoch.
+    uint64_t createdAt;
+    // How many complete records follow the header, and whether the file is finished.
+    uint64_t recordCount;
+    uint32_t closed;
+    uint8_t reserved[28];
+};
+
+struct AccountingRecord {
+    // When the connection was accepted and closed, in microseconds since the epoch.
+    uint64_t acceptedAt;
+    uint64_t closedAt;
+
+    // How long each phase took, in microseconds (0 for the phases the connection didn't go through).
+    uint64_t phaseMicros[ACCOUNTING_PHASES];
+
+    // The bytes relayed from the client to the destination and back.
+    uint64_t bytesClientToRemote;
+    uint64_t bytesRemoteToClient;
+
+    // The client's address, and the destination's (or the parent's, through a parent proxy) once connected to it.
+    struct AccountingAddress client;
+    struct AccountingAddress remote;
+
+    // The request: its CMD, ATYP and DST.PORT (all 0 if the client never sent one), and DST.ADDR as text in host.
+    uint8_t command;
+    uint8_t addressType;
+    uint16_t port;
+
+    // The REP code the client got (0 for success), how the connection ended, the parent the tunnel went through, and
+    // the worker that handled it.
+    uint8_t replyCode;
+    uint8_t closeReason;
+    uint8_t parent;
+    uint8_t reserved;
+    uint16_t worker;
+
+    // The lengths of host and user, which aren't NUL-terminated. The user is empty without authentication.
+    uint8_t hostLength;
+    uint8_t userLength;
+    char host[ACCOUNTING_HOST_LENGTH];
+    char user[ACCOUNTING_USER_LENGTH];
+    uint8_t padding[6];
+};
+
+_Static_assert(sizeof(struct AccountingHeader) == 64, "the accounting header's layout changed");
+_Static_assert(sizeof(struct AccountingRecord) == 640, "the accounting record's layout changed");
+
+/**
+ * Starts writing records to files named after the given path, each up to the given size, and the thread that writes
+ * them. The remaining records are written out when the process exits. Returns 0 if successful, or -1 if an error
+ * occurred.
+ */
+int accountingInit(const char* path, uint64_t fileSize);
+
+/**
+ * Whether records are being kept.
+ */
+int accountingEnabled();
+
+/**
+ * Returns the current time in microseconds since the epoch, for the records' timestamps.
+ */
+uint64_t accountingNow();
+
+/**
+ * Stores an address (and port) in a record.
+ */
+void accountingSetAddress(struct AccountingAddress* to, const struct sockaddr* address);
+
+/**
+ * Copies a finished record into the calling thread's ring, for the writer thread to append to the log. If the ring is
+ * full, the record is dropped (and counted, so the writer can report how many were lost).
+ */
+void accountingSubmit(const struct AccountingRecord* record);
+
+/**
+ * Moves the records waiting in every ring into the log right away, for a thread submitting records faster than the
+ * writer thread would take them. May be called from any thread.
+ */
+void accountingDrain();
+
+#endif
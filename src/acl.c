@@ -0,0 +1,505 @@
+#include <arpa/inet.h>
+#include <ctype.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "acl.h"
+#include "logger.h"
+#include "util.h"
+
+// Rules are referred to by their index plus one, so 0 means none. The roots of the tries are node 0, which is never
+// anybody's child, so a child of 0 also means none.
+#define ACL_NONE 0
+
+// Returned instead of a trie node when we ran out of memory building the tries.
+#define ACL_NO_MEMORY UINT32_MAX
+
+struct AclRule {
+    enum AclVerdict action;
+    int line;
+
+    // The client prefix, as an IPv6 address (IPv4 addresses being IPv4-mapped) and its length in bits. A length of 0
+    // matches any client.
+    uint8_t clientAddress[16];
+    int clientPrefixLength;
+
+    // The rule's port ranges are ports[firstPort] to ports[firstPort + portCount - 1]. No ranges match any port.
+    uint32_t firstPort;
+    uint32_t portCount;
+
+    // The next rule for the same destination, in the order they appear in the file.
+    uint32_t next;
+};
+
+struct AclPortRange {
+    uint16_t first;
+    uint16_t last;
+};
+
+struct AclTrieNode {
+    uint32_t children[2];
+    uint32_t rules;
+};
+
+struct AclTrie {
+    struct AclTrieNode* nodes;
+    uint32_t count;
+    uint32_t capacity;
+};
+
+/**
+ * A slot of the hash table of domain name labels: the node reached by following the label from its parent node.
+ */
+struct AclLabel {
+    uint32_t parent;
+    uint32_t child;
+    uint32_t hash;
+    uint32_t labelOffset;
+    uint32_t labelLength;
+};
+
+static struct {
+    int loaded;
+
+    struct AclRule* rules;
+    uint32_t ruleCount;
+    struct AclPortRange* ports;
+    uint32_t portCount;
+
+    struct AclTrie ipv4;
+    struct AclTrie ipv6;
+
+    // The domain name trie: each node's rules, and the labels leading from each node to its children.
+    uint32_t* nameRules;
+    uint32_t nameNodeCount;
+    struct AclLabel* labelTable;
+    uint32_t labelTableCapacity;
+    char* labels;
+    uint32_t labelsLength;
+
+    // The rules without a destination, checked when no rule for a more specific destination matched.
+    uint32_t anyRules;
+
+    uint32_t rulesCapacity;
+    uint32_t portsCapacity;
+    uint32_t nameRulesCapacity;
+    uint32_t labelsCapacity;
+} acl;
+
+/**
+ * Grows a dynamic array so it has room for one more element. Returns 0 if successful, or -1 if out of memory.
+ */
+static int reserve(void** array, uint32_t count, uint32_t* capacity, size_t elementSize) {
+    if (count < *capacity)
+        return 0;
+
+    uint32_t newCapacity = *capacity == 0 ? 64 : *capacity * 2;
+    void* newArray = realloc(*array, newCapacity * elementSize);
+    if (newArray == NULL)
+        return -1;
+    *array = newArray;
+    *capacity = newCapacity;
+    return 0;
+}
+
+static uint32_t addTrieNode(struct AclTrie* trie) {
+    if (reserve((void**)&trie->nodes, trie->count, &trie->capacity, sizeof(struct AclTrieNode)) != 0)
+        return ACL_NO_MEMORY;
+    memset(&trie->nodes[trie->count], 0, sizeof(struct AclTrieNode));
+    return trie->count++;
+}
+
+/**
+ * Adds a rule at the end of a destination's list of rules.
+ */
+static void appendRule(uint32_t* head, uint32_t rule) {
+    while (*head != ACL_NONE)
+        head = &acl.rules[*head - 1].next;
+    *head = rule;
+}
+
+/**
+ * Finds the trie node for a prefix, creating the path to it if needed. Returns the node, or ACL_NO_MEMORY.
+ */
+static uint32_t insertPrefix(struct AclTrie* trie, const uint8_t* address, int prefixLength) {
+    uint32_t node = 0;
+    for (int bit = 0; bit < prefixLength; bit++) {
+        int side = (address[bit >> 3] >> (7 - (bit & 7))) & 1;
+        if (trie->nodes[node].children[side] == ACL_NONE) {
+            uint32_t child = addTrieNode(trie);
+            if (child == ACL_NO_MEMORY)
+                return ACL_NO_MEMORY;
+            trie->nodes[node].children[side] = child;
+        }
+        node = trie->nodes[node].children[side];
+    }
+    return node;
+}
+
+static uint32_t hashLabel(uint32_t parent, const char* label, size_t length) {
+    uint32_t hash = FNV1A_INITIAL ^ (parent * 0x9E3779B1u);
+    for (size_t i = 0; i < length; i++) {
+        uint8_t c = (uint8_t)tolower((unsigned char)label[i]);
+        hash = fnv1aUpdate(hash, &c, 1);
+    }
+    return hash;
+}
+
+/**
+ * Finds the label's slot in the hash table: either the one holding it, or the empty one where it would go.
+ */
+static struct AclLabel* findLabelSlot(uint32_t parent, const char* label, size_t length, uint32_t hash) {
+    uint32_t mask = acl.labelTableCapacity - 1;
+    for (uint32_t position = hash & mask;; position = (position + 1) & mask) {
+        struct AclLabel* slot = &acl.labelTable[position];
+        if (slot->child == ACL_NONE)
+            return slot;
+        if (slot->parent == parent && slot->hash == hash && slot->labelLength == length && strncasecmp(acl.labels + slot->labelOffset, label, length) == 0)
+            return slot;
+    }
+}
+
+/**
+ * Doubles the label hash table's capacity, rehashing its labels. Returns 0 if successful, or -1 if out of memory.
+ */
+static int growLabelTable() {
+    struct AclLabel* oldTable = acl.labelTable;
+    uint32_t oldCapacity = acl.labelTableCapacity;
+
+    acl.labelTableCapacity = oldCapacity == 0 ? 1024 : oldCapacity * 2;
+    acl.labelTable = calloc(acl.labelTableCapacity, sizeof(struct AclLabel));
+    if (acl.labelTable == NULL)
+        return -1;
+
+    for (uint32_t i = 0; i < oldCapacity; i++) {
+        if (oldTable[i].child != ACL_NONE)
+            *findLabelSlot(oldTable[i].parent, acl.labels + oldTable[i].labelOffset, oldTable[i].labelLength, oldTable[i].hash) = oldTable[i];
+    }
+    free(oldTable);
+    return 0;
+}
+
+/**
+ * Finds the domain name trie node for a name, from its last label to its first, creating the path to it if
+ * needed. Returns the node, or ACL_NO_MEMORY.
+ */
+static uint32_t insertName(const char* name) {
+    uint32_t node = 0;
+    size_t end = strlen(name);
+    while (end > 0) {
+        size_t start = end;
+        while (start > 0 && name[start - 1] != '.')
+            start--;
+        const char* label = name + start;
+        size_t length = end - start;
+
+        // Keep the table at most half full, so probes stay short.
+        if ((acl.nameNodeCount + 1) * 2 > acl.labelTableCapacity && growLabelTable() != 0)
+            return ACL_NO_MEMORY;
+
+        uint32_t hash = hashLabel(node, label, length);
+        struct AclLabel* slot = findLabelSlot(node, label, length, hash);
+        if (slot->child == ACL_NONE) {
+            if (reserve((void**)&acl.nameRules, acl.nameNodeCount, &acl.nameRulesCapacity, sizeof(uint32_t)) != 0)
+                return ACL_NO_MEMORY;
+            while (acl.labelsLength + length > acl.labelsCapacity) {
+                if (reserve((void**)&acl.labels, acl.labelsCapacity, &acl.labelsCapacity, 1) != 0)
+                    return ACL_NO_MEMORY;
+            }
+
+            memcpy(acl.labels + acl.labelsLength, label, length);
+            slot->parent = node;
+            slot->hash = hash;
+            slot->labelOffset = acl.labelsLength;
+            slot->labelLength = length;
+            slot->child = acl.nameNodeCount;
+            acl.nameRules[acl.nameNodeCount++] = ACL_NONE;
+            acl.labelsLength += length;
+        }
+        node = slot->child;
+
+        end = start == 0 ? 0 : start - 1;
+    }
+    return node;
+}
+
+/**
+ * Parses a comma separated list of ports and port ranges into the rule. Returns 0 if successful, or -1 if invalid.
+ */
+static int parsePorts(char* text, struct AclRule* rule) {
+    rule->firstPort = acl.portCount;
+
+    char* savePointer;
+    for (char* range = strtok_r(text, ",", &savePointer); range != NULL; range = strtok_r(NULL, ",", &savePointer)) {
+        char* end;
+        long first = strtol(range, &end, 10);
+        long last = first;
+        if (*end == '-')
+            last = strtol(end + 1, &end, 10);
+        if (end == range || *end != '\0' || first < 0 || last > 65535 || first > last)
+            return -1;
+
+        if (reserve((void**)&acl.ports, acl.portCount, &acl.portsCapacity, sizeof(struct AclPortRange)) != 0)
+            return -1;
+        acl.ports[acl.portCount].first = (uint16_t)first;
+        acl.ports[acl.portCount].last = (uint16_t)last;
+        acl.portCount++;
+        rule->portCount++;
+    }
+    return rule->portCount > 0 ? 0 : -1;
+}
+
+/**
+ * Parses a rule and adds it to the tries. Returns 0 if successful, or -1 if the rule is invalid.
+ */
+static int addRule(char* line, int lineNumber) {
+    char* savePointer;
+    char* action = strtok_r(line, " \t", &savePointer);
+    if (action == NULL || action[0] == '#')
+        return 0;
+
+    if (reserve((void**)&acl.rules, acl.ruleCount, &acl.rulesCapacity, sizeof(struct AclRule)) != 0)
+        return -1;
+    struct AclRule* rule = &acl.rules[acl.ruleCount];
+    memset(rule, 0, sizeof(struct AclRule));
+    rule->line = lineNumber;
+
+    if (strcmp(action, "allow") == 0)
+        rule->action = ACL_ALLOW;
+    else if (strcmp(action, "deny") == 0)
+        rule->action = ACL_DENY;
+    else
+        return -1;
+
+    const char* destination = NULL;
+    char* keyword;
+    while ((keyword = strtok_r(NULL, " \t", &savePointer)) != NULL) {
+        char* value = strtok_r(NULL, " \t", &savePointer);
+        if (value == NULL)
+            return -1;
+
+        if (strcmp(keyword, "from") == 0) {
+            if (parseMappedPrefix(value, rule->clientAddress, &rule->clientPrefixLength) != 0)
+                return -1;
+        } else if (strcmp(keyword, "to") == 0) {
+            destination = value;
+        } else if (strcmp(keyword, "port") == 0) {
+            if (parsePorts(value, rule) != 0)
+                return -1;
+        } else {
+            return -1;
+        }
+    }
+
+    // The rule is only counted once we know where it goes, so an invalid rule leaves nothing behind.
+    uint32_t ruleIndex = acl.ruleCount + 1;
+    uint8_t address[16];
+    int prefixLength;
+    int family = destination == NULL || strcmp(destination, "*") == 0 ? AF_UNSPEC : parseAddressPrefix(destination, address, &prefixLength);
+    if (destination == NULL || strcmp(destination, "*") == 0) {
+        appendRule(&acl.anyRules, ruleIndex);
+    } else if (family != AF_UNSPEC) {
+        struct AclTrie* trie = family == AF_INET ? &acl.ipv4 : &acl.ipv6;
+        uint32_t node = insertPrefix(trie, address, prefixLength);
+        if (node == ACL_NO_MEMORY)
+            return -1;
+        appendRule(&trie->nodes[node].rules, ruleIndex);
+    } else {
+        char name[256];
+        if (normalizeDomainName(destination, name) != 0)
+            return -1;
+        uint32_t node = insertName(name);
+        if (node == ACL_NO_MEMORY)
+            return -1;
+        appendRule(&acl.nameRules[node], ruleIndex);
+    }
+
+    acl.ruleCount++;
+    return 0;
+}
+
+int aclInit(const char* path) {
+    FILE* file = fopen(path, "r");
+    if (file == NULL) {
+        logErrno(LOG_LEVEL_ERROR, "Failed to open access control list");
+        return -1;
+    }
+
+    // Every trie starts with its root.
+    int failed = addTrieNode(&acl.ipv4) == ACL_NO_MEMORY || addTrieNode(&acl.ipv6) == ACL_NO_MEMORY || growLabelTable() != 0;
+    if (!failed && (failed = reserve((void**)&acl.nameRules, 0, &acl.nameRulesCapacity, sizeof(uint32_t))) == 0)
+        acl.nameRules[acl.nameNodeCount++] = ACL_NONE;
+    if (failed) {
+        logError("Failed to allocate memory for the access control list");
+        fclose(file);
+        return -1;
+    }
+
+    char* line = NULL;
+    size_t lineCapacity = 0;
+    ssize_t lineLength;
+    int lineNumber = 0;
+    int status = 0;
+    while (status == 0 && (lineLength = getline(&line, &lineCapacity, file)) >= 0) {
+        lineNumber++;
+        while (lineLength > 0 && (line[lineLength - 1] == '\n' || line[lineLength - 1] == '\r'))
+            line[--lineLength] = '\0';
+        if ((status = addRule(line, lineNumber)) != 0)
+            logError("Invalid access control rule at %s:%d", path, lineNumber);
+    }
+
+    free(line);
+    fclose(file);
+    if (status != 0)
+        return -1;
+
+    acl.loaded = 1;
+    logInfo("Loaded access control list %s: %u rules, %u IPv4 nodes, %u IPv6 nodes, %u domain nodes", path, acl.ruleCount, acl.ipv4.count, acl.ipv6.count, acl.nameNodeCount);
+    return 0;
+}
+
+int aclEnabled() {
+    return acl.loaded;
+}
+
+/**
+ * Finds the first rule in a destination's list that matches the client and port. Returns it, or ACL_NONE.
+ */
+static uint32_t findMatchingRule(uint32_t rules, const uint8_t client[16], int port) {
+    for (uint32_t index = rules; index != ACL_NONE; index = acl.rules[index - 1].next) {
+        const struct AclRule* rule = &acl.rules[index - 1];
+        if (rule->clientPrefixLength > 0 && !addressPrefixMatches(rule->clientAddress, client, rule->clientPrefixLength))
+            continue;
+
+        int portMatches = rule->portCount == 0;
+        for (uint32_t i = rule->firstPort; !portMatches && i < rule->firstPort + rule->portCount; i++)
+            portMatches = port >= acl.ports[i].first && port <= acl.ports[i].last;
+        if (portMatches)
+            return index;
+    }
+    return ACL_NONE;
+}
+
+/**
+ * Walks an address's path in a trie, then checks the rules of the nodes along it from the deepest (the most
+ * specific prefix) up. Returns the first matching rule, or ACL_NONE.
+ */
+static uint32_t lookupTrie(const struct AclTrie* trie, const uint8_t* address, int bits, const uint8_t client[16], int port, uint64_t* visited) {
+    uint32_t candidates[129];
+    int candidateCount = 0;
+
+    uint32_t node = 0;
+    if (trie->nodes[0].rules != ACL_NONE)
+        candidates[candidateCount++] = 0;
+    for (int bit = 0; bit < bits; bit++) {
+        node = trie->nodes[node].children[(address[bit >> 3] >> (7 - (bit & 7))) & 1];
+        if (node == ACL_NONE)
+            break;
+        (*visited)++;
+        if (trie->nodes[node].rules != ACL_NONE)
+            candidates[candidateCount++] = node;
+    }
+
+    while (candidateCount > 0) {
+        uint32_t rule = findMatchingRule(trie->nodes[candidates[--candidateCount]].rules, client, port);
+        if (rule != ACL_NONE)
+            return rule;
+    }
+    return ACL_NONE;
+}
+
+static void recordEvaluation(struct Metrics* metrics, uint64_t startedAt, uint64_t visited, enum AclVerdict verdict) {
+    metricsAdd(&metrics->aclEvaluations, 1);
+    metricsAdd(&metrics->aclNodesVisited, visited);
+    metricsAdd(&metrics->aclEvaluationNanos, getMonotonicNanos() - startedAt);
+    if (verdict == ACL_DENY)
+        metricsAdd(&metrics->aclDenied, 1);
+}
+
+static enum AclVerdict verdictOf(uint32_t rule, const char* destination) {
+    if (rule == ACL_NONE)
+        return ACL_ALLOW;
+
+    const struct AclRule* matched = &acl.rules[rule - 1];
+    if (matched->action == ACL_DENY)
+        logDebug("Connection to %s denied by access control rule at line %d", destination, matched->line);
+    return matched->action;
+}
+
+enum AclVerdict aclCheckAddress(const struct sockaddr* client, const struct sockaddr* destination, struct Metrics* metrics) {
+    uint64_t startedAt = getMonotonicNanos();
+    uint64_t visited = 0;
+
+    uint8_t clientAddress[16];
+    sockAddrToMapped(client, clientAddress);
+
+    // IPv4-mapped destinations are checked against the IPv4 rules.
+    const struct AclTrie* trie;
+    const uint8_t* address;
+    int bits, port;
+    if (destination->sa_family == AF_INET) {
+        const struct sockaddr_in* ipv4 = (const struct sockaddr_in*)destination;
+        trie = &acl.ipv4;
+        address = (const uint8_t*)&ipv4->sin_addr;
+        bits = 32;
+        port = ntohs(ipv4->sin_port);
+    } else {
+        const struct sockaddr_in6* ipv6 = (const struct sockaddr_in6*)destination;
+        int mapped = IN6_IS_ADDR_V4MAPPED(&ipv6->sin6_addr);
+        trie = mapped ? &acl.ipv4 : &acl.ipv6;
+        address = ipv6->sin6_addr.s6_addr + (mapped ? 12 : 0);
+        bits = mapped ? 32 : 128;
+        port = ntohs(ipv6->sin6_port);
+    }
+
+    uint32_t rule = lookupTrie(trie, address, bits, clientAddress, port, &visited);
+    if (rule == ACL_NONE)
+        rule = findMatchingRule(acl.anyRules, clientAddress, port);
+
+    enum AclVerdict verdict = verdictOf(rule, "address");
+    recordEvaluation(metrics, startedAt, visited, verdict);
+    return verdict;
+}
+
+enum AclVerdict aclCheckHostname(const struct sockaddr* client, const char* hostname, int port, struct Metrics* metrics) {
+    uint64_t startedAt = getMonotonicNanos();
+    uint64_t visited = 0;
+
+    uint8_t clientAddress[16];
+    sockAddrToMapped(client, clientAddress);
+
+    // Follow the name's labels from the last one, remembering the nodes with rules along the way.
+    uint32_t candidates[129];
+    int candidateCount = 0;
+    uint32_t node = 0;
+    size_t end = strlen(hostname);
+    if (end > 0 && hostname[end - 1] == '.')
+        end--;
+    while (end > 0) {
+        size_t start = end;
+        while (start > 0 && hostname[start - 1] != '.')
+            start--;
+
+        uint32_t hash = hashLabel(node, hostname + start, end - start);
+        struct AclLabel* slot = findLabelSlot(node, hostname + start, end - start, hash);
+        if (slot->child == ACL_NONE)
+            break;
+        node = slot->child;
+        visited++;
+        if (acl.nameRules[node] != ACL_NONE && candidateCount < (int)(sizeof(candidates) / sizeof(candidates[0])))
+            candidates[candidateCount++] = node;
+
+        end = start == 0 ? 0 : start - 1;
+    }
+
+    uint32_t rule = ACL_NONE;
+    while (rule == ACL_NONE && candidateCount > 0)
+        rule = findMatchingRule(acl.nameRules[candidates[--candidateCount]], clientAddress, port);
+
+    enum AclVerdict verdict = rule == ACL_NONE ? ACL_NO_MATCH : verdictOf(rule, hostname);
+    recordEvaluation(metrics, startedAt, visited, verdict);
+    return verdict;
+}
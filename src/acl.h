@@ -0,0 +1,60 @@
+#ifndef _ACL_H_
+#define _ACL_H_
+
+#include <sys/socket.h>
+
+#include "metrics.h"
+
+/**
+ * The access control list decides where clients may connect to. It's loaded from a file with one rule per line:
+ *
+ *     allow|deny [from <client prefix>] [to <destination>] [port <ports>]
+ *
+ * where a prefix is an IPv4 or IPv6 address with an optional /length, a destination is either a prefix or a
+ * domain name (which also covers all its subdomains), and ports is a comma separated list of ports or ranges
+ * (like 80,443,8000-8100). Clauses left out match anything. Lines that are empty or start with '#' are skipped.
+ *
+ * Rules are compiled into tries indexed by destination: a binary trie per IP family, where each prefix is a
+ * path of bits, and a trie of domain names by label, from the top level domain down. Checking a destination
+ * walks its path in the trie, so it takes at most one step per bit (or label) no matter how many rules there are.
+ * The rules of the most specific destination that has any are checked first, in the order they appear in the
+ * file, against the client and port; if none of them matches, the next less specific destination's rules are
+ * checked, and so on, ending with the rules without a destination. If no rule matches, the connection is allowed,
+ * so a list meant to only allow some destinations should end with a plain "deny".
+ *
+ * A rule for a domain name decides on its own for requests to that name. Requests to domain names no such rule
+ * matches are decided by the IP rules, applied to each address the name resolves to.
+ */
+
+enum AclVerdict {
+    ACL_ALLOW,
+    ACL_DENY,
+    // No rule for the domain name matched, so its addresses must be checked.
+    ACL_NO_MATCH
+};
+
+/**
+ * Loads and compiles the access control list at the given path. Returns 0 if successful, or -1 if the file
+ * couldn't be read or has an invalid rule.
+ */
+int aclInit(const char* path);
+
+/**
+ * Whether an access control list was loaded.
+ */
+int aclEnabled();
+
+/**
+ * Checks whether a client may connect to an IP address and port (the port is taken from the destination). Never
+ * returns ACL_NO_MATCH. The evaluation is counted in the given metrics.
+ */
+enum AclVerdict aclCheckAddress(const struct sockaddr* client, const struct sockaddr* destination, struct Metrics* metrics);
+
+/**
+ * Checks whether a client may connect to a domain name and port. Returns ACL_NO_MATCH if no rule for domain names
+ * matched, in which case the name's addresses must be checked with aclCheckAddress(). The evaluation is counted in
+ * the given metrics.
+ */
+enum AclVerdict aclCheckHostname(const struct sockaddr* client, const char* hostname, int port, struct Metrics* metrics);
+
+#endif
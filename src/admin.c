@@ -0,0 +1,169 @@
+#include "admin.h"
+#include "logger.h"
+#include "metrics.h"
+#include "parents.h"
+#include "timeline.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define ADMIN_REQUEST_BUFFER_SIZE 1024
+
+struct AdminServer {
+    int serverSocket;
+    struct Metrics** metrics;
+    int metricsCount;
+
+    // The labels of the source addresses' counters.
+    const char* sourceAddressNames[MAX_SOURCE_ADDRESSES];
+    int sourceAddressCount;
+    pthread_t thread;
+    int running;
+};
+
+static struct AdminServer adminServer;
+
+/**
+ * Reads the request line of an HTTP request and answers it. We don't care about the headers, so we only read
+ * until the end of the first line.
+ */
+static void handleAdminClient(int clientSocket) {
+    char request[ADMIN_REQUEST_BUFFER_SIZE];
+    size_t requestLength = 0;
+    while (requestLength < sizeof(request) - 1 && memchr(request, '\n', requestLength) == NULL) {
+        ssize_t received = recv(clientSocket, request + requestLength, sizeof(request) - 1 - requestLength, 0);
+        if (received < 0 && errno == EINTR)
+            continue;
+        if (received <= 0)
+            return;
+        requestLength += received;
+    }
+    request[requestLength] = '\0';
+
+    FILE* out = fdopen(dup(clientSocket), "w");
+    if (out == NULL)
+        return;
+
+    if (strncmp(request, "GET /metrics ", 13) == 0 || strncmp(request, "GET /metrics?", 13) == 0) {
+        fprintf(out, "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nConnection: close\r\n\r\n");
+        metricsWritePrometheus(out, adminServer.metrics, adminServer.metricsCount, adminServer.sourceAddressNames, adminServer.sourceAddressCount);
+        parentsWritePrometheus(out, adminServer.metrics, adminServer.metricsCount);
+    } else if (strncmp(request, "GET /timelines ", 15) == 0 || strncmp(request, "GET /timelines?", 15) == 0) {
+        fprintf(out, "HTTP/1.0 200 OK\r\nContent-Type: application/x-ndjson\r\nConnection: close\r\n\r\n");
+        timelineWriteJson(out);
+    } else {
+        fprintf(out, "HTTP/1.0 404 Not Found\r\nContent-Type: text/plain\r\nConnection: close\r\n\r\nNot found\n");
+    }
+
+    fclose(out);
+}
+
+static void* adminThread(void* arg) {
+    while (1) {
+        int clientSocket = accept4(adminServer.serverSocket, NULL, NULL, SOCK_CLOEXEC);
+        if (clientSocket < 0) {
+            if (errno != EINTR && errno != ECONNABORTED)
+                logErrno(LOG_LEVEL_ERROR, "Failed to accept() admin connection");
+            continue;
+        }
+
+        // A scraper that stops reading mustn't keep the admin thread stuck forever.
+        struct timeval timeout = {.tv_sec = 5, .tv_usec = 0};
+        setsockopt(clientSocket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(clientSocket, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+        // adminStop() cancels the thread while it waits in accept4(), never halfway through answering.
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+        handleAdminClient(clientSocket);
+        close(clientSocket);
+        pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+    }
+
+    return NULL;
+}
+
+int adminStart(int port, int inheritedSocket, struct Worker* workers, int workerCount) {
+    adminServer.metrics = malloc(workerCount * sizeof(struct Metrics*));
+    if (adminServer.metrics == NULL) {
+        logErrno(LOG_LEVEL_ERROR, "Failed to allocate admin listener");
+        return -1;
+    }
+
+    for (int i = 0; i < workerCount; i++)
+        adminServer.metrics[i] = &workers[i].metrics;
+    adminServer.metricsCount = workerCount;
+
+    const struct ServerArgs* args = workers[0].args;
+    for (int i = 0; i < args->sourceAddressCount; i++)
+        adminServer.sourceAddressNames[i] = args->sourceAddresses[i].name;
+    adminServer.sourceAddressCount = args->sourceAddressCount;
+
+    // After a hot upgrade, the previous process's socket is already bound to the port, and we take it over. If the
+    // port changed, we close it and bind the new one instead.
+    adminServer.serverSocket = -1;
+    if (inheritedSocket >= 0) {
+        struct sockaddr_in boundAddress;
+        socklen_t boundAddressLength = sizeof(boundAddress);
+        if (getsockname(inheritedSocket, (struct sockaddr*)&boundAddress, &boundAddressLength) == 0 && boundAddress.sin_family == AF_INET && ntohs(boundAddress.sin_port) == port) {
+            adminServer.serverSocket = inheritedSocket;
+        } else {
+            logInfo("Closing the inherited admin socket, the admin port changed");
+            close(inheritedSocket);
+        }
+    }
+
+    if (adminServer.serverSocket < 0) {
+        adminServer.serverSocket = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, IPPROTO_TCP);
+        if (adminServer.serverSocket < 0) {
+            logErrno(LOG_LEVEL_ERROR, "Failed to create admin socket");
+            free(adminServer.metrics);
+            return -1;
+        }
+
+        int reuse = 1;
+        setsockopt(adminServer.serverSocket, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+        struct sockaddr_in address;
+        memset(&address, 0, sizeof(address));
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        address.sin_port = htons(port);
+        if (bind(adminServer.serverSocket, (struct sockaddr*)&address, sizeof(address)) != 0 || listen(adminServer.serverSocket, SOMAXCONN) != 0) {
+            logErrno(LOG_LEVEL_ERROR, "Failed to bind admin socket");
+            close(adminServer.serverSocket);
+            free(adminServer.metrics);
+            return -1;
+        }
+    }
+
+    int error = pthread_create(&adminServer.thread, NULL, adminThread, NULL);
+    if (error != 0) {
+        logError("Failed to create admin thread: %s", strerror(error));
+        close(adminServer.serverSocket);
+        free(adminServer.metrics);
+        return -1;
+    }
+
+    adminServer.running = 1;
+    logInfo("Admin listener serving metrics at http://127.0.0.1:%d/metrics", port);
+    return 0;
+}
+
+int adminGetSocket() {
+    return adminServer.running ? adminServer.serverSocket : -1;
+}
+
+void adminStop() {
+    if (!adminServer.running)
+        return;
+
+    pthread_cancel(adminServer.thread);
+    pthread_join(adminServer.thread, NULL);
+    close(adminServer.serverSocket);
+    adminServer.running = 0;
+}
@@ -0,0 +1,29 @@
+#ifndef _ADMIN_H_
+#define _ADMIN_H_
+
+#include "worker.h"
+
+/**
+ * The admin listener serves the workers' metrics over HTTP, in the Prometheus text format, at /metrics, and the
+ * sampled tunnels' timelines as JSON lines at /timelines. It runs on its own thread with blocking sockets, away from
+ * the workers' event loops, and only listens on the loopback address.
+ */
+
+/**
+ * Starts the admin listener on the given port of 127.0.0.1, or on the given passive socket if it's not -1 (one
+ * inherited in a hot upgrade, already bound to that port). Returns 0 if successful, or -1 if an error occurred.
+ */
+int adminStart(int port, int inheritedSocket, struct Worker* workers, int workerCount);
+
+/**
+ * Returns the admin listener's passive socket, or -1 if it's not running.
+ */
+int adminGetSocket();
+
+/**
+ * Stops the admin listener's thread and closes its passive socket. Only the calling process's descriptor is
+ * closed, so a process the socket was handed over to keeps serving on it.
+ */
+void adminStop();
+
+#endif
@@ -0,0 +1,152 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "admission.h"
+#include "logger.h"
+#include "util.h"
+
+// The clients with tunnels open are kept in a hash table with this many chains.
+#define ADMISSION_TABLE_SIZE 4096
+
+struct AdmissionClient {
+    // The next client in the chain, and how many tunnels it has open. Both protected by the table's lock.
+    struct AdmissionClient* next;
+    int tunnels;
+
+    // The client's address: 4 bytes for IPv4 (including IPv4-mapped IPv6 addresses) or 16 for IPv6.
+    uint8_t address[16];
+    int addressLength;
+};
+
+static const char* reasonNames[ADMISSION_REASON_COUNT] = {"tunnels", "client_tunnels", "dns", "lag"};
+
+static struct {
+    int maxTunnels;
+    int maxClientTunnels;
+    int maxHandshakes;
+
+    _Atomic int tunnels;
+    _Atomic int handshakes;
+
+    pthread_mutex_t lock;
+    struct AdmissionClient* table[ADMISSION_TABLE_SIZE];
+} admission = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+void admissionInit(int maxTunnels, int maxClientTunnels, int maxHandshakes) {
+    admission.maxTunnels = maxTunnels;
+    admission.maxClientTunnels = maxClientTunnels;
+    admission.maxHandshakes = maxHandshakes;
+}
+
+int admissionClientTunnelsEnabled() {
+    return admission.maxClientTunnels > 0;
+}
+
+/**
+ * Takes a slot under a cap shared by all the workers, unless they're all taken (or takes it anyway, if there's no
+ * cap). Returns 0 if successful, or -1 if the cap was reached.
+ */
+static int takeSlot(_Atomic int* count, int max) {
+    int current = atomic_load_explicit(count, memory_order_relaxed);
+    do {
+        if (max > 0 && current >= max)
+            return -1;
+    } while (!atomic_compare_exchange_weak_explicit(count, &current, current + 1, memory_order_relaxed, memory_order_relaxed));
+
+    return 0;
+}
+
+/**
+ * Counts a tunnel for the given client address, unless it already has as many as allowed. Returns the client's
+ * entry, or NULL if it has no room left (or there's not enough memory for its entry, in which case it's let in
+ * without being counted).
+ */
+static struct AdmissionClient* takeClientTunnel(const struct sockaddr* address, int* admitted) {
+    const uint8_t* bytes;
+    int length = sockAddrKeyBytes(address, &bytes);
+
+    pthread_mutex_lock(&admission.lock);
+    struct AdmissionClient** link = &admission.table[fnv1a(bytes, length) & (ADMISSION_TABLE_SIZE - 1)];
+    while (*link != NULL && ((*link)->addressLength != length || memcmp((*link)->address, bytes, length) != 0))
+        link = &(*link)->next;
+
+    struct AdmissionClient* client = *link;
+    if (client == NULL) {
+        client = calloc(1, sizeof(struct AdmissionClient));
+        if (client == NULL) {
+            pthread_mutex_unlock(&admission.lock);
+            logError("Failed to allocate memory to count a client's tunnels");
+            *admitted = 1;
+            return NULL;
+        }
+        memcpy(client->address, bytes, length);
+        client->addressLength = length;
+        *link = client;
+    }
+
+    *admitted = client->tunnels < admission.maxClientTunnels;
+    if (*admitted)
+        client->tunnels++;
+    else
+        client = NULL;
+    pthread_mutex_unlock(&admission.lock);
+    return client;
+}
+
+int admissionTakeTunnel(const struct sockaddr* address, struct AdmissionClient** client, enum AdmissionReason* reason) {
+    *client = NULL;
+    if (takeSlot(&admission.tunnels, admission.maxTunnels) != 0) {
+        *reason = ADMISSION_REASON_TUNNELS;
+        return -1;
+    }
+
+    if (admission.maxClientTunnels > 0) {
+        int admitted;
+        *client = takeClientTunnel(address, &admitted);
+        if (!admitted) {
+            atomic_fetch_sub_explicit(&admission.tunnels, 1, memory_order_relaxed);
+            *reason = ADMISSION_REASON_CLIENT_TUNNELS;
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+void admissionReleaseTunnel(struct AdmissionClient* client) {
+    atomic_fetch_sub_explicit(&admission.tunnels, 1, memory_order_relaxed);
+    if (client == NULL)
+        return;
+
+    // A client's entry goes away with its last tunnel, so the table only holds clients with tunnels open.
+    pthread_mutex_lock(&admission.lock);
+    if (--client->tunnels == 0) {
+        uint32_t hash = fnv1a(client->address, client->addressLength);
+        struct AdmissionClient** link = &admission.table[hash & (ADMISSION_TABLE_SIZE - 1)];
+        while (*link != client)
+            link = &(*link)->next;
+        *link = client->next;
+        free(client);
+    }
+    pthread_mutex_unlock(&admission.lock);
+}
+
+int admissionStartHandshake() {
+    int handshakes = atomic_fetch_add_explicit(&admission.handshakes, 1, memory_order_relaxed) + 1;
+    return admission.maxHandshakes > 0 && handshakes >= admission.maxHandshakes;
+}
+
+void admissionFinishHandshake() {
+    atomic_fetch_sub_explicit(&admission.handshakes, 1, memory_order_relaxed);
+}
+
+int admissionHandshakesFull() {
+    return admission.maxHandshakes > 0 && atomic_load_explicit(&admission.handshakes, memory_order_relaxed) >= admission.maxHandshakes;
+}
+
+const char* admissionReasonName(enum AdmissionReason reason) {
+    return reasonNames[reason];
+}
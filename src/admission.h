@@ -0,0 +1,74 @@
+#ifndef _ADMISSION_H_
+#define _ADMISSION_H_
+
+#include <sys/socket.h>
+
+/**
+ * Admission control keeps an overloaded server serving the clients it took well, instead of serving every client
+ * badly. There can be a cap on the tunnels open at the same time, one on the tunnels of each client address, and
+ * one on the connections still in their handshake. Requests over a tunnel cap are turned down right away with a
+ * general failure reply, before any lookup or connection is made for them. A worker that reaches the handshake cap
+ * stops accepting connections until handshakes finish, so new clients wait in the kernel's queue (or get their
+ * SYNs dropped once it's full) instead of slowing down the handshakes in progress.
+ *
+ * The counts are shared by all the workers, so they're updated with atomic operations, and the tunnels of each
+ * client address are kept in a hash table under a lock.
+ */
+
+/**
+ * Why a connection was turned away.
+ */
+enum AdmissionReason {
+    ADMISSION_REASON_TUNNELS,
+    ADMISSION_REASON_CLIENT_TUNNELS,
+    ADMISSION_REASON_DNS,
+    ADMISSION_REASON_LAG,
+    ADMISSION_REASON_COUNT
+};
+
+struct AdmissionClient;
+
+/**
+ * Sets up the caps (0 meaning no cap): on the tunnels open at the same time, on those of each client address, and
+ * on the connections in their handshake.
+ */
+void admissionInit(int maxTunnels, int maxClientTunnels, int maxHandshakes);
+
+/**
+ * Whether tunnels are counted for each client address, so the client's address must be known to open one.
+ */
+int admissionClientTunnelsEnabled();
+
+/**
+ * Counts a new tunnel from the given client (whose address is only needed if admissionClientTunnelsEnabled()).
+ * Returns 0 and stores the client's entry (if any) in client if it's admitted, or -1 and stores the reason in
+ * reason if it isn't.
+ */
+int admissionTakeTunnel(const struct sockaddr* address, struct AdmissionClient** client, enum AdmissionReason* reason);
+
+/**
+ * Counts a tunnel taken with admissionTakeTunnel() as closed.
+ */
+void admissionReleaseTunnel(struct AdmissionClient* client);
+
+/**
+ * Counts a connection as starting its handshake, and returns whether the handshake cap was reached with it.
+ */
+int admissionStartHandshake();
+
+/**
+ * Counts a connection's handshake as finished (whether it succeeded or not).
+ */
+void admissionFinishHandshake();
+
+/**
+ * Returns whether as many connections as allowed are in their handshake.
+ */
+int admissionHandshakesFull();
+
+/**
+ * Returns a reason's name, for the metrics' labels.
+ */
+const char* admissionReasonName(enum AdmissionReason reason);
+
+#endif
@@ -0,0 +1,918 @@
+#include "args.h"
+#include <arpa/inet.h>
+#include <ctype.h>
+#include <errno.h>
+#include <getopt.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define MAX_WORKERS 1024
+
+// Identifiers for the long options that don't have a short version.
+enum {
+    OPT_RESOLVER_THREADS = 1000,
+    OPT_DNS_CACHE_SIZE,
+    OPT_DNS_TTL,
+    OPT_DNS_NEGATIVE_TTL,
+    OPT_CONNECT_ATTEMPT_DELAY,
+    OPT_CONNECT_TIMEOUT,
+    OPT_LOG_LEVEL,
+    OPT_ADMIN_PORT,
+    OPT_IO_ENGINE,
+    OPT_ACL,
+    OPT_RATE_LIMIT,
+    OPT_CLIENT_RATE_LIMIT,
+    OPT_USER_RATE_LIMIT,
+    OPT_CLIENT_PREFIX_LENGTH,
+    OPT_HANDSHAKE_TIMEOUT,
+    OPT_IDLE_TIMEOUT,
+    OPT_DRAIN_TIMEOUT,
+    OPT_LISTEN,
+    OPT_BACKLOG,
+    OPT_CLIENT_SOCKET_OPTIONS,
+    OPT_REMOTE_SOCKET_OPTIONS,
+    OPT_SOURCE_ADDRESS,
+    OPT_SOURCE_SELECTION,
+    OPT_PARENT,
+    OPT_PARENT_BALANCE,
+    OPT_PARENT_HEALTH_INTERVAL,
+    OPT_PARENT_MAX_FAILURES,
+    OPT_RELAY_MEMORY,
+    OPT_MAX_TUNNELS,
+    OPT_MAX_CLIENT_TUNNELS,
+    OPT_MAX_HANDSHAKES,
+    OPT_MAX_DNS_LOOKUPS,
+    OPT_MAX_LOOP_LAG,
+    OPT_ACCOUNTING_LOG,
+    OPT_ACCOUNTING_LOG_SIZE,
+    OPT_TIMELINE_SAMPLE,
+    OPT_TIMELINE_CLIENT,
+    OPT_TIMELINE_DESTINATION,
+    OPT_AUTH_THREADS,
+};
+
+#define DEFAULT_PORT 1080
+
+// The Fast Open queue length of the passive sockets when the fastopen client socket option has no value.
+#define DEFAULT_FASTOPEN_QUEUE 256
+
+/**
+ * The arguments getopt goes through, once the configuration files were read into them.
+ */
+struct ArgumentList {
+    const char** values;
+    int count;
+    int capacity;
+};
+
+// The parsed options may point into the arguments read from configuration files, so they're kept for as long as the
+// process runs.
+static struct ArgumentList arguments;
+
+// The highest rate limit accepted, in bytes per second.
+#define MAX_RATE_LIMIT (64ULL << 30)
+
+// The lowest and highest relay memory limits accepted, and the default one.
+#define MIN_RELAY_MEMORY (64ULL << 10)
+#define MAX_RELAY_MEMORY (1024ULL << 30)
+#define DEFAULT_RELAY_MEMORY (1ULL << 30)
+
+// The size accounting log files are started with.
+#define DEFAULT_ACCOUNTING_LOG_SIZE (64ULL << 20)
+
+static void printUsage(const char* programName) {
+    printf("Usage: %s [OPTIONS]\n"
+           "\n"
+           "Options:\n"
+           "  -h, --help             Print this help message and exit.\n"
+           "  -c, --config <file>    Read options from the given file, one per line as '<option> [<value>]' (the\n"
+           "                         long option name without dashes). Options after it override the file's.\n"
+           "  -w, --workers <n>      Amount of worker threads to run, each with its own event loop (default: amount of online CPUs).\n"
+           "  -p, --pin-workers      Pin each worker thread to a different CPU.\n"
+           "  -u, --users <file>     Require username/password authentication against the given credential index,\n"
+           "                         built with mkcredentials. Send SIGHUP to reload it (default: no authentication).\n"
+           "      --auth-threads <n>       Amount of threads checking passwords the workers haven't verified recently\n"
+           "                               (default: 2).\n"
+           "  -r, --relay-mode <m>   How tunnel data is relayed: 'splice' moves it between the sockets through a pipe\n"
+           "                         without copying it to user space, 'copy' uses recv() and send(), 'sockmap' has the\n"
+           "                         kernel relay tunnels without rate limits through a BPF socket map, falling back to\n"
+           "                         splice if BPF isn't available (default: splice).\n"
+           "      --relay-memory <size>    Most memory the buffers of all tunnels may take together, with an optional\n"
+           "                               k, m or g suffix. Tunnels stop reading while it's all taken (default: 1g).\n"
+           "      --listen <address>       Listen for clients on the given address: '<port>', '<ipv4>:<port>' or\n"
+           "                               '[<ipv6>]:<port>'. Can be given up to %d times (default: [::]:%d).\n"
+           "      --backlog <n>            Length of the queue of connections waiting to be accepted (default: %d).\n"
+           "      --client-socket-options <list>  Tuning for the clients' sockets, applied to the passive sockets: a\n"
+           "                               comma separated list of nodelay, rcvbuf=<size>, sndbuf=<size>,\n"
+           "                               notsent-lowat=<size>, keepalive=<idle>[:<interval>[:<count>]],\n"
+           "                               defer-accept=<s> and fastopen[=<queue length>] (default: none).\n"
+           "      --remote-socket-options <list>  Tuning for the destinations' sockets, the same as for clients but\n"
+           "                               without defer-accept, and fastopen taking no value (default: none).\n",
+           programName, MAX_LISTEN_ADDRESSES, DEFAULT_PORT, SOMAXCONN);
+
+    // The rest goes separately, since the compilers only have to support string literals so long.
+    printf("      --source-address <address>  Connect to destinations from the given local IPv4 or IPv6 address. Can be\n"
+           "                               given up to %d times to spread connections over them (default: any).\n"
+           "      --source-selection <s>   How each connection picks its source address: 'round-robin' or 'hash',\n"
+           "                               which always picks the same one for a destination (default: round-robin).\n"
+           "      --parent [<user>:<password>@]<address>:<port>[/<weight>]  Connect to destinations through the given\n"
+           "                               parent SOCKS5 proxy instead of directly. Can be given up to %d times to\n"
+           "                               spread tunnels over them, each taking a share by its weight (default: 1).\n"
+           "      --parent-balance <b>     How tunnels pick a parent: 'weighted' round robin or 'least-connections'\n"
+           "                               (default: weighted).\n"
+           "      --parent-health-interval <ms>  How often to check that the parents answer, or 0 to not check them\n"
+           "                               (default: 5000).\n"
+           "      --parent-max-failures <n>  Take a parent out for 30 seconds after this many tunnels in a row failed\n"
+           "                               through it, or 0 to never take it out (default: 3).\n"
+           "      --acl <file>             Only allow the destinations permitted by the access control list in the given\n"
+           "                               file (default: any destination is allowed).\n"
+           "      --io-engine <e>          Event loop engine: 'epoll' or 'io_uring', which falls back to epoll if the\n"
+           "                               kernel doesn't support it (default: epoll).\n"
+           "      --resolver-threads <n>   Amount of threads resolving domain names (default: 4).\n"
+           "      --dns-cache-size <n>     Maximum amount of names kept in the DNS cache (default: 10000).\n"
+           "      --dns-ttl <s>            Seconds a successful lookup is cached for (default: 60).\n"
+           "      --dns-negative-ttl <s>   Seconds a failed lookup is cached for (default: 5).\n"
+           "      --connect-attempt-delay <ms>  Time to wait for a connection attempt before also trying the\n"
+           "                               next address of the destination (default: 250).\n"
+           "      --connect-timeout <ms>   Maximum time to connect to the destination (default: 10000).\n"
+           "      --handshake-timeout <ms> Maximum time for a client to finish its handshake, not counting the time\n"
+           "                               to connect to the destination (default: 10000).\n"
+           "      --idle-timeout <s>       Close tunnels that relayed nothing for this long, or 0 to never close\n"
+           "                               them (default: 300).\n"
+           "      --drain-timeout <s>      After handing over to a new process on SIGUSR2, how long to keep serving\n"
+           "                               the connections already open before exiting (default: 300).\n"
+           "      --rate-limit <rate>      Limit the bandwidth of all tunnels together, in bytes per second, with an\n"
+           "                               optional k, m or g suffix (default: no limit).\n"
+           "      --client-rate-limit <rate>  Limit the bandwidth of each client prefix (default: no limit).\n"
+           "      --client-prefix-length <n>[,<n6>]  Length of the prefixes clients are grouped by for their rate limit,\n"
+           "                               for IPv4 and IPv6 (default: 32,64).\n"
+           "      --user-rate-limit <rate> Limit the bandwidth of each authenticated user (default: no limit).\n",
+           MAX_SOURCE_ADDRESSES, MAX_PARENTS);
+
+    printf("      --max-tunnels <n>        Turn down requests while this many tunnels are open (default: no limit).\n"
+           "      --max-client-tunnels <n> Turn down requests from a client address with this many tunnels open\n"
+           "                               (default: no limit).\n"
+           "      --max-handshakes <n>     Stop accepting connections while this many are in their handshake\n"
+           "                               (default: no limit).\n"
+           "      --max-dns-lookups <n>    Turn down requests for names while this many lookups are in progress\n"
+           "                               (default: no limit).\n"
+           "      --max-loop-lag <ms>      Turn down requests and stop accepting connections on a worker whose event\n"
+           "                               loop runs this late (default: no limit).\n"
+           "      --accounting-log <path>  Keep a binary record of every connection in files named '<path>.<ms>'\n"
+           "                               (default: disabled).\n"
+           "      --accounting-log-size <size>  Start a new accounting log file once one reaches this size, with an\n"
+           "                               optional k, m or g suffix (default: 64m).\n"
+           "      --timeline-sample <n>    Keep a timeline of one in every n tunnels, for the admin listener to dump\n"
+           "                               at /timelines (default: disabled, or every tunnel matching a filter).\n"
+           "      --timeline-client <prefix>  Only sample tunnels from clients in this address prefix.\n"
+           "      --timeline-destination <name|prefix>  Only sample tunnels to this domain name (or its\n"
+           "                               subdomains) or address prefix.\n"
+           "      --log-level <level>      Most detailed level to log: error, warn, info or debug (default: info).\n"
+           "      --admin-port <port>      Serve Prometheus metrics at http://127.0.0.1:<port>/metrics (default: disabled).\n");
+}
+
+/**
+ * Parses a decimal integer in the range [min, max]. Prints an error and exits the process if it's invalid.
+ */
+static int parseInt(const char* optionName, const char* value, int min, int max) {
+    char* end;
+    long result = strtol(value, &end, 10);
+    if (end == value || *end != '\0' || result < min || result > max) {
+        fprintf(stderr, "[ERR] Invalid value for %s: %s (must be between %d and %d)\n", optionName, value, min, max);
+        exit(1);
+    }
+
+    return (int)result;
+}
+
+/**
+ * Parses a rate in bytes per second, with an optional k, m or g suffix (as powers of 1024). Prints an error and
+ * exits the process if it's invalid.
+ */
+static uint64_t parseRate(const char* optionName, const char* value) {
+    char* end;
+    unsigned long long result = strtoull(value, &end, 10);
+    int shift = 0;
+    if (end != value && (*end == 'k' || *end == 'K'))
+        shift = 10, end++;
+    else if (end != value && (*end == 'm' || *end == 'M'))
+        shift = 20, end++;
+    else if (end != value && (*end == 'g' || *end == 'G'))
+        shift = 30, end++;
+
+    if (end == value || *end != '\0' || value[0] == '-' || result == 0 || result > (MAX_RATE_LIMIT >> shift)) {
+        fprintf(stderr, "[ERR] Invalid value for %s: %s (must be a rate in bytes per second between 1 and 64g)\n", optionName, value);
+        exit(1);
+    }
+
+    return (uint64_t)result << shift;
+}
+
+/**
+ * Parses an amount of memory in bytes, with an optional k, m or g suffix (as powers of 1024). Prints an error and
+ * exits the process if it's invalid.
+ */
+static uint64_t parseMemory(const char* optionName, const char* value) {
+    char* end;
+    unsigned long long result = strtoull(value, &end, 10);
+    int shift = 0;
+    if (end != value && (*end == 'k' || *end == 'K'))
+        shift = 10, end++;
+    else if (end != value && (*end == 'm' || *end == 'M'))
+        shift = 20, end++;
+    else if (end != value && (*end == 'g' || *end == 'G'))
+        shift = 30, end++;
+
+    if (end == value || *end != '\0' || value[0] == '-' || result > (MAX_RELAY_MEMORY >> shift) || (result << shift) < MIN_RELAY_MEMORY) {
+        fprintf(stderr, "[ERR] Invalid value for %s: %s (must be an amount of bytes between 64k and 1024g)\n", optionName, value);
+        exit(1);
+    }
+
+    return (uint64_t)result << shift;
+}
+
+/**
+ * Parses the prefix lengths for IPv4 and (optionally, after a comma) IPv6. Prints an error and exits the process
+ * if they're invalid.
+ */
+static void parsePrefixLengths(const char* value, struct ServerArgs* args) {
+    char* end;
+    long length = strtol(value, &end, 10);
+    long length6 = args->clientPrefixLength6;
+    if (end != value && *end == ',') {
+        const char* value6 = end + 1;
+        length6 = strtol(value6, &end, 10);
+        if (end == value6)
+            end = (char*)value;
+    }
+
+    if (end == value || *end != '\0' || length < 0 || length > 32 || length6 < 0 || length6 > 128) {
+        fprintf(stderr, "[ERR] Invalid value for --client-prefix-length: %s (must be between 0 and 32, optionally followed by a comma and between 0 and 128)\n", value);
+        exit(1);
+    }
+
+    args->clientPrefixLength = (int)length;
+    args->clientPrefixLength6 = (int)length6;
+}
+
+/**
+ * Parses '<port>', '<ipv4>:<port>' or '[<ipv6>]:<port>'. A missing host, '*' or '[::]' is the IPv6 wildcard address,
+ * and only allowed if allowWildcard. Returns 0 if successful, or -1 if it's invalid.
+ */
+static int parseAddressPort(const char* value, int allowWildcard, struct sockaddr_storage* address, socklen_t* addressLength) {
+    // The port goes after the last colon, if there's one. IPv6 addresses have colons of their own, so they're
+    // written between brackets.
+    char host[INET6_ADDRSTRLEN + 2] = "";
+    const char* port = value;
+    const char* colon = strrchr(value, ':');
+    if (colon != NULL) {
+        size_t hostLength = colon - value;
+        if (hostLength >= sizeof(host))
+            return -1;
+        memcpy(host, value, hostLength);
+        host[hostLength] = '\0';
+        port = colon + 1;
+    }
+
+    char* end;
+    long portNumber = strtol(port, &end, 10);
+    if (end == port || *end != '\0' || portNumber < 1 || portNumber > 65535)
+        return -1;
+
+    memset(address, 0, sizeof(*address));
+    struct sockaddr_in* address4 = (struct sockaddr_in*)address;
+    struct sockaddr_in6* address6 = (struct sockaddr_in6*)address;
+    size_t hostLength = strlen(host);
+    if (hostLength == 0 || strcmp(host, "*") == 0 || strcmp(host, "[::]") == 0) {
+        if (!allowWildcard)
+            return -1;
+        address6->sin6_family = AF_INET6;
+        address6->sin6_addr = in6addr_any;
+        address6->sin6_port = htons(portNumber);
+        *addressLength = sizeof(struct sockaddr_in6);
+    } else if (host[0] == '[' && host[hostLength - 1] == ']') {
+        host[hostLength - 1] = '\0';
+        if (inet_pton(AF_INET6, host + 1, &address6->sin6_addr) != 1)
+            return -1;
+        address6->sin6_family = AF_INET6;
+        address6->sin6_port = htons(portNumber);
+        *addressLength = sizeof(struct sockaddr_in6);
+    } else {
+        if (inet_pton(AF_INET, host, &address4->sin_addr) != 1)
+            return -1;
+        address4->sin_family = AF_INET;
+        address4->sin_port = htons(portNumber);
+        *addressLength = sizeof(struct sockaddr_in);
+    }
+
+    return 0;
+}
+
+/**
+ * Parses a listen address and adds it to the list. Prints an error and exits the process if it's invalid.
+ */
+static void parseListenAddress(const char* value, struct ServerArgs* args) {
+    if (args->listenAddressCount == MAX_LISTEN_ADDRESSES) {
+        fprintf(stderr, "[ERR] Too many listen addresses (at most %d)\n", MAX_LISTEN_ADDRESSES);
+        exit(1);
+    }
+
+    struct ListenAddress* listen = &args->listenAddresses[args->listenAddressCount];
+    memset(listen, 0, sizeof(*listen));
+    if (parseAddressPort(value, 1, &listen->address, &listen->addressLength) != 0) {
+        fprintf(stderr, "[ERR] Invalid value for --listen: %s (must be '<port>', '<ipv4>:<port>' or '[<ipv6>]:<port>')\n", value);
+        exit(1);
+    }
+
+    args->listenAddressCount++;
+}
+
+/**
+ * Parses a parent proxy, '[<username>:<password>@]<address>:<port>[/<weight>]', and adds it to the list. Prints an
+ * error and exits the process if it's invalid.
+ */
+static void parseParent(const char* value, struct ServerArgs* args) {
+    if (args->parentCount == MAX_PARENTS) {
+        fprintf(stderr, "[ERR] Too many parents (at most %d)\n", MAX_PARENTS);
+        exit(1);
+    }
+
+    struct ParentAddress* parent = &args->parents[args->parentCount];
+    memset(parent, 0, sizeof(*parent));
+    parent->weight = 1;
+
+    // The credentials go before the last '@', so the password can have any character but the address can't.
+    const char* address = value;
+    const char* at = strrchr(value, '@');
+    if (at != NULL) {
+        const char* colon = memchr(value, ':', at - value);
+        if (colon == NULL || colon == value || colon - value > 255 || at - colon - 1 > 255 || at - colon - 1 == 0)
+            goto invalid;
+        parent->usernameLength = colon - value;
+        memcpy(parent->username, value, parent->usernameLength);
+        parent->passwordLength = at - colon - 1;
+        memcpy(parent->password, colon + 1, parent->passwordLength);
+        address = at + 1;
+    }
+
+    char addressPort[INET6_ADDRSTRLEN + 8];
+    size_t addressLength = strcspn(address, "/");
+    if (addressLength >= sizeof(addressPort))
+        goto invalid;
+    memcpy(addressPort, address, addressLength);
+    addressPort[addressLength] = '\0';
+    if (parseAddressPort(addressPort, 0, &parent->address, &parent->addressLength) != 0 || strchr(addressPort, ':') == NULL)
+        goto invalid;
+    strcpy(parent->name, addressPort);
+
+    if (address[addressLength] == '/') {
+        char* end;
+        long weight = strtol(address + addressLength + 1, &end, 10);
+        if (end == address + addressLength + 1 || *end != '\0' || weight < 1 || weight > 1000)
+            goto invalid;
+        parent->weight = (int)weight;
+    }
+
+    args->parentCount++;
+    return;
+
+invalid:
+    fprintf(stderr, "[ERR] Invalid value for --parent: %s (must be '[<username>:<password>@]<address>:<port>[/<weight>]', with an IPv4 or [IPv6] address and a weight between 1 and 1000)\n", value);
+    exit(1);
+}
+
+/**
+ * Parses a source address and adds it to the pool. Prints an error and exits the process if it's invalid.
+ */
+static void parseSourceAddress(const char* value, struct ServerArgs* args) {
+    if (args->sourceAddressCount == MAX_SOURCE_ADDRESSES) {
+        fprintf(stderr, "[ERR] Too many source addresses (at most %d)\n", MAX_SOURCE_ADDRESSES);
+        exit(1);
+    }
+
+    // Brackets around IPv6 addresses are optional, since there's no port to tell apart.
+    char host[INET6_ADDRSTRLEN + 2];
+    const char* start = value;
+    size_t length = strlen(value);
+    if (length >= 2 && value[0] == '[' && value[length - 1] == ']')
+        start++, length -= 2;
+    if (length >= sizeof(host))
+        goto invalid;
+    memcpy(host, start, length);
+    host[length] = '\0';
+
+    struct SourceAddress* source = &args->sourceAddresses[args->sourceAddressCount];
+    memset(source, 0, sizeof(*source));
+    struct sockaddr_in* address4 = (struct sockaddr_in*)&source->address;
+    struct sockaddr_in6* address6 = (struct sockaddr_in6*)&source->address;
+    if (inet_pton(AF_INET, host, &address4->sin_addr) == 1) {
+        address4->sin_family = AF_INET;
+        source->addressLength = sizeof(struct sockaddr_in);
+        inet_ntop(AF_INET, &address4->sin_addr, source->name, sizeof(source->name));
+    } else if (inet_pton(AF_INET6, host, &address6->sin6_addr) == 1) {
+        address6->sin6_family = AF_INET6;
+        source->addressLength = sizeof(struct sockaddr_in6);
+        inet_ntop(AF_INET6, &address6->sin6_addr, source->name, sizeof(source->name));
+    } else {
+        goto invalid;
+    }
+
+    args->sourceAddressCount++;
+    return;
+
+invalid:
+    fprintf(stderr, "[ERR] Invalid value for --source-address: %s (must be an IPv4 or IPv6 address)\n", value);
+    exit(1);
+}
+
+/**
+ * The IPv6 wildcard address takes IPv4 connections too, unless the IPv4 wildcard address is listened on the same port,
+ * in which case binding both would conflict.
+ */
+static void resolveDualStack(struct ServerArgs* args) {
+    for (int i = 0; i < args->listenAddressCount; i++) {
+        struct sockaddr_in6* address6 = (struct sockaddr_in6*)&args->listenAddresses[i].address;
+        if (address6->sin6_family != AF_INET6 || !IN6_IS_ADDR_UNSPECIFIED(&address6->sin6_addr))
+            continue;
+
+        for (int j = 0; j < args->listenAddressCount; j++) {
+            struct sockaddr_in* address4 = (struct sockaddr_in*)&args->listenAddresses[j].address;
+            if (address4->sin_family == AF_INET && address4->sin_addr.s_addr == htonl(INADDR_ANY) && address4->sin_port == address6->sin6_port)
+                args->listenAddresses[i].v6Only = 1;
+        }
+    }
+}
+
+/**
+ * Parses a size in bytes, with an optional k or m suffix (as powers of 1024), in the range [1, max]. Returns -1 if
+ * it's invalid.
+ */
+static int parseSize(const char* value, int max) {
+    char* end;
+    long result = strtol(value, &end, 10);
+    if (end != value && (*end == 'k' || *end == 'K'))
+        result <<= 10, end++;
+    else if (end != value && (*end == 'm' || *end == 'M'))
+        result <<= 20, end++;
+
+    return (end == value || *end != '\0' || result < 1 || result > max) ? -1 : (int)result;
+}
+
+/**
+ * Parses a list of socket options for the clients' side (if clientSide) or the destinations' side, replacing the
+ * ones given before. Prints an error and exits the process if it's invalid.
+ */
+static void parseSocketOptions(const char* optionName, const char* value, struct SocketOptions* options, int clientSide) {
+    memset(options, 0, sizeof(*options));
+
+    char* list = strdup(value);
+    if (list == NULL) {
+        perror("[ERR] strdup()");
+        exit(1);
+    }
+
+    char* saveptr;
+    for (char* item = strtok_r(list, ",", &saveptr); item != NULL; item = strtok_r(NULL, ",", &saveptr)) {
+        char* itemValue = strchr(item, '=');
+        if (itemValue != NULL)
+            *itemValue++ = '\0';
+
+        int valid = 1;
+        if (strcmp(item, "nodelay") == 0 && itemValue == NULL) {
+            options->noDelay = 1;
+        } else if (strcmp(item, "rcvbuf") == 0 && itemValue != NULL) {
+            valid = (options->receiveBuffer = parseSize(itemValue, 1 << 30)) > 0;
+        } else if (strcmp(item, "sndbuf") == 0 && itemValue != NULL) {
+            valid = (options->sendBuffer = parseSize(itemValue, 1 << 30)) > 0;
+        } else if (strcmp(item, "notsent-lowat") == 0 && itemValue != NULL) {
+            valid = (options->notSentLowat = parseSize(itemValue, 1 << 30)) > 0;
+        } else if (strcmp(item, "keepalive") == 0 && itemValue != NULL) {
+            // The kernel takes at most 32767 seconds for the idle time and the interval, and 127 probes.
+            char* end;
+            long idle = strtol(itemValue, &end, 10), interval = 0, count = 0;
+            if (*end == ':')
+                interval = strtol(end + 1, &end, 10);
+            if (*end == ':')
+                count = strtol(end + 1, &end, 10);
+            valid = *end == '\0' && idle >= 1 && idle <= 32767 && interval >= 0 && interval <= 32767 && count >= 0 && count <= 127;
+            options->keepAliveIdle = (int)idle;
+            options->keepAliveInterval = (int)interval;
+            options->keepAliveCount = (int)count;
+        } else if (strcmp(item, "defer-accept") == 0 && itemValue != NULL && clientSide) {
+            valid = (options->deferAccept = parseSize(itemValue, 3600)) > 0;
+        } else if (strcmp(item, "fastopen") == 0 && clientSide) {
+            options->fastOpen = itemValue == NULL ? DEFAULT_FASTOPEN_QUEUE : parseSize(itemValue, 65535);
+            valid = options->fastOpen > 0;
+        } else if (strcmp(item, "fastopen") == 0 && itemValue == NULL) {
+            options->fastOpen = 1;
+        } else {
+            valid = 0;
+        }
+
+        if (!valid) {
+            fprintf(stderr, "[ERR] Invalid value for %s: %s%s%s\n", optionName, item, itemValue == NULL ? "" : "=", itemValue == NULL ? "" : itemValue);
+            exit(1);
+        }
+    }
+
+    free(list);
+}
+
+static void appendArgument(struct ArgumentList* list, const char* value) {
+    if (list->count == list->capacity) {
+        list->capacity = list->capacity == 0 ? 32 : list->capacity * 2;
+        list->values = realloc(list->values, list->capacity * sizeof(const char*));
+        if (list->values == NULL) {
+            perror("[ERR] realloc()");
+            exit(1);
+        }
+    }
+
+    list->values[list->count++] = value;
+}
+
+/**
+ * Reads the options in a configuration file into arguments, as if they were given in the command line. Each line
+ * has the long name of an option (the leading dashes are optional) and its value if it takes one, separated by
+ * spaces or an equals sign. Empty lines and lines starting with # are skipped. Prints an error and exits the
+ * process if the file can't be read or has a --config of its own.
+ */
+static void readConfigFile(const char* path, struct ArgumentList* list) {
+    FILE* file = fopen(path, "r");
+    if (file == NULL) {
+        fprintf(stderr, "[ERR] Failed to open configuration file %s: %s\n", path, strerror(errno));
+        exit(1);
+    }
+
+    char* line = NULL;
+    size_t lineCapacity = 0;
+    int lineNumber = 0;
+    while (getline(&line, &lineCapacity, file) >= 0) {
+        lineNumber++;
+        char* start = line;
+        while (isspace((unsigned char)*start))
+            start++;
+        char* end = start + strlen(start);
+        while (end > start && isspace((unsigned char)end[-1]))
+            end--;
+        *end = '\0';
+        if (*start == '\0' || *start == '#')
+            continue;
+
+        while (*start == '-')
+            start++;
+        char* value = start + strcspn(start, " \t=");
+        if (*value != '\0') {
+            *value++ = '\0';
+            while (isspace((unsigned char)*value) || *value == '=')
+                value++;
+        }
+
+        if (strcmp(start, "config") == 0) {
+            fprintf(stderr, "[ERR] %s:%d: configuration files can't include other configuration files\n", path, lineNumber);
+            exit(1);
+        }
+
+        char* option = malloc(strlen(start) + 3);
+        char* optionValue = *value == '\0' ? NULL : strdup(value);
+        if (option == NULL || (*value != '\0' && optionValue == NULL)) {
+            perror("[ERR] malloc()");
+            exit(1);
+        }
+        sprintf(option, "--%s", start);
+        appendArgument(list, option);
+        if (optionValue != NULL)
+            appendArgument(list, optionValue);
+    }
+
+    free(line);
+    fclose(file);
+}
+
+/**
+ * Builds the arguments for getopt, replacing each --config option with the options in its file.
+ */
+static void expandArguments(int argc, const char* argv[], struct ArgumentList* list) {
+    list->values = NULL;
+    list->count = list->capacity = 0;
+    appendArgument(list, argv[0]);
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-c") == 0 || strcmp(argv[i], "--config") == 0) {
+            if (i + 1 == argc) {
+                fprintf(stderr, "[ERR] Missing file for %s\n", argv[i]);
+                exit(1);
+            }
+            readConfigFile(argv[++i], list);
+        } else if (strncmp(argv[i], "--config=", 9) == 0) {
+            readConfigFile(argv[i] + 9, list);
+        } else {
+            appendArgument(list, argv[i]);
+        }
+    }
+
+    appendArgument(list, NULL);
+    list->count--;
+}
+
+/**
+ * Parses the name of a log level. Prints an error and exits the process if it's invalid.
+ */
+static enum LogLevel parseLogLevel(const char* value) {
+    static const char* names[] = {"error", "warn", "info", "debug"};
+    for (int i = 0; i < (int)(sizeof(names) / sizeof(names[0])); i++) {
+        if (strcmp(value, names[i]) == 0)
+            return (enum LogLevel)i;
+    }
+
+    fprintf(stderr, "[ERR] Invalid value for --log-level: %s (must be 'error', 'warn', 'info' or 'debug')\n", value);
+    exit(1);
+}
+
+void parseArgs(int originalArgc, const char* originalArgv[], struct ServerArgs* args) {
+    expandArguments(originalArgc, originalArgv, &arguments);
+    int argc = arguments.count;
+    const char** argv = arguments.values;
+
+    long onlineCpus = sysconf(_SC_NPROCESSORS_ONLN);
+    args->workers = onlineCpus < 1 ? 1 : onlineCpus > MAX_WORKERS ? MAX_WORKERS : (int)onlineCpus;
+    args->pinWorkers = 0;
+    args->ioEngine = SELECTOR_BACKEND_EPOLL;
+    args->useSplice = 1;
+    args->useSockmap = 0;
+    args->relayMemoryLimit = DEFAULT_RELAY_MEMORY;
+    args->authThreads = 2;
+    args->resolverThreads = 4;
+    args->dnsCacheSize = 10000;
+    args->dnsTtl = 60;
+    args->dnsNegativeTtl = 5;
+    args->connectAttemptDelay = 250;
+    args->connectTimeout = 10000;
+    args->handshakeTimeout = 10000;
+    args->idleTimeout = 300;
+    args->drainTimeout = 300;
+    args->logLevel = LOG_LEVEL_INFO;
+    args->adminPort = 0;
+    args->usersFile = NULL;
+    args->aclFile = NULL;
+    args->rateLimit = 0;
+    args->clientRateLimit = 0;
+    args->userRateLimit = 0;
+    args->clientPrefixLength = 32;
+    args->clientPrefixLength6 = 64;
+    args->listenAddressCount = 0;
+    args->backlog = SOMAXCONN;
+    memset(&args->clientSocketOptions, 0, sizeof(args->clientSocketOptions));
+    memset(&args->remoteSocketOptions, 0, sizeof(args->remoteSocketOptions));
+    args->sourceAddressCount = 0;
+    args->sourceSelection = SOURCE_SELECTION_ROUND_ROBIN;
+    args->parentCount = 0;
+    args->parentBalance = PARENT_BALANCE_WEIGHTED;
+    args->parentHealthInterval = 5000;
+    args->parentMaxFailures = 3;
+    args->maxTunnels = 0;
+    args->maxClientTunnels = 0;
+    args->maxHandshakes = 0;
+    args->maxDnsLookups = 0;
+    args->maxLoopLag = 0;
+    args->accountingLog = NULL;
+    args->accountingLogSize = DEFAULT_ACCOUNTING_LOG_SIZE;
+    args->timelineSample = 0;
+    args->timelineClient = NULL;
+    args->timelineDestination = NULL;
+
+    static const struct option longOptions[] = {
+        {"help", no_argument, NULL, 'h'},
+        {"workers", required_argument, NULL, 'w'},
+        {"pin-workers", no_argument, NULL, 'p'},
+        {"relay-mode", required_argument, NULL, 'r'},
+        {"relay-memory", required_argument, NULL, OPT_RELAY_MEMORY},
+        {"users", required_argument, NULL, 'u'},
+        {"auth-threads", required_argument, NULL, OPT_AUTH_THREADS},
+        {"resolver-threads", required_argument, NULL, OPT_RESOLVER_THREADS},
+        {"dns-cache-size", required_argument, NULL, OPT_DNS_CACHE_SIZE},
+        {"dns-ttl", required_argument, NULL, OPT_DNS_TTL},
+        {"dns-negative-ttl", required_argument, NULL, OPT_DNS_NEGATIVE_TTL},
+        {"connect-attempt-delay", required_argument, NULL, OPT_CONNECT_ATTEMPT_DELAY},
+        {"connect-timeout", required_argument, NULL, OPT_CONNECT_TIMEOUT},
+        {"handshake-timeout", required_argument, NULL, OPT_HANDSHAKE_TIMEOUT},
+        {"idle-timeout", required_argument, NULL, OPT_IDLE_TIMEOUT},
+        {"drain-timeout", required_argument, NULL, OPT_DRAIN_TIMEOUT},
+        {"log-level", required_argument, NULL, OPT_LOG_LEVEL},
+        {"admin-port", required_argument, NULL, OPT_ADMIN_PORT},
+        {"io-engine", required_argument, NULL, OPT_IO_ENGINE},
+        {"acl", required_argument, NULL, OPT_ACL},
+        {"rate-limit", required_argument, NULL, OPT_RATE_LIMIT},
+        {"client-rate-limit", required_argument, NULL, OPT_CLIENT_RATE_LIMIT},
+        {"user-rate-limit", required_argument, NULL, OPT_USER_RATE_LIMIT},
+        {"client-prefix-length", required_argument, NULL, OPT_CLIENT_PREFIX_LENGTH},
+        {"listen", required_argument, NULL, OPT_LISTEN},
+        {"backlog", required_argument, NULL, OPT_BACKLOG},
+        {"client-socket-options", required_argument, NULL, OPT_CLIENT_SOCKET_OPTIONS},
+        {"remote-socket-options", required_argument, NULL, OPT_REMOTE_SOCKET_OPTIONS},
+        {"source-address", required_argument, NULL, OPT_SOURCE_ADDRESS},
+        {"source-selection", required_argument, NULL, OPT_SOURCE_SELECTION},
+        {"parent", required_argument, NULL, OPT_PARENT},
+        {"parent-balance", required_argument, NULL, OPT_PARENT_BALANCE},
+        {"parent-health-interval", required_argument, NULL, OPT_PARENT_HEALTH_INTERVAL},
+        {"parent-max-failures", required_argument, NULL, OPT_PARENT_MAX_FAILURES},
+        {"max-tunnels", required_argument, NULL, OPT_MAX_TUNNELS},
+        {"max-client-tunnels", required_argument, NULL, OPT_MAX_CLIENT_TUNNELS},
+        {"max-handshakes", required_argument, NULL, OPT_MAX_HANDSHAKES},
+        {"max-dns-lookups", required_argument, NULL, OPT_MAX_DNS_LOOKUPS},
+        {"max-loop-lag", required_argument, NULL, OPT_MAX_LOOP_LAG},
+        {"accounting-log", required_argument, NULL, OPT_ACCOUNTING_LOG},
+        {"accounting-log-size", required_argument, NULL, OPT_ACCOUNTING_LOG_SIZE},
+        {"timeline-sample", required_argument, NULL, OPT_TIMELINE_SAMPLE},
+        {"timeline-client", required_argument, NULL, OPT_TIMELINE_CLIENT},
+        {"timeline-destination", required_argument, NULL, OPT_TIMELINE_DESTINATION},
+        {NULL, 0, NULL, 0}};
+
+    int c;
+    while ((c = getopt_long(argc, (char* const*)argv, "hw:pr:u:", longOptions, NULL)) != -1) {
+        switch (c) {
+            case 'h':
+                printUsage(argv[0]);
+                exit(0);
+            case 'w':
+                args->workers = parseInt("--workers", optarg, 1, MAX_WORKERS);
+                break;
+            case 'p':
+                args->pinWorkers = 1;
+                break;
+            case 'r':
+                args->useSockmap = 0;
+                if (strcmp(optarg, "splice") == 0)
+                    args->useSplice = 1;
+                else if (strcmp(optarg, "copy") == 0)
+                    args->useSplice = 0;
+                else if (strcmp(optarg, "sockmap") == 0)
+                    args->useSplice = args->useSockmap = 1;
+                else {
+                    fprintf(stderr, "[ERR] Invalid value for --relay-mode: %s (must be 'splice', 'copy' or 'sockmap')\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'u':
+                args->usersFile = optarg;
+                break;
+            case OPT_RELAY_MEMORY:
+                args->relayMemoryLimit = parseMemory("--relay-memory", optarg);
+                break;
+            case OPT_AUTH_THREADS:
+                args->authThreads = parseInt("--auth-threads", optarg, 1, 1024);
+                break;
+            case OPT_RESOLVER_THREADS:
+                args->resolverThreads = parseInt("--resolver-threads", optarg, 1, 1024);
+                break;
+            case OPT_DNS_CACHE_SIZE:
+                args->dnsCacheSize = parseInt("--dns-cache-size", optarg, 1, 10000000);
+                break;
+            case OPT_DNS_TTL:
+                args->dnsTtl = parseInt("--dns-ttl", optarg, 0, 86400);
+                break;
+            case OPT_DNS_NEGATIVE_TTL:
+                args->dnsNegativeTtl = parseInt("--dns-negative-ttl", optarg, 0, 86400);
+                break;
+            case OPT_CONNECT_ATTEMPT_DELAY:
+                args->connectAttemptDelay = parseInt("--connect-attempt-delay", optarg, 10, 60000);
+                break;
+            case OPT_CONNECT_TIMEOUT:
+                args->connectTimeout = parseInt("--connect-timeout", optarg, 1, 3600000);
+                break;
+            case OPT_HANDSHAKE_TIMEOUT:
+                args->handshakeTimeout = parseInt("--handshake-timeout", optarg, 1, 3600000);
+                break;
+            case OPT_IDLE_TIMEOUT:
+                args->idleTimeout = parseInt("--idle-timeout", optarg, 0, 86400 * 7);
+                break;
+            case OPT_DRAIN_TIMEOUT:
+                args->drainTimeout = parseInt("--drain-timeout", optarg, 0, 86400 * 7);
+                break;
+            case OPT_LOG_LEVEL:
+                args->logLevel = parseLogLevel(optarg);
+                break;
+            case OPT_IO_ENGINE:
+                if (strcmp(optarg, "epoll") == 0)
+                    args->ioEngine = SELECTOR_BACKEND_EPOLL;
+                else if (strcmp(optarg, "io_uring") == 0)
+                    args->ioEngine = SELECTOR_BACKEND_IO_URING;
+                else {
+                    fprintf(stderr, "[ERR] Invalid value for --io-engine: %s (must be 'epoll' or 'io_uring')\n", optarg);
+                    exit(1);
+                }
+                break;
+            case OPT_ACL:
+                args->aclFile = optarg;
+                break;
+            case OPT_RATE_LIMIT:
+                args->rateLimit = parseRate("--rate-limit", optarg);
+                break;
+            case OPT_CLIENT_RATE_LIMIT:
+                args->clientRateLimit = parseRate("--client-rate-limit", optarg);
+                break;
+            case OPT_USER_RATE_LIMIT:
+                args->userRateLimit = parseRate("--user-rate-limit", optarg);
+                break;
+            case OPT_CLIENT_PREFIX_LENGTH:
+                parsePrefixLengths(optarg, args);
+                break;
+            case OPT_LISTEN:
+                parseListenAddress(optarg, args);
+                break;
+            case OPT_BACKLOG:
+                args->backlog = parseInt("--backlog", optarg, 1, 65535);
+                break;
+            case OPT_CLIENT_SOCKET_OPTIONS:
+                parseSocketOptions("--client-socket-options", optarg, &args->clientSocketOptions, 1);
+                break;
+            case OPT_REMOTE_SOCKET_OPTIONS:
+                parseSocketOptions("--remote-socket-options", optarg, &args->remoteSocketOptions, 0);
+                break;
+            case OPT_SOURCE_ADDRESS:
+                parseSourceAddress(optarg, args);
+                break;
+            case OPT_SOURCE_SELECTION:
+                if (strcmp(optarg, "round-robin") == 0)
+                    args->sourceSelection = SOURCE_SELECTION_ROUND_ROBIN;
+                else if (strcmp(optarg, "hash") == 0)
+                    args->sourceSelection = SOURCE_SELECTION_HASH;
+                else {
+                    fprintf(stderr, "[ERR] Invalid value for --source-selection: %s (must be 'round-robin' or 'hash')\n", optarg);
+                    exit(1);
+                }
+                break;
+            case OPT_PARENT:
+                parseParent(optarg, args);
+                break;
+            case OPT_PARENT_BALANCE:
+                if (strcmp(optarg, "weighted") == 0)
+                    args->parentBalance = PARENT_BALANCE_WEIGHTED;
+                else if (strcmp(optarg, "least-connections") == 0)
+                    args->parentBalance = PARENT_BALANCE_LEAST_CONNECTIONS;
+                else {
+                    fprintf(stderr, "[ERR] Invalid value for --parent-balance: %s (must be 'weighted' or 'least-connections')\n", optarg);
+                    exit(1);
+                }
+                break;
+            case OPT_PARENT_HEALTH_INTERVAL:
+                args->parentHealthInterval = parseInt("--parent-health-interval", optarg, 0, 3600000);
+                break;
+            case OPT_PARENT_MAX_FAILURES:
+                args->parentMaxFailures = parseInt("--parent-max-failures", optarg, 0, 1000);
+                break;
+            case OPT_MAX_TUNNELS:
+                args->maxTunnels = parseInt("--max-tunnels", optarg, 0, 100000000);
+                break;
+            case OPT_MAX_CLIENT_TUNNELS:
+                args->maxClientTunnels = parseInt("--max-client-tunnels", optarg, 0, 100000000);
+                break;
+            case OPT_MAX_HANDSHAKES:
+                args->maxHandshakes = parseInt("--max-handshakes", optarg, 0, 100000000);
+                break;
+            case OPT_MAX_DNS_LOOKUPS:
+                args->maxDnsLookups = parseInt("--max-dns-lookups", optarg, 0, 100000000);
+                break;
+            case OPT_MAX_LOOP_LAG:
+                args->maxLoopLag = parseInt("--max-loop-lag", optarg, 0, 60000);
+                break;
+            case OPT_ACCOUNTING_LOG:
+                args->accountingLog = optarg;
+                break;
+            case OPT_ACCOUNTING_LOG_SIZE:
+                args->accountingLogSize = parseMemory("--accounting-log-size", optarg);
+                break;
+            case OPT_TIMELINE_SAMPLE:
+                args->timelineSample = parseInt("--timeline-sample", optarg, 1, 1000000000);
+                break;
+            case OPT_TIMELINE_CLIENT:
+                args->timelineClient = optarg;
+                break;
+            case OPT_TIMELINE_DESTINATION:
+                args->timelineDestination = optarg;
+                break;
+            case OPT_ADMIN_PORT:
+                args->adminPort = parseInt("--admin-port", optarg, 1, 65535);
+                break;
+            default:
+                printUsage(argv[0]);
+                exit(1);
+        }
+    }
+
+    if (optind < argc) {
+        fprintf(stderr, "[ERR] Unexpected argument: %s\n", argv[optind]);
+        printUsage(argv[0]);
+        exit(1);
+    }
+
+    if (args->listenAddressCount == 0) {
+        char defaultAddress[16];
+        snprintf(defaultAddress, sizeof(defaultAddress), "%d", DEFAULT_PORT);
+        parseListenAddress(defaultAddress, args);
+    }
+    resolveDualStack(args);
+}
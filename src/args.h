@@ -0,0 +1,152 @@
+#ifndef _ARGS_H_
+#define _ARGS_H_
+
+#include <stdint.h>
+#include <sys/socket.h>
+
+#include "logger.h"
+#include "parents.h"
+#include "selector.h"
+#include "sockopts.h"
+#include "sourcepool.h"
+
+// The most addresses the server can listen on.
+#define MAX_LISTEN_ADDRESSES 16
+
+/**
+ * An address the server listens on. Every worker has its own passive socket for each of them.
+ */
+struct ListenAddress {
+    struct sockaddr_storage address;
+    socklen_t addressLength;
+
+    // For the IPv6 wildcard address, whether it only takes IPv6 connections (IPV6_V6ONLY), which is the case when
+    // the IPv4 wildcard address is also listened on the same port.
+    int v6Only;
+};
+
+/**
+ * The options the server was started with, parsed from the command line (and the configuration file, if there's
+ * one).
+ */
+struct ServerArgs {
+    // The addresses to listen on for clients, and the length of their queues of connections waiting to be accepted.
+    struct ListenAddress listenAddresses[MAX_LISTEN_ADDRESSES];
+    int listenAddressCount;
+    int backlog;
+
+    // Tuning options for the sockets of the clients' side and of the destinations' side of the tunnels.
+    struct SocketOptions clientSocketOptions;
+    struct SocketOptions remoteSocketOptions;
+
+    // The local addresses connections to destinations come from, and how each connection picks one. Destinations of a
+    // family with no source addresses are connected to from whichever address the kernel picks.
+    struct SourceAddress sourceAddresses[MAX_SOURCE_ADDRESSES];
+    int sourceAddressCount;
+    enum SourceSelection sourceSelection;
+
+    // The parent proxies CONNECT requests go through, if there are any, how tunnels are spread among them, how often
+    // their health is checked (in milliseconds, or 0 to not check it) and how many tunnels in a row must fail through
+    // a parent to eject it (or 0 to never eject parents).
+    struct ParentAddress parents[MAX_PARENTS];
+    int parentCount;
+    enum ParentBalance parentBalance;
+    int parentHealthInterval;
+    int parentMaxFailures;
+
+    // The amount of worker threads to run, each with its own passive socket and event loop.
+    int workers;
+
+    // Whether to pin each worker thread to its own CPU.
+    int pinWorkers;
+
+    // Whether the workers' event loops run on epoll or io_uring.
+    enum SelectorBackend ioEngine;
+
+    // Whether to relay tunnel data with splice() through a pipe instead of copying it through user space.
+    int useSplice;
+
+    // Whether to have the kernel relay established tunnels through a BPF socket map, when it can.
+    int useSockmap;
+
+    // The most memory (in bytes) the buffers tunnels relay their data through may take, all together.
+    uint64_t relayMemoryLimit;
+
+    // The amount of threads checking passwords the workers' caches don't know about, shared by all the workers.
+    int authThreads;
+
+    // The amount of threads resolving domain names, shared by all the workers.
+    int resolverThreads;
+
+    // The maximum amount of names kept in the DNS cache.
+    int dnsCacheSize;
+
+    // For how long the DNS cache keeps successful and failed lookups, in seconds.
+    int dnsTtl;
+    int dnsNegativeTtl;
+
+    // How long to wait for a connection attempt before racing the next address, and the overall deadline to
+    // connect to the remote server, in milliseconds.
+    int connectAttemptDelay;
+    int connectTimeout;
+
+    // How long a client has to finish its handshake, in milliseconds (connecting to the destination aside, which has
+    // its own timeout), and how long a tunnel may go without relaying anything before it's closed, in seconds (or 0
+    // to never close idle tunnels).
+    int handshakeTimeout;
+    int idleTimeout;
+
+    // How long a process that handed its passive sockets over to a new one keeps serving its connections, in seconds.
+    int drainTimeout;
+
+    // The credential index clients authenticate against with username and password, or NULL to not require
+    // authentication.
+    const char* usersFile;
+
+    // The access control list deciding where clients may connect to, or NULL to allow any destination.
+    const char* aclFile;
+
+    // Bandwidth limits in bytes per second (0 meaning no limit): for all tunnels together, for each client prefix and
+    // for each authenticated user. Client addresses are grouped by prefixes of the given lengths.
+    uint64_t rateLimit;
+    uint64_t clientRateLimit;
+    uint64_t userRateLimit;
+    int clientPrefixLength;
+    int clientPrefixLength6;
+
+    // Admission control caps (0 meaning no cap): on the tunnels open at the same time, on those of each client address,
+    // on the connections in their handshake and on the DNS lookups in progress, and how late a worker's event loop may
+    // run before it sheds load, in milliseconds.
+    int maxTunnels;
+    int maxClientTunnels;
+    int maxHandshakes;
+    int maxDnsLookups;
+    int maxLoopLag;
+
+    // Where to keep the accounting log of every connection (or NULL to not keep it), and how big each of its files
+    // gets.
+    const char* accountingLog;
+    uint64_t accountingLogSize;
+
+    // Sample one in every timelineSample tunnels (0 meaning none, unless there's a filter) for timelines, among those
+    // from clients in the timelineClient prefix and to the timelineDestination domain name or address prefix (either
+    // NULL to not filter by it).
+    int timelineSample;
+    const char* timelineClient;
+    const char* timelineDestination;
+
+    // The port on 127.0.0.1 where the admin listener serves metrics, or 0 to not start it.
+    int adminPort;
+
+    // The most detailed level of log records to write out.
+    enum LogLevel logLevel;
+};
+
+/**
+ * Parses the command line arguments into the given struct, filling in defaults for any options not
+ * specified. A --config option is replaced by the options in the file it names, so options after it override the
+ * file's. Prints an error and exits the process if the arguments are invalid.
+ */
+void parseArgs(int argc, const char* argv[], struct ServerArgs* args);
+
+#endif
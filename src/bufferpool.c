@@ -0,0 +1,181 @@
+#include <stdatomic.h>
+#include <stdlib.h>
+
+#include "bufferpool.h"
+
+// How long waiters wait before trying again, if no buffer was given back to their worker in the meantime.
+#define BUFFER_POOL_RETRY_MILLIS 10
+
+static uint64_t memoryLimit = UINT64_MAX;
+
+// The bytes all the workers' buffers take, in use or kept to hand out again.
+static _Atomic uint64_t memoryUsed;
+
+void bufferPoolSetLimit(uint64_t limit) {
+    memoryLimit = limit;
+}
+
+/**
+ * Counts the given amount of bytes against the memory limit. Returns 0 if successful, or -1 if they don't fit.
+ */
+static int reserveMemory(size_t size) {
+    uint64_t used = atomic_load_explicit(&memoryUsed, memory_order_relaxed);
+    do {
+        if (used + size > memoryLimit)
+            return -1;
+    } while (!atomic_compare_exchange_weak_explicit(&memoryUsed, &used, used + size, memory_order_relaxed, memory_order_relaxed));
+
+    return 0;
+}
+
+static void unreserveMemory(struct BufferPool* pool, size_t size) {
+    atomic_fetch_sub_explicit(&memoryUsed, size, memory_order_relaxed);
+    metricsAddGauge(&pool->metrics->relayMemoryBytes, -(int64_t)size);
+}
+
+/**
+ * Frees all the buffers the worker kept to hand out again, so their memory can go to buffers of other classes.
+ */
+static void trimIdle(struct BufferPool* pool) {
+    for (int sizeClass = 0; sizeClass < BUFFER_POOL_CLASSES; sizeClass++) {
+        while (pool->idle[sizeClass] != NULL) {
+            void* buffer = pool->idle[sizeClass];
+            pool->idle[sizeClass] = *(void**)buffer;
+            free(buffer);
+            unreserveMemory(pool, bufferPoolClassSize(sizeClass));
+        }
+        pool->idleCount[sizeClass] = 0;
+    }
+}
+
+static void listRemove(struct BufferWaiter* waiter) {
+    waiter->previous->next = waiter->next;
+    waiter->next->previous = waiter->previous;
+    waiter->next = waiter->previous = waiter;
+}
+
+static void listAppend(struct BufferWaiter* head, struct BufferWaiter* waiter) {
+    waiter->previous = head->previous;
+    waiter->next = head;
+    head->previous->next = waiter;
+    head->previous = waiter;
+}
+
+/**
+ * Resumes the waiters in the order they started waiting, until one of them has to wait again, in which case the
+ * rest would too.
+ */
+static void timerExpired(void* data) {
+    struct BufferPool* pool = (struct BufferPool*)data;
+
+    // Take the whole queue, so a waiter that has to wait again goes to the back of the (now empty) queue.
+    struct BufferWaiter pending;
+    pending.next = pending.previous = &pending;
+    if (pool->waiters.next != &pool->waiters) {
+        pending.next = pool->waiters.next;
+        pending.previous = pool->waiters.previous;
+        pending.next->previous = &pending;
+        pending.previous->next = &pending;
+        pool->waiters.next = pool->waiters.previous = &pool->waiters;
+    }
+
+    while (pending.next != &pending) {
+        // Once a waiter had to wait again, the others keep their place behind it.
+        if (pool->waiters.next != &pool->waiters) {
+            while (pending.next != &pending) {
+                struct BufferWaiter* waiter = pending.next;
+                listRemove(waiter);
+                listAppend(&pool->waiters, waiter);
+            }
+            break;
+        }
+
+        // The handler may close the connection, so the waiter can't be touched after calling it.
+        struct BufferWaiter* waiter = pending.next;
+        listRemove(waiter);
+        waiter->waiting = 0;
+        waiter->handler(waiter->fd, EPOLLIN, waiter->data);
+    }
+
+    if (pool->waiters.next != &pool->waiters && !pool->timer.scheduled)
+        timerSchedule(&pool->timer, BUFFER_POOL_RETRY_MILLIS);
+}
+
+void bufferPoolInit(struct BufferPool* pool, struct TimerWheel* timers, struct Metrics* metrics) {
+    for (int sizeClass = 0; sizeClass < BUFFER_POOL_CLASSES; sizeClass++) {
+        pool->idle[sizeClass] = NULL;
+        pool->idleCount[sizeClass] = 0;
+    }
+
+    pool->metrics = metrics;
+    timerInit(&pool->timer, timers, timerExpired, pool);
+    pool->waiters.next = pool->waiters.previous = &pool->waiters;
+}
+
+uint8_t* bufferAcquire(struct BufferPool* pool, int* sizeClass) {
+    for (int trimmed = 0; trimmed < 2; trimmed++) {
+        for (int candidate = *sizeClass; candidate >= 0; candidate--) {
+            void* buffer = pool->idle[candidate];
+            if (buffer != NULL) {
+                pool->idle[candidate] = *(void**)buffer;
+                pool->idleCount[candidate]--;
+            } else {
+                size_t size = bufferPoolClassSize(candidate);
+                if (reserveMemory(size) != 0)
+                    continue;
+                buffer = malloc(size);
+                if (buffer == NULL) {
+                    atomic_fetch_sub_explicit(&memoryUsed, size, memory_order_relaxed);
+                    continue;
+                }
+                metricsAddGauge(&pool->metrics->relayMemoryBytes, (int64_t)size);
+            }
+
+            *sizeClass = candidate;
+            return buffer;
+        }
+
+        // The idle buffers we have left are all bigger than we asked for, but their memory may fit a smaller one.
+        trimIdle(pool);
+    }
+
+    return NULL;
+}
+
+void bufferRelease(struct BufferPool* pool, uint8_t* buffer, int sizeClass) {
+    size_t size = bufferPoolClassSize(sizeClass);
+    if (pool->idleCount[sizeClass] < (int)(BUFFER_POOL_MAX_IDLE_BYTES / size)) {
+        *(void**)buffer = pool->idle[sizeClass];
+        pool->idle[sizeClass] = buffer;
+        pool->idleCount[sizeClass]++;
+    } else {
+        free(buffer);
+        unreserveMemory(pool, size);
+    }
+
+    if (pool->waiters.next != &pool->waiters)
+        timerSchedule(&pool->timer, 0);
+}
+
+void bufferWaiterInit(struct BufferWaiter* waiter, int fd, SelectorHandler handler, void* data) {
+    waiter->next = waiter->previous = waiter;
+    waiter->waiting = 0;
+    waiter->fd = fd;
+    waiter->handler = handler;
+    waiter->data = data;
+}
+
+void bufferWait(struct BufferPool* pool, struct BufferWaiter* waiter) {
+    metricsAdd(&pool->metrics->relayMemoryWaits, 1);
+    waiter->waiting = 1;
+    listAppend(&pool->waiters, waiter);
+    if (!pool->timer.scheduled)
+        timerSchedule(&pool->timer, BUFFER_POOL_RETRY_MILLIS);
+}
+
+void bufferCancel(struct BufferWaiter* waiter) {
+    if (!waiter->waiting)
+        return;
+    listRemove(waiter);
+    waiter->waiting = 0;
+}
@@ -0,0 +1,102 @@
+#ifndef _BUFFERPOOL_H_
+#define _BUFFERPOOL_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "metrics.h"
+#include "selector.h"
+#include "timerwheel.h"
+
+/**
+ * The buffers tunnels relay their data through (and handshakes are read into) come from a pool, and only while
+ * they hold data: a buffer is taken right before reading from a socket and given back as soon as everything in it
+ * was written, so an idle tunnel holds no buffer at all. Buffers come in a few size classes, each four times as big
+ * as the one before, and each direction of a tunnel picks its class from how it was used the last time (see
+ * relay.h).
+ *
+ * Every buffer counts against a memory limit shared by all the workers, including the ones each worker keeps to
+ * hand out again. Once the limit is reached, taking a buffer first falls back to smaller classes, and if even the
+ * smallest doesn't fit, the direction stops reading (its socket is taken out of the selector's interest) and waits
+ * in its worker's queue until a buffer is given back, like a direction waiting for its rate limit. Since other
+ * workers' buffers count too, waiting directions also try again every so often.
+ */
+
+#define BUFFER_POOL_CLASSES 4
+#define BUFFER_POOL_MIN_SIZE (4 * 1024)
+
+// How many bytes of buffers of each class a worker keeps to hand out again, instead of freeing them.
+#define BUFFER_POOL_MAX_IDLE_BYTES (1024 * 1024)
+
+/**
+ * Returns the size of the buffers of the given class: 4 KiB, 16 KiB, 64 KiB or 256 KiB.
+ */
+static inline size_t bufferPoolClassSize(int sizeClass) {
+    return (size_t)BUFFER_POOL_MIN_SIZE << (2 * sizeClass);
+}
+
+/**
+ * Something waiting for a buffer. When it's resumed, its handler is called for its socket as if the socket had
+ * become readable.
+ */
+struct BufferWaiter {
+    struct BufferWaiter* next;
+    struct BufferWaiter* previous;
+    int waiting;
+
+    int fd;
+    SelectorHandler handler;
+    void* data;
+};
+
+/**
+ * Each worker's buffers to hand out again, its queue of waiters, and the timer that resumes them.
+ */
+struct BufferPool {
+    void* idle[BUFFER_POOL_CLASSES];
+    int idleCount[BUFFER_POOL_CLASSES];
+
+    struct Metrics* metrics;
+    struct Timer timer;
+    struct BufferWaiter waiters;
+};
+
+/**
+ * Sets the most bytes all the workers' buffers may take together.
+ */
+void bufferPoolSetLimit(uint64_t limit);
+
+/**
+ * Initializes a worker's pool, whose timer is on the given wheel, and which accounts for its memory in the given
+ * metrics.
+ */
+void bufferPoolInit(struct BufferPool* pool, struct TimerWheel* timers, struct Metrics* metrics);
+
+/**
+ * Takes a buffer of the given class, or of a smaller one if the memory limit doesn't leave room for it, updating
+ * sizeClass to the class of the buffer taken. Returns NULL if not even the smallest class fits, in which case
+ * whoever wanted it should wait with bufferWait().
+ */
+uint8_t* bufferAcquire(struct BufferPool* pool, int* sizeClass);
+
+/**
+ * Gives back a buffer taken from the same pool, resuming the waiters (on the next turn of the event loop).
+ */
+void bufferRelease(struct BufferPool* pool, uint8_t* buffer, int sizeClass);
+
+/**
+ * Initializes a waiter for the given socket, whose handler will be called when it's resumed.
+ */
+void bufferWaiterInit(struct BufferWaiter* waiter, int fd, SelectorHandler handler, void* data);
+
+/**
+ * Makes a waiter wait in the pool's queue until a buffer is given back (or some time passed).
+ */
+void bufferWait(struct BufferPool* pool, struct BufferWaiter* waiter);
+
+/**
+ * Takes a waiter out of the queue, if it's waiting.
+ */
+void bufferCancel(struct BufferWaiter* waiter);
+
+#endif
@@ -0,0 +1,234 @@
+#include "connector.h"
+#include "logger.h"
+#include "probes.h"
+#include "timeline.h"
+#include "util.h"
+#include <errno.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+
+/**
+ * Orders the addresses as RFC 8305 suggests: keep the order the resolver gave us within each family, but
+ * alternate between families, starting with the family of the first address.
+ */
+static void buildOrder(struct Connector* connector, struct addrinfo* addresses) {
+    struct addrinfo* preferred[MAX_CONNECT_ADDRESSES];
+    struct addrinfo* others[MAX_CONNECT_ADDRESSES];
+    int preferredCount = 0, otherCount = 0;
+
+    int preferredFamily = addresses != NULL ? addresses->ai_family : AF_UNSPEC;
+    for (struct addrinfo* ai = addresses; ai != NULL && preferredCount + otherCount < MAX_CONNECT_ADDRESSES; ai = ai->ai_next) {
+        if (ai->ai_family == preferredFamily)
+            preferred[preferredCount++] = ai;
+        else
+            others[otherCount++] = ai;
+    }
+
+    connector->orderLength = 0;
+    for (int i = 0; i < preferredCount || i < otherCount; i++) {
+        if (i < preferredCount)
+            connector->order[connector->orderLength++] = preferred[i];
+        if (i < otherCount)
+            connector->order[connector->orderLength++] = others[i];
+    }
+}
+
+/**
+ * Arms the timer to fire when the next attempt should be started or at the deadline, whichever comes first.
+ */
+static void armTimer(struct Connector* connector) {
+    uint64_t fireAt = connector->deadline;
+    if (connector->nextIndex < connector->orderLength && connector->attemptCount > 0) {
+        uint64_t nextAttemptAt = connector->lastAttemptStartedAt + connector->attemptDelayMillis;
+        if (nextAttemptAt < fireAt)
+            fireAt = nextAttemptAt;
+    }
+
+    timerScheduleAt(&connector->timer, fireAt);
+}
+
+/**
+ * Opens a socket and starts connecting it to the given address, from an address of the source pool if it has any of
+ * the address's family. If the source address turns out to have no ports left for the destination, the next one of
+ * the pool is tried. Returns the socket, or -1 if it couldn't start connecting (with lastError set).
+ */
+static int startConnecting(struct Connector* connector, struct addrinfo* addr) {
+    char addrBuffer[128];
+    int sourceCount = connector->sourcePool == NULL ? 0 : sourcePoolSize(connector->sourcePool, addr->ai_addr);
+
+    for (int retry = 0;; retry++) {
+        int sock = socket(addr->ai_family, addr->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, addr->ai_protocol);
+        if (sock < 0) {
+            connector->lastError = errno;
+            logDebug("Failed to create remote socket on %s", printAddressPort(addr, addrBuffer));
+            return -1;
+        }
+
+        // Buffer sizes and Fast Open must be set before connecting, and a failure to set any of them doesn't stop
+        // us from connecting.
+        if (connector->socketOptions != NULL && socketOptionsApply(sock, connector->socketOptions, 0) != 0)
+            logDebug("Failed to apply the remote socket options on %s: %s", printAddressPort(addr, addrBuffer), strerror(errno));
+
+        int source = sourceCount == 0 ? -2 : sourcePoolBind(connector->sourcePool, sock, addr->ai_addr, retry);
+
+        // If connect() completes right away, the socket will be reported as writable immediately anyway. With a
+        // source address, this is where its port is picked, and where it may turn out to have none left.
+        if (source != -1 && (connect(sock, addr->ai_addr, addr->ai_addrlen) == 0 || errno == EINPROGRESS))
+            return sock;
+
+        connector->lastError = errno;
+        close(sock);
+        PROBE3(connect_failed, connector->handlerData, addr->ai_addr, connector->lastError);
+        if (connector->timeline != NULL)
+            timelineAddConnect(connector->timeline, TIMELINE_CONNECT_FAILED, addr->ai_addr, connector->lastError);
+        if (source == -1)
+            logDebug("Failed to bind remote socket to a source address for %s", printAddressPort(addr, addrBuffer));
+        else
+            logDebug("Failed to connect() remote socket to %s: %s", printAddressPort(addr, addrBuffer), strerror(connector->lastError));
+
+        if (source >= 0 && connector->lastError == EADDRNOTAVAIL)
+            sourcePoolCountExhausted(connector->sourcePool, source);
+        if (retry + 1 >= sourceCount || (source >= 0 && connector->lastError != EADDRNOTAVAIL))
+            return -1;
+    }
+}
+
+/**
+ * Starts a connection attempt to the next address on which we can open a socket and start connecting.
+ * Returns 0 if an attempt was started, or -1 if there are no addresses left.
+ */
+static int startNextAttempt(struct Connector* connector) {
+    while (connector->nextIndex < connector->orderLength) {
+        struct addrinfo* addr = connector->order[connector->nextIndex++];
+        int sock = startConnecting(connector, addr);
+        if (sock < 0)
+            continue;
+
+        if (selectorAdd(connector->selector, sock, EPOLLOUT, connector->handler, connector->handlerData) != 0) {
+            connector->lastError = errno;
+            logErrno(LOG_LEVEL_ERROR, "Failed to register remote socket in selector");
+            close(sock);
+            continue;
+        }
+
+        connector->attempts[connector->attemptCount].socket = sock;
+        connector->attempts[connector->attemptCount].address = addr;
+        connector->attemptCount++;
+        connector->lastAttemptStartedAt = getMonotonicMillis();
+        PROBE3(connect_attempt, connector->handlerData, addr->ai_addr, sock);
+        if (connector->timeline != NULL)
+            timelineAddConnect(connector->timeline, TIMELINE_CONNECT_ATTEMPT, addr->ai_addr, 0);
+        return 0;
+    }
+
+    return -1;
+}
+
+static void closeAttempt(struct Connector* connector, int index) {
+    selectorRemove(connector->selector, connector->attempts[index].socket);
+    close(connector->attempts[index].socket);
+    connector->attempts[index] = connector->attempts[--connector->attemptCount];
+}
+
+/**
+ * Checks whether the connector has nothing left to do, starting a new attempt if none are in progress.
+ */
+static enum ConnectorStatus continueOrFail(struct Connector* connector) {
+    if (connector->attemptCount == 0 && startNextAttempt(connector) != 0) {
+        connectorCancel(connector);
+        return CONNECTOR_FAILED;
+    }
+
+    armTimer(connector);
+    return CONNECTOR_IN_PROGRESS;
+}
+
+/**
+ * Lets the connector's handler know that the timer expired.
+ */
+static void timerExpired(void* data) {
+    struct Connector* connector = (struct Connector*)data;
+    connector->handler(CONNECTOR_TIMER_FD, 0, connector->handlerData);
+}
+
+enum ConnectorStatus connectorStart(struct Connector* connector, struct Selector* selector, struct TimerWheel* timers, struct addrinfo* addresses, const struct SocketOptions* socketOptions, struct SourcePool* sourcePool, struct Timeline* timeline, int attemptDelayMillis, int timeoutMillis, SelectorHandler handler, void* handlerData) {
+    memset(connector, 0, sizeof(struct Connector));
+    connector->selector = selector;
+    connector->socketOptions = socketOptions;
+    connector->sourcePool = sourcePool;
+    connector->timeline = timeline;
+    connector->handler = handler;
+    connector->handlerData = handlerData;
+    connector->attemptDelayMillis = attemptDelayMillis;
+    connector->deadline = getMonotonicMillis() + timeoutMillis;
+    connector->lastError = ECONNREFUSED;
+    connector->socket = -1;
+    buildOrder(connector, addresses);
+
+    timerInit(&connector->timer, timers, timerExpired, connector);
+    return continueOrFail(connector);
+}
+
+enum ConnectorStatus connectorHandleEvent(struct Connector* connector, int fd) {
+    char addrBuffer[128];
+
+    if (fd == CONNECTOR_TIMER_FD) {
+        uint64_t now = getMonotonicMillis();
+        if (now >= connector->deadline) {
+            logError("Timed out connecting to the remote server");
+            connector->lastError = ETIMEDOUT;
+            connectorCancel(connector);
+            return CONNECTOR_FAILED;
+        }
+
+        // The current attempts are taking too long, so we start another one in parallel.
+        if (now >= connector->lastAttemptStartedAt + connector->attemptDelayMillis)
+            startNextAttempt(connector);
+        return continueOrFail(connector);
+    }
+
+    int index = 0;
+    while (index < connector->attemptCount && connector->attempts[index].socket != fd)
+        index++;
+    if (index == connector->attemptCount)
+        return connector->socket >= 0 ? CONNECTOR_CONNECTED : CONNECTOR_IN_PROGRESS;
+
+    // The attempt's socket became writable, let's see how it went.
+    int error = 0;
+    socklen_t errorLength = sizeof(error);
+    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &errorLength) != 0)
+        error = errno;
+
+    if (error != 0) {
+        struct addrinfo* addr = connector->attempts[index].address;
+        logDebug("Failed to connect() remote socket to %s: %s", printAddressPort(addr, addrBuffer), strerror(error));
+        PROBE3(connect_failed, connector->handlerData, addr->ai_addr, error);
+        if (connector->timeline != NULL)
+            timelineAddConnect(connector->timeline, TIMELINE_CONNECT_FAILED, addr->ai_addr, error);
+        connector->lastError = error;
+        closeAttempt(connector, index);
+
+        // Since this attempt failed, we don't wait for the attempt delay to start the next one.
+        startNextAttempt(connector);
+        return continueOrFail(connector);
+    }
+
+    // We have a winner! Keep its socket and cancel everything else.
+    connector->socket = fd;
+    connector->address = connector->attempts[index].address;
+    connector->attempts[index] = connector->attempts[--connector->attemptCount];
+    PROBE3(connected, connector->handlerData, connector->address->ai_addr, fd);
+    if (connector->timeline != NULL)
+        timelineAddConnect(connector->timeline, TIMELINE_CONNECTED, connector->address->ai_addr, 0);
+    connectorCancel(connector);
+    return CONNECTOR_CONNECTED;
+}
+
+void connectorCancel(struct Connector* connector) {
+    while (connector->attemptCount > 0)
+        closeAttempt(connector, connector->attemptCount - 1);
+
+    timerCancel(&connector->timer);
+}
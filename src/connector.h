@@ -0,0 +1,95 @@
+#ifndef _CONNECTOR_H_
+#define _CONNECTOR_H_
+
+#include <netdb.h>
+#include <stdint.h>
+
+#include "selector.h"
+#include "sockopts.h"
+#include "sourcepool.h"
+#include "timerwheel.h"
+
+struct Timeline;
+
+// The maximum amount of addresses a connector will try.
+#define MAX_CONNECT_ADDRESSES 16
+
+// The file descriptor the connector's handler is called with when its timer expires.
+#define CONNECTOR_TIMER_FD -1
+
+/**
+ * A connector establishes a TCP connection to any of a list of addresses, following Happy Eyeballs
+ * (RFC 8305): the addresses are interleaved by family, starting with the family of the first one, and a
+ * connection attempt is started for the first address. If it hasn't finished after the attempt delay, an
+ * attempt to the next address is started in parallel, and so on. The first attempt to succeed wins and all
+ * the others are cancelled. If an attempt fails, the next one is started right away. The whole process has
+ * an overall deadline, after which it fails.
+ *
+ * The attempts' sockets are registered in the given selector with the given handler, which must call
+ * connectorHandleEvent() for them. The connector's timer is on the given timer wheel, and when it expires the
+ * handler is called with CONNECTOR_TIMER_FD instead of a socket.
+ */
+struct Connector {
+    struct Selector* selector;
+    SelectorHandler handler;
+    void* handlerData;
+
+    // Applied to every attempt's socket before it connects, unless it's NULL.
+    const struct SocketOptions* socketOptions;
+
+    // The local addresses the attempts' sockets are bound to, unless it's NULL.
+    struct SourcePool* sourcePool;
+
+    // Where the attempts are noted, if the tunnel is sampled, or NULL.
+    struct Timeline* timeline;
+
+    // The addresses in the order we'll try them, and the index of the next one to try.
+    struct addrinfo* order[MAX_CONNECT_ADDRESSES];
+    int orderLength;
+    int nextIndex;
+
+    // The attempts currently in progress.
+    struct {
+        int socket;
+        struct addrinfo* address;
+    } attempts[MAX_CONNECT_ADDRESSES];
+    int attemptCount;
+
+    struct Timer timer;
+    uint64_t attemptDelayMillis;
+    uint64_t lastAttemptStartedAt;
+    uint64_t deadline;
+
+    // The error of the last attempt that failed, used to pick the reply if they all fail.
+    int lastError;
+
+    // Once connected, the connected socket (still registered in the selector) and the address it connected to.
+    int socket;
+    struct addrinfo* address;
+};
+
+enum ConnectorStatus {
+    CONNECTOR_IN_PROGRESS,
+    CONNECTOR_CONNECTED,
+    CONNECTOR_FAILED
+};
+
+/**
+ * Starts connecting to the given addresses (which must outlive the connector, as must the socket options, the source
+ * pool and the timeline, which may be NULL). Returns the connector's status.
+ */
+enum ConnectorStatus connectorStart(struct Connector* connector, struct Selector* selector, struct TimerWheel* timers, struct addrinfo* addresses, const struct SocketOptions* socketOptions, struct SourcePool* sourcePool, struct Timeline* timeline, int attemptDelayMillis, int timeoutMillis, SelectorHandler handler, void* handlerData);
+
+/**
+ * Continues connecting after one of the connector's sockets became ready or its timer expired (fd being
+ * CONNECTOR_TIMER_FD). Returns the connector's status. File descriptors that don't belong to the connector are
+ * ignored.
+ */
+enum ConnectorStatus connectorHandleEvent(struct Connector* connector, int fd);
+
+/**
+ * Closes all the attempts in progress and the timer. A connected socket is not closed.
+ */
+void connectorCancel(struct Connector* connector);
+
+#endif
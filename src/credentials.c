@@ -0,0 +1,474 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <sys/random.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "credentials.h"
+#include "logger.h"
+
+// How many verifications may wait for a credential thread. Past that, clients are turned down right away, so a flood
+// of wrong passwords can't queue up more work (and memory) than the threads will ever get through.
+#define CREDENTIAL_QUEUE_CAPACITY 1024
+
+/**
+ * A mapped credential index. Each index loaded gets a new generation, so cached credentials verified against an
+ * index that was since replaced are never trusted.
+ */
+struct CredentialIndex {
+    uint64_t generation;
+    void* mapping;
+    size_t mappingLength;
+
+    const struct CredentialIndexHeader* header;
+    const struct CredentialSlot* slots;
+    const struct CredentialEntry* entries;
+    const char* usernames;
+};
+
+static char* indexPath = NULL;
+static _Atomic(struct CredentialIndex*) currentIndex = NULL;
+static uint64_t nextGeneration = 1;
+
+// Where the workers and the credential threads say which index they're using, so a reload can wait until none of
+// them uses the previous one.
+static pthread_mutex_t inUseLock = PTHREAD_MUTEX_INITIALIZER;
+static _Atomic(struct CredentialIndex*)** inUseSlots = NULL;
+static int inUseSlotCount = 0;
+
+struct CredentialsJob {
+    struct CredentialCache* cache;
+    CredentialsCallback callback;
+    void* data;
+
+    // Set by the worker, and checked by the credential thread so it doesn't hash passwords nobody waits for anymore.
+    atomic_int cancelled;
+
+    char username[255];
+    size_t usernameLength;
+    char password[255];
+    size_t passwordLength;
+
+    // The result, and if it's valid, what the worker's cache keeps about it.
+    int valid;
+    uint64_t generation;
+    uint32_t entry;
+    uint8_t digest[SHA256_DIGEST_LENGTH];
+    struct CredentialsJob* next;
+};
+
+// The verifications waiting for a credential thread.
+static pthread_mutex_t jobsLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t jobsAvailable = PTHREAD_COND_INITIALIZER;
+static struct CredentialsJob* jobsHead = NULL;
+static struct CredentialsJob* jobsTail = NULL;
+static int jobsQueued = 0;
+
+// A random key for the fast hashes kept in the caches, so they're useless outside this process.
+static uint8_t cacheSecret[SHA256_DIGEST_LENGTH];
+
+// Unknown usernames are checked against this salt and key, so they take as long as a wrong password.
+static uint8_t unknownUserSalt[CREDENTIAL_SALT_LENGTH];
+static uint8_t unknownUserKey[SHA256_DIGEST_LENGTH];
+
+static void unmapIndex(struct CredentialIndex* index) {
+    munmap(index->mapping, index->mappingLength);
+    free(index);
+}
+
+/**
+ * Maps the index at the given path and checks that its layout is consistent, so lookups never have to. Returns
+ * the index, or NULL if it couldn't be loaded.
+ */
+static struct CredentialIndex* mapIndex(const char* path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        logErrno(LOG_LEVEL_ERROR, "Failed to open credential index");
+        return NULL;
+    }
+
+    struct stat fileStat;
+    if (fstat(fd, &fileStat) != 0 || (size_t)fileStat.st_size < sizeof(struct CredentialIndexHeader)) {
+        logError("Credential index %s is too short", path);
+        close(fd);
+        return NULL;
+    }
+
+    // The whole index is faulted in right away, so no handshake has to wait for it to be read from disk.
+    size_t length = fileStat.st_size;
+    void* mapping = mmap(NULL, length, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        logErrno(LOG_LEVEL_ERROR, "Failed to mmap() credential index");
+        return NULL;
+    }
+
+    struct CredentialIndex* index = malloc(sizeof(struct CredentialIndex));
+    if (index == NULL) {
+        logError("Failed to allocate memory for credential index");
+        munmap(mapping, length);
+        return NULL;
+    }
+
+    index->mapping = mapping;
+    index->mappingLength = length;
+    index->header = (const struct CredentialIndexHeader*)mapping;
+    index->slots = (const struct CredentialSlot*)(index->header + 1);
+    index->entries = (const struct CredentialEntry*)(index->slots + index->header->slotCount);
+    index->usernames = (const char*)(index->entries + index->header->entryCount);
+
+    const struct CredentialIndexHeader* header = index->header;
+    uint64_t expectedLength = sizeof(struct CredentialIndexHeader) + (uint64_t)header->slotCount * sizeof(struct CredentialSlot) + (uint64_t)header->entryCount * sizeof(struct CredentialEntry) + header->usernamesLength;
+    int valid = memcmp(header->magic, CREDENTIAL_INDEX_MAGIC, sizeof(header->magic)) == 0 && header->version == CREDENTIAL_INDEX_VERSION && header->iterations > 0
+                && header->slotCount > 0 && (header->slotCount & (header->slotCount - 1)) == 0 && header->entryCount < header->slotCount && expectedLength == length;
+
+    for (uint32_t i = 0; valid && i < header->entryCount; i++) {
+        const struct CredentialEntry* entry = &index->entries[i];
+        valid = entry->usernameLength <= 255 && entry->usernameOffset <= header->usernamesLength && entry->usernameLength <= header->usernamesLength - entry->usernameOffset;
+    }
+
+    // Lookups probe until they find the user or an empty slot, so the slots taken must be as many as the entries, which
+    // are fewer than the slots.
+    uint32_t occupied = 0;
+    for (uint32_t i = 0; valid && i < header->slotCount; i++) {
+        valid = index->slots[i].entry <= header->entryCount;
+        occupied += index->slots[i].entry != 0;
+    }
+    valid = valid && occupied == header->entryCount;
+
+    if (!valid) {
+        logError("Credential index %s is corrupt or was built by an incompatible version", path);
+        unmapIndex(index);
+        return NULL;
+    }
+
+    index->generation = nextGeneration++;
+    return index;
+}
+
+/**
+ * Compares two digests in a time that doesn't depend on where they differ.
+ */
+static int digestsEqual(const uint8_t* a, const uint8_t* b) {
+    volatile uint8_t difference = 0;
+    for (int i = 0; i < SHA256_DIGEST_LENGTH; i++)
+        difference |= a[i] ^ b[i];
+    return difference == 0;
+}
+
+/**
+ * Finds a user in the index. Returns the user's entry index, or -1 if there's no such user.
+ */
+static int64_t findEntry(const struct CredentialIndex* index, const char* username, size_t usernameLength, uint32_t hash) {
+    uint32_t mask = index->header->slotCount - 1;
+    for (uint32_t position = hash & mask;; position = (position + 1) & mask) {
+        const struct CredentialSlot* slot = &index->slots[position];
+        if (slot->entry == 0)
+            return -1;
+
+        const struct CredentialEntry* entry = &index->entries[slot->entry - 1];
+        if (slot->hash == hash && entry->usernameLength == usernameLength && memcmp(index->usernames + entry->usernameOffset, username, usernameLength) == 0)
+            return slot->entry - 1;
+    }
+}
+
+/**
+ * Calculates the fast hash of an entry's salt and a password that the caches keep.
+ */
+static void cacheDigest(const struct CredentialEntry* entry, const char* password, size_t passwordLength, uint8_t digest[SHA256_DIGEST_LENGTH]) {
+    struct Sha256 sha;
+    sha256Init(&sha);
+    sha256Update(&sha, cacheSecret, sizeof(cacheSecret));
+    sha256Update(&sha, entry->salt, sizeof(entry->salt));
+    sha256Update(&sha, password, passwordLength);
+    sha256Final(&sha, digest);
+}
+
+/**
+ * Announces which index we're about to use before using it. If a reload swapped it in the meantime, we take the new
+ * one instead, so a reload that saw inUse pointing elsewhere knows we won't touch the previous index.
+ */
+static struct CredentialIndex* acquireIndex(_Atomic(struct CredentialIndex*)* inUse) {
+    struct CredentialIndex* index;
+    do {
+        index = atomic_load(&currentIndex);
+        atomic_store(inUse, index);
+    } while (atomic_load(&currentIndex) != index);
+    return index;
+}
+
+static int registerInUse(_Atomic(struct CredentialIndex*)* inUse) {
+    pthread_mutex_lock(&inUseLock);
+    _Atomic(struct CredentialIndex*)** newSlots = realloc(inUseSlots, (inUseSlotCount + 1) * sizeof(*inUseSlots));
+    if (newSlots == NULL) {
+        pthread_mutex_unlock(&inUseLock);
+        return -1;
+    }
+    inUseSlots = newSlots;
+    inUseSlots[inUseSlotCount++] = inUse;
+    pthread_mutex_unlock(&inUseLock);
+    return 0;
+}
+
+/**
+ * Checks a job's username and password with the full password hash. Unknown users are checked too, so they take as
+ * long as a wrong password.
+ */
+static void verifyJob(const struct CredentialIndex* index, struct CredentialsJob* job) {
+    uint8_t key[SHA256_DIGEST_LENGTH];
+    int64_t entryIndex = findEntry(index, job->username, job->usernameLength, credentialHash(job->username, job->usernameLength));
+    if (entryIndex < 0) {
+        sha256Pbkdf2(job->password, job->passwordLength, unknownUserSalt, sizeof(unknownUserSalt), index->header->iterations, key);
+        digestsEqual(key, unknownUserKey);
+        job->valid = 0;
+        return;
+    }
+
+    const struct CredentialEntry* entry = &index->entries[entryIndex];
+    sha256Pbkdf2(job->password, job->passwordLength, entry->salt, sizeof(entry->salt), index->header->iterations, key);
+    job->valid = digestsEqual(key, entry->key);
+    if (job->valid) {
+        job->generation = index->generation;
+        job->entry = entryIndex;
+        cacheDigest(entry, job->password, job->passwordLength, job->digest);
+    }
+}
+
+/**
+ * Hands a finished verification to its worker's queue, and wakes the worker up.
+ */
+static void completeJob(struct CredentialsJob* job) {
+    struct CredentialCache* cache = job->cache;
+    job->next = NULL;
+
+    pthread_mutex_lock(&cache->lock);
+    if (cache->completedTail != NULL)
+        cache->completedTail->next = job;
+    else
+        cache->completedHead = job;
+    cache->completedTail = job;
+    pthread_mutex_unlock(&cache->lock);
+
+    uint64_t one = 1;
+    if (write(cache->eventFd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+        logErrno(LOG_LEVEL_ERROR, "Failed to wake up worker with credential results");
+}
+
+static void* credentialThread(void* arg) {
+    _Atomic(struct CredentialIndex*)* inUse = (_Atomic(struct CredentialIndex*)*)arg;
+
+    while (1) {
+        pthread_mutex_lock(&jobsLock);
+        while (jobsHead == NULL)
+            pthread_cond_wait(&jobsAvailable, &jobsLock);
+
+        struct CredentialsJob* job = jobsHead;
+        jobsHead = job->next;
+        if (jobsHead == NULL)
+            jobsTail = NULL;
+        jobsQueued--;
+        pthread_mutex_unlock(&jobsLock);
+
+        if (!atomic_load_explicit(&job->cancelled, memory_order_relaxed)) {
+            struct CredentialIndex* index = acquireIndex(inUse);
+            verifyJob(index, job);
+            atomic_store(inUse, NULL);
+        }
+
+        completeJob(job);
+    }
+
+    return NULL;
+}
+
+int credentialsInit(const char* path, int threadCount) {
+    if (getrandom(cacheSecret, sizeof(cacheSecret), 0) != sizeof(cacheSecret) || getrandom(unknownUserSalt, sizeof(unknownUserSalt), 0) != sizeof(unknownUserSalt)) {
+        logErrno(LOG_LEVEL_ERROR, "getrandom()");
+        return -1;
+    }
+    memcpy(unknownUserKey, cacheSecret, sizeof(unknownUserKey));
+
+    indexPath = strdup(path);
+    struct CredentialIndex* index = indexPath == NULL ? NULL : mapIndex(indexPath);
+    if (index == NULL)
+        return -1;
+
+    atomic_store(&currentIndex, index);
+    logInfo("Loaded credential index %s with %u users", indexPath, index->header->entryCount);
+
+    for (int i = 0; i < threadCount; i++) {
+        _Atomic(struct CredentialIndex*)* inUse = malloc(sizeof(*inUse));
+        if (inUse == NULL || registerInUse(inUse) != 0) {
+            logError("Failed to allocate memory for credential thread");
+            free(inUse);
+            return -1;
+        }
+        atomic_init(inUse, NULL);
+
+        pthread_t thread;
+        int error = pthread_create(&thread, NULL, credentialThread, inUse);
+        if (error != 0) {
+            logError("Failed to create credential thread: %s", strerror(error));
+            return -1;
+        }
+        pthread_detach(thread);
+    }
+
+    return 0;
+}
+
+int credentialsReload() {
+    if (indexPath == NULL)
+        return -1;
+
+    struct CredentialIndex* index = mapIndex(indexPath);
+    if (index == NULL) {
+        logError("Keeping the current credential index");
+        return -1;
+    }
+
+    struct CredentialIndex* previous = atomic_exchange(&currentIndex, index);
+
+    // Workers and credential threads that started a verification before the swap might still be reading the previous
+    // index. They take as long as a password hash at most, so we just wait for them.
+    struct timespec pause = {0, 100000};
+    pthread_mutex_lock(&inUseLock);
+    for (int i = 0; i < inUseSlotCount; i++) {
+        while (atomic_load(inUseSlots[i]) == previous)
+            nanosleep(&pause, NULL);
+    }
+    pthread_mutex_unlock(&inUseLock);
+
+    unmapIndex(previous);
+    logInfo("Reloaded credential index %s with %u users", indexPath, index->header->entryCount);
+    return 0;
+}
+
+int credentialsEnabled() {
+    return atomic_load_explicit(&currentIndex, memory_order_relaxed) != NULL;
+}
+
+/**
+ * Handles a worker's eventfd becoming readable, by caching the credentials found valid and calling the callbacks of
+ * all its finished verifications.
+ */
+static void credentialCacheHandler(int fd, uint32_t events, void* data) {
+    struct CredentialCache* cache = (struct CredentialCache*)data;
+
+    uint64_t count;
+    if (read(fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+        logErrno(LOG_LEVEL_ERROR, "Failed to read credential eventfd");
+
+    pthread_mutex_lock(&cache->lock);
+    struct CredentialsJob* job = cache->completedHead;
+    cache->completedHead = cache->completedTail = NULL;
+    pthread_mutex_unlock(&cache->lock);
+
+    while (job != NULL) {
+        struct CredentialsJob* next = job->next;
+        if (job->valid) {
+            struct CachedCredential* cached = &cache->entries[credentialHash(job->username, job->usernameLength) & (CREDENTIAL_CACHE_SIZE - 1)];
+            cached->generation = job->generation;
+            cached->entry = job->entry;
+            memcpy(cached->digest, job->digest, sizeof(job->digest));
+        }
+        if (!atomic_load_explicit(&job->cancelled, memory_order_relaxed))
+            job->callback(job->data, job->valid);
+        explicit_bzero(job->password, sizeof(job->password));
+        free(job);
+        job = next;
+    }
+}
+
+int credentialCacheInit(struct CredentialCache* cache, struct Selector* selector) {
+    memset(cache->entries, 0, sizeof(cache->entries));
+    atomic_init(&cache->inUse, NULL);
+    cache->completedHead = cache->completedTail = NULL;
+    if (pthread_mutex_init(&cache->lock, NULL) != 0)
+        return -1;
+
+    cache->eventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (cache->eventFd < 0) {
+        pthread_mutex_destroy(&cache->lock);
+        return -1;
+    }
+
+    if (selectorAdd(selector, cache->eventFd, EPOLLIN, credentialCacheHandler, cache) != 0 || registerInUse(&cache->inUse) != 0) {
+        close(cache->eventFd);
+        pthread_mutex_destroy(&cache->lock);
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Looks the user up in the worker's cache. Returns 1 if this worker verified this password for this user recently,
+ * in which case a single hash was enough, or 0 otherwise.
+ */
+static int verifyCached(struct CredentialCache* cache, const struct CredentialIndex* index, const char* username, size_t usernameLength, const char* password, size_t passwordLength) {
+    uint32_t hash = credentialHash(username, usernameLength);
+    int64_t entryIndex = findEntry(index, username, usernameLength, hash);
+    if (entryIndex < 0)
+        return 0;
+
+    uint8_t digest[SHA256_DIGEST_LENGTH];
+    cacheDigest(&index->entries[entryIndex], password, passwordLength, digest);
+
+    const struct CachedCredential* cached = &cache->entries[hash & (CREDENTIAL_CACHE_SIZE - 1)];
+    return cached->generation == index->generation && cached->entry == entryIndex && digestsEqual(cached->digest, digest);
+}
+
+int credentialsVerify(struct CredentialCache* cache, const char* username, size_t usernameLength, const char* password, size_t passwordLength, CredentialsCallback callback, void* data, struct CredentialsJob** job) {
+    struct CredentialIndex* index = acquireIndex(&cache->inUse);
+    int cached = verifyCached(cache, index, username, usernameLength, password, passwordLength);
+    atomic_store(&cache->inUse, NULL);
+    if (cached)
+        return 1;
+
+    // Anything else takes the full password hash, which is left to the credential threads, unless too many
+    // verifications are waiting for them already.
+    pthread_mutex_lock(&jobsLock);
+    if (jobsQueued >= CREDENTIAL_QUEUE_CAPACITY) {
+        pthread_mutex_unlock(&jobsLock);
+        return -2;
+    }
+
+    struct CredentialsJob* newJob = calloc(1, sizeof(struct CredentialsJob));
+    if (newJob == NULL || usernameLength > sizeof(newJob->username) || passwordLength > sizeof(newJob->password)) {
+        pthread_mutex_unlock(&jobsLock);
+        free(newJob);
+        return -1;
+    }
+
+    newJob->cache = cache;
+    newJob->callback = callback;
+    newJob->data = data;
+    memcpy(newJob->username, username, usernameLength);
+    newJob->usernameLength = usernameLength;
+    memcpy(newJob->password, password, passwordLength);
+    newJob->passwordLength = passwordLength;
+
+    if (jobsTail != NULL)
+        jobsTail->next = newJob;
+    else
+        jobsHead = newJob;
+    jobsTail = newJob;
+    jobsQueued++;
+    pthread_cond_signal(&jobsAvailable);
+    pthread_mutex_unlock(&jobsLock);
+
+    *job = newJob;
+    return 0;
+}
+
+void credentialsCancel(struct CredentialsJob* job) {
+    // The job is freed once its result reaches the worker, the callback just won't be called.
+    atomic_store_explicit(&job->cancelled, 1, memory_order_relaxed);
+}
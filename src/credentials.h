@@ -0,0 +1,145 @@
+#ifndef _CREDENTIALS_H_
+#define _CREDENTIALS_H_
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "selector.h"
+#include "sha256.h"
+#include "util.h"
+
+/**
+ * The users allowed to authenticate with username and password (RFC 1929) are read from a credential index: a
+ * file built beforehand by tools/mkcredentials, which the server maps into memory as is. It's an open addressing
+ * hash table keyed by username, so finding a user takes a hash and a few probes no matter how many users there
+ * are, and loading it is just an mmap() and a sanity check.
+ *
+ * Passwords aren't stored: each user has a random salt and the PBKDF2-HMAC-SHA256 of its password with that salt.
+ * Since checking a password takes the configured amount of hash iterations, each worker keeps a small cache of
+ * the credentials it recently verified, so a client opening many connections only pays for it once. Everything
+ * else (wrong passwords and unknown users included) is checked by a pool of credential threads, which hand the
+ * result back to the worker through an eventfd, so clients guessing passwords never hold up the event loops.
+ *
+ * The index can be replaced while the server runs: credentialsReload() maps the new file and swaps it in
+ * atomically. Handshakes never wait for a reload, they keep using the index they started with. The file must be
+ * replaced by renaming a new one over it (as mkcredentials does), never rewritten in place: truncating a mapped
+ * file takes its pages away from under the workers.
+ */
+
+/**
+ * The file's layout, all numbers in the byte order of the machine that built it: a CredentialIndexHeader, then
+ * slotCount CredentialSlots (slotCount is a power of two), then entryCount CredentialEntries, then the usernames.
+ */
+#define CREDENTIAL_INDEX_MAGIC "MEDIASCR"
+#define CREDENTIAL_INDEX_VERSION 1
+#define CREDENTIAL_SALT_LENGTH 16
+
+struct CredentialIndexHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t iterations;
+    uint32_t slotCount;
+    uint32_t entryCount;
+    uint32_t usernamesLength;
+    uint32_t reserved;
+};
+
+struct CredentialSlot {
+    // The username's hash, so most probes don't need to look at the entry, and the entry's index plus one, or
+    // zero if the slot is empty.
+    uint32_t hash;
+    uint32_t entry;
+};
+
+struct CredentialEntry {
+    // Where the username starts among the usernames, and its length.
+    uint32_t usernameOffset;
+    uint32_t usernameLength;
+    uint8_t salt[CREDENTIAL_SALT_LENGTH];
+    uint8_t key[SHA256_DIGEST_LENGTH];
+};
+
+/**
+ * Hashes a username into the index (32 bits FNV-1a).
+ */
+static inline uint32_t credentialHash(const char* username, size_t length) {
+    return fnv1a(username, length);
+}
+
+#define CREDENTIAL_CACHE_SIZE 256
+
+struct CachedCredential {
+    // The generation of the index and the entry this was verified against (generation 0 means nothing was), and a
+    // fast hash of the entry's salt and the password.
+    uint64_t generation;
+    uint32_t entry;
+    uint8_t digest[SHA256_DIGEST_LENGTH];
+};
+
+/**
+ * The function called when a verification made by the credential threads finishes, with 1 if the username and
+ * password were valid, or 0 otherwise. It's always called on the thread of the worker that asked for it.
+ */
+typedef void (*CredentialsCallback)(void* data, int valid);
+
+/**
+ * A verification waiting for its result. It can be cancelled (for example, if the client disconnects meanwhile)
+ * with credentialsCancel().
+ */
+struct CredentialsJob;
+
+/**
+ * A worker's cache of recently verified credentials, and the queue through which the credential threads hand it
+ * the results of its verifications. Only its worker uses the cache, except for inUse, through which the thread
+ * reloading the index knows whether the worker is still using the previous one.
+ */
+struct CredentialCache {
+    _Atomic(struct CredentialIndex*) inUse;
+    struct CachedCredential entries[CREDENTIAL_CACHE_SIZE];
+
+    int eventFd;
+    pthread_mutex_t lock;
+    struct CredentialsJob* completedHead;
+    struct CredentialsJob* completedTail;
+};
+
+/**
+ * Maps the credential index at the given path, and starts the given amount of credential threads. Returns 0 if
+ * successful, or -1 if it couldn't be loaded.
+ */
+int credentialsInit(const char* path, int threadCount);
+
+/**
+ * Maps the credential index again from the same path, and swaps it in for the current one, which is unmapped once
+ * no worker uses it anymore. If the new index can't be loaded, the current one is kept. Must not be called from
+ * a worker. Returns 0 if successful, or -1 if an error occurred.
+ */
+int credentialsReload();
+
+/**
+ * Whether a credential index was loaded, meaning clients must authenticate with username and password.
+ */
+int credentialsEnabled();
+
+/**
+ * Initializes a worker's cache, registering its eventfd in the worker's selector and the cache itself so reloads
+ * know about it. Returns 0 if successful, or -1 if an error occurred.
+ */
+int credentialCacheInit(struct CredentialCache* cache, struct Selector* selector);
+
+/**
+ * Checks a username and password against the current index. If the worker's cache says they're valid, the function
+ * returns 1 right away. Otherwise, it returns 0, stores a handle for the verification in job, and the callback will
+ * be called once a credential thread is done with it. Returns -1 if the verification couldn't be started, or -2 if
+ * too many verifications are waiting for the credential threads already.
+ */
+int credentialsVerify(struct CredentialCache* cache, const char* username, size_t usernameLength, const char* password, size_t passwordLength, CredentialsCallback callback, void* data, struct CredentialsJob** job);
+
+/**
+ * Cancels a verification, so its callback won't be called. Must be called from the thread of the worker that made it.
+ */
+void credentialsCancel(struct CredentialsJob* job);
+
+#endif
@@ -0,0 +1,197 @@
+#include "logger.h"
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+// Each record takes a fixed-size slot, longer records are truncated.
+#define LOG_RECORD_SIZE 256
+#define LOG_RING_RECORDS 1024
+
+// How long the writer thread sleeps when it finds all the rings empty.
+#define LOG_DRAIN_INTERVAL_MILLIS 20
+
+// Records are copied into this buffer and written out with a single write() when it fills up.
+#define LOG_BATCH_SIZE (64 * 1024)
+
+struct LogRecord {
+    size_t length;
+    char text[LOG_RECORD_SIZE];
+};
+
+/**
+ * A single-producer single-consumer ring of records. The owner thread writes records at head and the writer
+ * thread reads them from tail. Each index is only written by one side, and the other side reads it with
+ * acquire semantics, so a record's contents are visible to the writer before the head that includes it.
+ */
+struct LogRing {
+    struct LogRecord records[LOG_RING_RECORDS];
+    _Atomic uint64_t head;
+    _Atomic uint64_t tail;
+    _Atomic uint64_t dropped;
+    struct LogRing* next;
+};
+
+enum LogLevel logLevel = LOG_LEVEL_INFO;
+
+static const char* levelTags[] = {"[ERR] ", "[WRN] ", "[INF] ", "[DBG] "};
+
+// Every ring ever created, so the writer can find them. Rings are created the first time a thread logs and
+// are never freed, since our threads live for as long as the process.
+static struct LogRing* rings = NULL;
+static pthread_mutex_t ringsLock = PTHREAD_MUTEX_INITIALIZER;
+static _Thread_local struct LogRing* threadRing = NULL;
+
+// Only one thread drains the rings at a time (the writer thread, or a thread calling logFlush()).
+static pthread_mutex_t drainLock = PTHREAD_MUTEX_INITIALIZER;
+static char batch[LOG_BATCH_SIZE];
+static size_t batchLength = 0;
+
+static pthread_t writerThread;
+
+/**
+ * Returns the calling thread's ring, creating it the first time.
+ */
+static struct LogRing* getThreadRing() {
+    if (threadRing != NULL)
+        return threadRing;
+
+    struct LogRing* ring = calloc(1, sizeof(struct LogRing));
+    if (ring == NULL)
+        return NULL;
+
+    pthread_mutex_lock(&ringsLock);
+    ring->next = rings;
+    rings = ring;
+    pthread_mutex_unlock(&ringsLock);
+
+    threadRing = ring;
+    return ring;
+}
+
+void logWrite(enum LogLevel level, const char* format, ...) {
+    struct LogRing* ring = getThreadRing();
+    if (ring == NULL)
+        return;
+
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    if (head - tail == LOG_RING_RECORDS) {
+        atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+        return;
+    }
+
+    // Format the record right into its slot, truncating it if it doesn't fit, and always ending it with a newline.
+    struct LogRecord* record = &ring->records[head % LOG_RING_RECORDS];
+    size_t tagLength = strlen(levelTags[level]);
+    memcpy(record->text, levelTags[level], tagLength);
+
+    va_list ap;
+    va_start(ap, format);
+    int length = vsnprintf(record->text + tagLength, LOG_RECORD_SIZE - tagLength, format, ap);
+    va_end(ap);
+
+    size_t total = tagLength + (length < 0 ? 0 : (size_t)length);
+    if (total > LOG_RECORD_SIZE - 1)
+        total = LOG_RECORD_SIZE - 1;
+    record->text[total] = '\n';
+    record->length = total + 1;
+
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+/**
+ * Writes out the batch buffer. Since this is a background thread, a blocking write() is fine here.
+ */
+static void writeBatch() {
+    size_t written = 0;
+    while (written < batchLength) {
+        ssize_t result = write(STDOUT_FILENO, batch + written, batchLength - written);
+        if (result < 0 && errno == EINTR)
+            continue;
+        if (result <= 0)
+            break;
+        written += result;
+    }
+
+    batchLength = 0;
+}
+
+static void appendToBatch(const char* text, size_t length) {
+    if (batchLength + length > LOG_BATCH_SIZE)
+        writeBatch();
+    memcpy(batch + batchLength, text, length);
+    batchLength += length;
+}
+
+/**
+ * Moves every pending record from all the rings into the batch, writing it out as it fills up. Returns the
+ * amount of records found.
+ */
+static size_t drainRings() {
+    size_t drained = 0;
+
+    pthread_mutex_lock(&drainLock);
+    pthread_mutex_lock(&ringsLock);
+    struct LogRing* ring = rings;
+    pthread_mutex_unlock(&ringsLock);
+
+    // Rings are only ever added at the front of the list, so the part of the list we got never changes.
+    for (; ring != NULL; ring = ring->next) {
+        uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        for (; tail != head; tail++) {
+            struct LogRecord* record = &ring->records[tail % LOG_RING_RECORDS];
+            appendToBatch(record->text, record->length);
+            drained++;
+
+            // Hand the slot back to the producer as soon as we're done with it.
+            atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+        }
+
+        uint64_t dropped = atomic_exchange_explicit(&ring->dropped, 0, memory_order_relaxed);
+        if (dropped != 0) {
+            char text[LOG_RECORD_SIZE];
+            int length = snprintf(text, sizeof(text), "%sLog buffer full, dropped %lu records\n", levelTags[LOG_LEVEL_WARN], (unsigned long)dropped);
+            appendToBatch(text, length);
+        }
+    }
+
+    if (batchLength != 0)
+        writeBatch();
+    pthread_mutex_unlock(&drainLock);
+    return drained;
+}
+
+static void* logWriterThread(void* arg) {
+    struct timespec interval = {.tv_sec = 0, .tv_nsec = LOG_DRAIN_INTERVAL_MILLIS * 1000000L};
+    while (1) {
+        // If there were records, there's likely more coming, so we only sleep once everything was drained.
+        if (drainRings() == 0)
+            nanosleep(&interval, NULL);
+    }
+
+    return NULL;
+}
+
+void logFlush() {
+    drainRings();
+}
+
+int logInit(enum LogLevel level) {
+    logLevel = level;
+
+    int error = pthread_create(&writerThread, NULL, logWriterThread, NULL);
+    if (error != 0) {
+        fprintf(stderr, "[ERR] Failed to create log writer thread: %s\n", strerror(error));
+        return -1;
+    }
+
+    pthread_detach(writerThread);
+    atexit(logFlush);
+    return 0;
+}
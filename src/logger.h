@@ -0,0 +1,81 @@
+#ifndef _LOGGER_H_
+#define _LOGGER_H_
+
+#include <errno.h>
+#include <string.h>
+
+/**
+ * The logger keeps logging off the proxy's hot path. Each thread that logs gets its own ring buffer of records,
+ * which only that thread writes and only the logger's writer thread reads, so logging a record takes no locks
+ * and no system calls. The writer thread drains all the rings every few milliseconds, writing the records out
+ * in large batches. If a thread logs faster than the writer drains its ring and the ring fills up, new records
+ * are dropped (and counted, so the writer can report how many were lost) instead of blocking the thread.
+ *
+ * Records below the configured level are discarded before their arguments are even formatted, so disabled
+ * levels cost just a comparison.
+ */
+enum LogLevel {
+    LOG_LEVEL_ERROR,
+    LOG_LEVEL_WARN,
+    LOG_LEVEL_INFO,
+    LOG_LEVEL_DEBUG
+};
+
+/**
+ * The most detailed level being logged. Set by logInit().
+ */
+extern enum LogLevel logLevel;
+
+/**
+ * Starts the writer thread and sets the level. The remaining records are written out when the process exits.
+ * Returns 0 if successful, or -1 if an error occurred.
+ */
+int logInit(enum LogLevel level);
+
+/**
+ * Writes out all the records logged so far, from every thread. Normally the writer thread does this.
+ */
+void logFlush();
+
+/**
+ * Formats a record into the calling thread's ring buffer. Use the macros below instead, which skip this
+ * (including evaluating the arguments) when the level is disabled. A newline is added at the end.
+ */
+void logWrite(enum LogLevel level, const char* format, ...) __attribute__((format(printf, 2, 3)));
+
+#define logEnabled(level) ((level) <= logLevel)
+
+#define logError(...)                              \
+    do {                                           \
+        if (logEnabled(LOG_LEVEL_ERROR))           \
+            logWrite(LOG_LEVEL_ERROR, __VA_ARGS__); \
+    } while (0)
+
+#define logWarn(...)                              \
+    do {                                          \
+        if (logEnabled(LOG_LEVEL_WARN))           \
+            logWrite(LOG_LEVEL_WARN, __VA_ARGS__); \
+    } while (0)
+
+#define logInfo(...)                              \
+    do {                                          \
+        if (logEnabled(LOG_LEVEL_INFO))           \
+            logWrite(LOG_LEVEL_INFO, __VA_ARGS__); \
+    } while (0)
+
+#define logDebug(...)                              \
+    do {                                           \
+        if (logEnabled(LOG_LEVEL_DEBUG))           \
+            logWrite(LOG_LEVEL_DEBUG, __VA_ARGS__); \
+    } while (0)
+
+/**
+ * Like perror(): logs the message followed by the description of the current errno.
+ */
+#define logErrno(level, message)                                      \
+    do {                                                              \
+        if (logEnabled(level))                                        \
+            logWrite(level, "%s: %s", message, strerror(errno));      \
+    } while (0)
+
+#endif
@@ -1,77 +1,302 @@
 // This is a personal academic project. Dear PVS-Studio, please check it.
 // PVS-Studio Static Code Analyzer for C, C++ and C#: http://www.viva64.com
 
-#include <errno.h>
-#include <stdio.h>
+#include <pthread.h>
+#include <sched.h>
+#include <netinet/in.h>
+#include <signal.h>
 #include <stdlib.h>
-#include <string.h>
 #include <sys/socket.h>
+#include <time.h>
 #include <unistd.h>
 
-#include "socks5.h"
+#include "accounting.h"
+#include "acl.h"
+#include "admin.h"
+#include "admission.h"
+#include "args.h"
+#include "bufferpool.h"
+#include "credentials.h"
+#include "logger.h"
+#include "parents.h"
+#include "resolver.h"
+#include "shaper.h"
+#include "sockmap.h"
+#include "timeline.h"
+#include "upgrade.h"
 #include "util.h"
+#include "worker.h"
 
-#define MAX_PENDING_CONNECTION_REQUESTS 5
-#define SOURCE_PORT 1080
+// How often a draining process checks whether its connections finished.
+#define DRAIN_POLL_INTERVAL_MILLIS 100
+
+/**
+ * Picks the CPU for the worker with the given index, taking the CPUs this process is allowed to run on in order.
+ */
+static int pickWorkerCpu(const cpu_set_t* allowedCpus, int workerIndex) {
+    int allowedCount = CPU_COUNT(allowedCpus);
+    if (allowedCount == 0)
+        return -1;
+
+    int target = workerIndex % allowedCount;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, allowedCpus) && target-- == 0)
+            return cpu;
+    }
+
+    return -1;
+}
+
+/**
+ * Tries the destinations' socket options on a throwaway socket. Failing to set them on the real ones is only logged
+ * in debug, since it would happen for every connection, so this warns once about the ones the kernel doesn't take.
+ */
+static void checkRemoteSocketOptions(const struct SocketOptions* options) {
+    int probe = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, IPPROTO_TCP);
+    if (probe < 0)
+        return;
+
+    if (socketOptionsApply(probe, options, 0) != 0)
+        logErrno(LOG_LEVEL_WARN, "Not all the remote socket options can be set");
+    close(probe);
+}
+
+/**
+ * Hands the passive sockets over to a new process running the executable we were started with. Returns 0 if the
+ * new process is accepting connections, or -1 if it couldn't take over.
+ */
+static int handOver(const char* argv[], struct Worker* workers, int workerCount) {
+    struct UpgradeSockets sockets;
+    sockets.listenerCount = 0;
+    for (int i = 0; i < workerCount; i++) {
+        for (int j = 0; j < workers[i].serverSocketCount && sockets.listenerCount < UPGRADE_MAX_LISTENERS; j++)
+            sockets.listeners[sockets.listenerCount++] = workers[i].serverSockets[j];
+    }
+    sockets.adminSocket = adminGetSocket();
+
+    return upgradeStart(argv, &sockets);
+}
+
+/**
+ * Takes an inherited passive socket bound to the given address, if there's one left. Returns the socket, or -1 if
+ * there's none (in which case the worker creates one).
+ */
+static int takeInheritedSocket(struct UpgradeSockets* inherited, const struct ListenAddress* listenAddress) {
+    for (int i = 0; i < inherited->listenerCount; i++) {
+        if (inherited->listeners[i] < 0)
+            continue;
+
+        struct sockaddr_storage boundAddress;
+        socklen_t boundAddressLength = sizeof(boundAddress);
+        if (getsockname(inherited->listeners[i], (struct sockaddr*)&boundAddress, &boundAddressLength) == 0 && sockAddrsEqual((struct sockaddr*)&boundAddress, (const struct sockaddr*)&listenAddress->address)) {
+            int serverSocket = inherited->listeners[i];
+            inherited->listeners[i] = -1;
+            return serverSocket;
+        }
+    }
+
+    return -1;
+}
+
+/**
+ * Has every worker close its passive sockets and the connections still open, and waits for their threads to end, so
+ * nothing is left to account for or log when the process exits.
+ */
+static void shutDownWorkers(struct Worker* workers, int workerCount) {
+    for (int i = 0; i < workerCount; i++)
+        workerShutdown(&workers[i]);
+    for (int i = 0; i < workerCount; i++)
+        pthread_join(workers[i].thread, NULL);
+}
+
+/**
+ * Stops accepting connections and waits for the ones still open to finish, up to the given amount of seconds,
+ * then closes the rest and exits.
+ */
+static void drainAndExit(struct Worker* workers, int workerCount, int drainTimeout) {
+    for (int i = 0; i < workerCount; i++)
+        workerStopAccepting(&workers[i]);
+    adminStop();
+
+    logInfo("Draining the open connections for up to %d seconds", drainTimeout);
+    uint64_t deadline = getMonotonicMillis() + drainTimeout * 1000ULL;
+    while (1) {
+        // We look after sleeping, so the workers had the time to stop accepting (and to take in the connections
+        // they accepted right before that).
+        struct timespec interval = {.tv_sec = 0, .tv_nsec = DRAIN_POLL_INTERVAL_MILLIS * 1000000L};
+        nanosleep(&interval, NULL);
+
+        int64_t remaining = 0;
+        for (int i = 0; i < workerCount; i++)
+            remaining += workerActiveConnections(&workers[i]);
+
+        if (remaining == 0) {
+            logInfo("All connections finished, exiting");
+            break;
+        }
+
+        if (getMonotonicMillis() >= deadline) {
+            logInfo("Drain timeout expired with %lld connection%s still open, closing them", (long long)remaining, remaining == 1 ? "" : "s");
+            break;
+        }
+    }
+
+    shutDownWorkers(workers, workerCount);
+    logFlush();
+    exit(0);
+}
 
 int main(int argc, const char* argv[]) {
-    // Disable buffering on stdout and stderr
-    setvbuf(stdout, NULL, _IONBF, 0);
-    setvbuf(stderr, NULL, _IONBF, 0);
-
-    // Create the socket. We'll use IPv6 only, IPv6 has backwards compatibility with IPv4
-    // so by using IPv6, we can also handle incoming IPv4 connections ;)
-    int serverSocket = socket(AF_INET6, SOCK_STREAM, IPPROTO_TCP);
-    if (serverSocket < 0) {
-        perror("[ERR] socket()");
+    // Writing to a socket closed by the other end must not kill the whole server, we handle EPIPE instead.
+    signal(SIGPIPE, SIG_IGN);
+
+    struct ServerArgs args;
+    parseArgs(argc, argv, &args);
+
+    // Signals are handled by the main thread alone, so they're blocked before starting any other thread, which
+    // inherit the mask.
+    sigset_t handledSignals;
+    sigemptyset(&handledSignals);
+    sigaddset(&handledSignals, SIGHUP);
+    sigaddset(&handledSignals, SIGUSR2);
+    sigaddset(&handledSignals, SIGTERM);
+    sigaddset(&handledSignals, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &handledSignals, NULL);
+
+    // From here on everything is logged through the logger, which writes the records out on its own thread.
+    if (logInit(args.logLevel) != 0)
+        exit(1);
+
+    // If we're the new process of a hot upgrade, the previous one hands us its passive sockets to keep accepting on.
+    struct UpgradeSockets inherited;
+    int upgrading = upgradeInherit(&inherited);
+    if (upgrading < 0) {
+        logError("Failed to take over from the previous process");
+        logFlush();
         exit(1);
     }
 
-    // We want to bind our socket on IPv6 listening on all available IP addresses on port SOURCE_PORT.
-    struct sockaddr_in6 srcSocket;
-    memset((char*)&srcSocket, 0, sizeof(srcSocket));
-    srcSocket.sin6_family = AF_INET6;
-    srcSocket.sin6_port = htons(SOURCE_PORT);
-    memcpy(&srcSocket.sin6_addr, &in6addr_any, sizeof(in6addr_any));
+    // Load the users clients authenticate as, if we require authentication.
+    if (args.usersFile != NULL && credentialsInit(args.usersFile, args.authThreads) != 0) {
+        logError("Failed to load the credential index");
+        exit(1);
+    }
 
-    if (bind(serverSocket, (struct sockaddr*)&srcSocket, sizeof(srcSocket)) != 0) {
-        perror("[ERR] bind()");
+    // Compile the access control list, if there's one.
+    if (args.aclFile != NULL && aclInit(args.aclFile) != 0) {
+        logError("Failed to load the access control list");
         exit(1);
     }
 
-    if (listen(serverSocket, MAX_PENDING_CONNECTION_REQUESTS) != 0) {
-        perror("[ERR] listen()");
+    checkRemoteSocketOptions(&args.remoteSocketOptions);
+
+    // Set up the rate limits, before the workers start taking tokens from them.
+    if (shaperInit(args.rateLimit, args.clientRateLimit, args.clientPrefixLength, args.clientPrefixLength6, args.userRateLimit) != 0)
+        exit(1);
+
+    // All the workers' relay buffers share a single memory limit.
+    bufferPoolSetLimit(args.relayMemoryLimit);
+
+    // Start the accounting log, if we keep one, before the workers have connections to account for.
+    if (args.accountingLog != NULL && accountingInit(args.accountingLog, args.accountingLogSize) != 0) {
+        logError("Failed to start the accounting log");
         exit(1);
     }
 
-    // Get the local address at which our socket was found, for nothing more than printing it out.
-    struct sockaddr_storage boundAddress;
-    socklen_t boundAddressLen = sizeof(boundAddress);
-    if (getsockname(serverSocket, (struct sockaddr*)&boundAddress, &boundAddressLen) >= 0) {
-        char addrBuffer[128];
-        printSocketAddress((struct sockaddr*)&boundAddress, addrBuffer);
-        printf("[INF] Binding to %s\n", addrBuffer);
-    } else
-        perror("[WRN] Failed to getsockname()");
-
-    // Handle incomming connections
-    while (1) {
-        printf("Listening for next client...\n");
+    // Likewise, the admission control caps count the tunnels and handshakes of all the workers.
+    admissionInit(args.maxTunnels, args.maxClientTunnels, args.maxHandshakes);
+
+    // The sampled tunnels' timelines are all kept in a single ring, for the admin listener to dump.
+    if (timelineInit(args.timelineSample, args.timelineClient, args.timelineDestination) != 0)
+        exit(1);
+
+    // In sockmap relay mode, load the BPF program that relays tunnels in the kernel. If that fails, tunnels are
+    // relayed in user space.
+    if (args.useSockmap)
+        sockmapInit();
+
+    // Start checking the parent proxies' health, if CONNECT requests go through them.
+    if (parentsInit(args.parents, args.parentCount, args.parentBalance, args.parentHealthInterval, args.parentMaxFailures) != 0)
+        exit(1);
+
+    cpu_set_t allowedCpus;
+    CPU_ZERO(&allowedCpus);
+    if (args.pinWorkers && sched_getaffinity(0, sizeof(allowedCpus), &allowedCpus) != 0) {
+        logErrno(LOG_LEVEL_WARN, "sched_getaffinity(), workers won't be pinned");
+        args.pinWorkers = 0;
+    }
 
-        struct sockaddr_storage clientAddress;
-        socklen_t clientAddressLen = sizeof(clientAddress);
-        int clientHandleSocket = accept(serverSocket, (struct sockaddr*)&clientAddress, &clientAddressLen);
-        if (clientHandleSocket < 0) {
-            perror("[ERR] accept()");
+    // Start the threads that resolve domain names for all the workers.
+    if (resolverInit(args.resolverThreads, args.dnsCacheSize, args.dnsTtl, args.dnsNegativeTtl, args.maxDnsLookups) != 0) {
+        logError("Failed to start the resolver");
+        exit(1);
+    }
+
+    struct Worker* workers = calloc(args.workers, sizeof(struct Worker));
+    if (workers == NULL) {
+        logErrno(LOG_LEVEL_ERROR, "Failed to allocate workers");
+        exit(1);
+    }
+
+    // Start all the workers. Each one binds its own passive socket for each listen address (or takes over one of
+    // the previous process's bound to it) and runs its own event loop.
+    logInfo("Starting %d worker%s", args.workers, args.workers == 1 ? "" : "s");
+    for (int i = 0; i < args.workers; i++) {
+        workers[i].id = i;
+        workers[i].args = &args;
+        workers[i].cpu = args.pinWorkers ? pickWorkerCpu(&allowedCpus, i) : -1;
+        for (int j = 0; j < args.listenAddressCount; j++)
+            workers[i].serverSockets[j] = takeInheritedSocket(&inherited, &args.listenAddresses[j]);
+        if (workerStart(&workers[i]) != 0)
             exit(1);
-        } else {
-            char addrBuffer[128];
-            printSocketAddress((struct sockaddr*)&clientAddress, addrBuffer);
-            printf("[INF] New connection from %s\n", addrBuffer);
+    }
+
+    // The previous process may have had more workers, or listened on addresses we don't anymore. The connections
+    // waiting on the sockets left over are lost.
+    int leftOver = 0;
+    for (int i = 0; i < inherited.listenerCount; i++) {
+        if (inherited.listeners[i] >= 0) {
+            close(inherited.listeners[i]);
+            leftOver++;
         }
+    }
+    if (leftOver > 0)
+        logWarn("Closed %d passive socket%s inherited from the previous process that no worker took over", leftOver, leftOver == 1 ? "" : "s");
+
+    // The admin listener reads the workers' metrics from its own thread.
+    if (args.adminPort != 0 && adminStart(args.adminPort, inherited.adminSocket, workers, args.workers) != 0)
+        exit(1);
+    if (args.adminPort == 0 && inherited.adminSocket >= 0)
+        close(inherited.adminSocket);
 
-        handleClient(clientHandleSocket);
+    logInfo("Listening for clients...");
+    if (upgrading)
+        upgradeReady();
 
-        close(clientHandleSocket);
+    // The workers run until the process exits, so the main thread is left waiting for signals. SIGHUP reloads the
+    // credential index, SIGUSR2 hands over to a new process (a hot upgrade) and then drains, and SIGTERM and SIGINT
+    // have the workers close every connection right away, and then exit() so the accounting log is finished.
+    while (1) {
+        int received;
+        if (sigwait(&handledSignals, &received) != 0)
+            continue;
+
+        if (received == SIGHUP) {
+            if (args.usersFile != NULL)
+                credentialsReload();
+            else
+                logInfo("Got SIGHUP, but there's no credential index to reload");
+        } else if (received == SIGUSR2) {
+            logInfo("Got SIGUSR2, handing over to a new process");
+            if (handOver(argv, workers, args.workers) == 0)
+                drainAndExit(workers, args.workers, args.drainTimeout);
+            logError("Hot upgrade failed, still serving");
+        } else if (received == SIGTERM || received == SIGINT) {
+            logInfo("Got %s, closing all connections and exiting", received == SIGTERM ? "SIGTERM" : "SIGINT");
+            adminStop();
+            shutDownWorkers(workers, args.workers);
+            logFlush();
+            exit(0);
+        }
     }
-}
\ No newline at end of file
+}
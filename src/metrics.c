@@ -0,0 +1,244 @@
+#include "metrics.h"
+#include <stddef.h>
+#include <string.h>
+
+static const char* phaseNames[METRICS_PHASE_COUNT] = {"auth", "request", "dns", "connect", "relay"};
+
+// The bucket bounds exported to Prometheus, in seconds. Each of our histogram buckets is counted under the first
+// of these bounds that's not below the bucket's upper edge.
+static const double exportedBounds[] = {0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10, 30, 60, 300, 3600};
+#define EXPORTED_BOUND_COUNT (sizeof(exportedBounds) / sizeof(exportedBounds[0]))
+
+static const double exportedQuantiles[] = {0.5, 0.9, 0.99, 0.999};
+#define EXPORTED_QUANTILE_COUNT (sizeof(exportedQuantiles) / sizeof(exportedQuantiles[0]))
+
+/**
+ * Returns the bucket for a value. Values below HISTOGRAM_SUB_BUCKETS get a bucket each. Above that, the bucket
+ * is given by the position of the value's highest bit and the HISTOGRAM_SUB_BUCKET_BITS bits that follow it.
+ */
+static int bucketIndex(uint64_t value) {
+    if (value < HISTOGRAM_SUB_BUCKETS)
+        return (int)value;
+
+    int exponent = 63 - __builtin_clzll(value);
+    if (exponent > HISTOGRAM_MAX_EXPONENT)
+        return HISTOGRAM_BUCKETS - 1;
+
+    int subBucket = (int)(value >> (exponent - HISTOGRAM_SUB_BUCKET_BITS)) & (HISTOGRAM_SUB_BUCKETS - 1);
+    return (exponent - HISTOGRAM_SUB_BUCKET_BITS + 1) * HISTOGRAM_SUB_BUCKETS + subBucket;
+}
+
+/**
+ * Returns the (exclusive) upper edge of a bucket, that is, the smallest value of the next bucket.
+ */
+static uint64_t bucketUpperEdge(int index) {
+    if (index < HISTOGRAM_SUB_BUCKETS)
+        return (uint64_t)index + 1;
+
+    int exponent = index / HISTOGRAM_SUB_BUCKETS + HISTOGRAM_SUB_BUCKET_BITS - 1;
+    uint64_t subBucket = index % HISTOGRAM_SUB_BUCKETS;
+    return (HISTOGRAM_SUB_BUCKETS + subBucket + 1) << (exponent - HISTOGRAM_SUB_BUCKET_BITS);
+}
+
+void metricsRecordPhase(struct Metrics* metrics, enum MetricsPhase phase, uint64_t micros) {
+    struct Histogram* histogram = &metrics->phases[phase];
+    metricsAdd(&histogram->buckets[bucketIndex(micros)], 1);
+    metricsAdd(&histogram->count, 1);
+    metricsAdd(&histogram->sumMicros, micros);
+}
+
+void metricsCountReply(struct Metrics* metrics, uint8_t replyCode) {
+    if (replyCode >= 1 && replyCode <= METRICS_MAX_REPLY_CODE)
+        metricsAdd(&metrics->failedReplies[replyCode], 1);
+}
+
+static uint64_t load(_Atomic uint64_t* value) {
+    return atomic_load_explicit(value, memory_order_relaxed);
+}
+
+uint64_t metricsSumCounter(struct Metrics* const* metrics, int count, size_t offset) {
+    uint64_t total = 0;
+    for (int i = 0; i < count; i++)
+        total += load((_Atomic uint64_t*)((char*)metrics[i] + offset));
+    return total;
+}
+
+static int64_t sumGauge(struct Metrics* const* metrics, int count, size_t offset) {
+    int64_t total = 0;
+    for (int i = 0; i < count; i++)
+        total += atomic_load_explicit((_Atomic int64_t*)((char*)metrics[i] + offset), memory_order_relaxed);
+    return total;
+}
+
+static int64_t maxGauge(struct Metrics* const* metrics, int count, size_t offset) {
+    int64_t max = 0;
+    for (int i = 0; i < count; i++) {
+        int64_t value = atomic_load_explicit((_Atomic int64_t*)((char*)metrics[i] + offset), memory_order_relaxed);
+        if (value > max)
+            max = value;
+    }
+    return max;
+}
+
+static void writePhases(FILE* out, struct Metrics* const* metrics, int count) {
+    fprintf(out, "# HELP medias_phase_duration_seconds Time taken by each phase of a client connection.\n");
+    fprintf(out, "# TYPE medias_phase_duration_seconds histogram\n");
+
+    uint64_t buckets[METRICS_PHASE_COUNT][HISTOGRAM_BUCKETS];
+    uint64_t totals[METRICS_PHASE_COUNT];
+    memset(buckets, 0, sizeof(buckets));
+
+    for (int phase = 0; phase < METRICS_PHASE_COUNT; phase++) {
+        uint64_t sumMicros = 0;
+        for (int i = 0; i < count; i++) {
+            struct Histogram* histogram = &metrics[i]->phases[phase];
+            for (int b = 0; b < HISTOGRAM_BUCKETS; b++)
+                buckets[phase][b] += load(&histogram->buckets[b]);
+            sumMicros += load(&histogram->sumMicros);
+        }
+
+        // The count is taken from the buckets themselves, so it's consistent with them even if the workers
+        // recorded values while we were reading.
+        uint64_t cumulative = 0;
+        int b = 0;
+        for (size_t bound = 0; bound < EXPORTED_BOUND_COUNT; bound++) {
+            for (; b < HISTOGRAM_BUCKETS && bucketUpperEdge(b) <= exportedBounds[bound] * 1e6 + 1; b++)
+                cumulative += buckets[phase][b];
+            fprintf(out, "medias_phase_duration_seconds_bucket{phase=\"%s\",le=\"%g\"} %lu\n", phaseNames[phase], exportedBounds[bound], (unsigned long)cumulative);
+        }
+        for (; b < HISTOGRAM_BUCKETS; b++)
+            cumulative += buckets[phase][b];
+        totals[phase] = cumulative;
+
+        fprintf(out, "medias_phase_duration_seconds_bucket{phase=\"%s\",le=\"+Inf\"} %lu\n", phaseNames[phase], (unsigned long)cumulative);
+        fprintf(out, "medias_phase_duration_seconds_sum{phase=\"%s\"} %.6f\n", phaseNames[phase], sumMicros / 1e6);
+        fprintf(out, "medias_phase_duration_seconds_count{phase=\"%s\"} %lu\n", phaseNames[phase], (unsigned long)cumulative);
+    }
+
+    // The exported buckets are coarse, so we also export quantiles computed from our own buckets. Each quantile
+    // is the upper edge of the bucket it falls in.
+    fprintf(out, "# HELP medias_phase_duration_quantile_seconds Quantiles of the time taken by each phase, since startup.\n");
+    fprintf(out, "# TYPE medias_phase_duration_quantile_seconds gauge\n");
+    for (int phase = 0; phase < METRICS_PHASE_COUNT; phase++) {
+        for (size_t q = 0; q < EXPORTED_QUANTILE_COUNT; q++) {
+            double value = 0;
+            if (totals[phase] != 0) {
+                uint64_t rank = (uint64_t)(exportedQuantiles[q] * totals[phase]);
+                uint64_t cumulative = 0;
+                for (int b = 0; b < HISTOGRAM_BUCKETS; b++) {
+                    cumulative += buckets[phase][b];
+                    if (cumulative > rank || b == HISTOGRAM_BUCKETS - 1) {
+                        value = bucketUpperEdge(b) / 1e6;
+                        break;
+                    }
+                }
+            }
+            fprintf(out, "medias_phase_duration_quantile_seconds{phase=\"%s\",quantile=\"%g\"} %g\n", phaseNames[phase], exportedQuantiles[q], value);
+        }
+    }
+}
+
+void metricsWritePrometheus(FILE* out, struct Metrics* const* metrics, int count, const char* const* sourceAddressNames, int sourceAddressCount) {
+    fprintf(out, "# HELP medias_connections_accepted_total Client connections accepted.\n");
+    fprintf(out, "# TYPE medias_connections_accepted_total counter\n");
+    fprintf(out, "medias_connections_accepted_total %lu\n", (unsigned long)metricsSumCounter(metrics, count, offsetof(struct Metrics, connectionsAccepted)));
+
+    fprintf(out, "# HELP medias_connections_active Client connections currently open, in any state.\n");
+    fprintf(out, "# TYPE medias_connections_active gauge\n");
+    fprintf(out, "medias_connections_active %ld\n", (long)sumGauge(metrics, count, offsetof(struct Metrics, connectionsActive)));
+
+    fprintf(out, "# HELP medias_tunnels_active Tunnels currently relaying data.\n");
+    fprintf(out, "# TYPE medias_tunnels_active gauge\n");
+    fprintf(out, "medias_tunnels_active %ld\n", (long)sumGauge(metrics, count, offsetof(struct Metrics, tunnelsActive)));
+
+    fprintf(out, "# HELP medias_tunnels_in_kernel Tunnels currently relayed by the kernel through the socket map.\n");
+    fprintf(out, "# TYPE medias_tunnels_in_kernel gauge\n");
+    fprintf(out, "medias_tunnels_in_kernel %ld\n", (long)sumGauge(metrics, count, offsetof(struct Metrics, tunnelsInKernel)));
+
+    fprintf(out, "# HELP medias_relay_bytes_total Bytes relayed through tunnels, by direction.\n");
+    fprintf(out, "# TYPE medias_relay_bytes_total counter\n");
+    fprintf(out, "medias_relay_bytes_total{direction=\"client_to_remote\"} %lu\n", (unsigned long)metricsSumCounter(metrics, count, offsetof(struct Metrics, bytesClientToRemote)));
+    fprintf(out, "medias_relay_bytes_total{direction=\"remote_to_client\"} %lu\n", (unsigned long)metricsSumCounter(metrics, count, offsetof(struct Metrics, bytesRemoteToClient)));
+
+    fprintf(out, "# HELP medias_udp_associations_active UDP associations currently open.\n");
+    fprintf(out, "# TYPE medias_udp_associations_active gauge\n");
+    fprintf(out, "medias_udp_associations_active %ld\n", (long)sumGauge(metrics, count, offsetof(struct Metrics, udpAssociationsActive)));
+
+    fprintf(out, "# HELP medias_udp_datagrams_total Datagrams relayed through UDP associations, by direction.\n");
+    fprintf(out, "# TYPE medias_udp_datagrams_total counter\n");
+    fprintf(out, "medias_udp_datagrams_total{direction=\"client_to_remote\"} %lu\n", (unsigned long)metricsSumCounter(metrics, count, offsetof(struct Metrics, udpDatagramsClientToRemote)));
+    fprintf(out, "medias_udp_datagrams_total{direction=\"remote_to_client\"} %lu\n", (unsigned long)metricsSumCounter(metrics, count, offsetof(struct Metrics, udpDatagramsRemoteToClient)));
+
+    fprintf(out, "# HELP medias_udp_datagrams_dropped_total Datagrams dropped by UDP associations (unknown sender, bad header, fragments, unresolved names).\n");
+    fprintf(out, "# TYPE medias_udp_datagrams_dropped_total counter\n");
+    fprintf(out, "medias_udp_datagrams_dropped_total %lu\n", (unsigned long)metricsSumCounter(metrics, count, offsetof(struct Metrics, udpDatagramsDropped)));
+
+    fprintf(out, "# HELP medias_acl_evaluations_total Destinations checked against the access control list.\n");
+    fprintf(out, "# TYPE medias_acl_evaluations_total counter\n");
+    fprintf(out, "medias_acl_evaluations_total %lu\n", (unsigned long)metricsSumCounter(metrics, count, offsetof(struct Metrics, aclEvaluations)));
+
+    fprintf(out, "# HELP medias_acl_denied_total Destinations denied by the access control list.\n");
+    fprintf(out, "# TYPE medias_acl_denied_total counter\n");
+    fprintf(out, "medias_acl_denied_total %lu\n", (unsigned long)metricsSumCounter(metrics, count, offsetof(struct Metrics, aclDenied)));
+
+    fprintf(out, "# HELP medias_acl_evaluation_seconds_total Time spent checking destinations against the access control list.\n");
+    fprintf(out, "# TYPE medias_acl_evaluation_seconds_total counter\n");
+    fprintf(out, "medias_acl_evaluation_seconds_total %.9f\n", metricsSumCounter(metrics, count, offsetof(struct Metrics, aclEvaluationNanos)) / 1e9);
+
+    fprintf(out, "# HELP medias_acl_nodes_visited_total Trie nodes visited checking destinations against the access control list.\n");
+    fprintf(out, "# TYPE medias_acl_nodes_visited_total counter\n");
+    fprintf(out, "medias_acl_nodes_visited_total %lu\n", (unsigned long)metricsSumCounter(metrics, count, offsetof(struct Metrics, aclNodesVisited)));
+
+    fprintf(out, "# HELP medias_shaper_pauses_total Times a tunnel direction stopped reading because its rate limit ran out of tokens.\n");
+    fprintf(out, "# TYPE medias_shaper_pauses_total counter\n");
+    fprintf(out, "medias_shaper_pauses_total %lu\n", (unsigned long)metricsSumCounter(metrics, count, offsetof(struct Metrics, shaperPauses)));
+
+    fprintf(out, "# HELP medias_relay_memory_bytes Memory taken by relay and handshake buffers, in use or kept for reuse.\n");
+    fprintf(out, "# TYPE medias_relay_memory_bytes gauge\n");
+    fprintf(out, "medias_relay_memory_bytes %ld\n", (long)sumGauge(metrics, count, offsetof(struct Metrics, relayMemoryBytes)));
+
+    fprintf(out, "# HELP medias_relay_memory_waits_total Times a connection stopped reading because the relay memory limit was reached.\n");
+    fprintf(out, "# TYPE medias_relay_memory_waits_total counter\n");
+    fprintf(out, "medias_relay_memory_waits_total %lu\n", (unsigned long)metricsSumCounter(metrics, count, offsetof(struct Metrics, relayMemoryWaits)));
+
+    fprintf(out, "# HELP medias_admission_rejected_total Requests turned down by admission control, by reason.\n");
+    fprintf(out, "# TYPE medias_admission_rejected_total counter\n");
+    for (int reason = 0; reason < ADMISSION_REASON_COUNT; reason++)
+        fprintf(out, "medias_admission_rejected_total{reason=\"%s\"} %lu\n", admissionReasonName(reason), (unsigned long)metricsSumCounter(metrics, count, offsetof(struct Metrics, admissionRejections) + reason * sizeof(uint64_t)));
+
+    fprintf(out, "# HELP medias_accept_pauses_total Times a worker stopped accepting connections for admission control.\n");
+    fprintf(out, "# TYPE medias_accept_pauses_total counter\n");
+    fprintf(out, "medias_accept_pauses_total %lu\n", (unsigned long)metricsSumCounter(metrics, count, offsetof(struct Metrics, acceptPauses)));
+
+    fprintf(out, "# HELP medias_accept_failure_pauses_total Times a worker stopped accepting connections because it ran out of file descriptors or memory.\n");
+    fprintf(out, "# TYPE medias_accept_failure_pauses_total counter\n");
+    fprintf(out, "medias_accept_failure_pauses_total %lu\n", (unsigned long)metricsSumCounter(metrics, count, offsetof(struct Metrics, acceptFailurePauses)));
+
+    fprintf(out, "# HELP medias_event_loop_lag_seconds How late the most lagging worker's event loop runs its timers, smoothed.\n");
+    fprintf(out, "# TYPE medias_event_loop_lag_seconds gauge\n");
+    fprintf(out, "medias_event_loop_lag_seconds %.6f\n", maxGauge(metrics, count, offsetof(struct Metrics, loopLagMicros)) / 1e6);
+
+    fprintf(out, "# HELP medias_timeouts_total Connections closed for taking too long, by what they were doing.\n");
+    fprintf(out, "# TYPE medias_timeouts_total counter\n");
+    fprintf(out, "medias_timeouts_total{kind=\"handshake\"} %lu\n", (unsigned long)metricsSumCounter(metrics, count, offsetof(struct Metrics, handshakeTimeouts)));
+    fprintf(out, "medias_timeouts_total{kind=\"idle\"} %lu\n", (unsigned long)metricsSumCounter(metrics, count, offsetof(struct Metrics, idleTimeouts)));
+
+    fprintf(out, "# HELP medias_failed_replies_total Failure replies sent to clients, by REP code.\n");
+    fprintf(out, "# TYPE medias_failed_replies_total counter\n");
+    for (int code = 1; code <= METRICS_MAX_REPLY_CODE; code++)
+        fprintf(out, "medias_failed_replies_total{rep=\"0x%02x\"} %lu\n", code, (unsigned long)metricsSumCounter(metrics, count, offsetof(struct Metrics, failedReplies) + code * sizeof(uint64_t)));
+
+    if (sourceAddressCount > 0) {
+        fprintf(out, "# HELP medias_source_address_connections_total Connection attempts to destinations from each local address.\n");
+        fprintf(out, "# TYPE medias_source_address_connections_total counter\n");
+        for (int i = 0; i < sourceAddressCount; i++)
+            fprintf(out, "medias_source_address_connections_total{address=\"%s\"} %lu\n", sourceAddressNames[i], (unsigned long)metricsSumCounter(metrics, count, offsetof(struct Metrics, sourceAddressConnections) + i * sizeof(uint64_t)));
+
+        fprintf(out, "# HELP medias_source_address_exhausted_total Connections to destinations that found no port left on a local address.\n");
+        fprintf(out, "# TYPE medias_source_address_exhausted_total counter\n");
+        for (int i = 0; i < sourceAddressCount; i++)
+            fprintf(out, "medias_source_address_exhausted_total{address=\"%s\"} %lu\n", sourceAddressNames[i], (unsigned long)metricsSumCounter(metrics, count, offsetof(struct Metrics, sourceAddressExhausted) + i * sizeof(uint64_t)));
+    }
+
+    writePhases(out, metrics, count);
+}
@@ -0,0 +1,115 @@
+#ifndef _METRICS_H_
+#define _METRICS_H_
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "admission.h"
+
+/**
+ * Each worker keeps its own metrics, which only that worker updates. Since there's a single writer, updating a
+ * metric is just a relaxed load and store (no locked instructions, no shared cache lines between workers), and
+ * the admin thread can read them at any time with relaxed loads, adding up the values of all the workers.
+ *
+ * Latencies go into HDR-style histograms: values are bucketed by their power of two, and each power of two is
+ * split in HISTOGRAM_SUB_BUCKETS linear sub-buckets, so any value is recorded with a relative error of at most
+ * 1/HISTOGRAM_SUB_BUCKETS, from a microsecond up to days, with a fixed and small amount of buckets.
+ */
+#define HISTOGRAM_SUB_BUCKET_BITS 3
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BUCKET_BITS)
+#define HISTOGRAM_MAX_EXPONENT 40
+#define HISTOGRAM_BUCKETS ((HISTOGRAM_MAX_EXPONENT - HISTOGRAM_SUB_BUCKET_BITS + 2) * HISTOGRAM_SUB_BUCKETS)
+
+/**
+ * The phases a client connection goes through, each with its own latency histogram.
+ */
+enum MetricsPhase {
+    METRICS_PHASE_AUTH,
+    METRICS_PHASE_REQUEST,
+    METRICS_PHASE_DNS,
+    METRICS_PHASE_CONNECT,
+    METRICS_PHASE_RELAY,
+    METRICS_PHASE_COUNT
+};
+
+// The REP codes from 0x01 to 0x08 are failures, each counted on its own.
+#define METRICS_MAX_REPLY_CODE 8
+
+// Outgoing connections are counted for each of the local addresses they may come from.
+#define METRICS_MAX_SOURCE_ADDRESSES 64
+
+// Tunnels through parent proxies are counted for each parent.
+#define METRICS_MAX_PARENTS 32
+
+struct Histogram {
+    _Atomic uint64_t buckets[HISTOGRAM_BUCKETS];
+    _Atomic uint64_t count;
+    _Atomic uint64_t sumMicros;
+};
+
+struct Metrics {
+    _Atomic uint64_t connectionsAccepted;
+    _Atomic int64_t connectionsActive;
+    _Atomic int64_t tunnelsActive;
+    _Atomic int64_t tunnelsInKernel;
+    _Atomic uint64_t bytesClientToRemote;
+    _Atomic uint64_t bytesRemoteToClient;
+    _Atomic uint64_t failedReplies[METRICS_MAX_REPLY_CODE + 1];
+    _Atomic int64_t udpAssociationsActive;
+    _Atomic uint64_t udpDatagramsClientToRemote;
+    _Atomic uint64_t udpDatagramsRemoteToClient;
+    _Atomic uint64_t udpDatagramsDropped;
+    _Atomic uint64_t aclEvaluations;
+    _Atomic uint64_t aclDenied;
+    _Atomic uint64_t aclEvaluationNanos;
+    _Atomic uint64_t aclNodesVisited;
+    _Atomic uint64_t shaperPauses;
+    _Atomic int64_t relayMemoryBytes;
+    _Atomic uint64_t relayMemoryWaits;
+    _Atomic uint64_t admissionRejections[ADMISSION_REASON_COUNT];
+    _Atomic uint64_t acceptPauses;
+    _Atomic uint64_t acceptFailurePauses;
+    _Atomic int64_t loopLagMicros;
+    _Atomic uint64_t handshakeTimeouts;
+    _Atomic uint64_t idleTimeouts;
+    _Atomic uint64_t sourceAddressConnections[METRICS_MAX_SOURCE_ADDRESSES];
+    _Atomic uint64_t sourceAddressExhausted[METRICS_MAX_SOURCE_ADDRESSES];
+    _Atomic uint64_t parentTunnels[METRICS_MAX_PARENTS];
+    _Atomic uint64_t parentFailures[METRICS_MAX_PARENTS];
+    struct Histogram phases[METRICS_PHASE_COUNT];
+};
+
+/**
+ * Adds to a counter or gauge. Must only be called by the thread owning the metrics.
+ */
+static inline void metricsAdd(_Atomic uint64_t* counter, uint64_t n) {
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+static inline void metricsAddGauge(_Atomic int64_t* gauge, int64_t n) {
+    atomic_store_explicit(gauge, atomic_load_explicit(gauge, memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+/**
+ * Records how long a phase took, in microseconds. Must only be called by the thread owning the metrics.
+ */
+void metricsRecordPhase(struct Metrics* metrics, enum MetricsPhase phase, uint64_t micros);
+
+/**
+ * Counts a failure reply sent to a client, given its REP code.
+ */
+void metricsCountReply(struct Metrics* metrics, uint8_t replyCode);
+
+/**
+ * Adds up a counter of the given metrics, at the given offset into the struct.
+ */
+uint64_t metricsSumCounter(struct Metrics* const* metrics, int count, size_t offset);
+
+/**
+ * Writes the sum of the given metrics in the Prometheus text exposition format. The source addresses' counters are
+ * labeled with the given names, if there are any.
+ */
+void metricsWritePrometheus(FILE* out, struct Metrics* const* metrics, int count, const char* const* sourceAddressNames, int sourceAddressCount);
+
+#endif
@@ -0,0 +1,351 @@
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "logger.h"
+#include "parents.h"
+#include "util.h"
+
+// How long a parent stays ejected after too many failures in a row, unless a health check finds it up sooner.
+#define PARENT_EJECT_MILLIS 30000
+
+// The longest a health check waits for a parent to connect and answer.
+#define HEALTH_CHECK_TIMEOUT_MILLIS 2000
+
+/**
+ * A parent, and its state shared by all the workers.
+ */
+struct Parent {
+    const struct ParentAddress* config;
+    struct addrinfo info;
+
+    // Whether the last health check succeeded (or there was none yet).
+    atomic_int healthy;
+
+    // The tunnels that failed through it in a row, and until when it's ejected for that (in monotonic milliseconds).
+    atomic_int failures;
+    _Atomic uint64_t ejectedUntil;
+};
+
+static struct {
+    struct Parent parents[MAX_PARENTS];
+    int count;
+    enum ParentBalance balance;
+    int healthIntervalMillis;
+    int maxFailures;
+    pthread_t healthThread;
+} parentSet;
+
+static int isUp(struct Parent* parent, uint64_t now) {
+    return atomic_load_explicit(&parent->healthy, memory_order_relaxed) && atomic_load_explicit(&parent->ejectedUntil, memory_order_relaxed) <= now;
+}
+
+/**
+ * Connects to a parent and sends it a greeting offering the method we'd use, waiting for each step with poll() for at
+ * most HEALTH_CHECK_TIMEOUT_MILLIS. Returns 1 if it answered with a method selection for it, or 0 otherwise.
+ */
+static int checkParent(struct Parent* parent) {
+    const struct ParentAddress* config = parent->config;
+    int sock = socket(config->address.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_TCP);
+    if (sock < 0)
+        return 0;
+
+    int healthy = 0;
+    struct pollfd pfd = {.fd = sock, .events = POLLOUT};
+    if (connect(sock, (const struct sockaddr*)&config->address, config->addressLength) != 0 && errno != EINPROGRESS)
+        goto done;
+    if (poll(&pfd, 1, HEALTH_CHECK_TIMEOUT_MILLIS) != 1)
+        goto done;
+
+    int error = 0;
+    socklen_t errorLength = sizeof(error);
+    if (getsockopt(sock, SOL_SOCKET, SO_ERROR, &error, &errorLength) != 0 || error != 0)
+        goto done;
+
+    uint8_t method = config->usernameLength > 0 ? 2 : 0;
+    uint8_t greeting[3] = {5, 1, method};
+    if (send(sock, greeting, sizeof(greeting), MSG_NOSIGNAL) != sizeof(greeting))
+        goto done;
+
+    uint8_t reply[2];
+    size_t received = 0;
+    pfd.events = POLLIN;
+    while (received < sizeof(reply) && poll(&pfd, 1, HEALTH_CHECK_TIMEOUT_MILLIS) == 1) {
+        ssize_t n = recv(sock, reply + received, sizeof(reply) - received, 0);
+        if (n <= 0 && !(n < 0 && (errno == EAGAIN || errno == EINTR)))
+            break;
+        if (n > 0)
+            received += n;
+    }
+    healthy = received == sizeof(reply) && reply[0] == 5 && reply[1] == method;
+
+done:
+    close(sock);
+    return healthy;
+}
+
+static void* healthThread(void* arg) {
+    struct timespec interval = {.tv_sec = parentSet.healthIntervalMillis / 1000, .tv_nsec = (parentSet.healthIntervalMillis % 1000) * 1000000L};
+
+    while (1) {
+        for (int i = 0; i < parentSet.count; i++) {
+            struct Parent* parent = &parentSet.parents[i];
+            int healthy = checkParent(parent);
+            int wasHealthy = atomic_exchange_explicit(&parent->healthy, healthy, memory_order_relaxed);
+            if (healthy != wasHealthy)
+                logWarn("Parent %s is %s", parent->config->name, healthy ? "up again" : "down");
+
+            // A parent that's answering again doesn't have to wait out its ejection.
+            if (healthy && atomic_load_explicit(&parent->ejectedUntil, memory_order_relaxed) > getMonotonicMillis()) {
+                logInfo("Parent %s passed its health check, taking it back", parent->config->name);
+                atomic_store_explicit(&parent->failures, 0, memory_order_relaxed);
+                atomic_store_explicit(&parent->ejectedUntil, 0, memory_order_relaxed);
+            }
+        }
+
+        nanosleep(&interval, NULL);
+    }
+
+    return NULL;
+}
+
+int parentsInit(const struct ParentAddress* parents, int count, enum ParentBalance balance, int healthIntervalMillis, int maxFailures) {
+    parentSet.count = count;
+    parentSet.balance = balance;
+    parentSet.healthIntervalMillis = healthIntervalMillis;
+    parentSet.maxFailures = maxFailures;
+
+    for (int i = 0; i < count; i++) {
+        struct Parent* parent = &parentSet.parents[i];
+        parent->config = &parents[i];
+        memset(&parent->info, 0, sizeof(parent->info));
+        parent->info.ai_family = parents[i].address.ss_family;
+        parent->info.ai_socktype = SOCK_STREAM;
+        parent->info.ai_protocol = IPPROTO_TCP;
+        parent->info.ai_addr = (struct sockaddr*)&parents[i].address;
+        parent->info.ai_addrlen = parents[i].addressLength;
+        atomic_init(&parent->healthy, 1);
+        atomic_init(&parent->failures, 0);
+        atomic_init(&parent->ejectedUntil, 0);
+        logInfo("Tunnels go through parent %s with weight %d", parents[i].name, parents[i].weight);
+    }
+
+    if (count == 0 || healthIntervalMillis == 0)
+        return 0;
+
+    int error = pthread_create(&parentSet.healthThread, NULL, healthThread, NULL);
+    if (error != 0) {
+        logError("Failed to create parent health check thread: %s", strerror(error));
+        return -1;
+    }
+
+    pthread_detach(parentSet.healthThread);
+    return 0;
+}
+
+int parentsEnabled() {
+    return parentSet.count > 0;
+}
+
+int parentCount() {
+    return parentSet.count;
+}
+
+void parentBalancerInit(struct ParentBalancer* balancer) {
+    memset(balancer, 0, sizeof(*balancer));
+}
+
+/**
+ * Smooth weighted round robin: every candidate's current weight grows by its weight, and the one with the highest
+ * current weight takes the tunnel, which takes the candidates' total weight off it. Over every round of total weight
+ * tunnels, each parent takes its weight's worth of them, without taking them all in a row.
+ */
+static int pickWeighted(struct ParentBalancer* balancer, uint32_t candidates) {
+    int best = -1;
+    int totalWeight = 0;
+    for (int i = 0; i < parentSet.count; i++) {
+        if (!(candidates & (1u << i)))
+            continue;
+
+        int weight = parentSet.parents[i].config->weight;
+        balancer->currentWeight[i] += weight;
+        totalWeight += weight;
+        if (best < 0 || balancer->currentWeight[i] > balancer->currentWeight[best])
+            best = i;
+    }
+
+    balancer->currentWeight[best] -= totalWeight;
+    return best;
+}
+
+/**
+ * Picks the candidate with the least tunnels open for its weight. Ties go to the first one after where the last
+ * search started, so they take turns.
+ */
+static int pickLeastConnections(struct ParentBalancer* balancer, uint32_t candidates) {
+    int best = -1;
+    int start = balancer->nextStart++ % parentSet.count;
+    for (int n = 0; n < parentSet.count; n++) {
+        int i = (start + n) % parentSet.count;
+        if (!(candidates & (1u << i)))
+            continue;
+
+        // active[i] / weight[i] < active[best] / weight[best], without dividing.
+        if (best < 0 || (int64_t)balancer->active[i] * parentSet.parents[best].config->weight < (int64_t)balancer->active[best] * parentSet.parents[i].config->weight)
+            best = i;
+    }
+
+    return best;
+}
+
+int parentPick(struct ParentBalancer* balancer, uint32_t tried) {
+    uint64_t now = getMonotonicMillis();
+    uint32_t all = parentSet.count == 32 ? UINT32_MAX : (1u << parentSet.count) - 1;
+    uint32_t candidates = 0;
+    for (int i = 0; i < parentSet.count; i++) {
+        if (!(tried & (1u << i)) && isUp(&parentSet.parents[i], now))
+            candidates |= 1u << i;
+    }
+
+    // Better to try a parent that's down than to fail right away.
+    if (candidates == 0)
+        candidates = all & ~tried;
+    if (candidates == 0)
+        candidates = all;
+
+    int index = parentSet.balance == PARENT_BALANCE_LEAST_CONNECTIONS ? pickLeastConnections(balancer, candidates) : pickWeighted(balancer, candidates);
+    balancer->active[index]++;
+    return index;
+}
+
+void parentRelease(struct ParentBalancer* balancer, int index) {
+    balancer->active[index]--;
+}
+
+void parentReportResult(int index, int success, struct Metrics* metrics) {
+    struct Parent* parent = &parentSet.parents[index];
+    if (success) {
+        metricsAdd(&metrics->parentTunnels[index], 1);
+        if (atomic_load_explicit(&parent->failures, memory_order_relaxed) != 0)
+            atomic_store_explicit(&parent->failures, 0, memory_order_relaxed);
+        return;
+    }
+
+    metricsAdd(&metrics->parentFailures[index], 1);
+    int failures = atomic_fetch_add_explicit(&parent->failures, 1, memory_order_relaxed) + 1;
+    if (parentSet.maxFailures > 0 && failures == parentSet.maxFailures) {
+        logWarn("Ejecting parent %s for %d seconds after %d failures in a row", parent->config->name, PARENT_EJECT_MILLIS / 1000, failures);
+        atomic_store_explicit(&parent->ejectedUntil, getMonotonicMillis() + PARENT_EJECT_MILLIS, memory_order_relaxed);
+        atomic_store_explicit(&parent->failures, 0, memory_order_relaxed);
+    }
+}
+
+const char* parentName(int index) {
+    return parentSet.parents[index].config->name;
+}
+
+struct addrinfo* parentAddress(int index) {
+    return &parentSet.parents[index].info;
+}
+
+size_t parentBuildHandshake(int index, const struct Socks5Request* request, uint8_t* buffer) {
+    const struct ParentAddress* config = parentSet.parents[index].config;
+    size_t length = 0;
+
+    // The greeting offers a single method, so the parent either takes it or refuses us.
+    buffer[length++] = 5;
+    buffer[length++] = 1;
+    buffer[length++] = config->usernameLength > 0 ? 2 : 0;
+
+    if (config->usernameLength > 0) {
+        buffer[length++] = 1;
+        buffer[length++] = config->usernameLength;
+        memcpy(buffer + length, config->username, config->usernameLength);
+        length += config->usernameLength;
+        buffer[length++] = config->passwordLength;
+        memcpy(buffer + length, config->password, config->passwordLength);
+        length += config->passwordLength;
+    }
+
+    // The request is the client's, addressed the way the client addressed it: domain names are resolved by the parent.
+    buffer[length++] = 5;
+    buffer[length++] = 1;
+    buffer[length++] = 0;
+    if (request->family == AF_INET) {
+        buffer[length++] = 1;
+        inet_pton(AF_INET, request->hostname, buffer + length);
+        length += 4;
+    } else if (request->family == AF_INET6) {
+        buffer[length++] = 4;
+        inet_pton(AF_INET6, request->hostname, buffer + length);
+        length += 16;
+    } else {
+        size_t hostnameLength = strlen(request->hostname);
+        buffer[length++] = 3;
+        buffer[length++] = hostnameLength;
+        memcpy(buffer + length, request->hostname, hostnameLength);
+        length += hostnameLength;
+    }
+    buffer[length++] = request->port >> 8;
+    buffer[length++] = request->port & 0xFF;
+    return length;
+}
+
+enum ParseStatus parentParseReplies(int index, const uint8_t* data, size_t length, struct Socks5Request* reply, size_t* consumed) {
+    const struct ParentAddress* config = parentSet.parents[index].config;
+
+    // The method selection: VER, METHOD.
+    if (length < 2)
+        return PARSE_INCOMPLETE;
+    if (data[0] != 5 || data[1] != (config->usernameLength > 0 ? 2 : 0))
+        return PARSE_ERROR;
+    size_t offset = 2;
+
+    // The authentication status: VER, STATUS.
+    if (config->usernameLength > 0) {
+        if (length < offset + 2)
+            return PARSE_INCOMPLETE;
+        if (data[offset + 1] != 0)
+            return PARSE_ERROR;
+        offset += 2;
+    }
+
+    size_t replyLength;
+    enum ParseStatus status = parseRequest(data + offset, length - offset, reply, &replyLength);
+    if (status != PARSE_OK)
+        return status;
+    if (reply->version != 5)
+        return PARSE_ERROR;
+
+    *consumed = offset + replyLength;
+    return PARSE_OK;
+}
+
+void parentsWritePrometheus(FILE* out, struct Metrics* const* metrics, int count) {
+    if (parentSet.count == 0)
+        return;
+
+    uint64_t now = getMonotonicMillis();
+    fprintf(out, "# HELP medias_parent_up Whether a parent proxy passed its last health check and isn't ejected.\n");
+    fprintf(out, "# TYPE medias_parent_up gauge\n");
+    for (int i = 0; i < parentSet.count; i++)
+        fprintf(out, "medias_parent_up{parent=\"%s\"} %d\n", parentSet.parents[i].config->name, isUp(&parentSet.parents[i], now));
+
+    fprintf(out, "# HELP medias_parent_tunnels_total Tunnels established through each parent proxy.\n");
+    fprintf(out, "# TYPE medias_parent_tunnels_total counter\n");
+    for (int i = 0; i < parentSet.count; i++)
+        fprintf(out, "medias_parent_tunnels_total{parent=\"%s\"} %lu\n", parentSet.parents[i].config->name, (unsigned long)metricsSumCounter(metrics, count, offsetof(struct Metrics, parentTunnels) + i * sizeof(uint64_t)));
+
+    fprintf(out, "# HELP medias_parent_failures_total Tunnels that failed to get through each parent proxy.\n");
+    fprintf(out, "# TYPE medias_parent_failures_total counter\n");
+    for (int i = 0; i < parentSet.count; i++)
+        fprintf(out, "medias_parent_failures_total{parent=\"%s\"} %lu\n", parentSet.parents[i].config->name, (unsigned long)metricsSumCounter(metrics, count, offsetof(struct Metrics, parentFailures) + i * sizeof(uint64_t)));
+}
@@ -0,0 +1,142 @@
+#ifndef _PARENTS_H_
+#define _PARENTS_H_
+
+#include <netdb.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/socket.h>
+
+#include "metrics.h"
+#include "parser.h"
+
+/**
+ * In parent proxy mode, CONNECT requests aren't connected to their destinations directly, but through one of a set
+ * of parent SOCKS5 proxies, which resolve the destinations themselves. Each tunnel picks a parent by weighted round
+ * robin or by least connections, among those that are up.
+ *
+ * A parent is down while its health checks fail: a thread connects to every parent at regular intervals and sends
+ * it a greeting, expecting a method selection back. A parent is also ejected for a while after too many tunnels in
+ * a row failed to get through it (failed to connect, or got a broken handshake back), which a successful health
+ * check cuts short. If every parent is down, tunnels go through any of them anyway, rather than failing right away.
+ *
+ * The handshake with a parent is pipelined: its greeting, authentication (if the parent requires a username and
+ * password) and request go out in a single write as soon as we're connected, without waiting for each reply, so a
+ * parent adds about one round trip to a tunnel's setup instead of three.
+ *
+ * Whether a parent is up is shared by all the workers (with atomic operations), but each worker balances its own
+ * tunnels, counting the tunnels it has open through each parent, so picking a parent never takes a lock.
+ */
+
+// The most parents there can be.
+#define MAX_PARENTS METRICS_MAX_PARENTS
+
+// The longest handshake we send a parent: the greeting, the authentication and the request.
+#define PARENT_HANDSHAKE_MAX_LENGTH (3 + 3 + 2 * 255 + 4 + 1 + MAX_HOSTNAME_LENGTH + 2)
+
+/**
+ * A parent proxy, as configured.
+ */
+struct ParentAddress {
+    struct sockaddr_storage address;
+    socklen_t addressLength;
+
+    // How many tunnels it takes for every one the parents with a weight of 1 take.
+    int weight;
+
+    // The credentials to authenticate with, if usernameLength isn't 0.
+    char username[256];
+    char password[256];
+    uint8_t usernameLength;
+    uint8_t passwordLength;
+
+    // The address as text, for the logs and the metrics' labels.
+    char name[INET6_ADDRSTRLEN + 8];
+};
+
+/**
+ * How tunnels are spread among the parents.
+ */
+enum ParentBalance {
+    // Each parent takes a share of the tunnels proportional to its weight, interleaved as evenly as possible.
+    PARENT_BALANCE_WEIGHTED,
+
+    // Each tunnel goes through the parent with the least tunnels open relative to its weight.
+    PARENT_BALANCE_LEAST_CONNECTIONS
+};
+
+/**
+ * Each worker's view of the parents: how many tunnels it has open through each, and where the weighted round robin
+ * stands.
+ */
+struct ParentBalancer {
+    int active[MAX_PARENTS];
+    int currentWeight[MAX_PARENTS];
+    unsigned int nextStart;
+};
+
+/**
+ * Sets up the parents (which must outlive the process), and starts checking their health every given amount of
+ * milliseconds, unless it's 0. Ejects a parent after the given amount of tunnels in a row failed through it. Returns
+ * 0 if successful, or -1 if an error occurred.
+ */
+int parentsInit(const struct ParentAddress* parents, int count, enum ParentBalance balance, int healthIntervalMillis, int maxFailures);
+
+/**
+ * Whether CONNECT requests go through parents.
+ */
+int parentsEnabled();
+
+void parentBalancerInit(struct ParentBalancer* balancer);
+
+/**
+ * Picks the parent for a new tunnel, counting it as open through it, and skipping the parents in the tried bit
+ * mask unless they're all that's left. Returns the parent's index.
+ */
+int parentPick(struct ParentBalancer* balancer, uint32_t tried);
+
+/**
+ * Counts a tunnel through the given parent as closed.
+ */
+void parentRelease(struct ParentBalancer* balancer, int index);
+
+/**
+ * Tells whether a tunnel got through the given parent, ejecting it after too many failures in a row, and counts it in
+ * the given metrics.
+ */
+void parentReportResult(int index, int success, struct Metrics* metrics);
+
+/**
+ * Returns the amount of parents.
+ */
+int parentCount();
+
+/**
+ * Returns a parent's address as text.
+ */
+const char* parentName(int index);
+
+/**
+ * Returns the address to connect to a parent, as a single addrinfo that lives as long as the process.
+ */
+struct addrinfo* parentAddress(int index);
+
+/**
+ * Writes the handshake asking the given parent to connect to a destination into the buffer, which must hold at
+ * least PARENT_HANDSHAKE_MAX_LENGTH bytes. Returns its length.
+ */
+size_t parentBuildHandshake(int index, const struct Socks5Request* request, uint8_t* buffer);
+
+/**
+ * Parses the parent's replies to the handshake: its method selection, its authentication status (if we sent
+ * credentials) and its reply to the request, which has the same shape as a request (with REP as its command).
+ * Returns PARSE_OK and stores how many bytes they took in consumed, PARSE_INCOMPLETE if more bytes are needed, or
+ * PARSE_ERROR if the parent refused the handshake (in which case reply holds nothing).
+ */
+enum ParseStatus parentParseReplies(int index, const uint8_t* data, size_t length, struct Socks5Request* reply, size_t* consumed);
+
+/**
+ * Writes the parents' state and the tunnels through each of them in the Prometheus text exposition format.
+ */
+void parentsWritePrometheus(FILE* out, struct Metrics* const* metrics, int count);
+
+#endif
@@ -0,0 +1,126 @@
+#include "parser.h"
+#include <arpa/inet.h>
+#include <string.h>
+#include <sys/socket.h>
+
+enum ParseStatus parseGreeting(const uint8_t* data, size_t length, struct Socks5Greeting* greeting, size_t* consumed) {
+    // VER and NMETHODS, followed by that amount of METHODS.
+    if (length < 2 || length < 2 + (size_t)data[1])
+        return PARSE_INCOMPLETE;
+
+    greeting->version = data[0];
+    greeting->methodCount = data[1];
+    greeting->methods = data + 2;
+    *consumed = 2 + greeting->methodCount;
+    return PARSE_OK;
+}
+
+enum ParseStatus parseUserPass(const uint8_t* data, size_t length, struct Socks5UserPass* userPass, size_t* consumed) {
+    // VER and ULEN, followed by that amount of UNAME, then PLEN, followed by that amount of PASSWD.
+    if (length < 2 || length < 2 + (size_t)data[1] + 1)
+        return PARSE_INCOMPLETE;
+
+    size_t passwordStart = 2 + data[1] + 1;
+    if (length < passwordStart + data[passwordStart - 1])
+        return PARSE_INCOMPLETE;
+
+    userPass->version = data[0];
+    userPass->usernameLength = data[1];
+    userPass->username = (const char*)data + 2;
+    userPass->passwordLength = data[passwordStart - 1];
+    userPass->password = (const char*)data + passwordStart;
+    *consumed = passwordStart + userPass->passwordLength;
+    return PARSE_OK;
+}
+
+enum ParseStatus parseRequest(const uint8_t* data, size_t length, struct Socks5Request* request, size_t* consumed) {
+    // VER, CMD, RSV, ATYP.
+    if (length < 4)
+        return PARSE_INCOMPLETE;
+
+    request->version = data[0];
+    request->command = data[1];
+    request->addressType = data[3];
+
+    size_t addressLength;
+    const uint8_t* address = data + 4;
+    switch (request->addressType) {
+        case 1:
+            // An IPv4 address (4 bytes).
+            addressLength = 4;
+            break;
+        case 3:
+            // A domain name, prefixed by one byte with its length.
+            if (length < 5)
+                return PARSE_INCOMPLETE;
+            addressLength = 1 + data[4];
+            address = data + 5;
+            break;
+        case 4:
+            // An IPv6 address (16 bytes).
+            addressLength = 16;
+            break;
+        default:
+            return PARSE_ERROR;
+    }
+
+    // After the address comes the port number (2 bytes).
+    if (length < 4 + addressLength + 2)
+        return PARSE_INCOMPLETE;
+
+    if (request->addressType == 1) {
+        request->family = AF_INET;
+        inet_ntop(AF_INET, address, request->hostname, sizeof(request->hostname));
+    } else if (request->addressType == 4) {
+        request->family = AF_INET6;
+        inet_ntop(AF_INET6, address, request->hostname, sizeof(request->hostname));
+    } else {
+        request->family = AF_UNSPEC;
+        memcpy(request->hostname, address, addressLength - 1);
+        request->hostname[addressLength - 1] = '\0';
+    }
+
+    request->port = (data[4 + addressLength] << 8) | data[4 + addressLength + 1];
+    *consumed = 4 + addressLength + 2;
+    return PARSE_OK;
+}
+
+enum ParseStatus parseUdpHeader(const uint8_t* data, size_t length, struct Socks5UdpHeader* header, size_t* consumed) {
+    // RSV (2 bytes), FRAG, ATYP.
+    if (length < 4)
+        return PARSE_ERROR;
+
+    header->fragment = data[2];
+    header->addressType = data[3];
+
+    size_t addressLength;
+    switch (header->addressType) {
+        case 1:
+            addressLength = 4;
+            break;
+        case 3:
+            if (length < 5)
+                return PARSE_ERROR;
+            addressLength = 1 + data[4];
+            break;
+        case 4:
+            addressLength = 16;
+            break;
+        default:
+            return PARSE_ERROR;
+    }
+
+    if (length < 4 + addressLength + 2)
+        return PARSE_ERROR;
+
+    if (header->addressType == 3) {
+        memcpy(header->hostname, data + 5, addressLength - 1);
+        header->hostname[addressLength - 1] = '\0';
+    } else {
+        memcpy(header->address, data + 4, addressLength);
+    }
+
+    header->port = (data[4 + addressLength] << 8) | data[4 + addressLength + 1];
+    *consumed = 4 + addressLength + 2;
+    return PARSE_OK;
+}
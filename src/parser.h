@@ -0,0 +1,93 @@
+#ifndef _PARSER_H_
+#define _PARSER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define MAX_HOSTNAME_LENGTH 255
+
+/**
+ * Incremental parsers for the messages a socks5 client sends during the handshake. Each parser takes all the
+ * bytes received so far and either parses a whole message from the start of them, telling how many bytes it
+ * took, or tells that more bytes are needed. This way, whatever a single recv() got can be parsed at once,
+ * even if the client sent several messages (and even data for the remote server) in the same segment.
+ */
+enum ParseStatus {
+    PARSE_INCOMPLETE,
+    PARSE_OK,
+    PARSE_ERROR
+};
+
+/**
+ * The client's greeting: VER, NMETHODS, METHODS.
+ */
+struct Socks5Greeting {
+    uint8_t version;
+    uint8_t methodCount;
+    const uint8_t* methods;
+};
+
+/**
+ * The client's request: VER, CMD, RSV, ATYP, DST.ADDR, DST.PORT. The destination address is stored as a
+ * string (an IP address is printed into it), with family telling which kind of address it is (AF_INET,
+ * AF_INET6 or AF_UNSPEC for domain names).
+ */
+struct Socks5Request {
+    uint8_t version;
+    uint8_t command;
+    uint8_t addressType;
+    int family;
+    char hostname[MAX_HOSTNAME_LENGTH + 1];
+    uint16_t port;
+};
+
+/**
+ * Parses a greeting. Returns PARSE_OK and stores how many bytes it took in consumed, or PARSE_INCOMPLETE if
+ * more bytes are needed. The methods pointer points into data.
+ */
+enum ParseStatus parseGreeting(const uint8_t* data, size_t length, struct Socks5Greeting* greeting, size_t* consumed);
+
+/**
+ * The client's username/password authentication (RFC 1929): VER, ULEN, UNAME, PLEN, PASSWD. The username and
+ * password are not NUL-terminated, their pointers point into the parsed data.
+ */
+struct Socks5UserPass {
+    uint8_t version;
+    uint8_t usernameLength;
+    const char* username;
+    uint8_t passwordLength;
+    const char* password;
+};
+
+/**
+ * Parses a username/password authentication. Returns PARSE_OK and stores how many bytes it took in consumed,
+ * or PARSE_INCOMPLETE if more bytes are needed.
+ */
+enum ParseStatus parseUserPass(const uint8_t* data, size_t length, struct Socks5UserPass* userPass, size_t* consumed);
+
+/**
+ * Parses a request. Returns PARSE_OK and stores how many bytes it took in consumed, PARSE_INCOMPLETE if more
+ * bytes are needed, or PARSE_ERROR if the address type is unknown (so the rest of the request can't be parsed;
+ * the fields up to ATYP are still filled in).
+ */
+enum ParseStatus parseRequest(const uint8_t* data, size_t length, struct Socks5Request* request, size_t* consumed);
+
+/**
+ * The header in front of every datagram relayed through a UDP association: RSV, FRAG, ATYP, DST.ADDR, DST.PORT.
+ * IP addresses are kept in binary form in address (4 or 16 bytes), domain names as a string in hostname.
+ */
+struct Socks5UdpHeader {
+    uint8_t fragment;
+    uint8_t addressType;
+    uint8_t address[16];
+    char hostname[MAX_HOSTNAME_LENGTH + 1];
+    uint16_t port;
+};
+
+/**
+ * Parses the header of a datagram. Returns PARSE_OK and stores the header's length in consumed, or PARSE_ERROR
+ * if the datagram is too short or the address type is unknown. Datagrams are never incomplete.
+ */
+enum ParseStatus parseUdpHeader(const uint8_t* data, size_t length, struct Socks5UdpHeader* header, size_t* consumed);
+
+#endif
@@ -0,0 +1,56 @@
+#include "pipepool.h"
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+// The size we ask the kernel to give each pipe. The default is 16 pages, which is usually already 64 KiB.
+#define PIPE_SIZE (64 * 1024)
+
+int pipePoolInit(struct PipePool* pool, int maxIdle) {
+    pool->count = 0;
+    pool->capacity = maxIdle;
+    pool->pipes = maxIdle > 0 ? malloc(maxIdle * sizeof(pool->pipes[0])) : NULL;
+    return (maxIdle > 0 && pool->pipes == NULL) ? -1 : 0;
+}
+
+void pipePoolDestroy(struct PipePool* pool) {
+    for (int i = 0; i < pool->count; i++) {
+        close(pool->pipes[i][0]);
+        close(pool->pipes[i][1]);
+    }
+
+    free(pool->pipes);
+    pool->pipes = NULL;
+    pool->count = 0;
+    pool->capacity = 0;
+}
+
+int pipePoolAcquire(struct PipePool* pool, int fds[2]) {
+    if (pool->count > 0) {
+        pool->count--;
+        fds[0] = pool->pipes[pool->count][0];
+        fds[1] = pool->pipes[pool->count][1];
+        return 0;
+    }
+
+    if (pipe2(fds, O_NONBLOCK | O_CLOEXEC) != 0)
+        return -1;
+
+    // This might fail if we're over the system's pipe size limits, but that's fine, we'll just use the default size.
+    fcntl(fds[1], F_SETPIPE_SZ, PIPE_SIZE);
+    return 0;
+}
+
+void pipePoolRelease(struct PipePool* pool, int fds[2], int isEmpty) {
+    if (isEmpty && pool->count < pool->capacity) {
+        pool->pipes[pool->count][0] = fds[0];
+        pool->pipes[pool->count][1] = fds[1];
+        pool->count++;
+    } else {
+        close(fds[0]);
+        close(fds[1]);
+    }
+
+    fds[0] = -1;
+    fds[1] = -1;
+}
@@ -0,0 +1,39 @@
+#ifndef _PIPEPOOL_H_
+#define _PIPEPOOL_H_
+
+/**
+ * A pool of reusable, non-blocking pipes. Pipes are used as the intermediate kernel buffer when relaying
+ * data between two sockets with splice(), and creating a new pipe for every tunnel costs two syscalls
+ * (plus two more to close it), so we keep the empty pipes around to reuse them. Each worker has its own
+ * pool, so no locking is needed.
+ */
+struct PipePool {
+    int (*pipes)[2];
+    int count;
+    int capacity;
+};
+
+/**
+ * Initializes an empty pipe pool that will keep up to maxIdle pipes for reuse. Returns 0 if successful,
+ * or -1 if an error occurred.
+ */
+int pipePoolInit(struct PipePool* pool, int maxIdle);
+
+/**
+ * Closes all the pipes in the pool and frees up its resources.
+ */
+void pipePoolDestroy(struct PipePool* pool);
+
+/**
+ * Gets an empty pipe, either by reusing one from the pool or by creating a new one. The read end is stored
+ * in fds[0] and the write end in fds[1]. Returns 0 if successful, or -1 if an error occurred.
+ */
+int pipePoolAcquire(struct PipePool* pool, int fds[2]);
+
+/**
+ * Returns a pipe to the pool. The pipe must be empty, otherwise its leftover data would end up in another
+ * tunnel, so if the pipe still contains data or the pool is full, it's closed instead.
+ */
+void pipePoolRelease(struct PipePool* pool, int fds[2], int isEmpty);
+
+#endif
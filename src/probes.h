@@ -0,0 +1,84 @@
+#ifndef _PROBES_H_
+#define _PROBES_H_
+
+#include <stdint.h>
+
+/**
+ * Static USDT probes, for tracing connections with bpftrace, perf or SystemTap under real load. Each probe is a
+ * single nop instruction, with a note in the binary's .note.stapsdt section saying where it is and where its
+ * arguments are (registers or stack slots the compiler already had them in). Nothing else runs unless a tracer
+ * attaches to the probe, which replaces the nop with a breakpoint.
+ *
+ * The probes are all under the "medias" provider, and their first argument is always the connection they're about,
+ * which identifies a tunnel across its probes. The rest are listed in the README. For example:
+ *
+ *     bpftrace -e 'usdt:./bin/medias:medias:request { printf("%s:%d\n", str(arg2), arg3); }'
+ *
+ * If <sys/sdt.h> is available, its macros are used. Otherwise, the same notes are written by hand for x86-64 and
+ * AArch64, and on other architectures the probes compile to nothing.
+ */
+
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#define PROBES_HAVE_SDT_H
+#endif
+#endif
+
+#if defined(PROBES_HAVE_SDT_H)
+
+#include <sys/sdt.h>
+
+#define PROBE1(name, a0) DTRACE_PROBE1(medias, name, a0)
+#define PROBE2(name, a0, a1) DTRACE_PROBE2(medias, name, a0, a1)
+#define PROBE3(name, a0, a1, a2) DTRACE_PROBE3(medias, name, a0, a1, a2)
+#define PROBE4(name, a0, a1, a2, a3) DTRACE_PROBE4(medias, name, a0, a1, a2, a3)
+
+#elif defined(__x86_64__) || defined(__aarch64__)
+
+// The note is laid out as <sys/sdt.h> lays it out: the probe's address, the address of the .stapsdt.base section
+// (so tools can tell how far the binary was moved when it was loaded), the semaphore's address (we have none), and
+// then the provider, the probe's name and its arguments. Every argument is passed as a signed 8 byte integer, written
+// as "-8@" followed by the operand the compiler put it in.
+#define PROBE_NOTE(name, arguments, ...)                                                          \
+    __asm__ __volatile__("990: nop\n"                                                             \
+                         ".pushsection .note.stapsdt,\"?\",\"note\"\n"                            \
+                         ".balign 4\n"                                                            \
+                         ".4byte 992f-991f, 994f-993f, 3\n"                                       \
+                         "991: .asciz \"stapsdt\"\n"                                              \
+                         "992: .balign 4\n"                                                       \
+                         "993: .8byte 990b\n"                                                     \
+                         ".8byte _.stapsdt.base\n"                                                \
+                         ".8byte 0\n"                                                             \
+                         ".asciz \"medias\"\n"                                                    \
+                         ".asciz \"" #name "\"\n"                                                 \
+                         ".asciz \"" arguments "\"\n"                                             \
+                         "994: .balign 4\n"                                                       \
+                         ".popsection\n"                                                          \
+                         ".ifndef _.stapsdt.base\n"                                               \
+                         ".pushsection .stapsdt.base,\"aG\",\"progbits\",.stapsdt.base,comdat\n" \
+                         ".weak _.stapsdt.base\n"                                                 \
+                         ".hidden _.stapsdt.base\n"                                               \
+                         "_.stapsdt.base: .space 1\n"                                             \
+                         ".size _.stapsdt.base, 1\n"                                              \
+                         ".popsection\n"                                                          \
+                         ".endif\n"                                                               \
+                         :                                                                        \
+                         : __VA_ARGS__)
+
+#define PROBE_ARGUMENT(id, value) [id] "nor"((int64_t)(value))
+
+#define PROBE1(name, v0) PROBE_NOTE(name, "-8@%[a0]", PROBE_ARGUMENT(a0, v0))
+#define PROBE2(name, v0, v1) PROBE_NOTE(name, "-8@%[a0] -8@%[a1]", PROBE_ARGUMENT(a0, v0), PROBE_ARGUMENT(a1, v1))
+#define PROBE3(name, v0, v1, v2) PROBE_NOTE(name, "-8@%[a0] -8@%[a1] -8@%[a2]", PROBE_ARGUMENT(a0, v0), PROBE_ARGUMENT(a1, v1), PROBE_ARGUMENT(a2, v2))
+#define PROBE4(name, v0, v1, v2, v3) PROBE_NOTE(name, "-8@%[a0] -8@%[a1] -8@%[a2] -8@%[a3]", PROBE_ARGUMENT(a0, v0), PROBE_ARGUMENT(a1, v1), PROBE_ARGUMENT(a2, v2), PROBE_ARGUMENT(a3, v3))
+
+#else
+
+#define PROBE1(name, a0) ((void)(a0))
+#define PROBE2(name, a0, a1) ((void)(a0), (void)(a1))
+#define PROBE3(name, a0, a1, a2) ((void)(a0), (void)(a1), (void)(a2))
+#define PROBE4(name, a0, a1, a2, a3) ((void)(a0), (void)(a1), (void)(a2), (void)(a3))
+
+#endif
+
+#endif
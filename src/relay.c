@@ -0,0 +1,250 @@
+#include "relay.h"
+#include "logger.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+void relayBufferInit(struct RelayBuffer* buffer) {
+    ringBufferInit(&buffer->ring, NULL, 0);
+    buffer->sizeClass = RELAY_INITIAL_SIZE_CLASS;
+    buffer->filledUp = 0;
+    buffer->peakLength = 0;
+    buffer->selector = NULL;
+    buffer->sending = 0;
+    buffer->pipe[0] = -1;
+    buffer->pipe[1] = -1;
+    buffer->pipeLength = 0;
+    buffer->pipeCapacity = 0;
+    buffer->readClosed = 0;
+    buffer->writeClosed = 0;
+    buffer->bytesRead = 0;
+    buffer->bytesWritten = 0;
+}
+
+int relayBufferUseSplice(struct RelayBuffer* buffer, struct PipePool* pool) {
+    if (pipePoolAcquire(pool, buffer->pipe) != 0)
+        return -1;
+
+    int pipeSize = fcntl(buffer->pipe[1], F_GETPIPE_SZ);
+    buffer->pipeCapacity = pipeSize > 0 ? pipeSize : 4096;
+    buffer->pipeLength = 0;
+    return 0;
+}
+
+void relayBufferUseForwarding(struct RelayBuffer* buffer, struct Selector* selector) {
+    buffer->selector = selector;
+}
+
+/**
+ * Returns the direction's pipe (if it has one) to the pool.
+ */
+static void releasePipe(struct RelayBuffer* buffer, struct PipePool* pool) {
+    if (buffer->pipe[0] >= 0)
+        pipePoolRelease(pool, buffer->pipe, buffer->pipeLength == 0);
+    buffer->pipeLength = 0;
+    buffer->pipeCapacity = 0;
+}
+
+/**
+ * Returns the direction's buffer (if it has one) to the pool, and picks the size of the next one from how this one
+ * was used (if it was, a read may have found nothing).
+ */
+static void releaseStorage(struct RelayBuffer* buffer, struct BufferPool* pool) {
+    if (buffer->ring.data == NULL)
+        return;
+
+    bufferRelease(pool, buffer->ring.data, buffer->sizeClass);
+    if (buffer->filledUp && buffer->sizeClass < BUFFER_POOL_CLASSES - 1)
+        buffer->sizeClass++;
+    else if (!buffer->filledUp && buffer->peakLength > 0 && buffer->peakLength <= buffer->ring.capacity / 4 && buffer->sizeClass > 0)
+        buffer->sizeClass--;
+
+    ringBufferInit(&buffer->ring, NULL, 0);
+    buffer->filledUp = 0;
+    buffer->peakLength = 0;
+}
+
+void relayBufferRelease(struct RelayBuffer* buffer, struct PipePool* pipePool, struct BufferPool* bufferPool) {
+    releasePipe(buffer, pipePool);
+    releaseStorage(buffer, bufferPool);
+}
+
+void relayBufferAdopt(struct RelayBuffer* buffer, uint8_t* storage, int sizeClass, size_t length) {
+    ringBufferInit(&buffer->ring, storage, bufferPoolClassSize(sizeClass));
+    ringBufferCommit(&buffer->ring, length);
+    buffer->sizeClass = sizeClass;
+    buffer->peakLength = length;
+}
+
+int relayBufferReserve(struct RelayBuffer* buffer, struct BufferPool* pool) {
+    if (buffer->ring.data != NULL)
+        return 0;
+
+    uint8_t* storage = bufferAcquire(pool, &buffer->sizeClass);
+    if (storage == NULL)
+        return -1;
+
+    ringBufferInit(&buffer->ring, storage, bufferPoolClassSize(buffer->sizeClass));
+    return 0;
+}
+
+int relayBufferCanRead(const struct RelayBuffer* buffer) {
+    if (buffer->readClosed || buffer->sending > 0)
+        return 0;
+
+    // Data the selector forwards must not get ahead of what's already in the buffer.
+    if (buffer->selector != NULL && !ringBufferIsEmpty(&buffer->ring))
+        return 0;
+    if (buffer->pipe[0] >= 0)
+        return buffer->pipeLength < buffer->pipeCapacity;
+    return buffer->ring.data == NULL || !ringBufferIsFull(&buffer->ring);
+}
+
+int relayBufferHasPending(const struct RelayBuffer* buffer) {
+    return buffer->pipeLength != 0 || !ringBufferIsEmpty(&buffer->ring);
+}
+
+/**
+ * Reads from the source socket into the pipe with splice(), so the data never gets copied into user space.
+ * Returns 0 if successful, -1 if the socket failed, or 1 if splice() isn't supported for this socket.
+ */
+static int relayReadSplice(struct RelayBuffer* buffer, int fromSocket, size_t maxBytes) {
+    size_t length = buffer->pipeCapacity - buffer->pipeLength;
+    ssize_t received = splice(fromSocket, NULL, buffer->pipe[1], NULL, length < maxBytes ? length : maxBytes, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (received < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+            return 0;
+        return (errno == EINVAL || errno == ENOSYS) ? 1 : -1;
+    }
+
+    if (received == 0)
+        buffer->readClosed = 1;
+    buffer->pipeLength += received;
+    buffer->bytesRead += received;
+    return 0;
+}
+
+/**
+ * Reads from the source socket into the free space of the ring buffer, taking a buffer from the pool if the
+ * direction has none. Returns 0 if successful, -1 if the socket failed, or 1 if there was no buffer to be had.
+ */
+static int relayReadCopy(struct RelayBuffer* buffer, int fromSocket, struct BufferPool* pool, size_t maxBytes) {
+    if (relayBufferReserve(buffer, pool) != 0)
+        return 1;
+
+    struct iovec iov[2];
+    int iovCount = ringBufferWritableIov(&buffer->ring, iov);
+    if (iovCount == 0)
+        return 0;
+
+    if (iov[0].iov_len >= maxBytes) {
+        iov[0].iov_len = maxBytes;
+        iovCount = 1;
+    } else if (iovCount == 2 && iov[0].iov_len + iov[1].iov_len > maxBytes) {
+        iov[1].iov_len = maxBytes - iov[0].iov_len;
+    }
+
+    ssize_t received = readv(fromSocket, iov, iovCount);
+    if (received < 0)
+        return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : -1;
+
+    if (received == 0)
+        buffer->readClosed = 1;
+    ringBufferCommit(&buffer->ring, received);
+    buffer->bytesRead += received;
+
+    if (ringBufferIsFull(&buffer->ring))
+        buffer->filledUp = 1;
+    if (buffer->ring.length > buffer->peakLength)
+        buffer->peakLength = buffer->ring.length;
+    return 0;
+}
+
+int relayRead(struct RelayBuffer* buffer, int fromSocket, struct PipePool* pipePool, struct BufferPool* bufferPool, size_t maxBytes) {
+    if (!relayBufferCanRead(buffer))
+        return 0;
+
+    if (buffer->pipe[0] >= 0) {
+        int status = relayReadSplice(buffer, fromSocket, maxBytes);
+        if (status <= 0)
+            return status;
+
+        // splice() isn't supported here, so we give the (still empty) pipe back and copy from now on.
+        logWarn("splice() not supported for this tunnel, falling back to copying");
+        releasePipe(buffer, pipePool);
+    }
+
+    return relayReadCopy(buffer, fromSocket, bufferPool, maxBytes);
+}
+
+int relayForward(struct RelayBuffer* buffer, int fromSocket, int toSocket, size_t maxBytes, int receiveNext) {
+    if (!relayBufferCanRead(buffer))
+        return 0;
+
+    ssize_t forwarded = selectorForward(buffer->selector, fromSocket, toSocket, maxBytes, receiveNext);
+    if (forwarded < 0) {
+        if (errno == EAGAIN)
+            return 0;
+        return errno == ENOBUFS ? 1 : -1;
+    }
+
+    if (forwarded == 0)
+        buffer->readClosed = 1;
+    buffer->bytesRead += forwarded;
+    buffer->sending = forwarded;
+    return 0;
+}
+
+int relayWrite(struct RelayBuffer* buffer, int toSocket, struct BufferPool* bufferPool) {
+    // Nothing else is written until the send the selector forwarded completed.
+    if (buffer->sending > 0) {
+        if (selectorIsSending(buffer->selector, toSocket))
+            return 0;
+        buffer->bytesWritten += buffer->sending;
+        buffer->sending = 0;
+    }
+
+    // Data taken through the copy path (before falling back, or received before the relay started) is always
+    // written before the data in the pipe.
+    while (!ringBufferIsEmpty(&buffer->ring)) {
+        struct msghdr msg = {0};
+        struct iovec iov[2];
+        msg.msg_iov = iov;
+        msg.msg_iovlen = ringBufferReadableIov(&buffer->ring, iov);
+
+        ssize_t sent = sendmsg(toSocket, &msg, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR)
+                continue;
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+        }
+
+        ringBufferConsume(&buffer->ring, sent);
+        buffer->bytesWritten += sent;
+    }
+
+    // The buffer is empty, so it's of more use to anyone else until there's something to read again.
+    releaseStorage(buffer, bufferPool);
+
+    while (buffer->pipeLength > 0) {
+        ssize_t sent = splice(buffer->pipe[0], NULL, toSocket, NULL, buffer->pipeLength, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (sent < 0) {
+            if (errno == EINTR)
+                continue;
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+        }
+
+        buffer->pipeLength -= sent;
+        buffer->bytesWritten += sent;
+    }
+
+    // Everything was written. If the source won't send anything else, let the destination know with a half-close.
+    if (buffer->readClosed && !buffer->writeClosed) {
+        buffer->writeClosed = 1;
+        if (shutdown(toSocket, SHUT_WR) != 0 && errno != ENOTCONN)
+            return -1;
+    }
+
+    return 0;
+}
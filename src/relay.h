@@ -0,0 +1,134 @@
+#ifndef _RELAY_H_
+#define _RELAY_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "bufferpool.h"
+#include "pipepool.h"
+#include "ringbuffer.h"
+
+// The size class of a direction's first buffer, 16 KiB.
+#define RELAY_INITIAL_SIZE_CLASS 1
+
+/**
+ * Represents one direction of a tunnel's data relay: bytes read from one socket waiting to be written to the
+ * other. The bytes wait in a ring buffer, or inside a pipe if the direction is relayed with splice(). Either
+ * way the buffer has a bounded size, and we stop reading from the source socket while it's full.
+ *
+ * The ring buffer's memory comes from the worker's buffer pool right before reading, and goes back to it as soon
+ * as everything was written, so an idle direction holds none. Each time it goes back, the direction picks the size
+ * of its next buffer: a read that filled the whole buffer means the source is sending faster than we relay it, so
+ * the next buffer is one class bigger, and a buffer that never got past a quarter full means the data comes in
+ * small pieces, so the next buffer is one class smaller.
+ *
+ * With io_uring, a direction can be forwarded by the selector instead: it receives the source socket's data into
+ * buffers of its own and sends it to the destination socket straight from them (see selectorForward()), with a
+ * single send in flight at a time, so the data doesn't go through the direction's buffer, or through any system
+ * call of ours. The direction's buffer is only used for data read otherwise (before the relay started, or while the
+ * selector had no buffer left to receive into), which is written before anything else is forwarded.
+ *
+ * Each direction is closed on its own: when the source socket reaches EOF we keep sending whatever is left
+ * in the buffer and then shutdown(SHUT_WR) the destination socket, while the other direction keeps going.
+ */
+struct RelayBuffer {
+    // The ring's data is NULL while the direction has no buffer from the pool.
+    struct RingBuffer ring;
+
+    // The size class of the current buffer (or of the next one), whether a read filled the current buffer up, and
+    // the most bytes it held.
+    int sizeClass;
+    int filledUp;
+    size_t peakLength;
+
+    // The selector forwarding this direction, or NULL if it's not forwarded, and how many bytes the send it has in
+    // flight for this direction is sending (0 if none).
+    struct Selector* selector;
+    size_t sending;
+
+    // The pipe used to splice() this direction, or -1 if this direction is relayed by copying.
+    int pipe[2];
+    size_t pipeLength;
+    size_t pipeCapacity;
+
+    // Whether we got EOF from the source socket.
+    int readClosed;
+
+    // Whether we already shutdown() the destination socket for writing, meaning this direction is finished.
+    int writeClosed;
+
+    // The total amount of bytes read from the source socket and written to the destination socket.
+    uint64_t bytesRead;
+    uint64_t bytesWritten;
+};
+
+/**
+ * Initializes an empty relay buffer that relays by copying.
+ */
+void relayBufferInit(struct RelayBuffer* buffer);
+
+/**
+ * Makes this direction relay with splice(), taking a pipe from the pool. Returns 0 if successful, or -1 if
+ * no pipe could be obtained (in which case the direction keeps relaying by copying).
+ */
+int relayBufferUseSplice(struct RelayBuffer* buffer, struct PipePool* pool);
+
+/**
+ * Makes this direction forwarded by the given selector, which must be receiving ahead from the source socket.
+ */
+void relayBufferUseForwarding(struct RelayBuffer* buffer, struct Selector* selector);
+
+/**
+ * Returns the direction's pipe and buffer (if it has them) to their pools.
+ */
+void relayBufferRelease(struct RelayBuffer* buffer, struct PipePool* pipePool, struct BufferPool* bufferPool);
+
+/**
+ * Makes the direction's (empty) buffer one taken from the buffer pool by someone else, of the given class and
+ * already holding the given amount of bytes of data.
+ */
+void relayBufferAdopt(struct RelayBuffer* buffer, uint8_t* storage, int sizeClass, size_t length);
+
+/**
+ * Makes sure the direction has a buffer from the pool. Returns 0 if successful, or -1 if the memory limit doesn't
+ * leave room for one.
+ */
+int relayBufferReserve(struct RelayBuffer* buffer, struct BufferPool* pool);
+
+/**
+ * Returns whether we should read from the source socket: it hasn't reached EOF, the buffer has room, and nothing
+ * forwarded is in flight (nor waiting in the buffer, if the direction is forwarded).
+ */
+int relayBufferCanRead(const struct RelayBuffer* buffer);
+
+/**
+ * Returns whether there is data waiting to be written to the destination socket.
+ */
+int relayBufferHasPending(const struct RelayBuffer* buffer);
+
+/**
+ * Reads as much as fits in the buffer from the source socket, but no more than maxBytes. If splice() turns out not
+ * to be supported for this socket, the pipe is returned to the pool and the direction falls back to copying.
+ * Returns 0 if successful (including if there was nothing to read or we got EOF), -1 if the socket failed, or 1 if
+ * there was no buffer to read into (see bufferAcquire()), in which case nothing was read.
+ */
+int relayRead(struct RelayBuffer* buffer, int fromSocket, struct PipePool* pipePool, struct BufferPool* bufferPool, size_t maxBytes);
+
+/**
+ * Forwards up to maxBytes of what the selector received from the source socket to the destination socket, linking
+ * the next receive to the send if receiveNext is set (see selectorForward()). Returns 0 if successful (including if
+ * there was nothing to forward yet or we got EOF), -1 if a socket failed, or 1 if the selector didn't receive
+ * anything ahead, in which case the source has to be read with relayRead().
+ */
+int relayForward(struct RelayBuffer* buffer, int fromSocket, int toSocket, size_t maxBytes, int receiveNext);
+
+/**
+ * Writes as much of the buffered data as the destination socket accepts, giving the buffer back to the pool once
+ * it's empty, once the send forwarded to it (if any) completed. If the source reached EOF and everything was
+ * written, the destination is shutdown() for writing.
+ * Returns 0 if successful (including if the socket couldn't take all the data right now), or -1 if the socket
+ * failed.
+ */
+int relayWrite(struct RelayBuffer* buffer, int toSocket, struct BufferPool* bufferPool);
+
+#endif
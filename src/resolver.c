@@ -0,0 +1,520 @@
+#include "resolver.h"
+#include "logger.h"
+#include "util.h"
+#include <ctype.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+
+#define MAX_HOSTNAME_LENGTH 255
+
+// The maximum amount of addresses we keep for each cached name.
+#define MAX_CACHED_ADDRESSES 16
+
+struct CacheEntry {
+    char hostname[MAX_HOSTNAME_LENGTH + 1];
+    int family;
+    uint32_t hash;
+    struct CacheEntry* hashNext;
+
+    // The entries form a list ordered from most to least recently used.
+    struct CacheEntry* lruPrev;
+    struct CacheEntry* lruNext;
+
+    // While a lookup is in progress the entry can't be evicted, and the lookups for the same name wait on it.
+    int pending;
+    struct ResolverWaiter* waiters;
+    struct CacheEntry* jobNext;
+
+    int gaiStatus;
+    int addressCount;
+    struct sockaddr_storage* addresses;
+    socklen_t* addressLengths;
+    uint64_t expiresAt;
+};
+
+struct ResolverWaiter {
+    struct ResolverClient* client;
+    ResolverCallback callback;
+    void* data;
+    int port;
+    int cancelled;
+
+    struct addrinfo* addresses;
+    int gaiStatus;
+    struct ResolverWaiter* next;
+};
+
+/**
+ * The resolver's state, shared by all the workers and resolver threads. It's all protected by a single lock,
+ * which is only held for quick operations (getaddrinfo() calls are made outside of it).
+ */
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t jobsAvailable;
+
+    struct CacheEntry** buckets;
+    uint32_t bucketCount;
+    int entryCount;
+    int maxEntries;
+
+    struct CacheEntry* lruHead;
+    struct CacheEntry* lruTail;
+
+    struct CacheEntry* jobsHead;
+    struct CacheEntry* jobsTail;
+
+    uint64_t positiveTtlMillis;
+    uint64_t negativeTtlMillis;
+
+    // How many getaddrinfo() calls are queued or running, and how many there may be (or 0 for no limit).
+    int lookupsInFlight;
+    int maxLookups;
+} resolver = {.lock = PTHREAD_MUTEX_INITIALIZER, .jobsAvailable = PTHREAD_COND_INITIALIZER};
+
+/**
+ * Calculates the FNV-1a hash of a hostname and family. The hostname must already be in lowercase.
+ */
+static uint32_t hashKey(const char* hostname, int family) {
+    uint32_t hash = fnv1a(hostname, strlen(hostname));
+    return fnv1aUpdate(hash, &family, sizeof(family));
+}
+
+static void lruUnlink(struct CacheEntry* entry) {
+    if (entry->lruPrev != NULL)
+        entry->lruPrev->lruNext = entry->lruNext;
+    else
+        resolver.lruHead = entry->lruNext;
+
+    if (entry->lruNext != NULL)
+        entry->lruNext->lruPrev = entry->lruPrev;
+    else
+        resolver.lruTail = entry->lruPrev;
+
+    entry->lruPrev = entry->lruNext = NULL;
+}
+
+static void lruPushFront(struct CacheEntry* entry) {
+    entry->lruPrev = NULL;
+    entry->lruNext = resolver.lruHead;
+    if (resolver.lruHead != NULL)
+        resolver.lruHead->lruPrev = entry;
+    resolver.lruHead = entry;
+    if (resolver.lruTail == NULL)
+        resolver.lruTail = entry;
+}
+
+static struct CacheEntry* findEntry(const char* hostname, int family, uint32_t hash) {
+    for (struct CacheEntry* entry = resolver.buckets[hash & (resolver.bucketCount - 1)]; entry != NULL; entry = entry->hashNext) {
+        if (entry->hash == hash && entry->family == family && strcmp(entry->hostname, hostname) == 0)
+            return entry;
+    }
+
+    return NULL;
+}
+
+static void freeEntry(struct CacheEntry* entry) {
+    free(entry->addresses);
+    free(entry->addressLengths);
+    free(entry);
+}
+
+/**
+ * Removes an entry from the cache and frees it. The entry must not have a lookup in progress.
+ */
+static void removeEntry(struct CacheEntry* entry) {
+    struct CacheEntry** link = &resolver.buckets[entry->hash & (resolver.bucketCount - 1)];
+    while (*link != entry)
+        link = &(*link)->hashNext;
+    *link = entry->hashNext;
+
+    lruUnlink(entry);
+    resolver.entryCount--;
+    freeEntry(entry);
+}
+
+/**
+ * Evicts the least recently used entries (skipping the ones with a lookup in progress) until the cache is
+ * within its size limit.
+ */
+static void evictEntries() {
+    struct CacheEntry* entry = resolver.lruTail;
+    while (resolver.entryCount > resolver.maxEntries && entry != NULL) {
+        struct CacheEntry* previous = entry->lruPrev;
+        if (!entry->pending)
+            removeEntry(entry);
+        entry = previous;
+    }
+}
+
+/**
+ * Builds an addrinfo list with an entry's addresses and the given port. The whole list is allocated in a
+ * single block, so it can be freed with a single free().
+ */
+static struct addrinfo* buildAddresses(const struct sockaddr_storage* addresses, const socklen_t* lengths, int count, int port) {
+    if (count == 0)
+        return NULL;
+
+    size_t nodeSize = sizeof(struct addrinfo) + sizeof(struct sockaddr_storage);
+    uint8_t* block = calloc(count, nodeSize);
+    if (block == NULL)
+        return NULL;
+
+    struct addrinfo* previous = NULL;
+    for (int i = count - 1; i >= 0; i--) {
+        struct addrinfo* ai = (struct addrinfo*)(block + i * nodeSize);
+        struct sockaddr_storage* addr = (struct sockaddr_storage*)(ai + 1);
+        memcpy(addr, &addresses[i], lengths[i]);
+        if (addr->ss_family == AF_INET)
+            ((struct sockaddr_in*)addr)->sin_port = htons(port);
+        else if (addr->ss_family == AF_INET6)
+            ((struct sockaddr_in6*)addr)->sin6_port = htons(port);
+
+        ai->ai_family = addr->ss_family;
+        ai->ai_socktype = SOCK_STREAM;
+        ai->ai_protocol = IPPROTO_TCP;
+        ai->ai_addr = (struct sockaddr*)addr;
+        ai->ai_addrlen = lengths[i];
+        ai->ai_next = previous;
+        previous = ai;
+    }
+
+    return previous;
+}
+
+static struct addrinfo* buildEntryAddresses(const struct CacheEntry* entry, int port) {
+    return buildAddresses(entry->addresses, entry->addressLengths, entry->addressCount, port);
+}
+
+/**
+ * Hands a finished lookup to its worker's queue, and wakes the worker up.
+ */
+static void completeWaiter(struct ResolverWaiter* waiter) {
+    struct ResolverClient* client = waiter->client;
+    waiter->next = NULL;
+
+    pthread_mutex_lock(&client->lock);
+    if (client->completedTail != NULL)
+        client->completedTail->next = waiter;
+    else
+        client->completedHead = waiter;
+    client->completedTail = waiter;
+    pthread_mutex_unlock(&client->lock);
+
+    uint64_t one = 1;
+    if (write(client->eventFd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+        logErrno(LOG_LEVEL_ERROR, "Failed to wake up worker with resolver results");
+}
+
+/**
+ * Stores the result of a getaddrinfo() call in a cache entry.
+ */
+static void storeResult(struct CacheEntry* entry, int gaiStatus, struct addrinfo* result) {
+    free(entry->addresses);
+    free(entry->addressLengths);
+    entry->addresses = NULL;
+    entry->addressLengths = NULL;
+    entry->addressCount = 0;
+
+    int count = 0;
+    for (struct addrinfo* ai = result; ai != NULL && count < MAX_CACHED_ADDRESSES; ai = ai->ai_next)
+        count++;
+
+    if (gaiStatus == 0 && count > 0) {
+        entry->addresses = malloc(count * sizeof(struct sockaddr_storage));
+        entry->addressLengths = malloc(count * sizeof(socklen_t));
+        if (entry->addresses == NULL || entry->addressLengths == NULL)
+            gaiStatus = EAI_MEMORY;
+    } else if (gaiStatus == 0) {
+        gaiStatus = EAI_NONAME;
+    }
+
+    if (gaiStatus == 0) {
+        struct addrinfo* ai = result;
+        for (int i = 0; i < count; i++, ai = ai->ai_next) {
+            memcpy(&entry->addresses[i], ai->ai_addr, ai->ai_addrlen);
+            entry->addressLengths[i] = ai->ai_addrlen;
+        }
+        entry->addressCount = count;
+    }
+
+    entry->gaiStatus = gaiStatus;
+    entry->expiresAt = getMonotonicMillis() + (gaiStatus == 0 ? resolver.positiveTtlMillis : resolver.negativeTtlMillis);
+}
+
+static void* resolverThread(void* arg) {
+    while (1) {
+        pthread_mutex_lock(&resolver.lock);
+        while (resolver.jobsHead == NULL)
+            pthread_cond_wait(&resolver.jobsAvailable, &resolver.lock);
+
+        struct CacheEntry* entry = resolver.jobsHead;
+        resolver.jobsHead = entry->jobNext;
+        if (resolver.jobsHead == NULL)
+            resolver.jobsTail = NULL;
+        entry->jobNext = NULL;
+        pthread_mutex_unlock(&resolver.lock);
+
+        // An entry with a lookup in progress is never freed nor modified by anyone else, so we can use it without the lock.
+        struct addrinfo hints;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = entry->family;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_protocol = IPPROTO_TCP;
+        hints.ai_flags = AI_ADDRCONFIG;
+
+        struct addrinfo* result = NULL;
+        int gaiStatus = getaddrinfo(entry->hostname, NULL, &hints, &result);
+
+        pthread_mutex_lock(&resolver.lock);
+        storeResult(entry, gaiStatus, result);
+        entry->pending = 0;
+        resolver.lookupsInFlight--;
+
+        // Build each waiter's result while we hold the lock, then hand them out to their workers.
+        struct ResolverWaiter* waiters = entry->waiters;
+        entry->waiters = NULL;
+        for (struct ResolverWaiter* waiter = waiters; waiter != NULL; waiter = waiter->next) {
+            waiter->gaiStatus = entry->gaiStatus;
+            waiter->addresses = entry->gaiStatus == 0 ? buildEntryAddresses(entry, waiter->port) : NULL;
+            if (entry->gaiStatus == 0 && waiter->addresses == NULL)
+                waiter->gaiStatus = EAI_MEMORY;
+        }
+
+        evictEntries();
+        pthread_mutex_unlock(&resolver.lock);
+
+        if (result != NULL)
+            freeaddrinfo(result);
+
+        while (waiters != NULL) {
+            struct ResolverWaiter* next = waiters->next;
+            completeWaiter(waiters);
+            waiters = next;
+        }
+    }
+
+    return NULL;
+}
+
+int resolverInit(int threadCount, int cacheSize, int positiveTtlSeconds, int negativeTtlSeconds, int maxLookups) {
+    resolver.bucketCount = 64;
+    while (resolver.bucketCount < (uint32_t)cacheSize)
+        resolver.bucketCount *= 2;
+
+    resolver.buckets = calloc(resolver.bucketCount, sizeof(struct CacheEntry*));
+    if (resolver.buckets == NULL)
+        return -1;
+
+    resolver.maxEntries = cacheSize;
+    resolver.positiveTtlMillis = (uint64_t)positiveTtlSeconds * 1000;
+    resolver.negativeTtlMillis = (uint64_t)negativeTtlSeconds * 1000;
+    resolver.maxLookups = maxLookups;
+
+    for (int i = 0; i < threadCount; i++) {
+        pthread_t thread;
+        int error = pthread_create(&thread, NULL, resolverThread, NULL);
+        if (error != 0) {
+            logError("Failed to create resolver thread: %s", strerror(error));
+            return -1;
+        }
+        pthread_detach(thread);
+    }
+
+    return 0;
+}
+
+/**
+ * Handles a worker's eventfd becoming readable, by calling the callbacks of all its finished lookups.
+ */
+static void resolverClientHandler(int fd, uint32_t events, void* data) {
+    struct ResolverClient* client = (struct ResolverClient*)data;
+
+    uint64_t count;
+    if (read(fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+        logErrno(LOG_LEVEL_ERROR, "Failed to read resolver eventfd");
+
+    pthread_mutex_lock(&client->lock);
+    struct ResolverWaiter* waiter = client->completedHead;
+    client->completedHead = client->completedTail = NULL;
+    pthread_mutex_unlock(&client->lock);
+
+    while (waiter != NULL) {
+        struct ResolverWaiter* next = waiter->next;
+        if (waiter->cancelled)
+            resolverFreeAddresses(waiter->addresses);
+        else
+            waiter->callback(waiter->data, waiter->addresses, waiter->gaiStatus);
+        free(waiter);
+        waiter = next;
+    }
+}
+
+int resolverClientInit(struct ResolverClient* client, struct Selector* selector) {
+    client->completedHead = client->completedTail = NULL;
+    if (pthread_mutex_init(&client->lock, NULL) != 0)
+        return -1;
+
+    client->eventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (client->eventFd < 0) {
+        pthread_mutex_destroy(&client->lock);
+        return -1;
+    }
+
+    if (selectorAdd(selector, client->eventFd, EPOLLIN, resolverClientHandler, client) != 0) {
+        close(client->eventFd);
+        pthread_mutex_destroy(&client->lock);
+        return -1;
+    }
+
+    return 0;
+}
+
+int resolverLookup(struct ResolverClient* client, const char* hostname, int family, int port, ResolverCallback callback, void* data, struct ResolverWaiter** waiter, struct addrinfo** addresses, int* gaiStatus) {
+    // Domain names are case insensitive, so we use them in lowercase as the cache key.
+    char key[MAX_HOSTNAME_LENGTH + 1];
+    size_t length = strlen(hostname);
+    if (length > MAX_HOSTNAME_LENGTH)
+        length = MAX_HOSTNAME_LENGTH;
+    for (size_t i = 0; i < length; i++)
+        key[i] = tolower((unsigned char)hostname[i]);
+    key[length] = '\0';
+
+    uint32_t hash = hashKey(key, family);
+    uint64_t now = getMonotonicMillis();
+
+    pthread_mutex_lock(&resolver.lock);
+    struct CacheEntry* entry = findEntry(key, family, hash);
+
+    // If we have a fresh result, we answer right away.
+    if (entry != NULL && !entry->pending && entry->expiresAt > now) {
+        lruUnlink(entry);
+        lruPushFront(entry);
+        *gaiStatus = entry->gaiStatus;
+        *addresses = entry->gaiStatus == 0 ? buildEntryAddresses(entry, port) : NULL;
+        if (entry->gaiStatus == 0 && *addresses == NULL)
+            *gaiStatus = EAI_MEMORY;
+        pthread_mutex_unlock(&resolver.lock);
+        return 1;
+    }
+
+    // Waiting for a lookup already in progress costs nothing, but a new one has to fit in the limit.
+    if ((entry == NULL || !entry->pending) && resolver.maxLookups > 0 && resolver.lookupsInFlight >= resolver.maxLookups) {
+        pthread_mutex_unlock(&resolver.lock);
+        return -2;
+    }
+
+    struct ResolverWaiter* newWaiter = calloc(1, sizeof(struct ResolverWaiter));
+    if (newWaiter == NULL) {
+        pthread_mutex_unlock(&resolver.lock);
+        return -1;
+    }
+
+    newWaiter->client = client;
+    newWaiter->callback = callback;
+    newWaiter->data = data;
+    newWaiter->port = port;
+
+    if (entry == NULL) {
+        entry = calloc(1, sizeof(struct CacheEntry));
+        if (entry == NULL) {
+            pthread_mutex_unlock(&resolver.lock);
+            free(newWaiter);
+            return -1;
+        }
+
+        memcpy(entry->hostname, key, length + 1);
+        entry->family = family;
+        entry->hash = hash;
+        entry->hashNext = resolver.buckets[hash & (resolver.bucketCount - 1)];
+        resolver.buckets[hash & (resolver.bucketCount - 1)] = entry;
+        resolver.entryCount++;
+    } else {
+        lruUnlink(entry);
+    }
+    lruPushFront(entry);
+
+    // If there's already a lookup in progress for this name we just wait for it, otherwise we start one.
+    newWaiter->next = entry->waiters;
+    entry->waiters = newWaiter;
+    if (!entry->pending) {
+        entry->pending = 1;
+        resolver.lookupsInFlight++;
+        if (resolver.jobsTail != NULL)
+            resolver.jobsTail->jobNext = entry;
+        else
+            resolver.jobsHead = entry;
+        resolver.jobsTail = entry;
+        pthread_cond_signal(&resolver.jobsAvailable);
+    }
+
+    evictEntries();
+    pthread_mutex_unlock(&resolver.lock);
+
+    *waiter = newWaiter;
+    return 0;
+}
+
+void resolverCancel(struct ResolverWaiter* waiter) {
+    // The waiter is freed once its result reaches the worker, the callback just won't be called.
+    waiter->cancelled = 1;
+}
+
+int resolverNumeric(const char* address, int family, int port, struct addrinfo** addresses) {
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = family;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_protocol = IPPROTO_TCP;
+    hints.ai_flags = AI_NUMERICHOST;
+
+    struct addrinfo* result;
+    int gaiStatus = getaddrinfo(address, NULL, &hints, &result);
+    if (gaiStatus != 0)
+        return gaiStatus;
+
+    struct sockaddr_storage addr;
+    socklen_t length = result->ai_addrlen;
+    memcpy(&addr, result->ai_addr, length);
+    freeaddrinfo(result);
+
+    *addresses = buildAddresses(&addr, &length, 1, port);
+    return *addresses == NULL ? EAI_MEMORY : 0;
+}
+
+int resolverFilterAddresses(struct addrinfo* addresses, int (*keep)(const struct sockaddr* address, void* data), void* data) {
+    // Every node has room for any address right after it, so the kept addresses are moved into the first nodes.
+    struct addrinfo* last = NULL;
+    struct addrinfo* target = addresses;
+    int kept = 0;
+    for (struct addrinfo* ai = addresses; ai != NULL; ai = ai->ai_next) {
+        if (!keep(ai->ai_addr, data))
+            continue;
+
+        if (target != ai) {
+            memcpy(target->ai_addr, ai->ai_addr, ai->ai_addrlen);
+            target->ai_family = ai->ai_family;
+            target->ai_socktype = ai->ai_socktype;
+            target->ai_protocol = ai->ai_protocol;
+            target->ai_addrlen = ai->ai_addrlen;
+        }
+        last = target;
+        target = target->ai_next;
+        kept++;
+    }
+
+    if (last != NULL)
+        last->ai_next = NULL;
+    else
+        addresses->ai_family = AF_UNSPEC;
+    return kept;
+}
+
+void resolverFreeAddresses(struct addrinfo* addresses) {
+    // The whole list is a single block, starting at its first node.
+    free(addresses);
+}
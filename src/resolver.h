@@ -0,0 +1,87 @@
+#ifndef _RESOLVER_H_
+#define _RESOLVER_H_
+
+#include <netdb.h>
+#include <pthread.h>
+
+#include "selector.h"
+
+/**
+ * The resolver turns domain names into addresses without blocking the workers. getaddrinfo() calls are made
+ * by a pool of resolver threads, and their results are kept in a cache shared by all the workers, so popular
+ * names are only resolved once per TTL. Since getaddrinfo() doesn't tell us the records' real TTL, we use a
+ * configured TTL for successful lookups and a (usually shorter) one for failed lookups.
+ *
+ * Concurrent lookups for the same name are coalesced into a single getaddrinfo() call. The cache has a
+ * maximum amount of entries, evicting the least recently used ones when it's full.
+ */
+
+/**
+ * The function called when a lookup finishes. If gaiStatus is 0 the lookup succeeded and addresses is a list
+ * that must be freed with resolverFreeAddresses(), otherwise gaiStatus is an EAI_* error and addresses is NULL.
+ * The callback is always called on the thread of the worker that made the lookup.
+ */
+typedef void (*ResolverCallback)(void* data, struct addrinfo* addresses, int gaiStatus);
+
+/**
+ * A lookup waiting for its result. It can be cancelled (for example, if the client disconnects meanwhile)
+ * with resolverCancel().
+ */
+struct ResolverWaiter;
+
+/**
+ * Each worker has a resolver client, through which the resolver threads hand it the results of its lookups.
+ * The results are queued and the worker is woken up through an eventfd registered in its selector.
+ */
+struct ResolverClient {
+    int eventFd;
+    pthread_mutex_t lock;
+    struct ResolverWaiter* completedHead;
+    struct ResolverWaiter* completedTail;
+};
+
+/**
+ * Starts the resolver threads and creates the cache, allowing up to maxLookups names to be looked up at the same
+ * time (or any amount if it's 0). Returns 0 if successful, or -1 if an error occurred.
+ */
+int resolverInit(int threadCount, int cacheSize, int positiveTtlSeconds, int negativeTtlSeconds, int maxLookups);
+
+/**
+ * Initializes a worker's resolver client, registering its eventfd in the worker's selector. Returns 0 if
+ * successful, or -1 if an error occurred.
+ */
+int resolverClientInit(struct ResolverClient* client, struct Selector* selector);
+
+/**
+ * Resolves a hostname into TCP addresses with the given port. If the result is cached, it's returned right
+ * away: the function returns 1 and stores the result in addresses and gaiStatus. Otherwise, the function
+ * returns 0, stores a handle for the lookup in waiter, and the callback will be called once it's done.
+ * Returns -1 if the lookup couldn't be started, or -2 if the name would need a lookup of its own and there are
+ * already as many in progress as allowed.
+ */
+int resolverLookup(struct ResolverClient* client, const char* hostname, int family, int port, ResolverCallback callback, void* data, struct ResolverWaiter** waiter, struct addrinfo** addresses, int* gaiStatus);
+
+/**
+ * Cancels a lookup, so its callback won't be called. Must be called from the thread of the worker that made it.
+ */
+void resolverCancel(struct ResolverWaiter* waiter);
+
+/**
+ * Resolves a numeric IPv4 or IPv6 address into a TCP address with the given port. This never blocks nor
+ * touches the cache. Returns 0 and stores the result in addresses if successful, or an EAI_* error otherwise.
+ */
+int resolverNumeric(const char* address, int family, int port, struct addrinfo** addresses);
+
+/**
+ * Removes from an address list returned by the resolver the addresses for which keep() returns 0, keeping the
+ * order of the rest. The list's first node stays its first node, so it's still freed with resolverFreeAddresses()
+ * (it's left empty, with ai_family AF_UNSPEC, if no address was kept). Returns the amount of addresses kept.
+ */
+int resolverFilterAddresses(struct addrinfo* addresses, int (*keep)(const struct sockaddr* address, void* data), void* data);
+
+/**
+ * Frees an address list returned by the resolver.
+ */
+void resolverFreeAddresses(struct addrinfo* addresses);
+
+#endif
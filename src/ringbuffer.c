@@ -0,0 +1,59 @@
+#include "ringbuffer.h"
+
+void ringBufferInit(struct RingBuffer* buffer, uint8_t* data, size_t capacity) {
+    buffer->data = data;
+    buffer->capacity = capacity;
+    buffer->start = 0;
+    buffer->length = 0;
+}
+
+int ringBufferWritableIov(const struct RingBuffer* buffer, struct iovec iov[2]) {
+    if (buffer->length == buffer->capacity)
+        return 0;
+
+    size_t end = (buffer->start + buffer->length) % buffer->capacity;
+    if (end < buffer->start) {
+        // The data wraps around, so the free space is the single region between its end and its start.
+        iov[0].iov_base = buffer->data + end;
+        iov[0].iov_len = buffer->start - end;
+        return 1;
+    }
+
+    // The free space goes from the end of the data to the end of the array, then from the beginning of the array to the start of the data.
+    iov[0].iov_base = buffer->data + end;
+    iov[0].iov_len = buffer->capacity - end;
+    if (buffer->start == 0)
+        return 1;
+
+    iov[1].iov_base = buffer->data;
+    iov[1].iov_len = buffer->start;
+    return 2;
+}
+
+void ringBufferCommit(struct RingBuffer* buffer, size_t n) {
+    buffer->length += n;
+}
+
+int ringBufferReadableIov(const struct RingBuffer* buffer, struct iovec iov[2]) {
+    if (buffer->length == 0)
+        return 0;
+
+    size_t firstLength = buffer->capacity - buffer->start;
+    iov[0].iov_base = buffer->data + buffer->start;
+    if (buffer->length <= firstLength) {
+        iov[0].iov_len = buffer->length;
+        return 1;
+    }
+
+    iov[0].iov_len = firstLength;
+    iov[1].iov_base = buffer->data;
+    iov[1].iov_len = buffer->length - firstLength;
+    return 2;
+}
+
+void ringBufferConsume(struct RingBuffer* buffer, size_t n) {
+    buffer->length -= n;
+
+    // If the buffer is now empty, go back to the start of the array so the free space is a single region.
+    buffer->start = buffer->length == 0 ? 0 : (buffer->start + n) % buffer->capacity;
+}
@@ -0,0 +1,55 @@
+#ifndef _RINGBUFFER_H_
+#define _RINGBUFFER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+/**
+ * A fixed-capacity circular byte buffer. Data is written at the end and read from the start, wrapping around
+ * the underlying array, so the free space (and the data) might be split in two regions. These are exposed as
+ * iovec arrays so both regions can be filled (or drained) with a single readv() or sendmsg() call.
+ */
+struct RingBuffer {
+    uint8_t* data;
+    size_t capacity;
+    size_t start;
+    size_t length;
+};
+
+/**
+ * Initializes an empty ring buffer over the given array.
+ */
+void ringBufferInit(struct RingBuffer* buffer, uint8_t* data, size_t capacity);
+
+/**
+ * Fills iov with the free regions of the buffer, in the order they should be written. Returns the amount of
+ * regions (0 if the buffer is full).
+ */
+int ringBufferWritableIov(const struct RingBuffer* buffer, struct iovec iov[2]);
+
+/**
+ * Marks n bytes, previously written into the free regions, as part of the buffer's data.
+ */
+void ringBufferCommit(struct RingBuffer* buffer, size_t n);
+
+/**
+ * Fills iov with the regions of the buffer holding data, in order. Returns the amount of regions (0 if the
+ * buffer is empty).
+ */
+int ringBufferReadableIov(const struct RingBuffer* buffer, struct iovec iov[2]);
+
+/**
+ * Discards the first n bytes of data from the buffer.
+ */
+void ringBufferConsume(struct RingBuffer* buffer, size_t n);
+
+static inline int ringBufferIsEmpty(const struct RingBuffer* buffer) {
+    return buffer->length == 0;
+}
+
+static inline int ringBufferIsFull(const struct RingBuffer* buffer) {
+    return buffer->length == buffer->capacity;
+}
+
+#endif
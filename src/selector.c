@@ -0,0 +1,848 @@
+#include "selector.h"
+#include "uring.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define INITIAL_TABLE_SIZE 1024
+#define MAX_EVENTS_PER_SELECT 256
+#define URING_ENTRIES 4096
+
+// The buffers data is received ahead into, shared by all the sockets of the selector.
+#define RECEIVE_BUFFER_COUNT 256
+#define RECEIVE_BUFFER_GROUP 0
+
+// The user data of io_uring requests whose completion we don't care about (like the ones cancelling polls).
+#define IGNORED_USER_DATA UINT64_MAX
+
+// The user data of io_uring requests has the fd in its low 30 bits, the kind of request in the next two (polls have
+// none), and something telling it apart from earlier requests of its kind for the same fd in the high 32 bits.
+#define ACCEPT_USER_DATA (1ULL << 30)
+#define RECEIVE_USER_DATA (2ULL << 30)
+#define SEND_USER_DATA (3ULL << 30)
+#define USER_DATA_KIND_MASK (3ULL << 30)
+#define USER_DATA_FD_MASK 0x3FFFFFFF
+
+/**
+ * An entry in the selector's table, one for each possible fd number. The generation number increments each
+ * time an fd is registered, so events belonging to a previous registration of the same fd number (for
+ * example, one that was closed and reused during the same selectorSelect() batch) can be recognized and discarded.
+ * With io_uring, it also increments each time a poll request is cancelled, so the completion of the cancelled
+ * request is discarded too.
+ */
+struct SelectorEntry {
+    SelectorHandler handler;
+    SelectorAcceptHandler acceptHandler;
+    void* data;
+    uint32_t events;
+    uint32_t generation;
+
+    // Increments each time the fd is registered, but not when a poll request is cancelled. With io_uring, receive
+    // requests are told apart by it, since they are kept in flight while the poll requests come and go.
+    uint32_t registration;
+
+    // With io_uring, whether this entry has a poll (or accept) request in flight, whether it's a no-op instead (which
+    // completes right away, to call the handler with data that was already received), and the events polled for.
+    int armed;
+    int armedNop;
+    uint32_t armedEvents;
+
+    // With io_uring, whether the entry's handler is running, in which case its requests are armed once it returns.
+    int dispatching;
+
+    // With io_uring, whether this passive socket has to fall back to polling because the kernel doesn't
+    // support multishot accept.
+    int pollAccept;
+
+    // With io_uring, the handler of the last multishot accept cancelled on this fd, and the generation it was
+    // armed with. The kernel may have accepted some connections before processing the cancellation, and their
+    // completions still go to it instead of being dropped.
+    SelectorAcceptHandler lateAcceptHandler;
+    void* lateAcceptData;
+    uint32_t lateAcceptGeneration;
+
+    // With io_uring, the most bytes the selector receives ahead at a time (0 if it doesn't), whether a receive request
+    // is in flight, and whether the last one found no buffer left, in which case the socket is polled once instead.
+    size_t receiveLength;
+    int receiving;
+    int receiveStarved;
+
+    // With io_uring, the result of the last receive if it wasn't all taken yet: how many bytes are left (at the given
+    // offset of the given buffer), 0 for EOF, or a negative errno.
+    int received;
+    int receivedResult;
+    unsigned short receivedBuffer;
+    unsigned receivedOffset;
+
+    // With io_uring, whether a forwarded send to this fd is in flight, and the buffer and amount of bytes it sends.
+    int sending;
+    unsigned short sendingBuffer;
+    unsigned sendingLength;
+};
+
+struct Selector {
+    enum SelectorBackend backend;
+    int epollFd;
+    struct Uring ring;
+
+    // With io_uring, the buffers data is received ahead into (if the kernel supports buffer rings), and how many
+    // references each one has: the data received into it, and the send forwarding it. A buffer is provided to the
+    // kernel again once it has none.
+    struct UringBufferRing buffers;
+    int buffersRegistered;
+    uint8_t bufferUsers[RECEIVE_BUFFER_COUNT];
+    struct SelectorEntry* entries;
+    int entriesLength;
+    struct epoll_event events[MAX_EVENTS_PER_SELECT];
+};
+
+/**
+ * Sets up the io_uring backend. We need poll requests and accept requests, which every kernel with the features
+ * uringInit() checks for supports, but we still ask so we never find out in the middle of serving clients.
+ */
+static int initUring(struct Selector* selector) {
+    if (uringInit(&selector->ring, URING_ENTRIES) != 0)
+        return -1;
+
+    if (!uringSupportsOp(&selector->ring, IORING_OP_POLL_ADD) || !uringSupportsOp(&selector->ring, IORING_OP_POLL_REMOVE) || !uringSupportsOp(&selector->ring, IORING_OP_ACCEPT)) {
+        uringDestroy(&selector->ring);
+        errno = ENOSYS;
+        return -1;
+    }
+
+    // Receiving data ahead needs a buffer ring, and sending it on needs sends. Without them, sockets are only polled.
+    memset(selector->bufferUsers, 0, sizeof(selector->bufferUsers));
+    selector->buffersRegistered = uringSupportsOp(&selector->ring, IORING_OP_SEND) && uringSupportsOp(&selector->ring, IORING_OP_ASYNC_CANCEL) && uringInitBufferRing(&selector->ring, &selector->buffers, RECEIVE_BUFFER_GROUP, RECEIVE_BUFFER_COUNT, SELECTOR_RECEIVE_BUFFER_SIZE) == 0;
+    return 0;
+}
+
+struct Selector* selectorCreate(enum SelectorBackend backend) {
+    struct Selector* selector = malloc(sizeof(struct Selector));
+    if (selector == NULL)
+        return NULL;
+
+    selector->backend = SELECTOR_BACKEND_EPOLL;
+    if (backend == SELECTOR_BACKEND_IO_URING && initUring(selector) == 0)
+        selector->backend = SELECTOR_BACKEND_IO_URING;
+
+    if (selector->backend == SELECTOR_BACKEND_EPOLL) {
+        selector->epollFd = epoll_create1(EPOLL_CLOEXEC);
+        if (selector->epollFd < 0) {
+            free(selector);
+            return NULL;
+        }
+    }
+
+    selector->entries = calloc(INITIAL_TABLE_SIZE, sizeof(struct SelectorEntry));
+    if (selector->entries == NULL) {
+        selectorDestroy(selector);
+        return NULL;
+    }
+
+    selector->entriesLength = INITIAL_TABLE_SIZE;
+    return selector;
+}
+
+enum SelectorBackend selectorGetBackend(const struct Selector* selector) {
+    return selector->backend;
+}
+
+int selectorCanReceiveAhead(const struct Selector* selector) {
+    return selector->backend == SELECTOR_BACKEND_IO_URING && selector->buffersRegistered;
+}
+
+void selectorDestroy(struct Selector* selector) {
+    if (selector == NULL)
+        return;
+
+    if (selector->backend == SELECTOR_BACKEND_IO_URING) {
+        uringDestroy(&selector->ring);
+        if (selector->buffersRegistered)
+            uringDestroyBufferRing(&selector->buffers);
+    } else {
+        close(selector->epollFd);
+    }
+    free(selector->entries);
+    free(selector);
+}
+
+/**
+ * Makes sure the selector's table can hold an entry for the given fd, growing it if necessary.
+ */
+static int ensureCapacity(struct Selector* selector, int fd) {
+    if (fd < selector->entriesLength)
+        return 0;
+
+    int newLength = selector->entriesLength;
+    while (newLength <= fd)
+        newLength *= 2;
+
+    struct SelectorEntry* newEntries = realloc(selector->entries, newLength * sizeof(struct SelectorEntry));
+    if (newEntries == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    memset(newEntries + selector->entriesLength, 0, (newLength - selector->entriesLength) * sizeof(struct SelectorEntry));
+    selector->entries = newEntries;
+    selector->entriesLength = newLength;
+    return 0;
+}
+
+/**
+ * Whether an accept failed for lack of resources, rather than because of the connection being accepted.
+ */
+static int isAcceptResourceError(int error) {
+    return error == EMFILE || error == ENFILE || error == ENOBUFS || error == ENOMEM;
+}
+
+static int isMultishotAccept(const struct SelectorEntry* entry) {
+    return entry->acceptHandler != NULL && !entry->pollAccept;
+}
+
+static uint64_t userDataFor(int fd, const struct SelectorEntry* entry) {
+    return ((uint64_t)entry->generation << 32) | (uint32_t)fd;
+}
+
+/**
+ * The user data of the entry's io_uring poll request, which also tells multishot accepts apart.
+ */
+static uint64_t requestUserDataFor(int fd, const struct SelectorEntry* entry) {
+    return userDataFor(fd, entry) | (isMultishotAccept(entry) ? ACCEPT_USER_DATA : 0);
+}
+
+static uint64_t receiveUserDataFor(int fd, const struct SelectorEntry* entry) {
+    return ((uint64_t)entry->registration << 32) | RECEIVE_USER_DATA | (uint32_t)fd;
+}
+
+static uint64_t sendUserDataFor(int fd, const struct SelectorEntry* entry) {
+    return ((uint64_t)entry->sendingBuffer << 32) | SEND_USER_DATA | (uint32_t)fd;
+}
+
+/**
+ * Drops a reference to a buffer data was received into, providing it to the kernel again if it was the last one.
+ */
+static void releaseBuffer(struct Selector* selector, unsigned short id) {
+    if (--selector->bufferUsers[id] == 0)
+        uringRecycleBuffer(&selector->buffers, id);
+}
+
+/**
+ * Takes the given amount of bytes out of the data received ahead for the entry, releasing its buffer once it's all
+ * taken.
+ */
+static void consumeReceived(struct Selector* selector, struct SelectorEntry* entry, size_t length) {
+    entry->receivedOffset += length;
+    entry->receivedResult -= (int)length;
+    if (entry->receivedResult == 0) {
+        entry->received = 0;
+        releaseBuffer(selector, entry->receivedBuffer);
+    }
+}
+
+/**
+ * Discards whatever was received ahead for the entry and not taken yet.
+ */
+static void dropReceived(struct Selector* selector, struct SelectorEntry* entry) {
+    if (entry->received && entry->receivedResult > 0)
+        releaseBuffer(selector, entry->receivedBuffer);
+    entry->received = 0;
+}
+
+/**
+ * Queues a receive request for the entry, which picks one of the selector's buffers once there's data.
+ */
+static int armReceive(struct Selector* selector, int fd, struct SelectorEntry* entry) {
+    struct io_uring_sqe* sqe = uringGetSqe(&selector->ring);
+    if (sqe == NULL)
+        return -1;
+
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->len = entry->receiveLength;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = selector->buffers.group;
+    sqe->user_data = receiveUserDataFor(fd, entry);
+    entry->receiving = 1;
+    return 0;
+}
+
+/**
+ * Queues the cancellation of the io_uring request with the given user data.
+ */
+static int cancelRequest(struct Selector* selector, uint64_t userData) {
+    struct io_uring_sqe* sqe = uringGetSqe(&selector->ring);
+    if (sqe == NULL)
+        return -1;
+
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = userData;
+    sqe->user_data = IGNORED_USER_DATA;
+    return 0;
+}
+
+/**
+ * Queues the cancellation of the entry's poll request in flight. Its completion will carry the current generation,
+ * so the generation is incremented to have it discarded. Must be called before the entry's handlers are cleared.
+ */
+static int disarmEntry(struct Selector* selector, struct SelectorEntry* entry, int fd) {
+    // A no-op completes right away, so there's nothing to cancel.
+    if (!entry->armedNop) {
+        struct io_uring_sqe* sqe = uringGetSqe(&selector->ring);
+        if (sqe == NULL)
+            return -1;
+
+        sqe->opcode = isMultishotAccept(entry) ? IORING_OP_ASYNC_CANCEL : IORING_OP_POLL_REMOVE;
+        sqe->fd = -1;
+        sqe->addr = requestUserDataFor(fd, entry);
+        sqe->user_data = IGNORED_USER_DATA;
+    }
+
+    if (isMultishotAccept(entry)) {
+        entry->lateAcceptHandler = entry->acceptHandler;
+        entry->lateAcceptData = entry->data;
+        entry->lateAcceptGeneration = entry->generation;
+    }
+
+    entry->generation++;
+    entry->armed = 0;
+    entry->armedNop = 0;
+    return 0;
+}
+
+/**
+ * Queues the io_uring requests the entry needs and doesn't have in flight. Passive sockets get a multishot accept.
+ * Other sockets get a receive if the selector receives their data ahead and they're interested in EPOLLIN, and a poll
+ * for the rest of their interest events, or a no-op if data they're interested in was already received. Like with
+ * epoll, errors and hang ups are always reported, even if no events are requested. A poll for other events than
+ * the ones needed now is replaced. The requests are submitted with the next selectorSelect().
+ */
+static int armEntry(struct Selector* selector, int fd, struct SelectorEntry* entry) {
+    if (entry->acceptHandler == NULL) {
+        if (entry->receiveLength > 0 && (entry->events & EPOLLIN) && !entry->received && !entry->receiving && !entry->receiveStarved && armReceive(selector, fd, entry) != 0)
+            return -1;
+
+        // A receive in flight reports errors and EOF too, so it only needs a poll if there are other events.
+        int nop = entry->received && (entry->events & EPOLLIN);
+        uint32_t events = entry->receiving ? entry->events & ~EPOLLIN : entry->events;
+        int needed = nop || !entry->receiving || events != 0;
+        if (entry->armed && (!needed || entry->armedNop != nop || (!nop && entry->armedEvents != events)) && disarmEntry(selector, entry, fd) != 0)
+            return -1;
+        if (entry->armed || !needed)
+            return 0;
+
+        struct io_uring_sqe* sqe = uringGetSqe(&selector->ring);
+        if (sqe == NULL)
+            return -1;
+
+        if (nop) {
+            sqe->opcode = IORING_OP_NOP;
+        } else {
+            sqe->opcode = IORING_OP_POLL_ADD;
+            sqe->poll32_events = events;
+        }
+        sqe->fd = fd;
+        sqe->user_data = requestUserDataFor(fd, entry);
+        entry->armed = 1;
+        entry->armedNop = nop;
+        entry->armedEvents = events;
+        return 0;
+    }
+
+    if (entry->armed)
+        return 0;
+
+    struct io_uring_sqe* sqe = uringGetSqe(&selector->ring);
+    if (sqe == NULL)
+        return -1;
+
+    if (isMultishotAccept(entry)) {
+        sqe->opcode = IORING_OP_ACCEPT;
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+        sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    } else {
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->poll32_events = EPOLLIN;
+    }
+
+    sqe->fd = fd;
+    sqe->user_data = requestUserDataFor(fd, entry);
+    entry->armed = 1;
+    return 0;
+}
+
+/**
+ * Fills in a new entry in the table and registers the fd in epoll, or arms its first io_uring request.
+ */
+static int addEntry(struct Selector* selector, int fd, uint32_t events, size_t receiveLength, SelectorHandler handler, SelectorAcceptHandler acceptHandler, void* data) {
+    if (fd < 0 || fd > USER_DATA_FD_MASK || (handler == NULL && acceptHandler == NULL)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (ensureCapacity(selector, fd))
+        return -1;
+
+    struct SelectorEntry* entry = &selector->entries[fd];
+    if (entry->handler != NULL || entry->acceptHandler != NULL) {
+        errno = EEXIST;
+        return -1;
+    }
+
+    entry->generation++;
+    entry->registration++;
+    entry->handler = handler;
+    entry->acceptHandler = acceptHandler;
+    entry->data = data;
+    entry->events = events;
+    entry->armed = 0;
+    entry->armedNop = 0;
+    entry->dispatching = 0;
+    entry->pollAccept = 0;
+    entry->receiveLength = selectorCanReceiveAhead(selector) ? receiveLength : 0;
+    entry->receiving = 0;
+    entry->receiveStarved = 0;
+    entry->received = 0;
+    entry->sending = 0;
+
+    int result;
+    if (selector->backend == SELECTOR_BACKEND_IO_URING) {
+        result = armEntry(selector, fd, entry);
+    } else {
+        // We store both the fd and the generation of this registration in the event's data.
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = events;
+        ev.data.u64 = userDataFor(fd, entry);
+        result = epoll_ctl(selector->epollFd, EPOLL_CTL_ADD, fd, &ev);
+    }
+
+    if (result != 0) {
+        entry->handler = NULL;
+        entry->acceptHandler = NULL;
+        entry->data = NULL;
+        entry->events = 0;
+    }
+
+    return result;
+}
+
+int selectorAdd(struct Selector* selector, int fd, uint32_t events, SelectorHandler handler, void* data) {
+    if (handler == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return addEntry(selector, fd, events, 0, handler, NULL, data);
+}
+
+int selectorAddReceiver(struct Selector* selector, int fd, size_t length, SelectorHandler handler, void* data) {
+    if (handler == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return addEntry(selector, fd, EPOLLIN, length < SELECTOR_RECEIVE_BUFFER_SIZE ? length : SELECTOR_RECEIVE_BUFFER_SIZE, handler, NULL, data);
+}
+
+int selectorAddAcceptor(struct Selector* selector, int fd, SelectorAcceptHandler handler, void* data) {
+    if (handler == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return addEntry(selector, fd, EPOLLIN, 0, NULL, handler, data);
+}
+
+/**
+ * Returns the entry of a registered fd, or NULL if the fd isn't registered.
+ */
+static struct SelectorEntry* getEntry(struct Selector* selector, int fd) {
+    if (fd < 0 || fd >= selector->entriesLength)
+        return NULL;
+
+    struct SelectorEntry* entry = &selector->entries[fd];
+    return (entry->handler == NULL && entry->acceptHandler == NULL) ? NULL : entry;
+}
+
+int selectorSetEvents(struct Selector* selector, int fd, uint32_t events) {
+    struct SelectorEntry* entry = getEntry(selector, fd);
+    if (entry == NULL || entry->acceptHandler != NULL) {
+        errno = ENOENT;
+        return -1;
+    }
+
+    if (entry->events == events)
+        return 0;
+
+    if (selector->backend == SELECTOR_BACKEND_IO_URING) {
+        // If the entry's handler is running right now, its requests are armed for the new events once it returns.
+        // Otherwise we arm them (replacing the poll in flight, if it's for other events) right away.
+        entry->events = events;
+        return entry->dispatching ? 0 : armEntry(selector, fd, entry);
+    }
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.u64 = userDataFor(fd, entry);
+    if (epoll_ctl(selector->epollFd, EPOLL_CTL_MOD, fd, &ev) != 0)
+        return -1;
+
+    entry->events = events;
+    return 0;
+}
+
+int selectorRemove(struct Selector* selector, int fd) {
+    struct SelectorEntry* entry = getEntry(selector, fd);
+    if (entry == NULL) {
+        errno = ENOENT;
+        return -1;
+    }
+
+    int result;
+    if (selector->backend == SELECTOR_BACKEND_IO_URING) {
+        // The caller will likely close the fd right away. That's fine: the requests in flight hold their own
+        // reference to the file, and the cancellations release them once they're submitted. Data received after
+        // that is dropped when its completion comes.
+        if (entry->armed) {
+            result = disarmEntry(selector, entry, fd);
+        } else {
+            entry->generation++;
+            result = 0;
+        }
+        if (entry->receiving && cancelRequest(selector, receiveUserDataFor(fd, entry)) != 0)
+            result = -1;
+        if (entry->sending && cancelRequest(selector, sendUserDataFor(fd, entry)) != 0)
+            result = -1;
+        dropReceived(selector, entry);
+        entry->receiving = 0;
+        entry->sending = 0;
+        entry->receiveLength = 0;
+    } else {
+        result = epoll_ctl(selector->epollFd, EPOLL_CTL_DEL, fd, NULL);
+    }
+
+    entry->handler = NULL;
+    entry->acceptHandler = NULL;
+    entry->data = NULL;
+    entry->events = 0;
+    return result;
+}
+
+int selectorReceiveAhead(struct Selector* selector, int fd, size_t length) {
+    struct SelectorEntry* entry = getEntry(selector, fd);
+    if (entry == NULL || entry->acceptHandler != NULL) {
+        errno = ENOENT;
+        return -1;
+    }
+
+    if (!selectorCanReceiveAhead(selector))
+        return 0;
+
+    // A receive already in flight keeps going (and its data is still taken with selectorRecv()).
+    entry->receiveLength = length < SELECTOR_RECEIVE_BUFFER_SIZE ? length : SELECTOR_RECEIVE_BUFFER_SIZE;
+    if (!entry->dispatching && armEntry(selector, fd, entry) != 0)
+        return -1;
+    return length > 0;
+}
+
+ssize_t selectorRecv(struct Selector* selector, int fd, void* buffer, size_t length) {
+    struct SelectorEntry* entry = getEntry(selector, fd);
+    if (entry != NULL && entry->received) {
+        if (entry->receivedResult < 0) {
+            errno = -entry->receivedResult;
+            return -1;
+        }
+
+        // EOF stays there, so it's reported every time, like recv() does.
+        if (entry->receivedResult == 0)
+            return 0;
+
+        size_t taken = length < (size_t)entry->receivedResult ? length : (size_t)entry->receivedResult;
+        memcpy(buffer, uringGetBuffer(&selector->buffers, entry->receivedBuffer) + entry->receivedOffset, taken);
+        consumeReceived(selector, entry, taken);
+        return taken;
+    }
+
+    // Receiving now could take data that comes after what the receive in flight may already have. If there's none,
+    // one is armed as soon as the socket is interested in EPOLLIN, unless the last one found no buffer.
+    if (entry != NULL && (entry->receiving || (entry->receiveLength > 0 && !entry->receiveStarved))) {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    ssize_t received;
+    do {
+        received = recv(fd, buffer, length, MSG_DONTWAIT);
+    } while (received < 0 && errno == EINTR);
+    return received;
+}
+
+ssize_t selectorForward(struct Selector* selector, int fromFd, int toFd, size_t maxBytes, int receiveNext) {
+    struct SelectorEntry* from = getEntry(selector, fromFd);
+    struct SelectorEntry* to = getEntry(selector, toFd);
+    if (from == NULL || to == NULL || selector->backend != SELECTOR_BACKEND_IO_URING) {
+        errno = ENOENT;
+        return -1;
+    }
+
+    if (!from->received) {
+        errno = from->receiving ? EAGAIN : ENOBUFS;
+        return -1;
+    }
+    if (from->receivedResult < 0) {
+        errno = -from->receivedResult;
+        return -1;
+    }
+    if (from->receivedResult == 0)
+        return 0;
+    if (to->sending || maxBytes == 0) {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    // Linked requests must go in the same submission, so we make room for both.
+    size_t length = maxBytes < (size_t)from->receivedResult ? maxBytes : (size_t)from->receivedResult;
+    int linked = receiveNext && length == (size_t)from->receivedResult && from->receiveLength > 0 && !from->receiving;
+    if (uringReserveSqes(&selector->ring, linked ? 2 : 1) != 0)
+        return -1;
+
+    // With MSG_WAITALL, the kernel keeps sending until all the data was sent (or the socket failed), waiting for
+    // room in the socket's buffer as needed, so the send completes once and its buffer is done with.
+    struct io_uring_sqe* sqe = uringGetSqe(&selector->ring);
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = toFd;
+    sqe->addr = (unsigned long long)(uintptr_t)(uringGetBuffer(&selector->buffers, from->receivedBuffer) + from->receivedOffset);
+    sqe->len = length;
+    sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL;
+    to->sending = 1;
+    to->sendingBuffer = from->receivedBuffer;
+    to->sendingLength = length;
+    sqe->user_data = sendUserDataFor(toFd, to);
+    selector->bufferUsers[from->receivedBuffer]++;
+    consumeReceived(selector, from, length);
+
+    if (linked) {
+        sqe->flags = IOSQE_IO_LINK;
+        armReceive(selector, fromFd, from);
+    }
+
+    return length;
+}
+
+int selectorIsSending(struct Selector* selector, int fd) {
+    struct SelectorEntry* entry = getEntry(selector, fd);
+    return entry != NULL && entry->sending;
+}
+
+/**
+ * Accepts all the connections pending on a passive socket, calling the entry's handler with each of them. This is
+ * how passive sockets are handled when they're polled for readability instead of using multishot accept.
+ */
+static void acceptPending(struct Selector* selector, int fd) {
+    // The handler may register new fds, which can grow (and move) the table, so we look the entry up every time.
+    uint32_t generation = selector->entries[fd].generation;
+    struct SelectorEntry* entry;
+    while ((entry = getEntry(selector, fd)) != NULL && entry->acceptHandler != NULL && entry->generation == generation) {
+        int clientSocket = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (clientSocket < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            if (isAcceptResourceError(errno))
+                entry->acceptHandler(-1, entry->data);
+            return;
+        }
+
+        entry->acceptHandler(clientSocket, entry->data);
+    }
+}
+
+static int selectEpoll(struct Selector* selector, int timeoutMillis) {
+    int eventCount = epoll_wait(selector->epollFd, selector->events, MAX_EVENTS_PER_SELECT, timeoutMillis);
+    if (eventCount < 0)
+        return errno == EINTR ? 0 : -1;
+
+    for (int i = 0; i < eventCount; i++) {
+        int fd = (int)(selector->events[i].data.u64 & 0xFFFFFFFF);
+        uint32_t generation = (uint32_t)(selector->events[i].data.u64 >> 32);
+
+        // A handler called earlier in this same batch may have removed (or even closed and re-registered)
+        // this fd, in which case we discard the event.
+        struct SelectorEntry* entry = getEntry(selector, fd);
+        if (entry == NULL || entry->generation != generation)
+            continue;
+
+        if (entry->acceptHandler != NULL)
+            acceptPending(selector, fd);
+        else
+            entry->handler(fd, selector->events[i].events, entry->data);
+    }
+
+    return eventCount;
+}
+
+/**
+ * Arms whatever requests the entry needs once its handler returned, unless the handler removed (or even closed and
+ * re-registered) the fd. The handler may also have grown the table, so we look the entry up again.
+ */
+static void rearmEntry(struct Selector* selector, int fd, uint32_t registration) {
+    struct SelectorEntry* entry = getEntry(selector, fd);
+    if (entry != NULL && entry->registration == registration) {
+        entry->dispatching = 0;
+        armEntry(selector, fd, entry);
+    }
+}
+
+/**
+ * Calls the entry's handler with the given events (if any), then re-arms its requests.
+ */
+static void dispatch(struct Selector* selector, int fd, struct SelectorEntry* entry, uint32_t events) {
+    uint32_t registration = entry->registration;
+    if (events != 0) {
+        entry->dispatching = 1;
+        entry->handler(fd, events, entry->data);
+    }
+    rearmEntry(selector, fd, registration);
+}
+
+/**
+ * Handles the completion of an entry's poll (or accept) request, then re-arms the request if it's no longer in flight.
+ */
+static void handleCompletion(struct Selector* selector, int fd, struct SelectorEntry* entry, const struct io_uring_cqe* cqe) {
+    uint32_t registration = entry->registration;
+
+    // Multishot accept keeps going (and stays armed) for as long as the kernel sets IORING_CQE_F_MORE.
+    if (!(cqe->flags & IORING_CQE_F_MORE))
+        entry->armed = 0;
+
+    if (isMultishotAccept(entry)) {
+        if (cqe->res >= 0) {
+            entry->acceptHandler(cqe->res, entry->data);
+        } else if (cqe->res == -EINVAL) {
+            entry->pollAccept = 1; // Kernels before 5.19 don't support multishot accept.
+        } else if (isAcceptResourceError(-cqe->res)) {
+            // Re-arming right away would just fail again, so the handler gets to back off first.
+            errno = -cqe->res;
+            entry->acceptHandler(-1, entry->data);
+        }
+        rearmEntry(selector, fd, registration);
+    } else if (entry->acceptHandler != NULL) {
+        acceptPending(selector, fd);
+        rearmEntry(selector, fd, registration);
+    } else if (entry->armedNop) {
+        entry->armedNop = 0;
+        dispatch(selector, fd, entry, EPOLLIN);
+    } else {
+        // A poll completes with the ready events, or with a negative errno if it couldn't be armed. If the socket
+        // was polled because there was no buffer to receive into, the next time we try receiving again.
+        entry->receiveStarved = 0;
+        dispatch(selector, fd, entry, cqe->res >= 0 ? (uint32_t)cqe->res : EPOLLERR);
+    }
+}
+
+/**
+ * Handles the completion of an entry's receive request. The data is kept for the handler to take, which is called
+ * right away if the entry is interested in it, and errors are always reported.
+ */
+static void handleReceive(struct Selector* selector, int fd, struct SelectorEntry* entry, const struct io_uring_cqe* cqe) {
+    entry->receiving = 0;
+    if (cqe->res == -ECANCELED) {
+        // The send it was linked to failed, which the handler hears about from the send.
+        dispatch(selector, fd, entry, 0);
+        return;
+    }
+    if (cqe->res == -ENOBUFS) {
+        entry->receiveStarved = 1;
+        dispatch(selector, fd, entry, 0);
+        return;
+    }
+
+    // Only data holds on to its buffer. The kernel may hand one over along with EOF or an error too.
+    entry->received = 1;
+    entry->receivedResult = cqe->res;
+    entry->receivedOffset = 0;
+    if (cqe->flags & IORING_CQE_F_BUFFER) {
+        entry->receivedBuffer = (unsigned short)(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+        selector->bufferUsers[entry->receivedBuffer] = 1;
+        if (cqe->res <= 0)
+            releaseBuffer(selector, entry->receivedBuffer);
+    }
+
+    dispatch(selector, fd, entry, cqe->res < 0 ? EPOLLERR : entry->events & EPOLLIN);
+}
+
+/**
+ * Handles the completion of a send forwarded to an entry. With MSG_WAITALL, anything short of the whole data
+ * means the socket failed.
+ */
+static void handleSend(struct Selector* selector, int fd, struct SelectorEntry* entry, const struct io_uring_cqe* cqe) {
+    entry->sending = 0;
+    releaseBuffer(selector, entry->sendingBuffer);
+    dispatch(selector, fd, entry, cqe->res == (int)entry->sendingLength ? EPOLLOUT : EPOLLERR);
+}
+
+/**
+ * Hands a connection accepted by a cancelled multishot accept to the handler it was armed with, or closes it if
+ * that's not known anymore, so it's never leaked.
+ */
+static void handleLateAccept(struct Selector* selector, int fd, uint32_t generation, int clientSocket) {
+    struct SelectorEntry* entry = &selector->entries[fd];
+    if (entry->lateAcceptHandler != NULL && entry->lateAcceptGeneration == generation)
+        entry->lateAcceptHandler(clientSocket, entry->lateAcceptData);
+    else
+        close(clientSocket);
+}
+
+static int selectUring(struct Selector* selector, int timeoutMillis) {
+    // The requests queued since the last call are submitted in the same system call that waits for completions.
+    if (uringSubmitAndWait(&selector->ring, 1, timeoutMillis) != 0)
+        return errno == EINTR ? 0 : -1;
+
+    int eventCount = 0;
+    struct io_uring_cqe cqe;
+    while (uringNextCqe(&selector->ring, &cqe)) {
+        if (cqe.user_data == IGNORED_USER_DATA)
+            continue;
+
+        // Completions of requests cancelled when their fd was removed (or re-registered) are discarded, but the
+        // buffers they hold are given back, and connections accepted late are handed over.
+        int fd = (int)(cqe.user_data & USER_DATA_FD_MASK);
+        uint32_t tag = (uint32_t)(cqe.user_data >> 32);
+        uint64_t kind = cqe.user_data & USER_DATA_KIND_MASK;
+        struct SelectorEntry* entry = getEntry(selector, fd);
+        if (kind == RECEIVE_USER_DATA) {
+            if (entry == NULL || !entry->receiving || entry->registration != tag) {
+                if (cqe.flags & IORING_CQE_F_BUFFER)
+                    uringRecycleBuffer(&selector->buffers, (unsigned short)(cqe.flags >> IORING_CQE_BUFFER_SHIFT));
+                continue;
+            }
+            handleReceive(selector, fd, entry, &cqe);
+        } else if (kind == SEND_USER_DATA) {
+            if (entry == NULL || !entry->sending || entry->sendingBuffer != tag) {
+                releaseBuffer(selector, (unsigned short)tag);
+                continue;
+            }
+            handleSend(selector, fd, entry, &cqe);
+        } else {
+            if (entry == NULL || entry->generation != tag) {
+                if (kind == ACCEPT_USER_DATA && cqe.res >= 0)
+                    handleLateAccept(selector, fd, tag, cqe.res);
+                continue;
+            }
+            handleCompletion(selector, fd, entry, &cqe);
+        }
+        eventCount++;
+    }
+
+    return eventCount;
+}
+
+int selectorSelect(struct Selector* selector, int timeoutMillis) {
+    if (selector->backend == SELECTOR_BACKEND_IO_URING)
+        return selectUring(selector, timeoutMillis);
+    return selectEpoll(selector, timeoutMillis);
+}
@@ -0,0 +1,142 @@
+#ifndef _SELECTOR_H_
+#define _SELECTOR_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <sys/types.h>
+
+/**
+ * A selector is a small wrapper around epoll that lets us register a file descriptor together with a
+ * handler function, which gets called whenever that file descriptor becomes ready for the requested events.
+ * Each registered file descriptor is stored in a table indexed by its fd number.
+ *
+ * The selector can also run on io_uring instead of epoll. Each registered file descriptor then has a poll
+ * request in flight, which is re-armed after its handler runs (so events are level-triggered, just like with
+ * epoll), and all the poll requests queued while handling a batch of events are submitted together with the
+ * wait for the next batch, in a single system call. Passive sockets use multishot accept, so the kernel
+ * accepts connections and posts their sockets without any system call per connection.
+ *
+ * With io_uring, the selector can also receive a socket's data itself (see selectorReceiveAhead()): instead of a
+ * poll for readability, the socket has a receive request in flight, which picks one of the selector's provided
+ * buffers only once there's data for it. Its handler is then called with the data already received, which it takes
+ * with selectorRecv() without any system call, or forwards to another socket with selectorForward(), which sends it
+ * straight from the buffer it was received into.
+ */
+struct Selector;
+
+// The size of the buffers the selector receives data ahead into, the most it receives at a time.
+#define SELECTOR_RECEIVE_BUFFER_SIZE (16 * 1024)
+
+enum SelectorBackend {
+    SELECTOR_BACKEND_EPOLL,
+    SELECTOR_BACKEND_IO_URING
+};
+
+/**
+ * The type of function called when a registered file descriptor has events ready. The events parameter is
+ * a bitmask of EPOLLIN, EPOLLOUT, EPOLLERR, EPOLLHUP, etc.
+ */
+typedef void (*SelectorHandler)(int fd, uint32_t events, void* data);
+
+/**
+ * The type of function called with each connection accepted on a passive socket registered with
+ * selectorAddAcceptor(). The accepted socket is non-blocking and close-on-exec. If accepting failed because the
+ * process ran out of file descriptors or memory, it's called with -1 instead (and errno set): the connection stays
+ * in the kernel's queue, so the passive socket stays ready, and the handler should take it out of the selector
+ * for a while instead of having it accept (and fail) again right away.
+ */
+typedef void (*SelectorAcceptHandler)(int clientSocket, void* data);
+
+/**
+ * Creates a new selector using the given backend. If io_uring is requested but the kernel doesn't support
+ * everything we need, the selector falls back to epoll. Returns NULL if creating it failed.
+ */
+struct Selector* selectorCreate(enum SelectorBackend backend);
+
+/**
+ * Returns the backend the selector ended up using.
+ */
+enum SelectorBackend selectorGetBackend(const struct Selector* selector);
+
+/**
+ * Returns whether the selector can receive data ahead of its handlers (it runs on io_uring, and the kernel takes
+ * provided buffer rings).
+ */
+int selectorCanReceiveAhead(const struct Selector* selector);
+
+/**
+ * Destroys a selector, freeing up all its resources. The registered file descriptors are not closed.
+ */
+void selectorDestroy(struct Selector* selector);
+
+/**
+ * Registers a file descriptor in the selector, with the given interest events and handler. Returns 0 if
+ * successful, or -1 if an error occurred (errno is set).
+ */
+int selectorAdd(struct Selector* selector, int fd, uint32_t events, SelectorHandler handler, void* data);
+
+/**
+ * Registers a socket interested in EPOLLIN, whose data the selector receives ahead up to length bytes at a time if
+ * it can (see selectorReceiveAhead()). Returns 0 if successful, or -1 if an error occurred (errno is set).
+ */
+int selectorAddReceiver(struct Selector* selector, int fd, size_t length, SelectorHandler handler, void* data);
+
+/**
+ * Registers a passive socket in the selector. The handler is called with each accepted connection. Returns 0
+ * if successful, or -1 if an error occurred (errno is set).
+ */
+int selectorAddAcceptor(struct Selector* selector, int fd, SelectorAcceptHandler handler, void* data);
+
+/**
+ * Changes the interest events of an already registered file descriptor. If the events are the same as the
+ * ones already registered, no system call is made (and with io_uring, the change is only submitted with the
+ * next selectorSelect()). Returns 0 if successful, or -1 if an error occurred.
+ */
+int selectorSetEvents(struct Selector* selector, int fd, uint32_t events);
+
+/**
+ * Unregisters a file descriptor from the selector. Any events for this file descriptor still pending on
+ * the current selectorSelect() call will be discarded. Returns 0 if successful, or -1 if an error occurred.
+ */
+int selectorRemove(struct Selector* selector, int fd);
+
+/**
+ * Has the selector receive up to the given amount of bytes at a time from a registered socket while it's interested
+ * in EPOLLIN, ahead of calling its handler, or stop doing so if length is 0. The socket must then only be read from
+ * with selectorRecv() or selectorForward(). Returns 1 if the selector receives ahead, 0 if it doesn't (on epoll, or
+ * if the kernel doesn't support it), or -1 if an error occurred.
+ */
+int selectorReceiveAhead(struct Selector* selector, int fd, size_t length);
+
+/**
+ * Receives up to length bytes from a registered socket like a non-blocking recv(): it returns the amount of bytes
+ * received, 0 on EOF, or -1 with errno set (EAGAIN if there's nothing yet). Data the selector received ahead is taken
+ * first, without any system call, and while it has a receive in flight for the socket, nothing else is received.
+ */
+ssize_t selectorRecv(struct Selector* selector, int fd, void* buffer, size_t length);
+
+/**
+ * Sends up to maxBytes of the data the selector received ahead from fromFd to toFd, straight from the buffer it was
+ * received into, with io_uring. The send's completion calls toFd's handler with EPOLLOUT, or EPOLLERR if not all the
+ * data could be sent, and until then nothing else can be forwarded to toFd. If receiveNext is set and all the data
+ * received was forwarded, the next receive from fromFd is linked to the send, so it's only started once the send
+ * completed, without waiting for another turn of the event loop.
+ * Returns the amount of bytes forwarded, 0 on EOF, or -1 with errno set: EAGAIN if there's nothing to forward yet, or
+ * a send to toFd is still in flight, or ENOBUFS if the selector isn't receiving ahead from fromFd (for example because
+ * it ran out of buffers), in which case the data has to be read from the socket as usual.
+ */
+ssize_t selectorForward(struct Selector* selector, int fromFd, int toFd, size_t maxBytes, int receiveNext);
+
+/**
+ * Returns whether a send forwarded to the given socket is still in flight.
+ */
+int selectorIsSending(struct Selector* selector, int fd);
+
+/**
+ * Waits up to timeoutMillis milliseconds (or forever, if -1) for events and calls the handlers of the file
+ * descriptors that are ready. Returns the amount of events dispatched, or -1 if an error occurred.
+ */
+int selectorSelect(struct Selector* selector, int timeoutMillis);
+
+#endif
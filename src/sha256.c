@@ -0,0 +1,188 @@
+#include <string.h>
+
+#include "sha256.h"
+
+// The first 32 bits of the fractional parts of the cube roots of the first 64 primes (FIPS 180-4, 4.2.2).
+static const uint32_t roundConstants[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+static inline uint32_t rotateRight(uint32_t value, int bits) {
+    return (value >> bits) | (value << (32 - bits));
+}
+
+/**
+ * Runs the compression function over a 64 bytes block.
+ */
+static void processBlock(uint32_t state[8], const uint8_t block[SHA256_BLOCK_LENGTH]) {
+    uint32_t w[64];
+    for (int i = 0; i < 16; i++)
+        w[i] = ((uint32_t)block[i * 4] << 24) | ((uint32_t)block[i * 4 + 1] << 16) | ((uint32_t)block[i * 4 + 2] << 8) | block[i * 4 + 3];
+    for (int i = 16; i < 64; i++) {
+        uint32_t s0 = rotateRight(w[i - 15], 7) ^ rotateRight(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = rotateRight(w[i - 2], 17) ^ rotateRight(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+    uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+    for (int i = 0; i < 64; i++) {
+        uint32_t s1 = rotateRight(e, 6) ^ rotateRight(e, 11) ^ rotateRight(e, 25);
+        uint32_t choice = (e & f) ^ (~e & g);
+        uint32_t temp1 = h + s1 + choice + roundConstants[i] + w[i];
+        uint32_t s0 = rotateRight(a, 2) ^ rotateRight(a, 13) ^ rotateRight(a, 22);
+        uint32_t majority = (a & b) ^ (a & c) ^ (b & c);
+        uint32_t temp2 = s0 + majority;
+
+        h = g;
+        g = f;
+        f = e;
+        e = d + temp1;
+        d = c;
+        c = b;
+        b = a;
+        a = temp1 + temp2;
+    }
+
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+    state[5] += f;
+    state[6] += g;
+    state[7] += h;
+}
+
+void sha256Init(struct Sha256* sha) {
+    static const uint32_t initialState[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+    memcpy(sha->state, initialState, sizeof(initialState));
+    sha->totalLength = 0;
+    sha->blockLength = 0;
+}
+
+void sha256Update(struct Sha256* sha, const void* data, size_t length) {
+    const uint8_t* bytes = (const uint8_t*)data;
+    sha->totalLength += length;
+    if (length == 0)
+        return;
+
+    // Fill up the partial block left by the previous update, then process whole blocks straight from the data.
+    if (sha->blockLength > 0) {
+        size_t toCopy = SHA256_BLOCK_LENGTH - sha->blockLength;
+        if (toCopy > length)
+            toCopy = length;
+        memcpy(sha->block + sha->blockLength, bytes, toCopy);
+        sha->blockLength += toCopy;
+        bytes += toCopy;
+        length -= toCopy;
+
+        if (sha->blockLength < SHA256_BLOCK_LENGTH)
+            return;
+        processBlock(sha->state, sha->block);
+        sha->blockLength = 0;
+    }
+
+    while (length >= SHA256_BLOCK_LENGTH) {
+        processBlock(sha->state, bytes);
+        bytes += SHA256_BLOCK_LENGTH;
+        length -= SHA256_BLOCK_LENGTH;
+    }
+
+    memcpy(sha->block, bytes, length);
+    sha->blockLength = length;
+}
+
+void sha256Final(struct Sha256* sha, uint8_t digest[SHA256_DIGEST_LENGTH]) {
+    uint64_t bitLength = sha->totalLength * 8;
+
+    // Padding: a 1 bit, zeros up to 8 bytes before the end of a block, then the message length in bits.
+    sha->block[sha->blockLength++] = 0x80;
+    if (sha->blockLength > SHA256_BLOCK_LENGTH - 8) {
+        memset(sha->block + sha->blockLength, 0, SHA256_BLOCK_LENGTH - sha->blockLength);
+        processBlock(sha->state, sha->block);
+        sha->blockLength = 0;
+    }
+    memset(sha->block + sha->blockLength, 0, SHA256_BLOCK_LENGTH - 8 - sha->blockLength);
+    for (int i = 0; i < 8; i++)
+        sha->block[SHA256_BLOCK_LENGTH - 1 - i] = (uint8_t)(bitLength >> (i * 8));
+    processBlock(sha->state, sha->block);
+
+    for (int i = 0; i < 8; i++) {
+        digest[i * 4] = (uint8_t)(sha->state[i] >> 24);
+        digest[i * 4 + 1] = (uint8_t)(sha->state[i] >> 16);
+        digest[i * 4 + 2] = (uint8_t)(sha->state[i] >> 8);
+        digest[i * 4 + 3] = (uint8_t)sha->state[i];
+    }
+}
+
+void sha256(const void* data, size_t length, uint8_t digest[SHA256_DIGEST_LENGTH]) {
+    struct Sha256 sha;
+    sha256Init(&sha);
+    sha256Update(&sha, data, length);
+    sha256Final(&sha, digest);
+}
+
+/**
+ * The HMAC-SHA256 states after absorbing the key XORed with the inner and outer pads. Each HMAC of the same key
+ * starts from a copy of these, instead of hashing the padded key again.
+ */
+struct Hmac {
+    struct Sha256 inner;
+    struct Sha256 outer;
+};
+
+static void hmacInit(struct Hmac* hmac, const void* key, size_t keyLength) {
+    uint8_t block[SHA256_BLOCK_LENGTH];
+    memset(block, 0, sizeof(block));
+    if (keyLength > SHA256_BLOCK_LENGTH)
+        sha256(key, keyLength, block);
+    else
+        memcpy(block, key, keyLength);
+
+    uint8_t pad[SHA256_BLOCK_LENGTH];
+    for (int i = 0; i < SHA256_BLOCK_LENGTH; i++)
+        pad[i] = block[i] ^ 0x36;
+    sha256Init(&hmac->inner);
+    sha256Update(&hmac->inner, pad, sizeof(pad));
+
+    for (int i = 0; i < SHA256_BLOCK_LENGTH; i++)
+        pad[i] = block[i] ^ 0x5c;
+    sha256Init(&hmac->outer);
+    sha256Update(&hmac->outer, pad, sizeof(pad));
+}
+
+static void hmacCompute(const struct Hmac* hmac, const void* data1, size_t length1, const void* data2, size_t length2, uint8_t mac[SHA256_DIGEST_LENGTH]) {
+    struct Sha256 sha = hmac->inner;
+    sha256Update(&sha, data1, length1);
+    sha256Update(&sha, data2, length2);
+    uint8_t innerDigest[SHA256_DIGEST_LENGTH];
+    sha256Final(&sha, innerDigest);
+
+    sha = hmac->outer;
+    sha256Update(&sha, innerDigest, sizeof(innerDigest));
+    sha256Final(&sha, mac);
+}
+
+void sha256Pbkdf2(const void* password, size_t passwordLength, const void* salt, size_t saltLength, uint32_t iterations, uint8_t key[SHA256_DIGEST_LENGTH]) {
+    struct Hmac hmac;
+    hmacInit(&hmac, password, passwordLength);
+
+    // The key is a single block of output, so U1 = HMAC(password, salt || INT(1)), and each Ui is XORed into it.
+    static const uint8_t blockIndex[4] = {0, 0, 0, 1};
+    uint8_t u[SHA256_DIGEST_LENGTH];
+    hmacCompute(&hmac, salt, saltLength, blockIndex, sizeof(blockIndex), u);
+    memcpy(key, u, SHA256_DIGEST_LENGTH);
+
+    for (uint32_t i = 1; i < iterations; i++) {
+        hmacCompute(&hmac, u, sizeof(u), NULL, 0, u);
+        for (int j = 0; j < SHA256_DIGEST_LENGTH; j++)
+            key[j] ^= u[j];
+    }
+}
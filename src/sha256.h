@@ -0,0 +1,35 @@
+#ifndef _SHA256_H_
+#define _SHA256_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SHA256_DIGEST_LENGTH 32
+#define SHA256_BLOCK_LENGTH 64
+
+/**
+ * The state of a SHA-256 computation, for hashing data given in several pieces.
+ */
+struct Sha256 {
+    uint32_t state[8];
+    uint64_t totalLength;
+    uint8_t block[SHA256_BLOCK_LENGTH];
+    size_t blockLength;
+};
+
+void sha256Init(struct Sha256* sha);
+void sha256Update(struct Sha256* sha, const void* data, size_t length);
+void sha256Final(struct Sha256* sha, uint8_t digest[SHA256_DIGEST_LENGTH]);
+
+/**
+ * Hashes data given in a single piece.
+ */
+void sha256(const void* data, size_t length, uint8_t digest[SHA256_DIGEST_LENGTH]);
+
+/**
+ * Derives a SHA256_DIGEST_LENGTH bytes key from a password and a salt with PBKDF2-HMAC-SHA256 (RFC 8018), so
+ * guessing a password from its hash takes the given amount of iterations per guess.
+ */
+void sha256Pbkdf2(const void* password, size_t passwordLength, const void* salt, size_t saltLength, uint32_t iterations, uint8_t key[SHA256_DIGEST_LENGTH]);
+
+#endif
@@ -0,0 +1,357 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "logger.h"
+#include "shaper.h"
+#include "util.h"
+
+#define NANOS_PER_SECOND 1000000000ULL
+
+// The buckets of client prefixes and users are kept in a hash table with this many chains.
+#define SHAPER_TABLE_SIZE 4096
+
+// A key is a kind byte followed by an address family and address, or by a username.
+#define SHAPER_MAX_KEY_LENGTH 258
+#define SHAPER_KEY_CLIENT 'c'
+#define SHAPER_KEY_USER 'u'
+
+struct TokenBucket {
+    _Atomic int64_t tokens;
+
+    // The time up to which the tokens were added, in nanoseconds. Whoever manages to move it forward adds the
+    // tokens for that interval, so concurrent refills never add the same tokens twice.
+    _Atomic uint64_t refilledAt;
+
+    uint64_t rate;
+    int64_t burst;
+
+    // For the buckets in the table: the next bucket in the chain, and how many tunnels are using it. Both protected
+    // by the table's lock.
+    struct TokenBucket* next;
+    uint32_t references;
+    uint32_t keyLength;
+    uint8_t key[];
+};
+
+static struct {
+    int enabled;
+
+    struct TokenBucket* global;
+    uint64_t clientRate;
+    int clientPrefixLength;
+    int clientPrefixLength6;
+    uint64_t userRate;
+
+    pthread_mutex_t lock;
+    struct TokenBucket* table[SHAPER_TABLE_SIZE];
+} shaper = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+static struct TokenBucket* createBucket(uint64_t rate, const uint8_t* key, uint32_t keyLength) {
+    struct TokenBucket* bucket = malloc(sizeof(struct TokenBucket) + keyLength);
+    if (bucket == NULL)
+        return NULL;
+
+    // A tenth of a second worth of bytes, but never less than a read has to wait for.
+    bucket->rate = rate;
+    bucket->burst = rate / 10 < SHAPER_MIN_GRANT ? SHAPER_MIN_GRANT : (int64_t)(rate / 10);
+    atomic_init(&bucket->tokens, bucket->burst);
+    atomic_init(&bucket->refilledAt, getMonotonicNanos());
+    bucket->next = NULL;
+    bucket->references = 0;
+    bucket->keyLength = keyLength;
+    if (keyLength > 0)
+        memcpy(bucket->key, key, keyLength);
+    return bucket;
+}
+
+/**
+ * Adds the tokens earned since the bucket was last refilled, up to its burst.
+ */
+static void refill(struct TokenBucket* bucket, uint64_t now) {
+    uint64_t refilledAt = atomic_load_explicit(&bucket->refilledAt, memory_order_relaxed);
+    if (now <= refilledAt)
+        return;
+
+    // Only whole tokens are added, and the time is moved forward only as much as they're worth, so slow buckets
+    // refilled very often still get their fractions of a token.
+    uint64_t elapsed = now - refilledAt;
+    uint64_t fillTime = (uint64_t)bucket->burst * NANOS_PER_SECOND / bucket->rate;
+    uint64_t added, newRefilledAt;
+    if (elapsed >= fillTime) {
+        added = bucket->burst;
+        newRefilledAt = now;
+    } else {
+        added = elapsed * bucket->rate / NANOS_PER_SECOND;
+        if (added == 0)
+            return;
+        newRefilledAt = refilledAt + added * NANOS_PER_SECOND / bucket->rate;
+    }
+
+    if (!atomic_compare_exchange_strong(&bucket->refilledAt, &refilledAt, newRefilledAt))
+        return;
+
+    int64_t tokens = atomic_load_explicit(&bucket->tokens, memory_order_relaxed);
+    int64_t newTokens;
+    do {
+        newTokens = tokens + (int64_t)added > bucket->burst ? bucket->burst : tokens + (int64_t)added;
+    } while (!atomic_compare_exchange_weak(&bucket->tokens, &tokens, newTokens));
+}
+
+/**
+ * Finds the bucket with the given key in the table, creating it if there's none. On the way, unused buckets that
+ * are full are freed, since a new bucket would be the same. Must be called with the table's lock held.
+ */
+static struct TokenBucket* findBucket(uint64_t rate, const uint8_t* key, uint32_t keyLength) {
+    uint32_t hash = fnv1a(key, keyLength);
+    uint64_t now = getMonotonicNanos();
+    struct TokenBucket** link = &shaper.table[hash & (SHAPER_TABLE_SIZE - 1)];
+    while (*link != NULL) {
+        struct TokenBucket* bucket = *link;
+        if (bucket->keyLength == keyLength && memcmp(bucket->key, key, keyLength) == 0) {
+            bucket->references++;
+            return bucket;
+        }
+
+        if (bucket->references == 0) {
+            refill(bucket, now);
+            if (atomic_load(&bucket->tokens) >= bucket->burst) {
+                *link = bucket->next;
+                free(bucket);
+                continue;
+            }
+        }
+        link = &bucket->next;
+    }
+
+    struct TokenBucket* bucket = createBucket(rate, key, keyLength);
+    if (bucket == NULL) {
+        logError("Failed to allocate memory for a rate limit bucket");
+        return NULL;
+    }
+    bucket->references = 1;
+    *link = bucket;
+    return bucket;
+}
+
+/**
+ * Builds the key of a client's bucket: its address cut down to the configured prefix length. IPv4-mapped addresses
+ * are taken as IPv4. Returns the key's length.
+ */
+static uint32_t buildClientKey(const struct sockaddr* client, uint8_t* key) {
+    const uint8_t* address;
+    int length = sockAddrKeyBytes(client, &address);
+    int prefixLength = length == 4 ? shaper.clientPrefixLength : shaper.clientPrefixLength6;
+
+    key[0] = SHAPER_KEY_CLIENT;
+    key[1] = length;
+    for (int i = 0; i < length; i++) {
+        int bits = prefixLength - i * 8;
+        key[2 + i] = bits >= 8 ? address[i] : bits <= 0 ? 0 : address[i] & (uint8_t)(0xFF << (8 - bits));
+    }
+    return 2 + length;
+}
+
+int shaperInit(uint64_t globalRate, uint64_t clientRate, int clientPrefixLength, int clientPrefixLength6, uint64_t userRate) {
+    if (globalRate != 0) {
+        shaper.global = createBucket(globalRate, NULL, 0);
+        if (shaper.global == NULL) {
+            logError("Failed to allocate memory for the global rate limit");
+            return -1;
+        }
+    }
+
+    shaper.clientRate = clientRate;
+    shaper.clientPrefixLength = clientPrefixLength;
+    shaper.clientPrefixLength6 = clientPrefixLength6;
+    shaper.userRate = userRate;
+    shaper.enabled = globalRate != 0 || clientRate != 0 || userRate != 0;
+    return 0;
+}
+
+int shaperEnabled() {
+    return shaper.enabled;
+}
+
+void shaperAcquire(struct ShaperLimits* limits, const struct sockaddr* client, const char* username) {
+    limits->bucketCount = 0;
+    limits->emptyBucket = NULL;
+    if (!shaper.enabled)
+        return;
+
+    if (shaper.global != NULL)
+        limits->buckets[limits->bucketCount++] = shaper.global;
+
+    uint8_t key[SHAPER_MAX_KEY_LENGTH];
+    struct TokenBucket* bucket;
+    pthread_mutex_lock(&shaper.lock);
+
+    if (shaper.clientRate != 0 && (client->sa_family == AF_INET || client->sa_family == AF_INET6)) {
+        uint32_t keyLength = buildClientKey(client, key);
+        if ((bucket = findBucket(shaper.clientRate, key, keyLength)) != NULL)
+            limits->buckets[limits->bucketCount++] = bucket;
+    }
+
+    if (shaper.userRate != 0 && username != NULL) {
+        size_t usernameLength = strlen(username);
+        key[0] = SHAPER_KEY_USER;
+        memcpy(key + 1, username, usernameLength);
+        if ((bucket = findBucket(shaper.userRate, key, 1 + usernameLength)) != NULL)
+            limits->buckets[limits->bucketCount++] = bucket;
+    }
+
+    pthread_mutex_unlock(&shaper.lock);
+}
+
+void shaperRelease(struct ShaperLimits* limits) {
+    if (limits->bucketCount == 0)
+        return;
+
+    // The buckets stay in the table until they're full again (and otherwise unused), so a client can't get a fresh
+    // burst by opening a new tunnel.
+    pthread_mutex_lock(&shaper.lock);
+    for (int i = 0; i < limits->bucketCount; i++) {
+        if (limits->buckets[i] != shaper.global)
+            limits->buckets[i]->references--;
+    }
+    pthread_mutex_unlock(&shaper.lock);
+    limits->bucketCount = 0;
+}
+
+size_t shaperTake(struct ShaperLimits* limits) {
+    uint64_t now = getMonotonicNanos();
+    int64_t granted = SHAPER_QUANTUM;
+    for (int i = 0; i < limits->bucketCount; i++) {
+        struct TokenBucket* bucket = limits->buckets[i];
+        refill(bucket, now);
+        int64_t tokens = atomic_load_explicit(&bucket->tokens, memory_order_relaxed);
+        if (tokens < SHAPER_MIN_GRANT) {
+            limits->emptyBucket = bucket;
+            return 0;
+        }
+        if (tokens < granted)
+            granted = tokens;
+    }
+
+    // Other workers may take from the same buckets at the same time, so a bucket can end up in debt. It then just
+    // takes longer to have enough tokens again.
+    for (int i = 0; i < limits->bucketCount; i++)
+        atomic_fetch_sub_explicit(&limits->buckets[i]->tokens, granted, memory_order_relaxed);
+    return granted;
+}
+
+void shaperGiveBack(struct ShaperLimits* limits, size_t unused) {
+    if (unused == 0)
+        return;
+    for (int i = 0; i < limits->bucketCount; i++)
+        atomic_fetch_add_explicit(&limits->buckets[i]->tokens, (int64_t)unused, memory_order_relaxed);
+}
+
+static void listRemove(struct ShaperWaiter* waiter) {
+    waiter->previous->next = waiter->next;
+    waiter->next->previous = waiter->previous;
+    waiter->next = waiter->previous = waiter;
+}
+
+static void listAppend(struct ShaperWaiter* head, struct ShaperWaiter* waiter) {
+    waiter->previous = head->previous;
+    waiter->next = head;
+    head->previous->next = waiter;
+    head->previous = waiter;
+}
+
+/**
+ * Schedules the queue's timer for the given time (in nanoseconds), unless it's already going to expire before.
+ */
+static void armTimer(struct ShaperQueue* queue, uint64_t deadline) {
+    uint64_t deadlineMillis = (deadline + 999999) / 1000000;
+    if (queue->timer.scheduled && queue->timer.deadline <= deadlineMillis)
+        return;
+    timerScheduleAt(&queue->timer, deadlineMillis);
+}
+
+/**
+ * Resumes the waiting directions whose bucket should have enough tokens by now, in the order they started waiting.
+ */
+static void timerExpired(void* data) {
+    struct ShaperQueue* queue = (struct ShaperQueue*)data;
+
+    // Take the whole queue, so directions that have to wait again go to the back of the (now empty) queue and
+    // aren't resumed twice.
+    struct ShaperWaiter pending;
+    pending.next = pending.previous = &pending;
+    if (queue->waiters.next != &queue->waiters) {
+        pending.next = queue->waiters.next;
+        pending.previous = queue->waiters.previous;
+        pending.next->previous = &pending;
+        pending.previous->next = &pending;
+        queue->waiters.next = queue->waiters.previous = &queue->waiters;
+    }
+
+    uint64_t now = getMonotonicNanos();
+    uint64_t nextDeadline = UINT64_MAX;
+    while (pending.next != &pending) {
+        struct ShaperWaiter* waiter = pending.next;
+        listRemove(waiter);
+
+        // Once a direction waiting for a bucket has to wait again, the rest waiting for that bucket would too. They
+        // keep their place in the queue until the time the bucket is expected to be ready.
+        struct ShaperWaiter* queued = queue->waiters.previous;
+        for (int i = 0; queued != &queue->waiters && i < 8; i++, queued = queued->previous) {
+            if (queued->bucket == waiter->bucket && queued->resumeAt > waiter->resumeAt) {
+                waiter->resumeAt = queued->resumeAt;
+                break;
+            }
+        }
+
+        if (waiter->resumeAt > now) {
+            listAppend(&queue->waiters, waiter);
+            if (waiter->resumeAt < nextDeadline)
+                nextDeadline = waiter->resumeAt;
+            continue;
+        }
+
+        // The handler may close the connection, so the waiter can't be touched after calling it.
+        waiter->waiting = 0;
+        waiter->handler(waiter->fd, EPOLLIN, waiter->data);
+    }
+
+    if (nextDeadline != UINT64_MAX)
+        armTimer(queue, nextDeadline);
+}
+
+void shaperQueueInit(struct ShaperQueue* queue, struct TimerWheel* timers) {
+    timerInit(&queue->timer, timers, timerExpired, queue);
+    queue->waiters.next = queue->waiters.previous = &queue->waiters;
+}
+
+void shaperWaiterInit(struct ShaperWaiter* waiter, int fd, SelectorHandler handler, void* data) {
+    waiter->next = waiter->previous = waiter;
+    waiter->waiting = 0;
+    waiter->bucket = NULL;
+    waiter->resumeAt = 0;
+    waiter->fd = fd;
+    waiter->handler = handler;
+    waiter->data = data;
+}
+
+void shaperWait(struct ShaperQueue* queue, struct ShaperLimits* limits, struct ShaperWaiter* waiter) {
+    struct TokenBucket* bucket = limits->emptyBucket;
+    int64_t missing = SHAPER_MIN_GRANT - atomic_load_explicit(&bucket->tokens, memory_order_relaxed);
+    if (missing < 1)
+        missing = 1;
+
+    waiter->bucket = bucket;
+    waiter->resumeAt = getMonotonicNanos() + (uint64_t)missing * NANOS_PER_SECOND / bucket->rate + 1;
+    waiter->waiting = 1;
+    listAppend(&queue->waiters, waiter);
+    armTimer(queue, waiter->resumeAt);
+}
+
+void shaperCancel(struct ShaperWaiter* waiter) {
+    if (!waiter->waiting)
+        return;
+    listRemove(waiter);
+    waiter->waiting = 0;
+}
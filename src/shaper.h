@@ -0,0 +1,126 @@
+#ifndef _SHAPER_H_
+#define _SHAPER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+#include "selector.h"
+#include "timerwheel.h"
+
+/**
+ * The shaper limits the bandwidth of tunnels with token buckets. There can be a bucket shared by all tunnels, one
+ * per client prefix (every client address is cut down to a prefix of the configured length, so a client can't get
+ * around its limit by using many addresses of its network) and one per authenticated user. A bucket fills up at
+ * its rate, up to a burst of a tenth of a second worth of bytes, and each byte a tunnel reads (in either direction)
+ * takes a token from every bucket the tunnel is subject to. Buckets are shared by all the workers, so they're
+ * updated with atomic operations.
+ *
+ * When a bucket runs out of tokens, the direction that wanted to read stops reading (its socket is taken out of
+ * the selector's interest) and waits in its worker's queue until the bucket should have refilled, when a timer
+ * resumes it. Waiting directions are resumed in the order they started waiting, and each read takes at most
+ * SHAPER_QUANTUM bytes, so thousands of tunnels sharing a bucket take turns instead of the fastest one getting all
+ * its tokens. Tunnels that aren't subject to any limit never touch the shaper.
+ */
+
+// The most bytes a single read of a limited tunnel takes from its buckets, and the least it waits for.
+#define SHAPER_QUANTUM (16 * 1024)
+#define SHAPER_MIN_GRANT 4096
+
+// A tunnel is subject to at most the global bucket, its client prefix's bucket and its user's bucket.
+#define SHAPER_MAX_BUCKETS 3
+
+struct TokenBucket;
+
+/**
+ * The buckets a tunnel takes its tokens from.
+ */
+struct ShaperLimits {
+    struct TokenBucket* buckets[SHAPER_MAX_BUCKETS];
+    int bucketCount;
+
+    // The bucket that didn't have enough tokens the last time shaperTake() returned 0.
+    struct TokenBucket* emptyBucket;
+};
+
+/**
+ * A direction of a tunnel waiting for tokens. When it's resumed, its handler is called for its socket as if the
+ * socket had become readable.
+ */
+struct ShaperWaiter {
+    struct ShaperWaiter* next;
+    struct ShaperWaiter* previous;
+    int waiting;
+
+    // The bucket it's waiting for, and when that bucket should have enough tokens (in nanoseconds).
+    struct TokenBucket* bucket;
+    uint64_t resumeAt;
+
+    int fd;
+    SelectorHandler handler;
+    void* data;
+};
+
+/**
+ * Each worker's queue of waiting directions, and the timer that resumes them.
+ */
+struct ShaperQueue {
+    struct Timer timer;
+    struct ShaperWaiter waiters;
+};
+
+/**
+ * Sets up the limits, in bytes per second (0 meaning no limit). Client addresses are grouped by prefixes of the
+ * given lengths for each family. Returns 0 if successful, or -1 if an error occurred.
+ */
+int shaperInit(uint64_t globalRate, uint64_t clientRate, int clientPrefixLength, int clientPrefixLength6, uint64_t userRate);
+
+/**
+ * Whether any limit was set up.
+ */
+int shaperEnabled();
+
+/**
+ * Initializes a worker's queue, whose timer is on the given wheel.
+ */
+void shaperQueueInit(struct ShaperQueue* queue, struct TimerWheel* timers);
+
+/**
+ * Initializes a waiter for the given socket, whose handler will be called when it's resumed.
+ */
+void shaperWaiterInit(struct ShaperWaiter* waiter, int fd, SelectorHandler handler, void* data);
+
+/**
+ * Finds (or creates) the buckets a tunnel from the given client, authenticated as the given user (or NULL), is
+ * subject to. If there's not enough memory for a bucket, the tunnel just isn't subject to it.
+ */
+void shaperAcquire(struct ShaperLimits* limits, const struct sockaddr* client, const char* username);
+
+/**
+ * Lets go of the buckets taken with shaperAcquire().
+ */
+void shaperRelease(struct ShaperLimits* limits);
+
+/**
+ * Takes up to SHAPER_QUANTUM tokens from each of the buckets, as many as the emptiest of them has. Returns the
+ * amount taken, or 0 if one of them has less than SHAPER_MIN_GRANT tokens, in which case the direction must wait.
+ */
+size_t shaperTake(struct ShaperLimits* limits);
+
+/**
+ * Gives back the tokens taken with shaperTake() that weren't used.
+ */
+void shaperGiveBack(struct ShaperLimits* limits, size_t unused);
+
+/**
+ * Makes a direction wait in the queue until the bucket that ran out of tokens in the last shaperTake() should have
+ * enough of them again.
+ */
+void shaperWait(struct ShaperQueue* queue, struct ShaperLimits* limits, struct ShaperWaiter* waiter);
+
+/**
+ * Takes a direction out of the queue, if it's waiting.
+ */
+void shaperCancel(struct ShaperWaiter* waiter);
+
+#endif
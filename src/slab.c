@@ -0,0 +1,85 @@
+#include <stdalign.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "slab.h"
+
+struct SlabChunk {
+    struct SlabChunk* next;
+
+    // The objects, each of the slab's object size rounded up so they're all aligned like anything malloc() returns.
+    alignas(max_align_t) unsigned char objects[];
+};
+
+/**
+ * Returns the room each object takes in a chunk.
+ */
+static size_t slotSize(const struct Slab* slab) {
+    return (slab->objectSize + alignof(max_align_t) - 1) & ~(alignof(max_align_t) - 1);
+}
+
+/**
+ * Allocates another chunk, putting all of its objects on the free list. Returns 0 if successful, or -1 if there's
+ * not enough memory.
+ */
+static int addChunk(struct Slab* slab) {
+    size_t size = slotSize(slab);
+    struct SlabChunk* chunk = malloc(sizeof(struct SlabChunk) + size * slab->objectsPerChunk);
+    if (chunk == NULL)
+        return -1;
+
+    chunk->next = slab->chunks;
+    slab->chunks = chunk;
+
+    // The objects go on the free list last to first, so they're handed out in the order they are in the chunk.
+    for (int i = slab->objectsPerChunk - 1; i >= 0; i--) {
+        void* object = chunk->objects + i * size;
+        *(void**)object = slab->freeList;
+        slab->freeList = object;
+    }
+
+    slab->capacity += slab->objectsPerChunk;
+    return 0;
+}
+
+int slabInit(struct Slab* slab, size_t objectSize, int objectsPerChunk) {
+    slab->objectSize = objectSize < sizeof(void*) ? sizeof(void*) : objectSize;
+    slab->objectsPerChunk = objectsPerChunk;
+    slab->freeList = NULL;
+    slab->chunks = NULL;
+    slab->used = 0;
+    slab->capacity = 0;
+    return addChunk(slab);
+}
+
+void slabDestroy(struct Slab* slab) {
+    while (slab->chunks != NULL) {
+        struct SlabChunk* next = slab->chunks->next;
+        free(slab->chunks);
+        slab->chunks = next;
+    }
+
+    slab->freeList = NULL;
+    slab->used = 0;
+    slab->capacity = 0;
+}
+
+void* slabAlloc(struct Slab* slab) {
+    if (slab->freeList == NULL && addChunk(slab) != 0)
+        return NULL;
+
+    void* object = slab->freeList;
+    slab->freeList = *(void**)object;
+    slab->used++;
+    memset(object, 0, slab->objectSize);
+    return object;
+}
+
+void slabFree(struct Slab* slab, void* object) {
+    if (object == NULL)
+        return;
+
+    *(void**)object = slab->freeList;
+    slab->freeList = object;
+    slab->used--;
+}
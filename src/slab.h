@@ -0,0 +1,53 @@
+#ifndef _SLAB_H_
+#define _SLAB_H_
+
+#include <stddef.h>
+
+/**
+ * A slab hands out objects of a single size, carved out of chunks holding many of them at once. Freed objects go
+ * on a free list and are handed out again before anything else, so once a worker had as many connections open as
+ * it will usually have, opening and closing connections never goes to malloc(). A slab grows by a whole chunk when
+ * its free list runs out, and keeps its chunks until it's destroyed.
+ *
+ * Each worker has its own slabs, so they take no locks.
+ */
+
+struct SlabChunk;
+
+struct Slab {
+    size_t objectSize;
+    int objectsPerChunk;
+
+    // The objects that are free to hand out, linked through their first bytes.
+    void* freeList;
+
+    // Every chunk the slab allocated, to free them when it's destroyed.
+    struct SlabChunk* chunks;
+
+    // How many objects are handed out right now, and how many there are in all the chunks.
+    int used;
+    int capacity;
+};
+
+/**
+ * Initializes a slab of objects of the given size, allocating its first chunk right away. Returns 0 if successful,
+ * or -1 if there's not enough memory.
+ */
+int slabInit(struct Slab* slab, size_t objectSize, int objectsPerChunk);
+
+/**
+ * Frees all of the slab's chunks. Objects still handed out can't be used anymore.
+ */
+void slabDestroy(struct Slab* slab);
+
+/**
+ * Hands out a zeroed object, or returns NULL if the slab needed another chunk and there's not enough memory for it.
+ */
+void* slabAlloc(struct Slab* slab);
+
+/**
+ * Takes back an object handed out by the same slab. Does nothing if it's NULL.
+ */
+void slabFree(struct Slab* slab, void* object);
+
+#endif
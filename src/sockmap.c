@@ -0,0 +1,276 @@
+#include <errno.h>
+#include <linux/bpf.h>
+#include <linux/sockios.h>
+#include <netinet/in.h>
+#include <linux/tcp.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "logger.h"
+#include "sockmap.h"
+
+/**
+ * There are two socket maps. Every socket of a tunnel is first put in the targets map, which has no program and is
+ * only where the verdict program finds the sockets to redirect to, and then in the sources map, which has the verdict
+ * program attached. This way a socket's data is never redirected to a socket that isn't in a map yet (which would
+ * drop it), and a socket's data is left alone until it's in the sources map.
+ *
+ * The peers map has an entry for each socket in the maps, with the other socket's cookie and the amount of bytes
+ * redirected from it.
+ */
+struct PeerEntry {
+    uint64_t peerCookie;
+    uint64_t redirected;
+};
+
+static int targetsMap = -1;
+static int sourcesMap = -1;
+static int peersMap = -1;
+static int verdictProgram = -1;
+
+static long bpfCall(int command, union bpf_attr* attr) {
+    return syscall(SYS_bpf, command, attr, sizeof(*attr));
+}
+
+static int createMap(enum bpf_map_type type, uint32_t valueSize, uint32_t maxEntries) {
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.map_type = type;
+    attr.key_size = sizeof(uint64_t);
+    attr.value_size = valueSize;
+    attr.max_entries = maxEntries;
+    return bpfCall(BPF_MAP_CREATE, &attr);
+}
+
+static int updateElement(int map, const void* key, const void* value) {
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.map_fd = map;
+    attr.key = (uint64_t)(uintptr_t)key;
+    attr.value = (uint64_t)(uintptr_t)value;
+    attr.flags = BPF_ANY;
+    return bpfCall(BPF_MAP_UPDATE_ELEM, &attr);
+}
+
+static int lookupElement(int map, const void* key, void* value) {
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.map_fd = map;
+    attr.key = (uint64_t)(uintptr_t)key;
+    attr.value = (uint64_t)(uintptr_t)value;
+    return bpfCall(BPF_MAP_LOOKUP_ELEM, &attr);
+}
+
+static void deleteElement(int map, const void* key) {
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.map_fd = map;
+    attr.key = (uint64_t)(uintptr_t)key;
+    bpfCall(BPF_MAP_DELETE_ELEM, &attr);
+}
+
+#define INSN(opcode, dst, src, offset, immediate) ((struct bpf_insn){.code = (opcode), .dst_reg = (dst), .src_reg = (src), .off = (offset), .imm = (immediate)})
+
+/**
+ * Loads the verdict program, which does this for every segment a socket in the sources map receives:
+ *
+ *     if (skb->len == 0)
+ *         return SK_DROP;
+ *     struct PeerEntry* peer = bpf_map_lookup_elem(&peersMap, bpf_get_socket_cookie(skb));
+ *     if (peer == NULL)
+ *         return SK_PASS;
+ *     __sync_fetch_and_add(&peer->redirected, skb->len);
+ *     return bpf_sk_redirect_hash(skb, &targetsMap, &peer->peerCookie, 0);
+ *
+ * A segment with nothing but a FIN comes through empty, and sending an empty segment on the other side would be taken
+ * as a failure to send, so those are dropped (the socket took note of the FIN already).
+ */
+static int loadVerdictProgram() {
+    struct bpf_insn program[] = {
+        INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_6, BPF_REG_1, 0, 0),
+        INSN(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_7, BPF_REG_6, offsetof(struct __sk_buff, len), 0),
+        // If it's empty, jump to the last two instructions.
+        INSN(BPF_JMP | BPF_JEQ | BPF_K, BPF_REG_7, 0, 21, 0),
+        INSN(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_get_socket_cookie),
+        INSN(BPF_STX | BPF_MEM | BPF_DW, BPF_REG_10, BPF_REG_0, -8, 0),
+        INSN(BPF_LD | BPF_IMM | BPF_DW, BPF_REG_1, BPF_PSEUDO_MAP_FD, 0, peersMap),
+        INSN(0, 0, 0, 0, 0),
+        INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_2, BPF_REG_10, 0, 0),
+        INSN(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_2, 0, 0, -8),
+        INSN(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_map_lookup_elem),
+        // If there's no entry, jump to the two instructions before the last two.
+        INSN(BPF_JMP | BPF_JEQ | BPF_K, BPF_REG_0, 0, 11, 0),
+        INSN(BPF_STX | BPF_ATOMIC | BPF_DW, BPF_REG_0, BPF_REG_7, offsetof(struct PeerEntry, redirected), BPF_ADD),
+        INSN(BPF_LDX | BPF_MEM | BPF_DW, BPF_REG_1, BPF_REG_0, offsetof(struct PeerEntry, peerCookie), 0),
+        INSN(BPF_STX | BPF_MEM | BPF_DW, BPF_REG_10, BPF_REG_1, -16, 0),
+        INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_1, BPF_REG_6, 0, 0),
+        INSN(BPF_LD | BPF_IMM | BPF_DW, BPF_REG_2, BPF_PSEUDO_MAP_FD, 0, targetsMap),
+        INSN(0, 0, 0, 0, 0),
+        INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_3, BPF_REG_10, 0, 0),
+        INSN(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_3, 0, 0, -16),
+        INSN(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_4, 0, 0, 0),
+        INSN(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_sk_redirect_hash),
+        INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+        INSN(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_0, 0, 0, SK_PASS),
+        INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+        INSN(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_0, 0, 0, SK_DROP),
+        INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+    };
+
+    char verifierLog[4096] = "";
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.prog_type = BPF_PROG_TYPE_SK_SKB;
+    attr.insns = (uint64_t)(uintptr_t)program;
+    attr.insn_cnt = sizeof(program) / sizeof(program[0]);
+    attr.license = (uint64_t)(uintptr_t) "MIT";
+    attr.log_buf = (uint64_t)(uintptr_t)verifierLog;
+    attr.log_size = sizeof(verifierLog);
+    attr.log_level = 1;
+
+    int fd = bpfCall(BPF_PROG_LOAD, &attr);
+    if (fd < 0) {
+        int error = errno;
+        logDebug("BPF verifier log: %s", verifierLog);
+        errno = error;
+    }
+    return fd;
+}
+
+static int attachVerdictProgram() {
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.target_fd = sourcesMap;
+    attr.attach_bpf_fd = verdictProgram;
+    attr.attach_type = BPF_SK_SKB_VERDICT;
+    if (bpfCall(BPF_PROG_ATTACH, &attr) == 0)
+        return 0;
+
+    // Kernels before 5.13 only have the stream verdict, which works the same way without a stream parser.
+    attr.attach_type = BPF_SK_SKB_STREAM_VERDICT;
+    return bpfCall(BPF_PROG_ATTACH, &attr);
+}
+
+int sockmapInit() {
+    const char* failed;
+    if ((targetsMap = createMap(BPF_MAP_TYPE_SOCKHASH, sizeof(uint32_t), SOCKMAP_MAX_TUNNELS * 2)) < 0)
+        failed = "create the targets map";
+    else if ((sourcesMap = createMap(BPF_MAP_TYPE_SOCKHASH, sizeof(uint32_t), SOCKMAP_MAX_TUNNELS * 2)) < 0)
+        failed = "create the sources map";
+    else if ((peersMap = createMap(BPF_MAP_TYPE_HASH, sizeof(struct PeerEntry), SOCKMAP_MAX_TUNNELS * 2)) < 0)
+        failed = "create the peers map";
+    else if ((verdictProgram = loadVerdictProgram()) < 0)
+        failed = "load the verdict program";
+    else if (attachVerdictProgram() != 0)
+        failed = "attach the verdict program";
+    else
+        return 0;
+
+    logWarn("Failed to %s for sockmap relaying (%s), tunnels will be relayed in user space", failed, strerror(errno));
+    int fds[] = {verdictProgram, peersMap, sourcesMap, targetsMap};
+    for (size_t i = 0; i < sizeof(fds) / sizeof(fds[0]); i++) {
+        if (fds[i] >= 0)
+            close(fds[i]);
+    }
+    targetsMap = sourcesMap = peersMap = verdictProgram = -1;
+    return -1;
+}
+
+int sockmapEnabled() {
+    return verdictProgram >= 0;
+}
+
+/**
+ * Returns how many bytes the socket was given to send since it connected: those it sent and were acknowledged, plus
+ * those still in its send queue.
+ */
+static int getQueuedBytes(int fd, uint64_t* queued) {
+    struct tcp_info info;
+    socklen_t infoLength = sizeof(info);
+    int outq;
+    if (getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &infoLength) != 0 || ioctl(fd, SIOCOUTQ, &outq) != 0)
+        return -1;
+    *queued = info.tcpi_bytes_acked + outq;
+    return 0;
+}
+
+int sockmapAttach(struct SockmapTunnel* tunnel, int clientSocket, int remoteSocket) {
+    memset(tunnel, 0, sizeof(*tunnel));
+    tunnel->clientSocket = clientSocket;
+    tunnel->remoteSocket = remoteSocket;
+
+    socklen_t cookieLength = sizeof(uint64_t);
+    if (getsockopt(clientSocket, SOL_SOCKET, SO_COOKIE, &tunnel->clientCookie, &cookieLength) != 0 || getsockopt(remoteSocket, SOL_SOCKET, SO_COOKIE, &tunnel->remoteCookie, &cookieLength) != 0)
+        return -1;
+    if (getQueuedBytes(clientSocket, &tunnel->clientQueuedBefore) != 0 || getQueuedBytes(remoteSocket, &tunnel->remoteQueuedBefore) != 0)
+        return -1;
+
+    struct PeerEntry clientPeer = {.peerCookie = tunnel->remoteCookie, .redirected = 0};
+    struct PeerEntry remotePeer = {.peerCookie = tunnel->clientCookie, .redirected = 0};
+    if (updateElement(peersMap, &tunnel->clientCookie, &clientPeer) != 0 || updateElement(peersMap, &tunnel->remoteCookie, &remotePeer) != 0) {
+        logErrno(LOG_LEVEL_DEBUG, "Failed to add a tunnel to the peers map");
+        sockmapDetach(tunnel);
+        return -1;
+    }
+
+    uint32_t clientFd = clientSocket;
+    uint32_t remoteFd = remoteSocket;
+    if (updateElement(targetsMap, &tunnel->clientCookie, &clientFd) != 0 || updateElement(targetsMap, &tunnel->remoteCookie, &remoteFd) != 0) {
+        logErrno(LOG_LEVEL_DEBUG, "Failed to add a tunnel to the targets map");
+        sockmapDetach(tunnel);
+        return -1;
+    }
+
+    // Once a socket is in the sources map the data it receives is redirected, so this is where the kernel takes over.
+    if (updateElement(sourcesMap, &tunnel->clientCookie, &clientFd) != 0) {
+        logErrno(LOG_LEVEL_DEBUG, "Failed to add a tunnel to the sources map");
+        sockmapDetach(tunnel);
+        return -1;
+    }
+    if (updateElement(sourcesMap, &tunnel->remoteCookie, &remoteFd) != 0) {
+        logErrno(LOG_LEVEL_WARN, "Failed to add a tunnel's remote socket to the sources map");
+
+        // If the client's data was redirected already, it's in the remote socket's queue ahead of anything user space
+        // would send, so the tunnel can't go on.
+        deleteElement(sourcesMap, &tunnel->clientCookie);
+        uint64_t clientToRemote, remoteToClient;
+        sockmapRedirected(tunnel, &clientToRemote, &remoteToClient);
+        sockmapDetach(tunnel);
+        return clientToRemote == 0 ? -1 : -2;
+    }
+
+    // The verdict program only runs when data arrives, so whatever a socket received before it was in the sources
+    // map (and we didn't read) would wait for more data to arrive. Setting SO_RCVLOWAT has TCP tell the socket that
+    // it has data, which runs the program over it right away.
+    int one = 1;
+    setsockopt(clientSocket, SOL_SOCKET, SO_RCVLOWAT, &one, sizeof(one));
+    setsockopt(remoteSocket, SOL_SOCKET, SO_RCVLOWAT, &one, sizeof(one));
+    return 0;
+}
+
+void sockmapDetach(struct SockmapTunnel* tunnel) {
+    deleteElement(sourcesMap, &tunnel->clientCookie);
+    deleteElement(sourcesMap, &tunnel->remoteCookie);
+    deleteElement(targetsMap, &tunnel->clientCookie);
+    deleteElement(targetsMap, &tunnel->remoteCookie);
+    deleteElement(peersMap, &tunnel->clientCookie);
+    deleteElement(peersMap, &tunnel->remoteCookie);
+}
+
+void sockmapRedirected(const struct SockmapTunnel* tunnel, uint64_t* clientToRemote, uint64_t* remoteToClient) {
+    struct PeerEntry entry;
+    *clientToRemote = lookupElement(peersMap, &tunnel->clientCookie, &entry) == 0 ? entry.redirected : 0;
+    *remoteToClient = lookupElement(peersMap, &tunnel->remoteCookie, &entry) == 0 ? entry.redirected : 0;
+}
+
+int sockmapDrained(const struct SockmapTunnel* tunnel, int toClient) {
+    uint64_t clientToRemote, remoteToClient, queued;
+    sockmapRedirected(tunnel, &clientToRemote, &remoteToClient);
+    if (toClient)
+        return getQueuedBytes(tunnel->clientSocket, &queued) == 0 && queued - tunnel->clientQueuedBefore >= remoteToClient;
+    return getQueuedBytes(tunnel->remoteSocket, &queued) == 0 && queued - tunnel->remoteQueuedBefore >= clientToRemote;
+}
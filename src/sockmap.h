@@ -0,0 +1,73 @@
+#ifndef _SOCKMAP_H_
+#define _SOCKMAP_H_
+
+#include <stdint.h>
+
+/**
+ * In sockmap relay mode, established tunnels are relayed entirely inside the kernel. Both of a tunnel's sockets are
+ * put in a BPF socket map (a BPF_MAP_TYPE_SOCKHASH, keyed by each socket's cookie), and a small sk_skb verdict
+ * program attached to the map looks up the other socket of the tunnel for every segment a socket receives and
+ * redirects it there to be sent. The program counts the bytes it redirects for each socket, so we can still account
+ * for them, and tell when a direction is done.
+ *
+ * User space only watches the sockets for EOF: once a socket reached EOF and everything it received was queued in
+ * the other socket, the other socket is shutdown() for writing, as when relaying in user space.
+ *
+ * The program is assembled by hand and loaded with the bpf() syscall, so there's nothing to build or link against.
+ * Loading it takes CAP_BPF and CAP_NET_ADMIN (or root); if that fails, tunnels are relayed in user space.
+ */
+
+// The most tunnels that can be relayed in the kernel at the same time. Tunnels after that are relayed in user space.
+#define SOCKMAP_MAX_TUNNELS (64 * 1024)
+
+/**
+ * A tunnel relayed in the kernel.
+ */
+struct SockmapTunnel {
+    int clientSocket;
+    int remoteSocket;
+    uint64_t clientCookie;
+    uint64_t remoteCookie;
+
+    // How many bytes each socket had been given to send before the tunnel was put in the map.
+    uint64_t clientQueuedBefore;
+    uint64_t remoteQueuedBefore;
+};
+
+/**
+ * Creates the maps and loads the verdict program. Returns 0 if successful, or -1 if BPF isn't available (in which
+ * case tunnels are relayed in user space).
+ */
+int sockmapInit();
+
+/**
+ * Whether tunnels can be relayed in the kernel.
+ */
+int sockmapEnabled();
+
+/**
+ * Puts a tunnel's sockets in the map, so the kernel relays from then on, starting with whatever the sockets received
+ * and wasn't read yet. Nothing must be waiting in user space to be sent through them. Returns 0 if successful, -1 if the tunnel
+ * must keep being relayed in user space (in which case it was left untouched), or -2 if the tunnel failed halfway and
+ * must be closed.
+ */
+int sockmapAttach(struct SockmapTunnel* tunnel, int clientSocket, int remoteSocket);
+
+/**
+ * Takes a tunnel's sockets out of the map. The sockets are left open.
+ */
+void sockmapDetach(struct SockmapTunnel* tunnel);
+
+/**
+ * Gets how many bytes the kernel redirected in each direction since the tunnel was put in the map.
+ */
+void sockmapRedirected(const struct SockmapTunnel* tunnel, uint64_t* clientToRemote, uint64_t* remoteToClient);
+
+/**
+ * Returns whether every byte redirected towards the given socket of the tunnel (the client's or the remote's) was
+ * queued in it to be sent, so the socket can be shutdown() for writing without losing any. Bytes are redirected to a
+ * socket asynchronously, so this is not true right after the other socket reached EOF.
+ */
+int sockmapDrained(const struct SockmapTunnel* tunnel, int toClient);
+
+#endif
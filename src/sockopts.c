@@ -0,0 +1,55 @@
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include "logger.h"
+#include "sockopts.h"
+
+/**
+ * Sets an integer option, logging it if it fails. Returns 0 if successful, or -1 if it failed.
+ */
+static int setOption(int fd, int level, int name, int value, const char* optionName) {
+    if (setsockopt(fd, level, name, &value, sizeof(value)) == 0)
+        return 0;
+
+    int error = errno;
+    logDebug("Failed to set %s: %s", optionName, strerror(error));
+    errno = error;
+    return -1;
+}
+
+int socketOptionsApply(int fd, const struct SocketOptions* options, int passive) {
+    int result = 0;
+    if (options->noDelay)
+        result |= setOption(fd, IPPROTO_TCP, TCP_NODELAY, 1, "TCP_NODELAY");
+
+    // The buffer sizes must be set before listening or connecting, since they decide the window scale.
+    if (options->receiveBuffer > 0)
+        result |= setOption(fd, SOL_SOCKET, SO_RCVBUF, options->receiveBuffer, "SO_RCVBUF");
+    if (options->sendBuffer > 0)
+        result |= setOption(fd, SOL_SOCKET, SO_SNDBUF, options->sendBuffer, "SO_SNDBUF");
+
+    if (options->notSentLowat > 0)
+        result |= setOption(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, options->notSentLowat, "TCP_NOTSENT_LOWAT");
+
+    if (options->keepAliveIdle > 0) {
+        result |= setOption(fd, SOL_SOCKET, SO_KEEPALIVE, 1, "SO_KEEPALIVE");
+        result |= setOption(fd, IPPROTO_TCP, TCP_KEEPIDLE, options->keepAliveIdle, "TCP_KEEPIDLE");
+        if (options->keepAliveInterval > 0)
+            result |= setOption(fd, IPPROTO_TCP, TCP_KEEPINTVL, options->keepAliveInterval, "TCP_KEEPINTVL");
+        if (options->keepAliveCount > 0)
+            result |= setOption(fd, IPPROTO_TCP, TCP_KEEPCNT, options->keepAliveCount, "TCP_KEEPCNT");
+    }
+
+    if (passive && options->deferAccept > 0)
+        result |= setOption(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, options->deferAccept, "TCP_DEFER_ACCEPT");
+
+    if (options->fastOpen > 0 && passive)
+        result |= setOption(fd, IPPROTO_TCP, TCP_FASTOPEN, options->fastOpen, "TCP_FASTOPEN");
+    else if (options->fastOpen > 0)
+        result |= setOption(fd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, 1, "TCP_FASTOPEN_CONNECT");
+
+    return result;
+}
@@ -0,0 +1,44 @@
+#ifndef _SOCKOPTS_H_
+#define _SOCKOPTS_H_
+
+/**
+ * Tuning options for the TCP sockets on one side of the tunnels: the clients' side, where they're applied to the
+ * passive sockets (Linux copies them to every socket accepted from them, so accepting costs nothing extra), or the
+ * destinations' side, where they're applied to every outgoing socket before it connects. Options left at 0 keep
+ * the kernel's defaults.
+ */
+struct SocketOptions {
+    // TCP_NODELAY: send small writes right away instead of coalescing them (Nagle's algorithm).
+    int noDelay;
+
+    // SO_RCVBUF and SO_SNDBUF, in bytes. Setting them turns off the kernel's autotuning of that buffer.
+    int receiveBuffer;
+    int sendBuffer;
+
+    // TCP_NOTSENT_LOWAT, in bytes: how much unsent data the socket holds before it stops being writable. Keeps
+    // the data queued in the kernel (and the latency it adds) low.
+    int notSentLowat;
+
+    // SO_KEEPALIVE with TCP_KEEPIDLE, TCP_KEEPINTVL and TCP_KEEPCNT, if keepAliveIdle isn't 0.
+    int keepAliveIdle;
+    int keepAliveInterval;
+    int keepAliveCount;
+
+    // Client side only: TCP_DEFER_ACCEPT, in seconds. A connection isn't accepted until the client sends something.
+    int deferAccept;
+
+    // TCP Fast Open. On the client side, the length of the queue of pending Fast Open requests (TCP_FASTOPEN). On
+    // the destination side, whether to use TCP_FASTOPEN_CONNECT, which makes connect() return right away and sends
+    // the SYN along with the first data relayed: attempts always look successful, so Happy Eyeballs can't race
+    // them, and destinations that speak first never get a SYN until the client sends something.
+    int fastOpen;
+};
+
+/**
+ * Applies the options to a socket, which for the client side is a passive socket that isn't bound yet. Returns 0
+ * if successful, or -1 if an option couldn't be set (with errno set by the last one that failed), in which case
+ * the rest are still applied.
+ */
+int socketOptionsApply(int fd, const struct SocketOptions* options, int passive);
+
+#endif
@@ -2,390 +2,1597 @@
 #include <errno.h>
 #include <limits.h>
 #include <netdb.h>
-#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/sendfile.h>
+#include <sys/socket.h>
 #include <unistd.h>
 
+#include "accounting.h"
+#include "acl.h"
+#include "admission.h"
+#include "credentials.h"
+#include "logger.h"
+#include "parser.h"
+#include "probes.h"
+#include "shaper.h"
 #include "socks5.h"
+#include "timeline.h"
 #include "util.h"
 
-#define READ_BUFFER_SIZE 2048
-#define MAX_HOSTNAME_LENGTH 255
+// The most parents a tunnel tries to connect through before giving up.
+#define MAX_PARENT_TRIES 3
+
+// How often we look whether a tunnel relayed by the kernel has all the data of a direction that reached EOF queued in
+// the other socket: right away, and then backing off up to this long.
+#define SOCKMAP_DRAIN_MAX_DELAY_MILLIS 128
+
+static void clientSocketHandler(int fd, uint32_t events, void* data);
+static void remoteSocketHandler(int fd, uint32_t events, void* data);
 
 /**
- * Receives a full buffer of data from a socket, by receiving data until the requested amount
- * of bytes is reached. Returns the amount of bytes received, or -1 if receiving failed before
- * that amount was reached.
+ * Gives the input buffer back to the worker's pool, if the connection has one.
  */
-static ssize_t recvFull(int fd, void* buf, size_t n, int flags) {
-    size_t totalReceived = 0;
+static void releaseInput(struct Socks5Connection* conn) {
+    if (conn->input != NULL)
+        bufferRelease(&conn->worker->bufferPool, conn->input, 0);
+    conn->input = NULL;
+    conn->inputLength = 0;
+}
 
-    while (totalReceived < n) {
-        ssize_t nowReceived = recv(fd, buf + totalReceived, n - totalReceived, flags);
-        if (nowReceived < 0) {
-            perror("[ERR] recv()");
-            return -1;
+/**
+ * With io_uring, the selector receives the client's handshake ahead of us, but never more than the input buffer has
+ * room for, so whatever it received is all taken by the next recvInput().
+ */
+static void updateReceiveLength(struct Socks5Connection* conn) {
+    selectorReceiveAhead(conn->selector, conn->clientSocket, READ_BUFFER_SIZE - conn->inputLength);
+}
+
+/**
+ * Receives whatever the client sent so far into the free space of the connection's input buffer, with a single
+ * selectorRecv(), taking the buffer from the worker's pool if the connection has none. Returns 1 if some bytes were
+ * received, 0 if there was nothing to receive yet (or no buffer to receive into, in which case the client waits
+ * for one), or -1 if receiving failed, the client closed the connection or the buffer is full (no handshake
+ * message is that long).
+ */
+static int recvInput(struct Socks5Connection* conn) {
+    if (conn->inputLength >= READ_BUFFER_SIZE) {
+        logError("Client sent too much data during the handshake");
+        return -1;
+    }
+
+    if (conn->input == NULL) {
+        int sizeClass = 0;
+        conn->input = bufferAcquire(&conn->worker->bufferPool, &sizeClass);
+        if (conn->input == NULL) {
+            bufferWait(&conn->worker->bufferPool, &conn->clientMemoryWaiter);
+            return 0;
         }
+    }
 
-        if (nowReceived == 0) {
-            printf("[ERR] Failed to recv(), client closed connection unexpectedly\n");
-            return -1;
+    ssize_t received = selectorRecv(conn->selector, conn->clientSocket, conn->input + conn->inputLength, READ_BUFFER_SIZE - conn->inputLength);
+    if (received < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            if (conn->inputLength == 0)
+                releaseInput(conn);
+            return 0;
         }
+        logErrno(LOG_LEVEL_ERROR, "recv()");
+        return -1;
+    }
 
-        totalReceived += nowReceived;
+    if (received == 0) {
+        logError("Failed to recv(), client closed connection unexpectedly");
+        return -1;
     }
 
-    return totalReceived;
+    conn->inputLength += received;
+    updateReceiveLength(conn);
+    return 1;
 }
 
 /**
- * Sends a full buffer of data from a socket, by sending data until the requested amount
- * of bytes is reached. Returns the amount of bytes sent, or -1 if sending failed before
- * that amount was reached.
+ * Discards the first n bytes of the input buffer (a message that was already parsed), moving whatever the
+ * client sent after them to the start of the buffer. An empty buffer goes back to the pool.
  */
-static ssize_t sendFull(int fd, const void* buf, size_t n, int flags) {
-    size_t totalSent = 0;
+static void consumeInput(struct Socks5Connection* conn, size_t n) {
+    conn->inputLength -= n;
+    memmove(conn->input, conn->input + n, conn->inputLength);
+    if (conn->inputLength == 0)
+        releaseInput(conn);
+    updateReceiveLength(conn);
+}
 
-    while (totalSent < n) {
-        ssize_t nowSent = send(fd, buf + totalSent, n - totalSent, flags);
+/**
+ * Sends as much of the connection's pending reply as the client socket accepts right now. Returns 1 if the
+ * whole reply was sent, 0 if we need to wait for the socket to be writable again, or -1 if sending failed.
+ */
+static int flushOutput(struct Socks5Connection* conn) {
+    while (conn->outputSent < conn->outputLength) {
+        ssize_t nowSent = send(conn->clientSocket, conn->output + conn->outputSent, conn->outputLength - conn->outputSent, MSG_NOSIGNAL);
         if (nowSent < 0) {
-            perror("[ERR] send()");
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            if (errno == EINTR)
+                continue;
+            logErrno(LOG_LEVEL_ERROR, "send()");
             return -1;
         }
 
-        if (nowSent == 0) {
-            printf("[ERR] Failed to send(), client closed connection unexpectedly\n");
-            return -1;
-        }
+        conn->outputSent += nowSent;
+    }
+
+    return 1;
+}
 
-        totalSent += nowSent;
+/**
+ * Adds a reply to be sent to the client, after any reply that's still pending. The replies are sent by
+ * flushOutput(), so replies that are pending at the same time go out in a single send().
+ */
+static void appendOutput(struct Socks5Connection* conn, const void* data, size_t length) {
+    if (conn->outputSent == conn->outputLength) {
+        conn->outputLength = 0;
+        conn->outputSent = 0;
     }
 
-    return totalSent;
+    memcpy(conn->output + conn->outputLength, data, length);
+    conn->outputLength += length;
 }
 
-int handleClient(int clientSocket) {
-    if (handleAuthNegotiation(clientSocket))
-        return -1;
+/**
+ * Sets an error reply to be sent to the client, after which the connection will be closed.
+ */
+static void setErrorReply(struct Socks5Connection* conn, const char* reply) {
+    metricsCountReply(&conn->worker->metrics, reply[1]);
+    conn->replyCode = reply[1];
+    appendOutput(conn, reply, 10);
+    conn->state = SOCKS5_STATE_ERROR_WRITE;
+}
 
-    // The client can now start sending requests.
+/**
+ * Turns down a request for admission control, with a general failure reply. It's cheap for us and tells the client
+ * right away to try elsewhere (or later), instead of making it wait for a tunnel we couldn't serve well.
+ */
+static void rejectRequest(struct Socks5Connection* conn, enum AdmissionReason reason) {
+    logWarn("Request turned down by admission control (%s)", admissionReasonName(reason));
+    metricsAdd(&conn->worker->metrics.admissionRejections[reason], 1);
 
-    struct addrinfo* connectAddresses;
-    if (handleRequest(clientSocket, &connectAddresses))
-        return -1;
+    // The reply specified REP as X'01' "General SOCKS server failure", ATYP as IPv4 and BND as 0.0.0.0:0.
+    setErrorReply(conn, "\x05\x01\x00\x01\x00\x00\x00\x00\x00\x00");
+}
 
-    // Now we must conenct to the requested server and reply with success/error code.
+/**
+ * Stops counting the connection as a handshake in progress, once its tunnel is up or it's closed.
+ */
+static void finishHandshake(struct Socks5Connection* conn) {
+    if (conn->handshakeCounted) {
+        admissionFinishHandshake();
+        conn->handshakeCounted = 0;
+    }
+}
 
-    int remoteSocket = -1;
-    if (handleConnectAndReply(clientSocket, &connectAddresses, &remoteSocket))
-        return -1;
+/**
+ * Adds an event to the connection's timeline, if it's sampled. The event's USDT probe is fired separately, since
+ * each probe's name must be known at compile time.
+ */
+static void noteEvent(struct Socks5Connection* conn, enum TimelineEventType type, int64_t value) {
+    if (conn->timeline != NULL)
+        timelineAdd(conn->timeline, type, value);
+}
 
-    // The connection has been established! Now the client and requested server can talk to each other.
+/**
+ * Records how long the phase that just finished took, and starts timing the next one.
+ */
+static void finishPhase(struct Socks5Connection* conn, enum MetricsPhase phase) {
+    uint64_t now = getMonotonicMicros();
+    metricsRecordPhase(&conn->worker->metrics, phase, now - conn->phaseStartedAt);
+    if (conn->accounting != NULL)
+        conn->accounting->phaseMicros[phase] = now - conn->phaseStartedAt;
+    conn->phaseStartedAt = now;
+}
 
-    int status = handleConnectionData(clientSocket, remoteSocket);
-    close(remoteSocket);
-    return status;
+/**
+ * Adds the bytes relayed since the last call to the worker's metrics.
+ */
+static void countRelayedBytes(struct Socks5Connection* conn) {
+    struct Metrics* metrics = &conn->worker->metrics;
+    metricsAdd(&metrics->bytesClientToRemote, conn->clientToRemote.bytesWritten - conn->countedClientToRemote);
+    metricsAdd(&metrics->bytesRemoteToClient, conn->remoteToClient.bytesWritten - conn->countedRemoteToClient);
+    conn->countedClientToRemote = conn->clientToRemote.bytesWritten;
+    conn->countedRemoteToClient = conn->remoteToClient.bytesWritten;
 }
 
-int handleAuthNegotiation(int clientSocket) {
-    ssize_t received;
-    char receiveBuffer[READ_BUFFER_SIZE + 1];
+/**
+ * Catches up with the bytes the kernel redirected for a tunnel it relays, noting the tunnel's activity if there were
+ * any.
+ */
+static void countSockmapBytes(struct Socks5Connection* conn) {
+    uint64_t clientToRemote, remoteToClient;
+    sockmapRedirected(&conn->sockmap, &clientToRemote, &remoteToClient);
+    if (clientToRemote == conn->sockmapClientToRemote && remoteToClient == conn->sockmapRemoteToClient)
+        return;
+
+    conn->clientToRemote.bytesRead += clientToRemote - conn->sockmapClientToRemote;
+    conn->clientToRemote.bytesWritten += clientToRemote - conn->sockmapClientToRemote;
+    conn->remoteToClient.bytesRead += remoteToClient - conn->sockmapRemoteToClient;
+    conn->remoteToClient.bytesWritten += remoteToClient - conn->sockmapRemoteToClient;
+    conn->sockmapClientToRemote = clientToRemote;
+    conn->sockmapRemoteToClient = remoteToClient;
+    conn->lastActivity = getMonotonicMillis();
+}
+
+/**
+ * Finishes a direction of a tunnel relayed by the kernel, if its source reached EOF and all its data was queued in
+ * the destination socket, by shutting the destination down for writing. Returns 0 if successful (including if the
+ * direction isn't done yet), or -1 if the socket failed.
+ */
+static int finishSockmapDirection(struct Socks5Connection* conn, struct RelayBuffer* buffer, int toSocket) {
+    if (!buffer->readClosed || buffer->writeClosed || !sockmapDrained(&conn->sockmap, toSocket == conn->clientSocket))
+        return 0;
 
-    // Socks5 starts with the client sending VER, NMETHODS, followed by that amount of METHODS. Let's read VER and NMETHODS.
-    received = recvFull(clientSocket, receiveBuffer, 2, 0);
-    if (received < 0)
+    buffer->writeClosed = 1;
+    conn->sockmapDrainDelay = 1;
+    if (shutdown(toSocket, SHUT_WR) != 0 && errno != ENOTCONN)
         return -1;
+    return 0;
+}
+
+/**
+ * Catches up with a tunnel relayed by the kernel: counts the bytes it redirected, and finishes the directions that
+ * are done. While a direction that reached EOF still has data on its way to the other socket, the connection's timer
+ * looks again in a little while. Returns 0 if successful, or -1 if a socket failed.
+ */
+static int updateSockmapTunnel(struct Socks5Connection* conn) {
+    countSockmapBytes(conn);
+    countRelayedBytes(conn);
 
-    // Check that version is 5
-    if (receiveBuffer[0] != 5) {
-        printf("[ERR] Client specified invalid version: %d\n", receiveBuffer[0]);
+    if (finishSockmapDirection(conn, &conn->clientToRemote, conn->remoteSocket) || finishSockmapDirection(conn, &conn->remoteToClient, conn->clientSocket))
         return -1;
+
+    if (conn->clientToRemote.writeClosed && conn->remoteToClient.writeClosed) {
+        conn->state = SOCKS5_STATE_CLOSED;
+    } else if ((conn->clientToRemote.readClosed && !conn->clientToRemote.writeClosed) || (conn->remoteToClient.readClosed && !conn->remoteToClient.writeClosed)) {
+        timerSchedule(&conn->timer, conn->sockmapDrainDelay);
+        if (conn->sockmapDrainDelay < SOCKMAP_DRAIN_MAX_DELAY_MILLIS)
+            conn->sockmapDrainDelay *= 2;
     }
 
-    // Read NMETHODS methods.
-    int nmethods = receiveBuffer[1];
-    received = recvFull(clientSocket, receiveBuffer, nmethods, 0);
-    if (received < 0)
-        return -1;
+    return 0;
+}
 
-    // We check that the methods specified by the client contains method 0, which is "no authentication required".
-    int hasValidAuthMethod = 0;
-    printf("[INF] Client specified auth methods: ");
-    for (int i = 0; i < nmethods; i++) {
-        hasValidAuthMethod = hasValidAuthMethod || (receiveBuffer[i] == 0);
-        printf("%x%s", receiveBuffer[i], i + 1 == nmethods ? "\n" : ", ");
+/**
+ * Has the kernel relay the tunnel from now on, if it's meant to and nothing is waiting in our buffers for it. Returns
+ * 0 if successful (including if the tunnel stays with us), or -1 if the tunnel failed.
+ */
+static int attachSockmap(struct Socks5Connection* conn) {
+    if (!conn->sockmapWanted || relayBufferHasPending(&conn->clientToRemote) || relayBufferHasPending(&conn->remoteToClient) || conn->clientToRemote.readClosed || conn->remoteToClient.readClosed)
+        return 0;
+
+    // If the kernel can't take the tunnel now (like when the socket maps are full), it stays with us for good.
+    conn->sockmapWanted = 0;
+    int status = sockmapAttach(&conn->sockmap, conn->clientSocket, conn->remoteSocket);
+    if (status != 0)
+        return status == -1 ? 0 : -1;
+
+    logDebug("Tunnel handed over to the kernel");
+    conn->sockmapAttached = 1;
+    conn->sockmapDrainDelay = 1;
+    metricsAddGauge(&conn->worker->metrics.tunnelsInKernel, 1);
+
+    // The pipes are empty, and won't be used again.
+    relayBufferRelease(&conn->clientToRemote, &conn->worker->pipePool, &conn->worker->bufferPool);
+    relayBufferRelease(&conn->remoteToClient, &conn->worker->pipePool, &conn->worker->bufferPool);
+    return 0;
+}
+
+/**
+ * Updates the events we're waiting for on the connection's sockets, based on its current state.
+ */
+static void updateInterests(struct Socks5Connection* conn) {
+    uint32_t clientEvents = 0;
+    uint32_t remoteEvents = 0;
+
+    switch (conn->state) {
+        case SOCKS5_STATE_AUTH_NEGOTIATION_READ:
+        case SOCKS5_STATE_USERPASS_READ:
+        case SOCKS5_STATE_REQUEST_READ:
+            // While there's no memory to read the client's messages into, the pool resumes it once there is.
+            if (!conn->clientMemoryWaiter.waiting)
+                clientEvents = EPOLLIN;
+            break;
+
+        case SOCKS5_STATE_AUTH_FAILED:
+            clientEvents = conn->outputSent < conn->outputLength ? EPOLLOUT : EPOLLIN;
+            break;
+
+        case SOCKS5_STATE_AUTH_NEGOTIATION_WRITE:
+        case SOCKS5_STATE_USERPASS_WRITE:
+        case SOCKS5_STATE_REPLY_WRITE:
+        case SOCKS5_STATE_ERROR_WRITE:
+            clientEvents = EPOLLOUT;
+            break;
+
+        case SOCKS5_STATE_CONNECTING:
+            remoteEvents = EPOLLOUT;
+            break;
+
+        case SOCKS5_STATE_PARENT_HANDSHAKE:
+            // The parent's replies may come before it read all of our handshake, so we read them all along.
+            remoteEvents = EPOLLIN;
+            if (conn->parentHandshake->outputSent < conn->parentHandshake->outputLength)
+                remoteEvents |= EPOLLOUT;
+            break;
+
+        case SOCKS5_STATE_UDP_ASSOCIATED:
+            // The TCP connection is only there to tell us when the client is done with the association.
+            clientEvents = EPOLLIN;
+            break;
+
+        case SOCKS5_STATE_CONNECTED:
+            if (conn->sockmapAttached) {
+                // The kernel relays the data, so a socket only becomes readable when it reaches EOF.
+                if (!conn->clientToRemote.readClosed)
+                    clientEvents = EPOLLIN;
+                if (!conn->remoteToClient.readClosed)
+                    remoteEvents = EPOLLIN;
+            } else {
+                // We only read from a socket while the buffer towards the other side has room, and only wait for a
+                // socket to be writable while we have data for it. This way a slow reader makes us stop reading
+                // from the other side instead of buffering its data without limit.
+                // A direction waiting for its rate limit's tokens doesn't read either, the shaper resumes it. Neither
+                // does one waiting for a buffer to read into, the buffer pool resumes it.
+                if (relayBufferCanRead(&conn->clientToRemote) && !conn->clientWaiter.waiting && !conn->clientMemoryWaiter.waiting)
+                    clientEvents |= EPOLLIN;
+                if (relayBufferHasPending(&conn->clientToRemote))
+                    remoteEvents |= EPOLLOUT;
+                if (relayBufferCanRead(&conn->remoteToClient) && !conn->remoteWaiter.waiting && !conn->remoteMemoryWaiter.waiting)
+                    remoteEvents |= EPOLLIN;
+                if (relayBufferHasPending(&conn->remoteToClient))
+                    clientEvents |= EPOLLOUT;
+            }
+
+            // Once we got EOF from a socket and we also shut it down for writing, we're done with it. It would keep
+            // reporting EPOLLHUP while the other direction drains, so we take it out of the selector.
+            if (conn->clientToRemote.readClosed && conn->remoteToClient.writeClosed) {
+                selectorRemove(conn->selector, conn->clientSocket);
+                clientEvents = 0;
+            }
+            if (conn->remoteToClient.readClosed && conn->clientToRemote.writeClosed) {
+                selectorRemove(conn->selector, conn->remoteSocket);
+                remoteEvents = 0;
+            }
+            break;
+
+        default:
+            break;
     }
 
-    // If the client didn't specify "no authentication required", send an error and wait for the client to close the connection.
-    if (!hasValidAuthMethod) {
-        printf("[ERR] No valid auth method detected!\n");
-        if (sendFull(clientSocket, "\x05\xFF", 2, 0) < 0)
-            return -1;
+    selectorSetEvents(conn->selector, conn->clientSocket, clientEvents);
+    if (conn->remoteSocket >= 0)
+        selectorSetEvents(conn->selector, conn->remoteSocket, remoteEvents);
+}
 
-        // TODO: Investigate if we should shutdown to wait for the client to close the TCP connection,
-        // and if so how can we know when the connection was finally closed (since we can't recv() anymore).
-        // shutdown(clientSocket, SHUT_RDWR);
+/**
+ * Completes the connection's accounting record with what's only known once it's over, and hands it to the
+ * accounting log.
+ */
+static void submitAccounting(struct Socks5Connection* conn, enum AccountingCloseReason reason) {
+    struct AccountingRecord* record = conn->accounting;
+    record->closedAt = accountingNow();
+    record->closeReason = reason;
+    record->replyCode = conn->replyCode;
+    record->bytesClientToRemote = conn->clientToRemote.bytesWritten;
+    record->bytesRemoteToClient = conn->remoteToClient.bytesWritten;
+    if (conn->parent >= 0)
+        record->parent = conn->parent;
+    if (conn->authMethod == 2) {
+        size_t userLength = strlen(conn->username);
+        record->userLength = userLength > ACCOUNTING_USER_LENGTH ? ACCOUNTING_USER_LENGTH : userLength;
+        memcpy(record->user, conn->username, record->userLength);
+    }
 
-        // Wait for the client to close the TCP connection.
-        printf("[INF] Waiting for client to close the connection.\n");
-        while (recv(clientSocket, receiveBuffer, READ_BUFFER_SIZE, 0) > 0) {}
-        return -1;
+    accountingSubmit(record);
+    slabFree(&conn->worker->accountingSlab, record);
+}
+
+/**
+ * Closes both of the connection's sockets and frees up all its resources, accounting for it as ended for the given
+ * reason.
+ */
+static void closeConnection(struct Socks5Connection* conn, enum AccountingCloseReason reason) {
+    struct Metrics* metrics = &conn->worker->metrics;
+    timerCancel(&conn->timer);
+    metricsAddGauge(&metrics->connectionsActive, -1);
+    if (conn->sockmapAttached) {
+        countSockmapBytes(conn);
+        sockmapDetach(&conn->sockmap);
+        metricsAddGauge(&metrics->tunnelsInKernel, -1);
+    }
+    if (conn->tunnelEstablished) {
+        countRelayedBytes(conn);
+        finishPhase(conn, METRICS_PHASE_RELAY);
+        metricsAddGauge(&metrics->tunnelsActive, -1);
     }
 
-    // Tell the client we're using auth method 00 ("no authentication required").
-    if (sendFull(clientSocket, "\x05\x00", 2, 0) < 0)
-        return -1;
+    PROBE4(close, conn, reason, conn->clientToRemote.bytesWritten, conn->remoteToClient.bytesWritten);
+    if (conn->timeline != NULL) {
+        timelineAdd(conn->timeline, TIMELINE_CLOSE, reason);
+        timelineFinish(conn->timeline);
+        slabFree(&conn->worker->timelineSlab, conn->timeline);
+    }
+    if (conn->accounting != NULL)
+        submitAccounting(conn, reason);
+
+    finishHandshake(conn);
+    if (conn->tunnelAdmitted)
+        admissionReleaseTunnel(conn->admissionClient);
+
+    bufferCancel(&conn->clientMemoryWaiter);
+    bufferCancel(&conn->remoteMemoryWaiter);
+    relayBufferRelease(&conn->clientToRemote, &conn->worker->pipePool, &conn->worker->bufferPool);
+    relayBufferRelease(&conn->remoteToClient, &conn->worker->pipePool, &conn->worker->bufferPool);
+    releaseInput(conn);
+
+    if (conn->limits.bucketCount > 0) {
+        shaperCancel(&conn->clientWaiter);
+        shaperCancel(&conn->remoteWaiter);
+        shaperRelease(&conn->limits);
+    }
 
-    return 0;
+    selectorRemove(conn->selector, conn->clientSocket);
+    close(conn->clientSocket);
+
+    if (conn->remoteSocket >= 0) {
+        selectorRemove(conn->selector, conn->remoteSocket);
+        close(conn->remoteSocket);
+    }
+
+    if (conn->credentialsJob != NULL)
+        credentialsCancel(conn->credentialsJob);
+
+    if (conn->resolverWaiter != NULL)
+        resolverCancel(conn->resolverWaiter);
+
+    if (conn->state == SOCKS5_STATE_CONNECTING && conn->connectStarted)
+        connectorCancel(&conn->connector);
+
+    if (conn->connectAddresses != NULL)
+        resolverFreeAddresses(conn->connectAddresses);
+
+    if (conn->parent >= 0)
+        parentRelease(&conn->worker->parentBalancer, conn->parent);
+    slabFree(&conn->worker->parentHandshakeSlab, conn->parentHandshake);
+
+    if (conn->udpAssociation != NULL) {
+        udpAssociationClose(conn->udpAssociation);
+        slabFree(&conn->worker->udpAssociationSlab, conn->udpAssociation);
+    }
+
+    if (conn->previous != NULL)
+        conn->previous->next = conn->next;
+    else
+        conn->worker->connections = conn->next;
+    if (conn->next != NULL)
+        conn->next->previous = conn->previous;
+
+    logInfo("Connection closed");
+    slabFree(&conn->worker->connectionSlab, conn);
 }
 
-int handleRequest(int clientSocket, struct addrinfo** connectAddresses) {
-    ssize_t received;
-    char receiveBuffer[READ_BUFFER_SIZE + 1];
+void closeAllConnections(struct Worker* worker) {
+    int closed = 0;
+    while (worker->connections != NULL) {
+        closeConnection(worker->connections, ACCOUNTING_CLOSE_SHUTDOWN);
+
+        // The records go through this thread's accounting ring, which drops them once it's full, so it's emptied right
+        // here every time it could be, instead of waiting for the writer thread.
+        if (++closed % ACCOUNTING_RING_RECORDS == 0 && accountingEnabled())
+            accountingDrain();
+    }
+}
+
+/**
+ * Continues a connection after one of its sockets became ready, running it through as many states as it can
+ * until it has to wait for a socket again. Closes the connection if it failed or finished.
+ */
+static void handleConnectionEvent(struct Socks5Connection* conn, int fd, uint32_t events) {
+    // If the client's socket errored or hung up during the handshake, there's nothing left to do.
+    if (conn->state != SOCKS5_STATE_CONNECTED && fd == conn->clientSocket && (events & (EPOLLERR | EPOLLHUP))) {
+        closeConnection(conn, ACCOUNTING_CLOSE_ERROR);
+        return;
+    }
+
+    int status = 0;
+    enum Socks5State previousState;
+    do {
+        previousState = conn->state;
+        switch (conn->state) {
+            case SOCKS5_STATE_AUTH_NEGOTIATION_READ:
+            case SOCKS5_STATE_AUTH_NEGOTIATION_WRITE:
+            case SOCKS5_STATE_AUTH_FAILED:
+                status = handleAuthNegotiation(conn);
+                break;
+
+            case SOCKS5_STATE_USERPASS_READ:
+            case SOCKS5_STATE_USERPASS_WRITE:
+                status = handleUserPass(conn);
+                break;
+
+            case SOCKS5_STATE_AUTHENTICATING:
+                // We're waiting for a credential thread to call onAuthenticated().
+                break;
+
+            case SOCKS5_STATE_REQUEST_READ:
+                status = handleRequest(conn);
+                break;
+
+            case SOCKS5_STATE_RESOLVING:
+                // We're waiting for the resolver to call onResolved().
+                break;
+
+            case SOCKS5_STATE_CONNECTING:
+            case SOCKS5_STATE_REPLY_WRITE:
+                status = handleConnectAndReply(conn, fd);
+                break;
+
+            case SOCKS5_STATE_PARENT_HANDSHAKE:
+                status = handleParentHandshake(conn);
+                break;
+
+            case SOCKS5_STATE_ERROR_WRITE:
+                // Once the error reply was sent, we close the connection.
+                status = flushOutput(conn);
+                if (status > 0) {
+                    PROBE2(reply, conn, conn->replyCode);
+                    noteEvent(conn, TIMELINE_REPLY, conn->replyCode);
+                    conn->state = SOCKS5_STATE_CLOSED;
+                }
+                break;
+
+            case SOCKS5_STATE_CONNECTED:
+                status = handleConnectionData(conn, fd, events);
+                break;
+
+            case SOCKS5_STATE_UDP_ASSOCIATED:
+                status = handleUdpControl(conn);
+                break;
+
+            default:
+                break;
+        }
+    } while (status >= 0 && conn->state != previousState && conn->state != SOCKS5_STATE_CLOSED);
+
+    if (status < 0 || conn->state == SOCKS5_STATE_CLOSED)
+        closeConnection(conn, status < 0 ? ACCOUNTING_CLOSE_ERROR : ACCOUNTING_CLOSE_DONE);
+    else
+        updateInterests(conn);
+}
+
+static void clientSocketHandler(int fd, uint32_t events, void* data) {
+    handleConnectionEvent((struct Socks5Connection*)data, fd, events);
+}
+
+/**
+ * Closes the connection if its handshake timed out, or if its tunnel has been idle for too long. A tunnel that
+ * relayed something since the timer was scheduled gets its timer scheduled again instead.
+ */
+static void connectionTimerExpired(void* data) {
+    struct Socks5Connection* conn = (struct Socks5Connection*)data;
+    struct Metrics* metrics = &conn->worker->metrics;
+
+    if (conn->state == SOCKS5_STATE_CONNECTED || conn->state == SOCKS5_STATE_UDP_ASSOCIATED) {
+        // A tunnel relayed by the kernel shows no activity to us, so we look at what the kernel did. It may be done,
+        // or have its timer looking again soon for a direction that's finishing.
+        if (conn->sockmapAttached) {
+            if (updateSockmapTunnel(conn) != 0) {
+                closeConnection(conn, ACCOUNTING_CLOSE_ERROR);
+                return;
+            }
+            if (conn->state == SOCKS5_STATE_CLOSED) {
+                closeConnection(conn, ACCOUNTING_CLOSE_DONE);
+                return;
+            }
+            if (conn->worker->args->idleTimeout == 0)
+                return;
+        }
+
+        uint64_t lastActivity = conn->lastActivity;
+        if (conn->udpAssociation != NULL && conn->udpAssociation->lastActivity > lastActivity)
+            lastActivity = conn->udpAssociation->lastActivity;
+
+        uint64_t idleUntil = lastActivity + conn->worker->args->idleTimeout * 1000ULL;
+        if (idleUntil > getMonotonicMillis()) {
+            if (!conn->timer.scheduled)
+                timerScheduleAt(&conn->timer, idleUntil);
+            return;
+        }
 
-    // Read from a client request: VER, CMD, RSV, ATYP.
-    received = recvFull(clientSocket, receiveBuffer, 4, 0);
-    if (received < 0)
+        logInfo("Closing tunnel idle for %d seconds", conn->worker->args->idleTimeout);
+        metricsAdd(&metrics->idleTimeouts, 1);
+        closeConnection(conn, ACCOUNTING_CLOSE_IDLE_TIMEOUT);
+    } else {
+        logError("Client took too long to finish its handshake");
+        metricsAdd(&metrics->handshakeTimeouts, 1);
+        closeConnection(conn, ACCOUNTING_CLOSE_HANDSHAKE_TIMEOUT);
+    }
+}
+
+static void remoteSocketHandler(int fd, uint32_t events, void* data) {
+    handleConnectionEvent((struct Socks5Connection*)data, fd, events);
+}
+
+int handleClient(struct Worker* worker, int clientSocket, const struct sockaddr_storage* clientAddress) {
+    struct Socks5Connection* conn = slabAlloc(&worker->connectionSlab);
+    if (conn == NULL) {
+        logError("Failed to allocate memory for new connection");
+        close(clientSocket);
         return -1;
+    }
 
-    // Check that the CMD the client specified is X'01' "connect". Otherwise, send and error and close the TCP connection.
-    if (receiveBuffer[1] != 1) {
-        // The reply specified REP as X'07' "Command not supported", ATYP as IPv4 and BND as 0.0.0.0:0.
-        sendFull(clientSocket, "\x05\x07\x00\x01\x00\x00\x00\x00\x00\x00", 10, 0);
+    if (clientAddress != NULL) {
+        conn->clientAddress = *clientAddress;
+        conn->clientAddressKnown = 1;
+    }
+
+    // The accounting record is filled in as the connection goes, and handed to the accounting log once it's closed.
+    // Connections we don't have a record for go unaccounted rather than turned away.
+    if (accountingEnabled()) {
+        conn->accounting = slabAlloc(&worker->accountingSlab);
+        if (conn->accounting != NULL) {
+            conn->accounting->acceptedAt = accountingNow();
+            if (clientAddress != NULL)
+                accountingSetAddress(&conn->accounting->client, (const struct sockaddr*)clientAddress);
+            conn->accounting->parent = ACCOUNTING_NO_PARENT;
+            conn->accounting->worker = worker->id;
+        } else {
+            logError("Failed to allocate memory for the connection's accounting record");
+        }
+    }
+
+    // Sampled connections get a timeline from the start, which they drop if their request turns out not to be sampled.
+    if (timelineEnabled() && timelineSampleClient(&worker->timelineCounter, (const struct sockaddr*)clientAddress)) {
+        conn->timeline = slabAlloc(&worker->timelineSlab);
+        if (conn->timeline != NULL) {
+            // Sampled connections are few, so they can afford to look up the client's address if nobody else did.
+            socklen_t clientAddressLength = sizeof(conn->clientAddress);
+            if (!conn->clientAddressKnown)
+                conn->clientAddressKnown = getpeername(clientSocket, (struct sockaddr*)&conn->clientAddress, &clientAddressLength) == 0;
+            timelineStart(conn->timeline, worker->id, conn->clientAddressKnown ? (const struct sockaddr*)&conn->clientAddress : NULL);
+        } else {
+            logError("Failed to allocate memory for the connection's timeline");
+        }
+    }
+
+    conn->worker = worker;
+    conn->selector = worker->selector;
+    conn->replyCode = ACCOUNTING_NO_REPLY;
+    conn->state = SOCKS5_STATE_AUTH_NEGOTIATION_READ;
+    conn->clientSocket = clientSocket;
+    conn->remoteSocket = -1;
+    conn->parent = -1;
+    relayBufferInit(&conn->clientToRemote);
+    relayBufferInit(&conn->remoteToClient);
+    bufferWaiterInit(&conn->clientMemoryWaiter, clientSocket, clientSocketHandler, conn);
+    conn->phaseStartedAt = getMonotonicMicros();
+    timerInit(&conn->timer, &worker->timers, connectionTimerExpired, conn);
+    timerSchedule(&conn->timer, worker->args->handshakeTimeout);
+
+    // The client will start by sending its auth negotiation, so we wait for the socket to be readable (or have the
+    // selector receive it ahead, with io_uring).
+    if (selectorAddReceiver(conn->selector, clientSocket, READ_BUFFER_SIZE, clientSocketHandler, conn) != 0) {
+        logErrno(LOG_LEVEL_ERROR, "Failed to register client socket in selector");
+        timerCancel(&conn->timer);
+        close(clientSocket);
+        slabFree(&worker->accountingSlab, conn->accounting);
+        slabFree(&worker->timelineSlab, conn->timeline);
+        slabFree(&worker->connectionSlab, conn);
         return -1;
     }
 
-    // We will store the hostname and port in these variables. If the client asked to connect to an IP, we
-    // will print it into hostname and then pass it throught getaddrinfo().
-    // Is this the best option? Definitely not, but it's kinda easier ;)
-    char hostname[MAX_HOSTNAME_LENGTH + 1];
-    int port = 0;
+    conn->next = worker->connections;
+    if (conn->next != NULL)
+        conn->next->previous = conn;
+    worker->connections = conn;
 
-    // The hints for getaddrinfo. We will specify we want a stream TCP socket.
-    struct addrinfo addrHints;
-    memset(&addrHints, 0, sizeof(addrHints));
-    addrHints.ai_socktype = SOCK_STREAM;
-    addrHints.ai_protocol = IPPROTO_TCP;
+    metricsAdd(&worker->metrics.connectionsAccepted, 1);
+    metricsAddGauge(&worker->metrics.connectionsActive, 1);
+    admissionStartHandshake();
+    conn->handshakeCounted = 1;
+    PROBE3(accepted, conn, clientSocket, worker->id);
+    return 0;
+}
 
-    // Check ATYP and print the address/hostname the client asked to connect to.
-    if (receiveBuffer[3] == 1) {
-        // Client requested to connect to an IPv4 address.
-        addrHints.ai_family = AF_INET;
+int handleAuthNegotiation(struct Socks5Connection* conn) {
+    int status;
+
+    if (conn->state == SOCKS5_STATE_AUTH_NEGOTIATION_READ) {
+        // Socks5 starts with the client sending VER, NMETHODS, followed by that amount of METHODS. We parse it from
+        // whatever we received so far, only calling recv() if the greeting isn't complete yet.
+        struct Socks5Greeting greeting;
+        size_t consumed;
+        while (parseGreeting(conn->input, conn->inputLength, &greeting, &consumed) == PARSE_INCOMPLETE) {
+            if ((status = recvInput(conn)) <= 0)
+                return status;
+        }
 
-        // Read the IPv4 address (4 bytes).
-        struct in_addr addr;
-        received = recvFull(clientSocket, &addr, 4, 0);
-        if (received < 0)
+        // Check that version is 5
+        if (greeting.version != 5) {
+            logError("Client specified invalid version: %d", greeting.version);
             return -1;
+        }
+        PROBE2(greeting, conn, greeting.methodCount);
+        noteEvent(conn, TIMELINE_GREETING, greeting.methodCount);
+
+        // We check that the methods specified by the client contains the one we require: method 2, "username/password",
+        // if we have a credential index, otherwise method 0, "no authentication required".
+        conn->authMethod = credentialsEnabled() ? 2 : 0;
+        int hasValidAuthMethod = memchr(greeting.methods, conn->authMethod, greeting.methodCount) != NULL;
+        PROBE2(method, conn, hasValidAuthMethod ? conn->authMethod : 0xFF);
+        noteEvent(conn, TIMELINE_METHOD, hasValidAuthMethod ? conn->authMethod : 0xFF);
+        if (logEnabled(LOG_LEVEL_DEBUG)) {
+            char methodsText[4 * 255 + 1];
+            methodsText[0] = '\0';
+            for (int i = 0; i < greeting.methodCount; i++)
+                sprintf(methodsText + strlen(methodsText), "%s%x", i == 0 ? "" : ", ", greeting.methods[i]);
+            logDebug("Client specified auth methods: %s", methodsText);
+        }
 
-        // Read the port number (2 bytes).
-        in_port_t portBuf;
-        received = recvFull(clientSocket, &portBuf, 2, 0);
-        if (received < 0)
-            return -1;
+        // Anything the client sent after the greeting (its request, if it didn't wait for our reply) stays in the buffer.
+        consumeInput(conn, consumed);
 
-        // Store the port and convert the IP to a hostname string.
-        port = ntohs(portBuf);
-        inet_ntop(AF_INET, &addr, hostname, INET_ADDRSTRLEN);
-    } else if (receiveBuffer[3] == 3) {
-        // Client requested to connect to a domain name.
-        // Read one byte, the length of the domain name string.
-        received = recvFull(clientSocket, receiveBuffer, 1, 0);
-        if (received < 0)
-            return -1;
+        if (hasValidAuthMethod) {
+            // Tell the client which auth method we're using.
+            uint8_t reply[2] = {5, conn->authMethod};
+            appendOutput(conn, reply, 2);
+            conn->state = SOCKS5_STATE_AUTH_NEGOTIATION_WRITE;
+        } else {
+            // If the client didn't specify the method we require, send an error and wait for the client to close the connection.
+            logError("No valid auth method detected!");
+            appendOutput(conn, "\x05\xFF", 2);
+            conn->state = SOCKS5_STATE_AUTH_FAILED;
+        }
+    }
 
-        // Read the domain name string into the 'hostname' buffer.
-        int hostnameLength = receiveBuffer[0];
-        received = recvFull(clientSocket, hostname, hostnameLength, 0);
-        if (received < 0)
-            return -1;
+    if (conn->state == SOCKS5_STATE_AUTH_NEGOTIATION_WRITE && conn->authMethod == 2) {
+        // Same as below, but the client's next message is its username and password.
+        struct Socks5UserPass userPass;
+        size_t consumed;
+        if (parseUserPass(conn->input, conn->inputLength, &userPass, &consumed) == PARSE_INCOMPLETE && (status = flushOutput(conn)) <= 0)
+            return status;
 
-        // Read the port number.
-        in_port_t portBuffer;
-        received = recvFull(clientSocket, &portBuffer, 2, 0);
-        if (received < 0)
+        conn->state = SOCKS5_STATE_USERPASS_READ;
+    }
+
+    if (conn->state == SOCKS5_STATE_AUTH_NEGOTIATION_WRITE) {
+        // If the client sent its request along with the greeting, it isn't waiting for our method reply. In that case
+        // we hold the reply and send it along with the request's reply, in a single send().
+        struct Socks5Request request;
+        size_t consumed;
+        if (parseRequest(conn->input, conn->inputLength, &request, &consumed) == PARSE_INCOMPLETE && (status = flushOutput(conn)) <= 0)
+            return status;
+
+        // The client can now start sending requests.
+        finishPhase(conn, METRICS_PHASE_AUTH);
+        conn->state = SOCKS5_STATE_REQUEST_READ;
+    }
+
+    if (conn->state == SOCKS5_STATE_AUTH_FAILED) {
+        if ((status = flushOutput(conn)) <= 0)
+            return status;
+
+        // Wait for the client to close the TCP connection, discarding anything it sends.
+        char discardBuffer[READ_BUFFER_SIZE];
+        ssize_t received;
+        while ((received = selectorRecv(conn->selector, conn->clientSocket, discardBuffer, sizeof(discardBuffer))) > 0) {}
+        if (received == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
             return -1;
+    }
 
-        // Store the port number and hostname.
-        port = ntohs(portBuffer);
-        hostname[hostnameLength] = '\0';
-    } else if (receiveBuffer[3] == 4) {
-        // Client requested to connect to an IPv6 address.
-        addrHints.ai_family = AF_INET6;
-
-        // Read the IPv6 address (16 bytes).
-        struct in6_addr addr;
-        received = recvFull(clientSocket, &addr, 16, 0);
-        if (received < 0)
+    return 0;
+}
+
+/**
+ * Replies to the client's username and password, once we know whether they're valid.
+ */
+static void finishAuthentication(struct Socks5Connection* conn, int valid) {
+    PROBE3(authenticated, conn, conn->username, valid);
+    noteEvent(conn, TIMELINE_AUTHENTICATED, valid);
+
+    if (!valid) {
+        // A STATUS other than 0 means failure, after which we close the connection.
+        logError("Authentication failed for user %s", conn->username);
+        appendOutput(conn, "\x01\x01", 2);
+        conn->state = SOCKS5_STATE_ERROR_WRITE;
+        return;
+    }
+
+    logInfo("User %s authenticated", conn->username);
+    appendOutput(conn, "\x01\x00", 2);
+    conn->state = SOCKS5_STATE_USERPASS_WRITE;
+}
+
+static void onAuthenticated(void* data, int valid) {
+    struct Socks5Connection* conn = (struct Socks5Connection*)data;
+    conn->credentialsJob = NULL;
+    finishAuthentication(conn, valid);
+
+    // Resume the connection from its new state, as if one of its sockets had become ready.
+    handleConnectionEvent(conn, -1, 0);
+}
+
+int handleUserPass(struct Socks5Connection* conn) {
+    int status;
+
+    if (conn->state == SOCKS5_STATE_USERPASS_READ) {
+        struct Socks5UserPass userPass;
+        size_t consumed;
+        while (parseUserPass(conn->input, conn->inputLength, &userPass, &consumed) == PARSE_INCOMPLETE) {
+            if ((status = recvInput(conn)) <= 0)
+                return status;
+        }
+
+        if (userPass.version != 1) {
+            logError("Client specified invalid username/password version: %d", userPass.version);
             return -1;
+        }
 
-        // Read the port number (2 bytes).
-        in_port_t portBuf;
-        received = recvFull(clientSocket, &portBuf, 2, 0);
-        if (received < 0)
+        // Credentials this worker verified recently are valid right away, the rest are checked on another thread,
+        // which calls onAuthenticated() once it's done.
+        int verified = credentialsVerify(&conn->worker->credentialCache, userPass.username, userPass.usernameLength, userPass.password, userPass.passwordLength, onAuthenticated, conn, &conn->credentialsJob);
+        memcpy(conn->username, userPass.username, userPass.usernameLength);
+        conn->username[userPass.usernameLength] = '\0';
+        consumeInput(conn, consumed);
+
+        if (verified == -2) {
+            // The credential threads have more than they can take already, so the client is turned down as if its
+            // password was wrong, and can try again later.
+            logError("Too many credentials waiting to be verified, turning down user %s", conn->username);
+            finishAuthentication(conn, 0);
+            return 0;
+        } else if (verified < 0) {
+            logError("Failed to start verifying the credentials of user %s", conn->username);
             return -1;
+        } else if (verified == 0) {
+            conn->state = SOCKS5_STATE_AUTHENTICATING;
+            return 0;
+        }
 
-        // Store the port and convert the IP to a hostname string.
-        port = ntohs(portBuf);
-        inet_ntop(AF_INET6, &addr, hostname, INET6_ADDRSTRLEN);
-    } else {
-        // The reply specified REP as X'08' "Address type not supported", ATYP as IPv4 and BND as 0.0.0.0:0.
-        sendFull(clientSocket, "\x05\x08\x00\x01\x00\x00\x00\x00\x00\x00", 10, 0);
-        return -1;
+        finishAuthentication(conn, 1);
+    }
+
+    if (conn->state != SOCKS5_STATE_USERPASS_WRITE)
+        return 0;
+
+    // As with the method reply, if the request is already here we hold our reply to send it along with the request's.
+    struct Socks5Request request;
+    size_t consumed;
+    if (parseRequest(conn->input, conn->inputLength, &request, &consumed) == PARSE_INCOMPLETE && (status = flushOutput(conn)) <= 0)
+        return status;
+
+    finishPhase(conn, METRICS_PHASE_AUTH);
+    conn->state = SOCKS5_STATE_REQUEST_READ;
+    return 0;
+}
+
+/**
+ * Adds a success reply to be sent to the client, with the given address as BND.ADDR and BND.PORT.
+ */
+static void appendSuccessReply(struct Socks5Connection* conn, const struct sockaddr_storage* boundAddress) {
+    // Prepare a server reply: SUCCESS, then the address to which our socket is bound.
+    uint8_t reply[22];
+    size_t replyLength;
+    memcpy(reply, "\x05\x00\x00", 3);
+    conn->replyCode = 0;
+    switch (boundAddress->ss_family) {
+        case AF_INET:
+            // '\x01' (ATYP identifier for IPv4) followed by the IP and PORT.
+            reply[3] = '\x01';
+            memcpy(reply + 4, &((struct sockaddr_in*)boundAddress)->sin_addr, 4);
+            memcpy(reply + 8, &((struct sockaddr_in*)boundAddress)->sin_port, 2);
+            replyLength = 10;
+            break;
+
+        case AF_INET6:
+            // '\x04' (ATYP identifier for IPv6) followed by the IP and PORT.
+            reply[3] = '\x04';
+            memcpy(reply + 4, &((struct sockaddr_in6*)boundAddress)->sin6_addr, 16);
+            memcpy(reply + 20, &((struct sockaddr_in6*)boundAddress)->sin6_port, 2);
+            replyLength = 22;
+            break;
+
+        default:
+            // We don't know the address type? Send IPv4 0.0.0.0:0.
+            memcpy(reply + 3, "\x01\x00\x00\x00\x00\x00\x00", 7);
+            replyLength = 10;
+            break;
     }
 
-    printf("[INF] Client asked to connect to: %s:%d\n", hostname, port);
+    appendOutput(conn, reply, replyLength);
+}
 
-    // For "service", we will indicate the port number
-    char service[6] = {0};
-    sprintf(service, "%d", port);
+/**
+ * Whether the access control list allows the connection's client to connect to an address.
+ */
+static int isAddressAllowed(const struct sockaddr* address, void* data) {
+    struct Socks5Connection* conn = (struct Socks5Connection*)data;
+    return aclCheckAddress((struct sockaddr*)&conn->clientAddress, address, &conn->worker->metrics) == ACL_ALLOW;
+}
 
-    // Call getaddrinfo to get the prepared addrinfo structures to connect to.
-    int getAddrStatus = getaddrinfo(hostname, service, &addrHints, connectAddresses);
-    if (getAddrStatus != 0) {
-        printf("[ERR] getaddrinfo() failed: %s\n", gai_strerror(getAddrStatus));
+/**
+ * Continues a connection once the requested address was resolved, by either moving on to connecting to it or
+ * sending an error reply.
+ */
+static void handleResolved(struct Socks5Connection* conn, struct addrinfo* addresses, int gaiStatus) {
+    if (gaiStatus != 0) {
+        logError("getaddrinfo() failed: %s", gai_strerror(gaiStatus));
 
         // The reply specifies ATYP as IPv4 and BND as 0.0.0.0:0.
         char errorMessage[10] = "\x05 \x00\x01\x00\x00\x00\x00\x00\x00";
         // We calculate the REP value based on the type of error returned by getaddrinfo
         errorMessage[1] =
-            getAddrStatus == EAI_FAMILY   ? '\x08'  // REP is "Address type not supported"
-            : getAddrStatus == EAI_NONAME ? '\x04'  // REP is "Host Unreachable"
-                                          : '\x01'; // REP is "General SOCKS server failure"
-        sendFull(clientSocket, errorMessage, 10, 0);
+            gaiStatus == EAI_FAMILY   ? '\x08'  // REP is "Address type not supported"
+            : gaiStatus == EAI_NONAME ? '\x04'  // REP is "Host Unreachable"
+                                      : '\x01'; // REP is "General SOCKS server failure"
+        setErrorReply(conn, errorMessage);
+        return;
+    }
+
+    // Addresses the client isn't allowed to connect to are left out. If none is left, we refuse the request.
+    if (conn->aclCheckAddresses && resolverFilterAddresses(addresses, isAddressAllowed, conn) == 0) {
+        logError("Connection not allowed by the access control list");
+        resolverFreeAddresses(addresses);
+
+        // The reply specified REP as X'02' "Connection not allowed by ruleset", ATYP as IPv4 and BND as 0.0.0.0:0.
+        setErrorReply(conn, "\x05\x02\x00\x01\x00\x00\x00\x00\x00\x00");
+        return;
+    }
+
+    // Now we must conenct to the requested server and reply with success/error code.
+    conn->connectAddresses = addresses;
+    conn->state = SOCKS5_STATE_CONNECTING;
+}
+
+/**
+ * Called by the resolver, on this connection's worker thread, once a domain name lookup finished.
+ */
+static void onResolved(void* data, struct addrinfo* addresses, int gaiStatus) {
+    struct Socks5Connection* conn = (struct Socks5Connection*)data;
+    conn->resolverWaiter = NULL;
+    finishPhase(conn, METRICS_PHASE_DNS);
+    PROBE2(resolved, conn, gaiStatus);
+    noteEvent(conn, TIMELINE_RESOLVED, gaiStatus);
+    handleResolved(conn, addresses, gaiStatus);
+
+    // Resume the connection from its new state, as if one of its sockets had become ready.
+    handleConnectionEvent(conn, -1, 0);
+}
+
+/**
+ * Opens a UDP association for the client and prepares the reply telling it where to send its datagrams. There's
+ * no remote server to connect to, so the connection goes straight to sending the reply.
+ */
+static int handleUdpAssociate(struct Socks5Connection* conn, const struct Socks5Request* request) {
+    logInfo("Client asked for a UDP association, sending from: %s:%d", request->hostname, request->port);
+
+    struct sockaddr_storage boundAddress;
+    conn->udpAssociation = slabAlloc(&conn->worker->udpAssociationSlab);
+    if (conn->udpAssociation == NULL || udpAssociationOpen(conn->udpAssociation, conn->worker, conn->clientSocket, request, &boundAddress) != 0) {
+        slabFree(&conn->worker->udpAssociationSlab, conn->udpAssociation);
+        conn->udpAssociation = NULL;
+
+        // The reply specified REP as X'01' "General SOCKS server failure", ATYP as IPv4 and BND as 0.0.0.0:0.
+        setErrorReply(conn, "\x05\x01\x00\x01\x00\x00\x00\x00\x00\x00");
+        return 0;
+    }
+
+    if (logEnabled(LOG_LEVEL_DEBUG)) {
+        char addrBuffer[128];
+        printSocketAddress((struct sockaddr*)&boundAddress, addrBuffer);
+        logDebug("UDP association bound at %s", addrBuffer);
+    }
+
+    appendSuccessReply(conn, &boundAddress);
+    conn->state = SOCKS5_STATE_REPLY_WRITE;
+    return 0;
+}
+
+/**
+ * Gets a CONNECT request ready to go through a parent proxy, which resolves domain names itself. Only IP addresses
+ * can be checked against the access control list's address rules, then.
+ */
+static int startParentTunnel(struct Socks5Connection* conn, const struct Socks5Request* request) {
+    if (conn->aclCheckAddresses && request->family != AF_UNSPEC) {
+        struct addrinfo* addresses = NULL;
+        int allowed = resolverNumeric(request->hostname, request->family, request->port, &addresses) == 0 && resolverFilterAddresses(addresses, isAddressAllowed, conn) > 0;
+        if (addresses != NULL)
+            resolverFreeAddresses(addresses);
+        if (!allowed) {
+            logError("Connection not allowed by the access control list");
+            // The reply specified REP as X'02' "Connection not allowed by ruleset", ATYP as IPv4 and BND as 0.0.0.0:0.
+            setErrorReply(conn, "\x05\x02\x00\x01\x00\x00\x00\x00\x00\x00");
+            return 0;
+        }
+    }
+
+    conn->parentHandshake = slabAlloc(&conn->worker->parentHandshakeSlab);
+    if (conn->parentHandshake == NULL) {
+        logError("Failed to allocate memory for the parent handshake");
         return -1;
     }
 
+    conn->parentHandshake->request = *request;
+    conn->state = SOCKS5_STATE_CONNECTING;
     return 0;
 }
 
-int handleConnectAndReply(int clientSocket, struct addrinfo** connectAddresses, int* remoteSocket) {
-    char addrBuf[64];
-    int aipIndex = 0;
+int handleRequest(struct Socks5Connection* conn) {
+    int status;
+
+    // A client request is VER, CMD, RSV, ATYP, DST.ADDR, DST.PORT. As with the greeting, we only call recv() if
+    // what we received so far doesn't hold the whole request.
+    struct Socks5Request request;
+    size_t consumed;
+    enum ParseStatus parseStatus;
+    while ((parseStatus = parseRequest(conn->input, conn->inputLength, &request, &consumed)) == PARSE_INCOMPLETE) {
+        if ((status = recvInput(conn)) <= 0)
+            return status;
+    }
 
-    // Print all the addrinfo options, just for debugging.
-    for (struct addrinfo* aip = *connectAddresses; aip != NULL; aip = aip->ai_next) {
-        printf("[INF] Option %i: %s (%s %s) %s %s (Flags: ", aipIndex++, printFamily(aip), printType(aip), printProtocol(aip), aip->ai_canonname ? aip->ai_canonname : "-", printAddressPort(aip, addrBuf));
-        printFlags(aip);
-        printf(")\n");
+    // A request we can't make sense of has no destination.
+    if (parseStatus != PARSE_OK) {
+        request.family = AF_UNSPEC;
+        request.hostname[0] = '\0';
+        request.port = 0;
     }
+    PROBE4(request, conn, request.command, request.hostname, request.port);
 
-    // Find the first addrinfo option in which we can both open a socket, and connect to the remote server.
-    int sock = -1;
-    char addrBuffer[128];
-    for (struct addrinfo* addr = *connectAddresses; addr != NULL && sock == -1; addr = addr->ai_next) {
-        sock = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
-        if (sock < 0) {
-            printf("[INF] Failed to create remote socket on %s\n", printAddressPort(addr, addrBuffer));
+    // A timeline taken for the connection is kept if the request is sampled, starting with the request itself.
+    if (conn->timeline != NULL) {
+        if (timelineSampleRequest(&conn->worker->timelineCounter, request.hostname, request.family)) {
+            timelineSetDestination(conn->timeline, request.hostname, request.port);
+            timelineAdd(conn->timeline, TIMELINE_REQUEST, request.command);
         } else {
-            errno = 0;
-            if (connect(sock, addr->ai_addr, addr->ai_addrlen) != 0) {
-                printf("[INF] Failed to connect() remote socket to %s: %s\n", printAddressPort(addr, addrBuffer), strerror(errno));
-                close(sock);
-                sock = -1;
-            } else {
-                printf("[INF] Successfully connected to: %s (%s %s) %s %s (Flags: ", printFamily(addr), printType(addr), printProtocol(addr), addr->ai_canonname ? addr->ai_canonname : "-", printAddressPort(addr, addrBuf));
-                printFlags(addr);
-                printf(")\n");
+            slabFree(&conn->worker->timelineSlab, conn->timeline);
+            conn->timeline = NULL;
+        }
+    }
+
+    if (conn->accounting != NULL && parseStatus == PARSE_OK) {
+        struct AccountingRecord* record = conn->accounting;
+        record->command = request.command;
+        record->addressType = request.addressType;
+        record->port = request.port;
+        size_t hostLength = strlen(request.hostname);
+        record->hostLength = hostLength > ACCOUNTING_HOST_LENGTH ? ACCOUNTING_HOST_LENGTH : hostLength;
+        memcpy(record->host, request.hostname, record->hostLength);
+    }
+
+    // Check that the CMD the client specified is X'01' "connect" or X'03' "UDP associate". Otherwise, send and error
+    // and close the TCP connection.
+    if (request.command != 1 && request.command != 3) {
+        // The reply specified REP as X'07' "Command not supported", ATYP as IPv4 and BND as 0.0.0.0:0.
+        setErrorReply(conn, "\x05\x07\x00\x01\x00\x00\x00\x00\x00\x00");
+        return 0;
+    }
+
+    if (parseStatus == PARSE_ERROR) {
+        // The reply specified REP as X'08' "Address type not supported", ATYP as IPv4 and BND as 0.0.0.0:0.
+        setErrorReply(conn, "\x05\x08\x00\x01\x00\x00\x00\x00\x00\x00");
+        return 0;
+    }
+
+    // Whatever the client sent after the request is data for the remote server, which stays in the buffer until
+    // we're connected to it.
+    consumeInput(conn, consumed);
+    finishPhase(conn, METRICS_PHASE_REQUEST);
+
+    // A worker whose event loop runs late turns down new requests, so the tunnels it already has stay fast.
+    if (conn->worker->loopLagging) {
+        rejectRequest(conn, ADMISSION_REASON_LAG);
+        return 0;
+    }
+
+    // The client's address is checked against the access control list, picks the client's rate limit, and counts
+    // the client's tunnels.
+    if (!conn->clientAddressKnown && (aclEnabled() || shaperEnabled() || admissionClientTunnelsEnabled())) {
+        socklen_t clientAddressLength = sizeof(conn->clientAddress);
+        if (getpeername(conn->clientSocket, (struct sockaddr*)&conn->clientAddress, &clientAddressLength) != 0) {
+            logErrno(LOG_LEVEL_ERROR, "getpeername()");
+            return -1;
+        }
+        conn->clientAddressKnown = 1;
+    }
+
+    // The tunnel is turned down before anything is resolved or connected for it if there are as many as allowed.
+    enum AdmissionReason reason;
+    if (admissionTakeTunnel((struct sockaddr*)&conn->clientAddress, &conn->admissionClient, &reason) != 0) {
+        rejectRequest(conn, reason);
+        return 0;
+    }
+    conn->tunnelAdmitted = 1;
+
+    if (request.command == 3)
+        return handleUdpAssociate(conn, &request);
+
+    logInfo("Client asked to connect to: %s:%d", request.hostname, request.port);
+
+    // A rule for the requested domain name decides right away, before resolving it. Otherwise, the addresses it
+    // resolves to are checked once we have them.
+    if (aclEnabled()) {
+        conn->aclCheckAddresses = 1;
+        if (request.family == AF_UNSPEC) {
+            enum AclVerdict verdict = aclCheckHostname((struct sockaddr*)&conn->clientAddress, request.hostname, request.port, &conn->worker->metrics);
+            if (verdict == ACL_DENY) {
+                logError("Connection to %s not allowed by the access control list", request.hostname);
+                // The reply specified REP as X'02' "Connection not allowed by ruleset", ATYP as IPv4 and BND as 0.0.0.0:0.
+                setErrorReply(conn, "\x05\x02\x00\x01\x00\x00\x00\x00\x00\x00");
+                return 0;
             }
+            conn->aclCheckAddresses = verdict == ACL_NO_MATCH;
         }
     }
 
-    freeaddrinfo(*connectAddresses);
+    if (parentsEnabled())
+        return startParentTunnel(conn, &request);
 
-    if (sock == -1) {
-        printf("[ERR] Failed to connect to any of the available options.\n");
-        // The reply specified REP as X'05' "Connection refused", ATYP as IPv4 and BND as 0.0.0.0:0.
-        sendFull(clientSocket, "\x05\x05\x00\x01\x00\x00\x00\x00\x00\x00", 10, 0);
-        return -1;
+    // IP addresses are converted right away. Domain names go through the resolver, which answers right away if
+    // the name is cached, and otherwise resolves it on another thread and calls onResolved() once it's done.
+    struct addrinfo* addresses = NULL;
+    int gaiStatus;
+    if (request.family != AF_UNSPEC) {
+        gaiStatus = resolverNumeric(request.hostname, request.family, request.port, &addresses);
+    } else {
+        status = resolverLookup(&conn->worker->resolverClient, request.hostname, request.family, request.port, onResolved, conn, &conn->resolverWaiter, &addresses, &gaiStatus);
+        if (status == -2) {
+            rejectRequest(conn, ADMISSION_REASON_DNS);
+            return 0;
+        } else if (status < 0) {
+            logError("Failed to start resolving %s", request.hostname);
+            gaiStatus = EAI_MEMORY;
+        } else if (status == 0) {
+            conn->state = SOCKS5_STATE_RESOLVING;
+            return 0;
+        } else {
+            finishPhase(conn, METRICS_PHASE_DNS);
+            PROBE2(resolved, conn, gaiStatus);
+            noteEvent(conn, TIMELINE_RESOLVED, gaiStatus);
+        }
     }
 
-    *remoteSocket = sock;
+    handleResolved(conn, addresses, gaiStatus);
+    return 0;
+}
 
-    // Get and print the address and port at which our socket got bound.
-    struct sockaddr_storage boundAddress;
-    socklen_t boundAddressLen = sizeof(boundAddress);
-    if (getsockname(sock, (struct sockaddr*)&boundAddress, &boundAddressLen) >= 0) {
-        printSocketAddress((struct sockaddr*)&boundAddress, addrBuffer);
-        printf("[INF] Remote socket bound at %s\n", addrBuffer);
-    } else
-        perror("[WRN] Failed to getsockname() for remote socket");
+/**
+ * Once the handshake is over, the connection's timer only closes it if it stays idle for too long, if at all.
+ */
+static void startIdleTimer(struct Socks5Connection* conn) {
+    int idleTimeout = conn->worker->args->idleTimeout;
+    conn->lastActivity = getMonotonicMillis();
+    if (idleTimeout > 0)
+        timerSchedule(&conn->timer, idleTimeout * 1000ULL);
+    else
+        timerCancel(&conn->timer);
+}
 
-    // Send a server reply: SUCCESS, then send the address to which our socket is bound.
-    if (sendFull(clientSocket, "\x05\x00\x00", 3, 0) < 0)
-        return -1;
+int handleConnectAndReply(struct Socks5Connection* conn, int readyFd) {
+    char addrBuf[64];
+    char addrBuffer[128];
+    char flagsBuf[PRINT_FLAGS_LENGTH];
+    int status;
+
+    if (conn->state == SOCKS5_STATE_CONNECTING) {
+        enum ConnectorStatus connectStatus;
+
+        if (!conn->connectStarted) {
+            // Through a parent, the only address to connect to is the parent's.
+            struct addrinfo* addresses = conn->connectAddresses;
+            if (conn->parentHandshake != NULL) {
+                conn->parent = parentPick(&conn->worker->parentBalancer, conn->parentsTried);
+                conn->parentsTried |= 1u << conn->parent;
+                addresses = parentAddress(conn->parent);
+            }
 
-    switch (boundAddress.ss_family) {
-        case AF_INET:
-            // Send: '\x01' (ATYP identifier for IPv4) followed by the IP and PORT.
-            if (sendFull(clientSocket, "\x01", 1, 0) < 0)
-                return -1;
-            if (sendFull(clientSocket, &((struct sockaddr_in*)&boundAddress)->sin_addr, 4, 0) < 0)
-                return -1;
-            if (sendFull(clientSocket, &((struct sockaddr_in*)&boundAddress)->sin_port, 2, 0) < 0)
-                return -1;
-            break;
+            // Print all the addrinfo options, just for debugging.
+            if (logEnabled(LOG_LEVEL_DEBUG)) {
+                int aipIndex = 0;
+                for (struct addrinfo* aip = addresses; aip != NULL; aip = aip->ai_next)
+                    logDebug("Option %i: %s (%s %s) %s %s (Flags: %s)", aipIndex++, printFamily(aip), printType(aip), printProtocol(aip), aip->ai_canonname ? aip->ai_canonname : "-", printAddressPort(aip, addrBuf), printFlags(aip, flagsBuf));
+            }
 
-        case AF_INET6:
-            // Send: '\x04' (ATYP identifier for IPv6) followed by the IP and PORT.
-            if (sendFull(clientSocket, "\x04", 1, 0) < 0)
-                return -1;
-            if (sendFull(clientSocket, &((struct sockaddr_in6*)&boundAddress)->sin6_addr, 16, 0) < 0)
-                return -1;
-            if (sendFull(clientSocket, &((struct sockaddr_in6*)&boundAddress)->sin6_port, 2, 0) < 0)
-                return -1;
-            break;
+            // Start racing connections to the options, Happy Eyeballs style. The connector has its own deadline, so
+            // the handshake's timer stops until it's done.
+            const struct ServerArgs* args = conn->worker->args;
+            conn->connectStarted = 1;
+            conn->phaseStartedAt = getMonotonicMicros();
+            timerCancel(&conn->timer);
+            connectStatus = connectorStart(&conn->connector, conn->selector, &conn->worker->timers, addresses, &args->remoteSocketOptions, &conn->worker->sourcePool, conn->timeline, args->connectAttemptDelay, args->connectTimeout, remoteSocketHandler, conn);
+        } else {
+            connectStatus = connectorHandleEvent(&conn->connector, readyFd);
+        }
 
-        default:
-            // We don't know the address type? Send IPv4 0.0.0.0:0.
-            if (sendFull(clientSocket, "\x01\x00\x00\x00\x00\x00\x00", 7, 0) < 0)
+        if (connectStatus == CONNECTOR_IN_PROGRESS)
+            return 0;
+
+        // The client still has to take our reply (and a parent has to give us its own first).
+        timerSchedule(&conn->timer, conn->worker->args->handshakeTimeout);
+
+        if (connectStatus == CONNECTOR_FAILED && conn->parent >= 0) {
+            logError("Failed to connect to parent %s", parentName(conn->parent));
+            parentReportResult(conn->parent, 0, &conn->worker->metrics);
+            parentRelease(&conn->worker->parentBalancer, conn->parent);
+            conn->parent = -1;
+
+            // Another parent may do better, while there are others left to try.
+            if (__builtin_popcount(conn->parentsTried) < MAX_PARENT_TRIES && __builtin_popcount(conn->parentsTried) < parentCount()) {
+                conn->connectStarted = 0;
+                return handleConnectAndReply(conn, -1);
+            }
+        }
+
+        if (connectStatus == CONNECTOR_FAILED) {
+            finishPhase(conn, METRICS_PHASE_CONNECT);
+            logError("Failed to connect to any of the available options.");
+            resolverFreeAddresses(conn->connectAddresses);
+            conn->connectAddresses = NULL;
+
+            // The reply's REP depends on why the last attempt failed, with ATYP as IPv4 and BND as 0.0.0.0:0.
+            char errorMessage[10] = "\x05 \x00\x01\x00\x00\x00\x00\x00\x00";
+            int error = conn->connector.lastError;
+            errorMessage[1] =
+                error == ENETUNREACH                             ? '\x03'  // REP is "Network unreachable"
+                : (error == EHOSTUNREACH || error == ETIMEDOUT) ? '\x04'  // REP is "Host unreachable"
+                                                                : '\x05'; // REP is "Connection refused"
+            setErrorReply(conn, errorMessage);
+            return 0;
+        }
+
+        conn->remoteSocket = conn->connector.socket;
+        if (conn->accounting != NULL)
+            accountingSetAddress(&conn->accounting->remote, conn->connector.address->ai_addr);
+
+        // Through a parent, the tunnel isn't there until the parent connected to the destination.
+        if (conn->parentHandshake != NULL) {
+            logDebug("Connected to parent %s", parentName(conn->parent));
+            struct ParentHandshake* handshake = conn->parentHandshake;
+            handshake->outputLength = parentBuildHandshake(conn->parent, &handshake->request, handshake->output);
+            handshake->outputSent = 0;
+            handshake->inputLength = 0;
+            conn->state = SOCKS5_STATE_PARENT_HANDSHAKE;
+            return 0;
+        }
+
+        finishPhase(conn, METRICS_PHASE_CONNECT);
+        struct addrinfo* addr = conn->connector.address;
+        logInfo("Successfully connected to: %s (%s %s) %s %s (Flags: %s)", printFamily(addr), printType(addr), printProtocol(addr), addr->ai_canonname ? addr->ai_canonname : "-", printAddressPort(addr, addrBuf), printFlags(addr, flagsBuf));
+
+        resolverFreeAddresses(conn->connectAddresses);
+        conn->connectAddresses = NULL;
+
+        // Get and print the address and port at which our socket got bound.
+        struct sockaddr_storage boundAddress;
+        socklen_t boundAddressLen = sizeof(boundAddress);
+        if (getsockname(conn->remoteSocket, (struct sockaddr*)&boundAddress, &boundAddressLen) >= 0) {
+            if (logEnabled(LOG_LEVEL_DEBUG)) {
+                printSocketAddress((struct sockaddr*)&boundAddress, addrBuffer);
+                logDebug("Remote socket bound at %s", addrBuffer);
+            }
+        } else {
+            logErrno(LOG_LEVEL_WARN, "Failed to getsockname() for remote socket");
+            boundAddress.ss_family = AF_UNSPEC;
+        }
+
+        appendSuccessReply(conn, &boundAddress);
+        conn->state = SOCKS5_STATE_REPLY_WRITE;
+    }
+
+    if (conn->state == SOCKS5_STATE_REPLY_WRITE) {
+        if ((status = flushOutput(conn)) <= 0)
+            return status;
+        PROBE2(reply, conn, conn->replyCode);
+        noteEvent(conn, TIMELINE_REPLY, conn->replyCode);
+        finishHandshake(conn);
+
+        // A UDP association needs nothing else, its datagrams are relayed by its own socket.
+        if (conn->udpAssociation != NULL) {
+            releaseInput(conn);
+            conn->state = SOCKS5_STATE_UDP_ASSOCIATED;
+            startIdleTimer(conn);
+            return 0;
+        }
+
+        // The connection has been established! Now the client and requested server can talk to each other.
+        // The tunnel's bytes are taken from the buckets of the rate limits it's subject to, if any.
+        if (shaperEnabled()) {
+            shaperAcquire(&conn->limits, (struct sockaddr*)&conn->clientAddress, conn->authMethod == 2 ? conn->username : NULL);
+            shaperWaiterInit(&conn->clientWaiter, conn->clientSocket, clientSocketHandler, conn);
+            shaperWaiterInit(&conn->remoteWaiter, conn->remoteSocket, remoteSocketHandler, conn);
+        }
+
+        // In sockmap relay mode, the kernel takes over the tunnels that have no rate limits to count their bytes
+        // against, as soon as nothing is waiting in our buffers for them. With io_uring, the selector forwards the
+        // other tunnels itself, receiving each socket's data ahead and sending it on straight from its buffers.
+        // Otherwise, if we're relaying with splice(), each direction needs a pipe. If we can't get them, we just copy.
+        conn->sockmapWanted = sockmapEnabled() && conn->limits.bucketCount == 0;
+        if (!conn->sockmapWanted && selectorReceiveAhead(conn->selector, conn->clientSocket, SELECTOR_RECEIVE_BUFFER_SIZE) > 0 && selectorReceiveAhead(conn->selector, conn->remoteSocket, SELECTOR_RECEIVE_BUFFER_SIZE) > 0) {
+            relayBufferUseForwarding(&conn->clientToRemote, conn->selector);
+            relayBufferUseForwarding(&conn->remoteToClient, conn->selector);
+        } else {
+            selectorReceiveAhead(conn->selector, conn->clientSocket, 0);
+            if (conn->worker->args->useSplice && (relayBufferUseSplice(&conn->clientToRemote, &conn->worker->pipePool) != 0 || relayBufferUseSplice(&conn->remoteToClient, &conn->worker->pipePool) != 0)) {
+                logErrno(LOG_LEVEL_WARN, "Failed to get pipes for splice(), falling back to copying");
+                relayBufferRelease(&conn->clientToRemote, &conn->worker->pipePool, &conn->worker->bufferPool);
+            }
+        }
+
+        // Whatever the client sent right after its request is the start of its data for the remote server. The
+        // relay takes the input buffer it's in as its own, which is always written before anything read from the
+        // client later on.
+        struct BufferPool* bufferPool = &conn->worker->bufferPool;
+        if (conn->inputLength > 0) {
+            relayBufferAdopt(&conn->clientToRemote, conn->input, 0, conn->inputLength);
+            conn->input = NULL;
+            conn->inputLength = 0;
+            if (relayWrite(&conn->clientToRemote, conn->remoteSocket, bufferPool))
                 return -1;
-            break;
+        }
+
+        // Likewise, whatever a parent got from the destination along with its reply goes first to the client.
+        if (conn->parentHandshake != NULL) {
+            if (conn->parentHandshake->inputLength > 0) {
+                if (relayBufferReserve(&conn->remoteToClient, bufferPool) != 0) {
+                    logError("Not enough relay memory for the destination's first data");
+                    return -1;
+                }
+
+                struct iovec iov[2];
+                ringBufferWritableIov(&conn->remoteToClient.ring, iov);
+                memcpy(iov[0].iov_base, conn->parentHandshake->input, conn->parentHandshake->inputLength);
+                ringBufferCommit(&conn->remoteToClient.ring, conn->parentHandshake->inputLength);
+                if (relayWrite(&conn->remoteToClient, conn->clientSocket, bufferPool))
+                    return -1;
+            }
+            slabFree(&conn->worker->parentHandshakeSlab, conn->parentHandshake);
+            conn->parentHandshake = NULL;
+        }
+
+        bufferWaiterInit(&conn->remoteMemoryWaiter, conn->remoteSocket, remoteSocketHandler, conn);
+
+        // The relay phase lasts until the tunnel is closed.
+        conn->phaseStartedAt = getMonotonicMicros();
+        conn->tunnelEstablished = 1;
+        metricsAddGauge(&conn->worker->metrics.tunnelsActive, 1);
+        conn->state = SOCKS5_STATE_CONNECTED;
+        startIdleTimer(conn);
+        return attachSockmap(conn);
     }
 
     return 0;
 }
 
-int handleConnectionData(int clientSocket, int remoteSocket) {
+/**
+ * A parent failed to get the tunnel through: it'll be ejected if that keeps happening, and the client gets a general
+ * failure.
+ */
+static void failParentHandshake(struct Socks5Connection* conn, const char* reason) {
+    logError("Parent %s %s", parentName(conn->parent), reason);
+    parentReportResult(conn->parent, 0, &conn->worker->metrics);
+    finishPhase(conn, METRICS_PHASE_CONNECT);
+
+    // The reply specified REP as X'01' "General SOCKS server failure", ATYP as IPv4 and BND as 0.0.0.0:0.
+    setErrorReply(conn, "\x05\x01\x00\x01\x00\x00\x00\x00\x00\x00");
+}
+
+int handleParentHandshake(struct Socks5Connection* conn) {
+    struct ParentHandshake* handshake = conn->parentHandshake;
+
+    // The whole handshake usually goes out in the first send(), since the socket was just connected.
+    while (handshake->outputSent < handshake->outputLength) {
+        ssize_t sent = send(conn->remoteSocket, handshake->output + handshake->outputSent, handshake->outputLength - handshake->outputSent, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR)
+            continue;
+        if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        if (sent < 0) {
+            failParentHandshake(conn, "failed to take the handshake");
+            return 0;
+        }
+        handshake->outputSent += sent;
+    }
+
     ssize_t received;
-    char receiveBuffer[4096];
+    do {
+        received = recv(conn->remoteSocket, handshake->input + handshake->inputLength, sizeof(handshake->input) - handshake->inputLength, 0);
+    } while (received < 0 && errno == EINTR);
+
+    if (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        return 0;
+    if (received <= 0) {
+        failParentHandshake(conn, received == 0 ? "closed the connection during the handshake" : "failed during the handshake");
+        return 0;
+    }
+    handshake->inputLength += received;
+
+    // The method selection, authentication status and reply to the request, all at once if the parent is as quick.
+    struct Socks5Request reply;
+    size_t consumed;
+    enum ParseStatus parseStatus = parentParseReplies(conn->parent, handshake->input, handshake->inputLength, &reply, &consumed);
+    if (parseStatus == PARSE_INCOMPLETE && handshake->inputLength == sizeof(handshake->input))
+        parseStatus = PARSE_ERROR;
+    if (parseStatus == PARSE_INCOMPLETE)
+        return 0;
+    if (parseStatus == PARSE_ERROR) {
+        failParentHandshake(conn, "refused the handshake");
+        return 0;
+    }
 
-    // Create poll structures to say we are waiting for bytes to read on both sockets.
-    struct pollfd pollFds[2];
-    pollFds[0].fd = clientSocket;
-    pollFds[0].events = POLLIN;
-    pollFds[0].revents = 0;
-    pollFds[1].fd = remoteSocket;
-    pollFds[1].events = POLLIN;
-    pollFds[1].revents = 0;
+    // The parent did its part, even if the destination refused it, whose reply the client gets.
+    parentReportResult(conn->parent, 1, &conn->worker->metrics);
+    finishPhase(conn, METRICS_PHASE_CONNECT);
+    if (reply.command != 0) {
+        logError("Parent failed to connect to %s:%d, REP %d", handshake->request.hostname, handshake->request.port, reply.command);
+        char errorMessage[10] = "\x05 \x00\x01\x00\x00\x00\x00\x00\x00";
+        errorMessage[1] = (char)reply.command;
+        setErrorReply(conn, errorMessage);
+        return 0;
+    }
 
+    logInfo("Connected to %s:%d through parent %s", handshake->request.hostname, handshake->request.port, parentName(conn->parent));
+
+    // The client gets the address the parent's socket is bound to, where the destination sees the tunnel come from.
+    struct sockaddr_storage boundAddress;
+    memset(&boundAddress, 0, sizeof(boundAddress));
+    boundAddress.ss_family = reply.family;
+    if (reply.family == AF_INET) {
+        inet_pton(AF_INET, reply.hostname, &((struct sockaddr_in*)&boundAddress)->sin_addr);
+        ((struct sockaddr_in*)&boundAddress)->sin_port = htons(reply.port);
+    } else if (reply.family == AF_INET6) {
+        inet_pton(AF_INET6, reply.hostname, &((struct sockaddr_in6*)&boundAddress)->sin6_addr);
+        ((struct sockaddr_in6*)&boundAddress)->sin6_port = htons(reply.port);
+    }
+    appendSuccessReply(conn, &boundAddress);
+
+    // Whatever came after the replies is kept for the client, once it has its own reply.
+    handshake->inputLength -= consumed;
+    memmove(handshake->input, handshake->input + consumed, handshake->inputLength);
+    conn->state = SOCKS5_STATE_REPLY_WRITE;
+    return 0;
+}
+
+/**
+ * Takes up to maxBytes from a tunnel's socket into the direction towards the other side. If the direction is
+ * forwarded, the selector sends what it received ahead straight to the other socket, linking its next receive to the
+ * send unless the tunnel's rate limits have to grant each read first. Otherwise, or if the selector received nothing
+ * for lack of buffers, the socket is read into the direction's buffer. Returns like relayRead().
+ */
+static int relayTake(struct Socks5Connection* conn, struct RelayBuffer* buffer, int fromSocket, size_t maxBytes) {
+    if (buffer->selector != NULL) {
+        int toSocket = fromSocket == conn->clientSocket ? conn->remoteSocket : conn->clientSocket;
+        int status = relayForward(buffer, fromSocket, toSocket, maxBytes, conn->limits.bucketCount == 0);
+        if (status <= 0)
+            return status;
+    }
+
+    return relayRead(buffer, fromSocket, &conn->worker->pipePool, &conn->worker->bufferPool, maxBytes);
+}
+
+/**
+ * Takes what arrived on a tunnel's socket towards the other side, with relayTake(). If the tunnel has rate limits,
+ * the bytes are taken from their buckets first, and if they ran out of tokens, the direction waits for the shaper to resume
+ * it. If there's no buffer to read into, the direction waits for the buffer pool to resume it. Returns 0 if
+ * successful, or -1 if the socket failed.
+ */
+static int readShaped(struct Socks5Connection* conn, struct RelayBuffer* buffer, int fromSocket, struct ShaperWaiter* waiter, struct BufferWaiter* memoryWaiter) {
+    struct BufferPool* bufferPool = &conn->worker->bufferPool;
+    if (memoryWaiter->waiting)
+        return 0;
+
+    int status;
+    uint64_t readBefore = buffer->bytesRead;
+    if (conn->limits.bucketCount == 0) {
+        status = relayTake(conn, buffer, fromSocket, SIZE_MAX);
+    } else {
+        if (waiter->waiting || !relayBufferCanRead(buffer))
+            return 0;
+
+        size_t granted = shaperTake(&conn->limits);
+        if (granted == 0) {
+            metricsAdd(&conn->worker->metrics.shaperPauses, 1);
+            shaperWait(&conn->worker->shaperQueue, &conn->limits, waiter);
+            return 0;
+        }
+
+        status = relayTake(conn, buffer, fromSocket, granted);
+        shaperGiveBack(&conn->limits, granted - (buffer->bytesRead - readBefore));
+    }
+
+    // Each read is a chunk of the relay, from the client (direction 0) or from the destination (direction 1).
+    if (buffer->bytesRead != readBefore) {
+        int fromClient = fromSocket == conn->clientSocket;
+        PROBE3(relay, conn, !fromClient, buffer->bytesRead - readBefore);
+        noteEvent(conn, fromClient ? TIMELINE_RELAY_CLIENT : TIMELINE_RELAY_REMOTE, buffer->bytesRead - readBefore);
+    }
+
+    if (status > 0) {
+        bufferWait(bufferPool, memoryWaiter);
+        return 0;
+    }
+    return status;
+}
+
+/**
+ * Handles an event on a tunnel relayed by the kernel, where a socket becoming readable means it reached EOF.
+ */
+static int handleSockmapData(struct Socks5Connection* conn, int readyFd) {
+    char byte;
+    ssize_t received = recv(readyFd, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+    if (received > 0) {
+        logError("Data reached user space in a tunnel relayed by the kernel");
+        return -1;
+    }
+
+    if (received == 0) {
+        if (readyFd == conn->clientSocket)
+            conn->clientToRemote.readClosed = 1;
+        else
+            conn->remoteToClient.readClosed = 1;
+    } else if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+        return -1;
+    }
+
+    return updateSockmapTunnel(conn);
+}
+
+int handleConnectionData(struct Socks5Connection* conn, int readyFd, uint32_t events) {
     // What comes in through clientSocket, we send to remoteSocket. What comes in through remoteSocket, we send to clientSocket.
-    // This gets repeated until either the client or remote server closes the connection, at which point we close both connections.
-    int alive = 1;
-    do {
-        int pollResult = poll(pollFds, 2, -1);
-        if (pollResult < 0) {
-            printf("[ERR] Poll returned %d: ", pollResult);
-            perror(NULL);
+    // If a socket failed, the data still in flight can't be delivered anyway, so we close the whole tunnel.
+    if (events & EPOLLERR)
+        return -1;
+
+    if (conn->sockmapAttached)
+        return (events & (EPOLLIN | EPOLLHUP)) ? handleSockmapData(conn, readyFd) : 0;
+
+    int canRead = (events & (EPOLLIN | EPOLLHUP)) != 0;
+    int canWrite = (events & EPOLLOUT) != 0;
+    conn->lastActivity = getMonotonicMillis();
+
+    // We read whatever arrived, then try to write it to the other side right away. If the socket was writable,
+    // we write the data we have for it.
+    struct BufferPool* bufferPool = &conn->worker->bufferPool;
+    if (readyFd == conn->clientSocket) {
+        if (canRead && (readShaped(conn, &conn->clientToRemote, conn->clientSocket, &conn->clientWaiter, &conn->clientMemoryWaiter) || relayWrite(&conn->clientToRemote, conn->remoteSocket, bufferPool)))
             return -1;
-        }
+        if (canWrite && relayWrite(&conn->remoteToClient, conn->clientSocket, bufferPool))
+            return -1;
+    } else {
+        if (canRead && (readShaped(conn, &conn->remoteToClient, conn->remoteSocket, &conn->remoteWaiter, &conn->remoteMemoryWaiter) || relayWrite(&conn->remoteToClient, conn->clientSocket, bufferPool)))
+            return -1;
+        if (canWrite && relayWrite(&conn->clientToRemote, conn->remoteSocket, bufferPool))
+            return -1;
+    }
 
-        for (int i = 0; i < 2 && alive; i++) {
-            if (pollFds[i].revents == 0)
-                continue;
+    countRelayedBytes(conn);
 
-            received = recv(pollFds[i].fd, receiveBuffer, sizeof(receiveBuffer), 0);
-            if (received <= 0) {
-                alive = 0;
-            } else {
-                int otherSocket = pollFds[i].fd == clientSocket ? remoteSocket : clientSocket;
-                send(otherSocket, receiveBuffer, received, 0);
-            }
-        }
-    } while (alive);
+    // Each direction finishes on its own, once its source reached EOF and all its data was written. The tunnel is
+    // closed when both directions are finished.
+    if (conn->clientToRemote.writeClosed && conn->remoteToClient.writeClosed)
+        conn->state = SOCKS5_STATE_CLOSED;
 
+    // A tunnel meant for the kernel that had data waiting in our buffers goes to it once they're empty.
+    return attachSockmap(conn);
+}
+
+int handleUdpControl(struct Socks5Connection* conn) {
+    // The client isn't supposed to send anything else through the TCP connection, so we discard whatever it sends
+    // until it closes the connection, which ends the association.
+    char discardBuffer[READ_BUFFER_SIZE];
+    ssize_t received;
+    while ((received = selectorRecv(conn->selector, conn->clientSocket, discardBuffer, sizeof(discardBuffer))) > 0) {}
+    if (received == 0) {
+        conn->state = SOCKS5_STATE_CLOSED;
+        return 0;
+    }
+    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+        return -1;
     return 0;
-}
\ No newline at end of file
+}
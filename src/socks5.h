@@ -2,12 +2,202 @@
 #define _SOCKS5_H_
 
 #include <netdb.h>
+#include <stddef.h>
+#include <stdint.h>
 
-int handleClient(int clientSocket);
+#include "accounting.h"
+#include "admission.h"
+#include "bufferpool.h"
+#include "connector.h"
+#include "parents.h"
+#include "relay.h"
+#include "resolver.h"
+#include "selector.h"
+#include "shaper.h"
+#include "sockmap.h"
+#include "timeline.h"
+#include "udprelay.h"
+#include "worker.h"
 
-int handleAuthNegotiation(int clientSocket);
-int handleRequest(int clientSocket, struct addrinfo** addressConnectTo);
-int handleConnectAndReply(int clientSocket, struct addrinfo** addressConnectTo, int* remoteSocket);
-int handleConnectionData(int clientSocket, int remoteSocket);
+#define READ_BUFFER_SIZE 2048
+#define REPLY_BUFFER_SIZE 32
 
-#endif
\ No newline at end of file
+// Room for a parent's replies to our handshake, and whatever the destination sends right after them.
+#define PARENT_REPLY_BUFFER_SIZE 512
+
+/**
+ * The states a client connection goes through. Each state knows what it's waiting for (bytes to read from
+ * the client, bytes to write to the client, a connection to the remote server to complete, etc), so when
+ * the corresponding socket becomes ready we can resume the connection right where we left it off.
+ */
+enum Socks5State {
+    SOCKS5_STATE_AUTH_NEGOTIATION_READ,
+    SOCKS5_STATE_AUTH_NEGOTIATION_WRITE,
+    SOCKS5_STATE_AUTH_FAILED,
+    SOCKS5_STATE_USERPASS_READ,
+    SOCKS5_STATE_AUTHENTICATING,
+    SOCKS5_STATE_USERPASS_WRITE,
+    SOCKS5_STATE_REQUEST_READ,
+    SOCKS5_STATE_RESOLVING,
+    SOCKS5_STATE_CONNECTING,
+    SOCKS5_STATE_PARENT_HANDSHAKE,
+    SOCKS5_STATE_REPLY_WRITE,
+    SOCKS5_STATE_ERROR_WRITE,
+    SOCKS5_STATE_CONNECTED,
+    SOCKS5_STATE_UDP_ASSOCIATED,
+    SOCKS5_STATE_CLOSED
+};
+
+/**
+ * The handshake with a parent proxy, while a tunnel is being set up through one.
+ */
+struct ParentHandshake {
+    // The client's request, which is sent on to the parent.
+    struct Socks5Request request;
+
+    // The greeting, authentication and request for the parent, sent together, and how much of them was sent.
+    uint8_t output[PARENT_HANDSHAKE_MAX_LENGTH];
+    size_t outputLength;
+    size_t outputSent;
+
+    // The parent's replies, as they arrive. Bytes left after them are the destination's first data for the client.
+    uint8_t input[PARENT_REPLY_BUFFER_SIZE];
+    size_t inputLength;
+};
+
+struct Socks5Connection {
+    struct Worker* worker;
+    struct Selector* selector;
+    enum Socks5State state;
+
+    // The worker's other open connections, so it can close them all when it shuts down.
+    struct Socks5Connection* previous;
+    struct Socks5Connection* next;
+
+    int clientSocket;
+    int remoteSocket;
+
+    // Bytes received from the client during the handshake. Each recv() takes whatever the client sent so far, and
+    // the handshake messages are parsed from here, so a client that sends its greeting, request and first data
+    // without waiting for our replies is handled with a single recv(). Bytes left after the request are the
+    // first data for the remote server. The buffer (of the smallest class) comes from the worker's buffer pool, and
+    // only while it holds some bytes, or NULL otherwise.
+    uint8_t* input;
+    size_t inputLength;
+
+    // The auth method we selected for the client, and the user it authenticated as if it was username/password.
+    uint8_t authMethod;
+    char username[256];
+
+    // Replies waiting to be sent to the client. If more than one is pending, they are sent together.
+    uint8_t output[REPLY_BUFFER_SIZE];
+    size_t outputLength;
+    size_t outputSent;
+
+    // The client's address (if clientAddressKnown), and whether the destination's addresses must be checked against
+    // the access control list (only when there is one, and no rule for the requested domain name decided already).
+    struct sockaddr_storage clientAddress;
+    int clientAddressKnown;
+    int aclCheckAddresses;
+
+    // The verification in progress while a credential thread checks the client's username and password.
+    struct CredentialsJob* credentialsJob;
+
+    // The lookup in progress while we are resolving the requested domain name.
+    struct ResolverWaiter* resolverWaiter;
+
+    // The addresses we got from the resolver and the connector racing connections to them.
+    struct addrinfo* connectAddresses;
+    struct Connector connector;
+    int connectStarted;
+
+    // In parent proxy mode, the parent the tunnel goes through (or -1 if there's none yet), the parents already tried
+    // as a bit mask, and the handshake with the parent until it's done.
+    int parent;
+    uint32_t parentsTried;
+    struct ParentHandshake* parentHandshake;
+
+    // Data read from the client waiting to be sent to the remote server, and vice versa.
+    struct RelayBuffer clientToRemote;
+    struct RelayBuffer remoteToClient;
+
+    // The rate limits the tunnel is subject to, and each direction's place in the shaper's queue while its limits
+    // ran out of tokens.
+    struct ShaperLimits limits;
+    struct ShaperWaiter clientWaiter;
+    struct ShaperWaiter remoteWaiter;
+
+    // Reading from each socket (the client's during the handshake too) waits here while the relay memory limit
+    // leaves no room for a buffer to read into.
+    struct BufferWaiter clientMemoryWaiter;
+    struct BufferWaiter remoteMemoryWaiter;
+
+    // In sockmap relay mode, whether the tunnel is meant to be relayed by the kernel (once nothing is waiting in our
+    // buffers), and whether it is. While it is, its data goes around us, so we keep how many bytes the kernel
+    // redirected each way as of the last time we looked, and how long to wait before looking again whether a
+    // direction that reached EOF has all its data queued in the other socket.
+    int sockmapWanted;
+    int sockmapAttached;
+    struct SockmapTunnel sockmap;
+    uint64_t sockmapClientToRemote;
+    uint64_t sockmapRemoteToClient;
+    int sockmapDrainDelay;
+
+    // The association relaying the client's datagrams, if the client asked for a UDP ASSOCIATE instead of a CONNECT.
+    struct UdpAssociation* udpAssociation;
+
+    // Whether the connection counts as a handshake in progress for admission control, and whether it took a tunnel
+    // under the admission caps (along with its client's entry, if tunnels are counted for each client).
+    int handshakeCounted;
+    int tunnelAdmitted;
+    struct AdmissionClient* admissionClient;
+
+    // The connection's accounting record, filled in as it goes through its phases, if accounting is enabled.
+    struct AccountingRecord* accounting;
+
+    // The connection's timeline, if it's sampled.
+    struct Timeline* timeline;
+
+    // The REP code of the reply to the request (ACCOUNTING_NO_REPLY until there is one).
+    uint8_t replyCode;
+
+    // Closes the connection if the handshake takes too long, and then if the tunnel is idle for too long. While
+    // connecting to the destination, the connector's own timer takes over. The tunnel's last activity is only
+    // noted when data is relayed, and the timer checks it when it expires, so relaying never has to move the timer.
+    struct Timer timer;
+    uint64_t lastActivity;
+
+    // When the current phase of the connection started (in microseconds), for the worker's latency histograms.
+    uint64_t phaseStartedAt;
+    int tunnelEstablished;
+
+    // How much of each direction's relayed bytes were already added to the worker's metrics.
+    uint64_t countedClientToRemote;
+    uint64_t countedRemoteToClient;
+};
+
+/**
+ * Starts handling a newly accepted client. The client socket must be non-blocking. The connection will be
+ * handled by the given worker, and its sockets will be closed once the connection finishes. The client's address
+ * may be given if it was already looked up, or NULL otherwise.
+ * Returns 0 if successful, or -1 if the connection couldn't be set up (in which case the socket is closed).
+ */
+int handleClient(struct Worker* worker, int clientSocket, const struct sockaddr_storage* clientAddress);
+
+/**
+ * Closes every connection the worker has open, accounting for them as ended by the shutdown.
+ */
+void closeAllConnections(struct Worker* worker);
+
+// Each of these continue a connection on its current state. They return 0 if the connection should keep
+// going (either because it moved on to another state or because it's waiting for a socket to be ready),
+// or -1 if the connection failed and must be closed.
+int handleAuthNegotiation(struct Socks5Connection* conn);
+int handleUserPass(struct Socks5Connection* conn);
+int handleRequest(struct Socks5Connection* conn);
+int handleConnectAndReply(struct Socks5Connection* conn, int readyFd);
+int handleParentHandshake(struct Socks5Connection* conn);
+int handleConnectionData(struct Socks5Connection* conn, int readyFd, uint32_t events);
+int handleUdpControl(struct Socks5Connection* conn);
+
+#endif
@@ -0,0 +1,72 @@
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "logger.h"
+#include "sourcepool.h"
+#include "util.h"
+
+void sourcePoolInit(struct SourcePool* pool, const struct SourceAddress* addresses, int count, enum SourceSelection selection, struct Metrics* metrics) {
+    memset(pool, 0, sizeof(*pool));
+    pool->addresses = addresses;
+    pool->selection = selection;
+    pool->metrics = metrics;
+
+    for (int i = 0; i < count; i++) {
+        if (addresses[i].address.ss_family == AF_INET)
+            pool->indexes4[pool->count4++] = i;
+        else
+            pool->indexes6[pool->count6++] = i;
+    }
+}
+
+int sourcePoolSize(const struct SourcePool* pool, const struct sockaddr* destination) {
+    return destination->sa_family == AF_INET ? pool->count4 : pool->count6;
+}
+
+/**
+ * Hashes the destination's address (not its port, so every service of a host sees the same source address) with
+ * FNV-1a.
+ */
+static uint32_t hashDestination(const struct sockaddr* destination) {
+    const uint8_t* bytes;
+    int length = sockAddrKeyBytes(destination, &bytes);
+    return fnv1a(bytes, length);
+}
+
+int sourcePoolBind(struct SourcePool* pool, int fd, const struct sockaddr* destination, int retry) {
+    const int* indexes = destination->sa_family == AF_INET ? pool->indexes4 : pool->indexes6;
+    int count = sourcePoolSize(pool, destination);
+    if (count == 0)
+        return -2;
+
+    // Round robin moves on with every socket, retries included, so a retry takes the next address by itself.
+    unsigned int position;
+    if (pool->selection == SOURCE_SELECTION_HASH)
+        position = hashDestination(destination) + retry;
+    else if (destination->sa_family == AF_INET)
+        position = pool->next4++;
+    else
+        position = pool->next6++;
+    int index = indexes[position % count];
+
+    // Without this, bind() would pick a port right away, one that's unused for every destination.
+    int one = 1;
+    if (setsockopt(fd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &one, sizeof(one)) != 0)
+        logErrno(LOG_LEVEL_DEBUG, "setsockopt(IP_BIND_ADDRESS_NO_PORT)");
+
+    const struct SourceAddress* source = &pool->addresses[index];
+    if (bind(fd, (const struct sockaddr*)&source->address, source->addressLength) != 0) {
+        int error = errno;
+        logDebug("Failed to bind() remote socket to %s: %s", source->name, strerror(error));
+        errno = error;
+        return -1;
+    }
+
+    metricsAdd(&pool->metrics->sourceAddressConnections[index], 1);
+    return index;
+}
+
+void sourcePoolCountExhausted(struct SourcePool* pool, int index) {
+    metricsAdd(&pool->metrics->sourceAddressExhausted[index], 1);
+}
@@ -0,0 +1,85 @@
+#ifndef _SOURCEPOOL_H_
+#define _SOURCEPOOL_H_
+
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include "metrics.h"
+
+// The most local addresses outgoing connections can be spread over.
+#define MAX_SOURCE_ADDRESSES METRICS_MAX_SOURCE_ADDRESSES
+
+/**
+ * A local address outgoing connections to destinations may come from.
+ */
+struct SourceAddress {
+    struct sockaddr_storage address;
+    socklen_t addressLength;
+
+    // The address as text, for the logs and the metrics' labels.
+    char name[INET6_ADDRSTRLEN];
+};
+
+/**
+ * How the source address of each outgoing connection is picked among those of the destination's family.
+ */
+enum SourceSelection {
+    // Each connection takes the next address, spreading them evenly.
+    SOURCE_SELECTION_ROUND_ROBIN,
+
+    // The destination's address picks the source address, so a destination always sees connections coming from the
+    // same one (as long as it has ports left).
+    SOURCE_SELECTION_HASH
+};
+
+/**
+ * Every outgoing connection takes a port from the kernel's ephemeral range, and since a connection is told apart by
+ * its addresses and ports, a single local address can only have so many connections open to the same destination
+ * (and bind() without a port takes one that's unused for every destination). Binding outgoing sockets to a pool of
+ * local addresses multiplies that by the size of the pool.
+ *
+ * Sockets are bound with IP_BIND_ADDRESS_NO_PORT, which leaves picking the port to connect(): it then only needs the
+ * port to be unused towards that destination, instead of unused altogether. If connect() still runs out of ports,
+ * the connection is retried from the next address of the pool.
+ *
+ * Each worker has its own pool, so no locking is needed, and counts the connections from each address in its metrics.
+ */
+struct SourcePool {
+    const struct SourceAddress* addresses;
+    enum SourceSelection selection;
+
+    // The indexes of the addresses of each family, and which one round robin takes next.
+    int indexes4[MAX_SOURCE_ADDRESSES];
+    int count4;
+    int indexes6[MAX_SOURCE_ADDRESSES];
+    int count6;
+    unsigned int next4;
+    unsigned int next6;
+
+    struct Metrics* metrics;
+};
+
+/**
+ * Initializes a pool over the given addresses (which must outlive it), counting their usage in the given metrics.
+ */
+void sourcePoolInit(struct SourcePool* pool, const struct SourceAddress* addresses, int count, enum SourceSelection selection, struct Metrics* metrics);
+
+/**
+ * Binds a socket that's about to connect to the given destination to an address of the pool, the retry-th one after
+ * the address the selection picks (so retrying a connection goes through the pool). Returns the index of the address,
+ * -2 if the pool has no address of the destination's family (and the socket was left alone), or -1 if an error
+ * occurred.
+ */
+int sourcePoolBind(struct SourcePool* pool, int fd, const struct sockaddr* destination, int retry);
+
+/**
+ * Returns how many addresses the pool has for the family of the given destination.
+ */
+int sourcePoolSize(const struct SourcePool* pool, const struct sockaddr* destination);
+
+/**
+ * Counts a connect() that failed because the address at the given index had no ports left.
+ */
+void sourcePoolCountExhausted(struct SourcePool* pool, int index);
+
+#endif
@@ -0,0 +1,258 @@
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "logger.h"
+#include "timeline.h"
+#include "util.h"
+
+// The index of connection attempts to addresses that didn't fit in the timeline's addresses.
+#define TIMELINE_NO_ADDRESS 0xFF
+
+static const char* eventNames[TIMELINE_EVENT_TYPE_COUNT] = {"accepted", "greeting", "method", "authenticated", "request", "resolved", "connect_attempt", "connect_failed", "connected", "reply", "relay_client", "relay_remote", "close"};
+
+static const char* closeReasonNames[ACCOUNTING_CLOSE_REASON_COUNT] = {"done", "error", "handshake_timeout", "idle_timeout", "shutdown"};
+
+/**
+ * An address prefix to match against, with IPv4 addresses stored as IPv4-mapped IPv6 addresses. A prefix length
+ * of -1 means there's no prefix.
+ */
+struct TimelinePrefix {
+    uint8_t address[16];
+    int length;
+};
+
+static struct {
+    int sampleRate;
+    struct TimelinePrefix client;
+
+    // The destination filter is either an address prefix, or a domain name (empty if there's none).
+    struct TimelinePrefix destination;
+    char destinationName[256];
+
+    // The finished timelines, the next one being written at head % TIMELINE_RING_SIZE.
+    pthread_mutex_t lock;
+    struct Timeline* ring;
+    uint64_t head;
+} timelines = {.client = {.length = -1}, .destination = {.length = -1}, .lock = PTHREAD_MUTEX_INITIALIZER};
+
+int timelineInit(int sampleRate, const char* clientFilter, const char* destinationFilter) {
+    if (clientFilter != NULL && parseMappedPrefix(clientFilter, timelines.client.address, &timelines.client.length) != 0) {
+        logError("Invalid timeline client filter: %s (must be an address, optionally followed by /length)", clientFilter);
+        return -1;
+    }
+
+    // A destination that isn't an address prefix is a domain name, kept in lowercase without a leading "*." or "."
+    // nor a trailing "." so it can be compared with the end of the requested name.
+    if (destinationFilter != NULL && parseMappedPrefix(destinationFilter, timelines.destination.address, &timelines.destination.length) != 0 && normalizeDomainName(destinationFilter, timelines.destinationName) != 0) {
+        logError("Invalid timeline destination filter: %s (must be a domain name, or an address optionally followed by /length)", destinationFilter);
+        return -1;
+    }
+
+    // Filtering without a sample rate samples every tunnel that matches.
+    int filtered = clientFilter != NULL || destinationFilter != NULL;
+    timelines.sampleRate = sampleRate == 0 && filtered ? 1 : sampleRate;
+    if (timelines.sampleRate == 0)
+        return 0;
+
+    timelines.ring = calloc(TIMELINE_RING_SIZE, sizeof(struct Timeline));
+    if (timelines.ring == NULL) {
+        logError("Failed to allocate memory for the timelines");
+        return -1;
+    }
+
+    logInfo("Sampling one in every %d tunnels%s for timelines", timelines.sampleRate, filtered ? " matching the filters" : "");
+    return 0;
+}
+
+int timelineEnabled() {
+    return timelines.sampleRate > 0;
+}
+
+int timelineNeedsClientAddress() {
+    return timelines.client.length >= 0;
+}
+
+static int sample(uint64_t* counter) {
+    return (*counter)++ % timelines.sampleRate == 0;
+}
+
+static int hasDestinationFilter() {
+    return timelines.destination.length >= 0 || timelines.destinationName[0] != '\0';
+}
+
+int timelineSampleClient(uint64_t* counter, const struct sockaddr* client) {
+    if (timelines.client.length >= 0) {
+        uint8_t mapped[16];
+        if (client == NULL || sockAddrToMapped(client, mapped) != 0 || !addressPrefixMatches(timelines.client.address, mapped, timelines.client.length))
+            return 0;
+    }
+
+    // With a destination filter, the tunnels are counted towards the sample rate once we know whether they match it.
+    return hasDestinationFilter() ? 1 : sample(counter);
+}
+
+int timelineSampleRequest(uint64_t* counter, const char* host, int family) {
+    if (!hasDestinationFilter())
+        return 1;
+
+    int matches;
+    if (timelines.destination.length >= 0) {
+        // An address prefix only matches requests for an address, the names' addresses aren't known yet.
+        uint8_t mapped[16];
+        int length;
+        matches = family != AF_UNSPEC && parseMappedPrefix(host, mapped, &length) == 0 && addressPrefixMatches(timelines.destination.address, mapped, timelines.destination.length);
+    } else {
+        // A domain name matches itself and its subdomains.
+        size_t hostLength = strlen(host);
+        size_t nameLength = strlen(timelines.destinationName);
+        if (hostLength > 0 && host[hostLength - 1] == '.')
+            hostLength--;
+        matches = family == AF_UNSPEC && hostLength >= nameLength && strncasecmp(host + hostLength - nameLength, timelines.destinationName, nameLength) == 0 && (hostLength == nameLength || host[hostLength - nameLength - 1] == '.');
+    }
+
+    return matches && sample(counter);
+}
+
+void timelineStart(struct Timeline* timeline, int worker, const struct sockaddr* client) {
+    timeline->startedAt = accountingNow();
+    timeline->startedMicros = getMonotonicMicros();
+    timeline->worker = worker;
+    timeline->sampled = !hasDestinationFilter();
+    if (client != NULL)
+        accountingSetAddress(&timeline->client, client);
+    timelineAdd(timeline, TIMELINE_ACCEPTED, 0);
+}
+
+void timelineSetDestination(struct Timeline* timeline, const char* host, int port) {
+    strncpy(timeline->host, host, ACCOUNTING_HOST_LENGTH);
+    timeline->host[ACCOUNTING_HOST_LENGTH] = '\0';
+    timeline->port = port;
+    timeline->sampled = 1;
+}
+
+/**
+ * Adds an event, keeping the last slot for the close so a timeline always shows how it ended.
+ */
+static void addEvent(struct Timeline* timeline, enum TimelineEventType type, int address, int64_t value) {
+    if (timeline->eventCount >= TIMELINE_MAX_EVENTS - (type == TIMELINE_CLOSE ? 0 : 1)) {
+        timeline->droppedEvents++;
+        return;
+    }
+
+    struct TimelineEvent* event = &timeline->events[timeline->eventCount++];
+    event->micros = (uint32_t)(getMonotonicMicros() - timeline->startedMicros);
+    event->type = type;
+    event->address = address;
+    event->value = value;
+}
+
+void timelineAdd(struct Timeline* timeline, enum TimelineEventType type, int64_t value) {
+    addEvent(timeline, type, TIMELINE_NO_ADDRESS, value);
+}
+
+void timelineAddConnect(struct Timeline* timeline, enum TimelineEventType type, const struct sockaddr* address, int64_t value) {
+    struct AccountingAddress converted;
+    accountingSetAddress(&converted, address);
+
+    int index = 0;
+    while (index < timeline->addressCount && memcmp(&timeline->addresses[index], &converted, sizeof(converted)) != 0)
+        index++;
+    if (index == timeline->addressCount) {
+        if (index == MAX_CONNECT_ADDRESSES)
+            index = TIMELINE_NO_ADDRESS;
+        else
+            timeline->addresses[timeline->addressCount++] = converted;
+    }
+
+    addEvent(timeline, type, index, value);
+}
+
+void timelineFinish(const struct Timeline* finished) {
+    if (!finished->sampled)
+        return;
+
+    pthread_mutex_lock(&timelines.lock);
+    timelines.ring[timelines.head++ % TIMELINE_RING_SIZE] = *finished;
+    pthread_mutex_unlock(&timelines.lock);
+}
+
+static void writeAddress(FILE* out, const struct AccountingAddress* address) {
+    char text[INET6_ADDRSTRLEN];
+    if (address->family == 4)
+        fprintf(out, "\"%s:%u\"", inet_ntop(AF_INET, address->address, text, sizeof(text)), address->port);
+    else if (address->family == 6)
+        fprintf(out, "\"[%s]:%u\"", inet_ntop(AF_INET6, address->address, text, sizeof(text)), address->port);
+    else
+        fputs("null", out);
+}
+
+/**
+ * Writes a string as a JSON string. The requested host is whatever the client sent, so anything but printable ASCII
+ * is escaped.
+ */
+static void writeString(FILE* out, const char* text) {
+    fputc('"', out);
+    for (const unsigned char* c = (const unsigned char*)text; *c != '\0'; c++) {
+        if (*c == '"' || *c == '\\')
+            fprintf(out, "\\%c", *c);
+        else if (*c < 0x20 || *c >= 0x7F)
+            fprintf(out, "\\u%04x", *c);
+        else
+            fputc(*c, out);
+    }
+    fputc('"', out);
+}
+
+static void writeTimeline(FILE* out, const struct Timeline* timeline) {
+    fprintf(out, "{\"started_at\":%lu,\"worker\":%d,\"client\":", (unsigned long)timeline->startedAt, timeline->worker);
+    writeAddress(out, &timeline->client);
+    fputs(",\"host\":", out);
+    writeString(out, timeline->host);
+    fprintf(out, ",\"port\":%d,\"dropped_events\":%u,\"events\":[", timeline->port, timeline->droppedEvents);
+
+    for (int i = 0; i < timeline->eventCount; i++) {
+        const struct TimelineEvent* event = &timeline->events[i];
+        fprintf(out, "%s{\"micros\":%u,\"event\":\"%s\"", i == 0 ? "" : ",", event->micros, eventNames[event->type]);
+        if (event->type == TIMELINE_CONNECT_ATTEMPT || event->type == TIMELINE_CONNECT_FAILED || event->type == TIMELINE_CONNECTED) {
+            fputs(",\"address\":", out);
+            if (event->address == TIMELINE_NO_ADDRESS)
+                fputs("null", out);
+            else
+                writeAddress(out, &timeline->addresses[event->address]);
+        }
+
+        if (event->type == TIMELINE_CLOSE && event->value >= 0 && event->value < ACCOUNTING_CLOSE_REASON_COUNT)
+            fprintf(out, ",\"reason\":\"%s\"", closeReasonNames[event->value]);
+        else if (event->type != TIMELINE_ACCEPTED && event->type != TIMELINE_CONNECT_ATTEMPT && event->type != TIMELINE_CONNECTED)
+            fprintf(out, ",\"value\":%ld", (long)event->value);
+        fputc('}', out);
+    }
+
+    fputs("]}\n", out);
+}
+
+void timelineWriteJson(FILE* out) {
+    if (timelines.ring == NULL)
+        return;
+
+    // The timelines are copied out under the lock, so the workers never wait for a slow reader.
+    struct Timeline* copy = malloc(TIMELINE_RING_SIZE * sizeof(struct Timeline));
+    if (copy == NULL) {
+        logError("Failed to allocate memory to dump the timelines");
+        return;
+    }
+
+    pthread_mutex_lock(&timelines.lock);
+    uint64_t head = timelines.head;
+    int count = head < TIMELINE_RING_SIZE ? (int)head : TIMELINE_RING_SIZE;
+    for (int i = 0; i < count; i++)
+        copy[i] = timelines.ring[(head - count + i) % TIMELINE_RING_SIZE];
+    pthread_mutex_unlock(&timelines.lock);
+
+    for (int i = 0; i < count; i++)
+        writeTimeline(out, &copy[i]);
+    free(copy);
+}
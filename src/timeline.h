@@ -0,0 +1,151 @@
+#ifndef _TIMELINE_H_
+#define _TIMELINE_H_
+
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/socket.h>
+
+#include "accounting.h"
+#include "connector.h"
+
+/**
+ * Timelines follow a sample of the tunnels through their whole life, for profiling a specific client or destination
+ * in production without turning on debug logging for everyone. A sampled connection gets a timeline, where each of
+ * its events (the same ones that fire the USDT probes) is noted along with how long after the connection was
+ * accepted it happened. Once the connection is closed, its timeline is copied into a ring holding the last
+ * TIMELINE_RING_SIZE of them, which the admin listener dumps at /timelines.
+ *
+ * One in every N tunnels is sampled, of those matching the filters if there are any: the client's address may have
+ * to be in a prefix, and the requested destination may have to be a domain name (or one of its subdomains) or an
+ * address in a prefix. Timelines are taken for connections as they're accepted, and dropped once their request
+ * turns out not to be sampled, so the ones kept start at the very beginning.
+ */
+
+// How many events a timeline holds. Events past these are counted, but not kept (except for the close).
+#define TIMELINE_MAX_EVENTS 64
+
+// How many finished timelines are kept for the admin listener.
+#define TIMELINE_RING_SIZE 256
+
+enum TimelineEventType {
+    TIMELINE_ACCEPTED,
+    // The greeting arrived (value: how many methods the client offered).
+    TIMELINE_GREETING,
+    // The auth method was chosen (value: the method, or 0xFF if the client offered none we take).
+    TIMELINE_METHOD,
+    // The client sent its username and password (value: 1 if they were valid, 0 otherwise).
+    TIMELINE_AUTHENTICATED,
+    // The request was parsed (value: its CMD).
+    TIMELINE_REQUEST,
+    // The destination's domain name was resolved (value: getaddrinfo()'s status, 0 if successful).
+    TIMELINE_RESOLVED,
+    // A connection attempt to one of the destination's addresses started, failed (value: the error) or succeeded.
+    TIMELINE_CONNECT_ATTEMPT,
+    TIMELINE_CONNECT_FAILED,
+    TIMELINE_CONNECTED,
+    // The reply to the request was sent (value: its REP).
+    TIMELINE_REPLY,
+    // Bytes were read from the client, or from the destination (value: how many).
+    TIMELINE_RELAY_CLIENT,
+    TIMELINE_RELAY_REMOTE,
+    // The connection was closed (value: its enum AccountingCloseReason).
+    TIMELINE_CLOSE,
+    TIMELINE_EVENT_TYPE_COUNT
+};
+
+struct TimelineEvent {
+    // How long after the connection was accepted the event happened, in microseconds.
+    uint32_t micros;
+    uint8_t type;
+    // For connection attempts, the index of the address in the timeline's addresses.
+    uint8_t address;
+    uint16_t reserved;
+    int64_t value;
+};
+
+struct Timeline {
+    // When the connection was accepted, in microseconds since the epoch and on the monotonic clock.
+    uint64_t startedAt;
+    uint64_t startedMicros;
+
+    int worker;
+    struct AccountingAddress client;
+
+    // Whether the tunnel is sampled. With a destination filter, that's only known once the request is parsed.
+    int sampled;
+
+    // The requested destination, once the request is parsed.
+    char host[ACCOUNTING_HOST_LENGTH + 1];
+    int port;
+
+    // The addresses connection attempts were made to.
+    struct AccountingAddress addresses[MAX_CONNECT_ADDRESSES];
+    int addressCount;
+
+    struct TimelineEvent events[TIMELINE_MAX_EVENTS];
+    int eventCount;
+    uint32_t droppedEvents;
+};
+
+/**
+ * Sets up sampling one in every sampleRate tunnels (0 to sample none, unless there's a filter, which samples every
+ * matching tunnel), among those from clients in clientFilter and to destinations matching destinationFilter (either
+ * may be NULL to match any). Returns 0 if successful, or -1 if a filter is invalid.
+ */
+int timelineInit(int sampleRate, const char* clientFilter, const char* destinationFilter);
+
+/**
+ * Whether any tunnels are being sampled.
+ */
+int timelineEnabled();
+
+/**
+ * Whether the client's address must be known for timelineSampleClient().
+ */
+int timelineNeedsClientAddress();
+
+/**
+ * Decides whether a newly accepted connection gets a timeline, counting it towards the sample rate with the given
+ * counter (one per worker) unless it's only decided once the request is known. The client's address may be NULL if
+ * it's not known.
+ */
+int timelineSampleClient(uint64_t* counter, const struct sockaddr* client);
+
+/**
+ * Decides whether a connection that got a timeline keeps it once its request is parsed.
+ */
+int timelineSampleRequest(uint64_t* counter, const char* host, int family);
+
+/**
+ * Starts a timeline for a newly accepted connection.
+ */
+void timelineStart(struct Timeline* timeline, int worker, const struct sockaddr* client);
+
+/**
+ * Notes the requested destination, of a connection that keeps its timeline.
+ */
+void timelineSetDestination(struct Timeline* timeline, const char* host, int port);
+
+/**
+ * Notes an event.
+ */
+void timelineAdd(struct Timeline* timeline, enum TimelineEventType type, int64_t value);
+
+/**
+ * Notes an event about a connection attempt to the given address.
+ */
+void timelineAddConnect(struct Timeline* timeline, enum TimelineEventType type, const struct sockaddr* address, int64_t value);
+
+/**
+ * Copies a finished timeline into the ring, unless its connection closed before it was known to be sampled. May be
+ * called from any thread.
+ */
+void timelineFinish(const struct Timeline* timeline);
+
+/**
+ * Writes out the timelines in the ring as JSON, one per line, from the oldest to the newest. May be called from any
+ * thread.
+ */
+void timelineWriteJson(FILE* out);
+
+#endif
@@ -0,0 +1,202 @@
+#include <limits.h>
+
+#include "timerwheel.h"
+#include "util.h"
+
+#define SLOT_MASK (TIMER_WHEEL_SLOTS - 1)
+
+// The furthest deadline the wheel can hold, counting from its current tick.
+#define WHEEL_SPAN (1ULL << (TIMER_WHEEL_LEVELS * TIMER_WHEEL_SLOT_BITS))
+
+static void listRemove(struct Timer* timer) {
+    timer->previous->next = timer->next;
+    timer->next->previous = timer->previous;
+    timer->next = timer->previous = timer;
+}
+
+static void listAppend(struct Timer* head, struct Timer* timer) {
+    timer->previous = head->previous;
+    timer->next = head;
+    head->previous->next = timer;
+    head->previous = timer;
+}
+
+/**
+ * Puts a timer in the slot of the lowest level that reaches its deadline, or the given earliest tick if the deadline
+ * is before it. That's the next tick when scheduling, but while cascading it's the tick about to run.
+ */
+static void insert(struct TimerWheel* wheel, struct Timer* timer, uint64_t earliest) {
+    uint64_t deadline = timer->deadline;
+    if (deadline < earliest)
+        deadline = earliest;
+    else if (deadline - wheel->now >= WHEEL_SPAN)
+        deadline = wheel->now + WHEEL_SPAN - 1;
+
+    // The level is the lowest one where the deadline falls less than a whole turn of slots away. At level 0 that's
+    // a slot per tick, at level 1 a slot per TIMER_WHEEL_SLOTS ticks, and so on.
+    int level = 0;
+    while (level < TIMER_WHEEL_LEVELS - 1 && (deadline >> (level * TIMER_WHEEL_SLOT_BITS)) - (wheel->now >> (level * TIMER_WHEEL_SLOT_BITS)) >= TIMER_WHEEL_SLOTS)
+        level++;
+
+    int slot = (deadline >> (level * TIMER_WHEEL_SLOT_BITS)) & SLOT_MASK;
+    timer->level = level;
+    timer->slot = slot;
+    listAppend(&wheel->slots[level][slot], timer);
+    wheel->occupied[level] |= 1ULL << slot;
+}
+
+static void removeFromSlot(struct TimerWheel* wheel, struct Timer* timer) {
+    struct Timer* head = &wheel->slots[timer->level][timer->slot];
+    listRemove(timer);
+    if (head->next == head)
+        wheel->occupied[timer->level] &= ~(1ULL << timer->slot);
+}
+
+/**
+ * Takes all the timers out of a slot, into the given list.
+ */
+static void takeSlot(struct TimerWheel* wheel, int level, int slot, struct Timer* list) {
+    struct Timer* head = &wheel->slots[level][slot];
+    list->next = list->previous = list;
+    if (head->next != head) {
+        list->next = head->next;
+        list->previous = head->previous;
+        list->next->previous = list;
+        list->previous->next = list;
+        head->next = head->previous = head;
+    }
+    wheel->occupied[level] &= ~(1ULL << slot);
+}
+
+void timerWheelInit(struct TimerWheel* wheel) {
+    wheel->now = getMonotonicMillis();
+    wheel->count = 0;
+    for (int level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+        wheel->occupied[level] = 0;
+        for (int slot = 0; slot < TIMER_WHEEL_SLOTS; slot++)
+            wheel->slots[level][slot].next = wheel->slots[level][slot].previous = &wheel->slots[level][slot];
+    }
+}
+
+int timerWheelTimeout(const struct TimerWheel* wheel) {
+    if (wheel->count == 0)
+        return -1;
+
+    // For each level, the first non-empty slot after the current one tells the next tick the wheel has something to
+    // do: run the timers of a level 0 slot, or cascade a higher level's slot.
+    uint64_t next = UINT64_MAX;
+    for (int level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+        uint64_t occupied = wheel->occupied[level];
+        if (occupied == 0)
+            continue;
+
+        int shift = level * TIMER_WHEEL_SLOT_BITS;
+        uint64_t current = wheel->now >> shift;
+        int first = (current + 1) & SLOT_MASK;
+        uint64_t rotated = first == 0 ? occupied : (occupied >> first) | (occupied << (TIMER_WHEEL_SLOTS - first));
+        uint64_t tick = (current + 1 + __builtin_ctzll(rotated)) << shift;
+        if (tick < next)
+            next = tick;
+    }
+
+    uint64_t now = getMonotonicMillis();
+    if (next <= now)
+        return 0;
+    return next - now > INT_MAX ? INT_MAX : (int)(next - now);
+}
+
+void timerWheelAdvance(struct TimerWheel* wheel) {
+    uint64_t target = getMonotonicMillis();
+    struct Timer expired;
+
+    while (wheel->now < target) {
+        if (wheel->count == 0) {
+            wheel->now = target;
+            break;
+        }
+
+        // Skip straight past the ticks that have nothing to do: while a level is empty, nothing happens until the
+        // next slot of the level above it starts.
+        uint64_t next = wheel->now + 1;
+        for (int level = 0; level < TIMER_WHEEL_LEVELS - 1 && wheel->occupied[level] == 0; level++) {
+            int shift = (level + 1) * TIMER_WHEEL_SLOT_BITS;
+            next = ((wheel->now >> shift) + 1) << shift;
+        }
+        if (next > target) {
+            wheel->now = target;
+            break;
+        }
+        wheel->now = next;
+
+        // Entering a higher level's slot spreads its timers over the lower levels.
+        for (int level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+            int shift = level * TIMER_WHEEL_SLOT_BITS;
+            if ((next & ((1ULL << shift) - 1)) != 0)
+                break;
+
+            takeSlot(wheel, level, (next >> shift) & SLOT_MASK, &expired);
+            while (expired.next != &expired) {
+                struct Timer* timer = expired.next;
+                listRemove(timer);
+                insert(wheel, timer, wheel->now);
+            }
+        }
+
+        // Run this tick's timers. The list is taken out of the wheel first, so callbacks can schedule or cancel
+        // any timer (cancelling one still in the list just takes it out of it).
+        takeSlot(wheel, 0, next & SLOT_MASK, &expired);
+        while (expired.next != &expired) {
+            struct Timer* timer = expired.next;
+            listRemove(timer);
+
+            // Deadlines beyond the wheel's span were put in its last slot, and go around again.
+            if (timer->deadline > wheel->now) {
+                insert(wheel, timer, wheel->now + 1);
+                continue;
+            }
+
+            timer->scheduled = 0;
+            wheel->count--;
+            timer->callback(timer->data);
+        }
+    }
+}
+
+void timerInit(struct Timer* timer, struct TimerWheel* wheel, TimerCallback callback, void* data) {
+    timer->next = timer->previous = timer;
+    timer->wheel = wheel;
+    timer->deadline = 0;
+    timer->scheduled = 0;
+    timer->level = 0;
+    timer->slot = 0;
+    timer->callback = callback;
+    timer->data = data;
+}
+
+void timerScheduleAt(struct Timer* timer, uint64_t deadline) {
+    struct TimerWheel* wheel = timer->wheel;
+    if (timer->scheduled)
+        removeFromSlot(wheel, timer);
+    else
+        wheel->count++;
+
+    timer->deadline = deadline;
+    timer->scheduled = 1;
+    insert(wheel, timer, wheel->now + 1);
+}
+
+void timerSchedule(struct Timer* timer, uint64_t delayMillis) {
+    timerScheduleAt(timer, getMonotonicMillis() + delayMillis);
+}
+
+void timerCancel(struct Timer* timer) {
+    if (!timer->scheduled)
+        return;
+
+    // A timer taken out of its slot to be run is in a temporary list instead, and unlinking it works the same (its
+    // slot is already empty by then).
+    if (timer->next != timer)
+        removeFromSlot(timer->wheel, timer);
+    timer->scheduled = 0;
+    timer->wheel->count--;
+}
@@ -0,0 +1,92 @@
+#ifndef _TIMERWHEEL_H_
+#define _TIMERWHEEL_H_
+
+#include <stdint.h>
+
+/**
+ * A hierarchical timing wheel, keeping all the timers of a worker. Time advances in ticks of a millisecond. The
+ * first level has a slot for each of the next TIMER_WHEEL_SLOTS ticks, and each level after it has slots spanning
+ * TIMER_WHEEL_SLOTS times as many ticks as the previous one's. A timer goes in the slot of the lowest level that
+ * reaches its deadline, which is a doubly linked list, so scheduling, re-scheduling and cancelling a timer are
+ * O(1) no matter how many there are. When the wheel reaches the start of a higher level's slot, the timers in it
+ * are spread over the lower levels ("cascaded"), so every timer is moved at most once per level.
+ *
+ * Deadlines further away than the wheel spans (about four and a half hours) wait in the last slots of the highest
+ * level and are put back in the wheel when they get there.
+ *
+ * The wheel doesn't have a file descriptor of its own: the worker's event loop waits for its sockets for at most
+ * timerWheelTimeout() milliseconds, and then calls timerWheelAdvance() to run the timers that expired.
+ */
+#define TIMER_WHEEL_LEVELS 4
+#define TIMER_WHEEL_SLOT_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_SLOT_BITS)
+
+struct TimerWheel;
+
+typedef void (*TimerCallback)(void* data);
+
+struct Timer {
+    struct Timer* next;
+    struct Timer* previous;
+    struct TimerWheel* wheel;
+
+    // When the timer expires (in milliseconds, on the same clock as getMonotonicMillis()), if it's scheduled.
+    uint64_t deadline;
+    int scheduled;
+    uint8_t level;
+    uint8_t slot;
+
+    TimerCallback callback;
+    void* data;
+};
+
+struct TimerWheel {
+    // The tick the wheel has advanced to. Timers expiring at or before it already ran. It's only updated after the
+    // event loop handles its sockets, so it's not a clock to measure anything by.
+    uint64_t now;
+
+    // Each slot is the sentinel of a circular list of timers, and each level has a bitmap of its non-empty slots.
+    struct Timer slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+    uint64_t occupied[TIMER_WHEEL_LEVELS];
+    uint64_t count;
+};
+
+/**
+ * Initializes an empty wheel, starting at the current time.
+ */
+void timerWheelInit(struct TimerWheel* wheel);
+
+/**
+ * Returns how many milliseconds the event loop may wait before the wheel has a timer to run (or a slot to cascade),
+ * or -1 if there are no timers.
+ */
+int timerWheelTimeout(const struct TimerWheel* wheel);
+
+/**
+ * Advances the wheel to the current time, running the callbacks of the timers that expired in order. Callbacks may
+ * schedule and cancel any timer, including themselves.
+ */
+void timerWheelAdvance(struct TimerWheel* wheel);
+
+/**
+ * Initializes an unscheduled timer of the given wheel, which calls the given callback when it expires.
+ */
+void timerInit(struct Timer* timer, struct TimerWheel* wheel, TimerCallback callback, void* data);
+
+/**
+ * Schedules the timer to expire at the given time (in milliseconds), moving it if it was already scheduled.
+ */
+void timerScheduleAt(struct Timer* timer, uint64_t deadline);
+
+/**
+ * Schedules the timer to expire after the given amount of milliseconds from now. That's counted from the clock and
+ * not from the wheel's tick, which lags behind it by however long the event loop waited for its sockets.
+ */
+void timerSchedule(struct Timer* timer, uint64_t delayMillis);
+
+/**
+ * Unschedules the timer, if it's scheduled.
+ */
+void timerCancel(struct Timer* timer);
+
+#endif
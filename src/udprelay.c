@@ -0,0 +1,363 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "acl.h"
+#include "logger.h"
+#include "udprelay.h"
+#include "util.h"
+
+// How many datagrams we receive or send with a single system call.
+#define UDP_BATCH_SIZE 16
+
+// How many batches we handle each time the socket is readable, before letting other connections run.
+#define UDP_MAX_BATCHES_PER_EVENT 4
+
+// The largest datagram we relay (the largest a UDP datagram can carry).
+#define UDP_MAX_DATAGRAM 65535
+
+// Room left in front of each received datagram, so the header of a reply to the client (at most ATYP IPv6, 22
+// bytes) can be written right before it instead of copying the datagram.
+#define UDP_HEADROOM 22
+
+/**
+ * The buffers of a batch of datagrams. Datagrams are handled as soon as they're received, so each worker needs
+ * a single batch, shared by all of its associations.
+ */
+struct UdpBatch {
+    struct mmsghdr received[UDP_BATCH_SIZE];
+    struct iovec receivedIov[UDP_BATCH_SIZE];
+    struct sockaddr_in6 sources[UDP_BATCH_SIZE];
+
+    struct mmsghdr toSend[UDP_BATCH_SIZE];
+    struct iovec toSendIov[UDP_BATCH_SIZE];
+    struct sockaddr_in6 destinations[UDP_BATCH_SIZE];
+    int toClient[UDP_BATCH_SIZE];
+
+    uint8_t buffers[UDP_BATCH_SIZE][UDP_HEADROOM + UDP_MAX_DATAGRAM];
+};
+
+// Each worker's batch, allocated when the worker opens its first association and kept for the worker's lifetime.
+static _Thread_local struct UdpBatch* threadBatch = NULL;
+
+static struct UdpBatch* getBatch() {
+    if (threadBatch == NULL)
+        threadBatch = malloc(sizeof(struct UdpBatch));
+    return threadBatch;
+}
+
+void udpAssociationFreeBatch() {
+    free(threadBatch);
+    threadBatch = NULL;
+}
+
+/**
+ * Stores an IPv4 or IPv6 socket address as an IPv6 one, IPv4 addresses being IPv4-mapped, since that's what our
+ * dual-stack sockets use.
+ */
+static void toMappedAddress(const struct sockaddr* address, struct sockaddr_in6* mapped) {
+    if (address->sa_family == AF_INET6) {
+        memcpy(mapped, address, sizeof(struct sockaddr_in6));
+        return;
+    }
+
+    memset(mapped, 0, sizeof(struct sockaddr_in6));
+    mapped->sin6_family = AF_INET6;
+    mapped->sin6_port = ((const struct sockaddr_in*)address)->sin_port;
+    sockAddrToMapped(address, mapped->sin6_addr.s6_addr);
+}
+
+/**
+ * Called by the resolver once a domain name the client sent datagrams to was resolved. We don't keep the datagrams
+ * waiting for it: the result is in the cache now, so the client's next datagrams will go through.
+ */
+static void onResolved(void* data, struct addrinfo* addresses, int gaiStatus) {
+    struct UdpAssociation* assoc = (struct UdpAssociation*)data;
+    assoc->resolverWaiter = NULL;
+
+    if (gaiStatus != 0)
+        logDebug("UDP association failed to resolve a destination: %s", gai_strerror(gaiStatus));
+    else
+        resolverFreeAddresses(addresses);
+}
+
+/**
+ * Finds out where a datagram the client sent must go, from its header. Returns the length of the header, or -1
+ * if the datagram must be dropped.
+ */
+static int getDestination(struct UdpAssociation* assoc, const uint8_t* datagram, size_t length, struct sockaddr_in6* destination) {
+    struct Socks5UdpHeader header;
+    size_t consumed;
+    if (parseUdpHeader(datagram, length, &header, &consumed) != PARSE_OK)
+        return -1;
+
+    // We don't reassemble fragments, which the RFC allows us to do by dropping them.
+    if (header.fragment != 0)
+        return -1;
+
+    memset(destination, 0, sizeof(struct sockaddr_in6));
+    destination->sin6_family = AF_INET6;
+    destination->sin6_port = htons(header.port);
+
+    struct Metrics* metrics = &assoc->worker->metrics;
+    const struct sockaddr* client = (const struct sockaddr*)&assoc->clientAddress;
+    switch (header.addressType) {
+        case 1:
+            destination->sin6_addr.s6_addr[10] = 0xFF;
+            destination->sin6_addr.s6_addr[11] = 0xFF;
+            memcpy(&destination->sin6_addr.s6_addr[12], header.address, 4);
+            return !aclEnabled() || aclCheckAddress(client, (struct sockaddr*)destination, metrics) == ACL_ALLOW ? (int)consumed : -1;
+
+        case 4:
+            memcpy(&destination->sin6_addr, header.address, 16);
+            return !aclEnabled() || aclCheckAddress(client, (struct sockaddr*)destination, metrics) == ACL_ALLOW ? (int)consumed : -1;
+
+        default:
+            break;
+    }
+
+    // Datagrams to domain names are checked against the access control list the same way connections are.
+    enum AclVerdict verdict = aclEnabled() ? aclCheckHostname(client, header.hostname, header.port, metrics) : ACL_ALLOW;
+    if (verdict == ACL_DENY)
+        return -1;
+
+    // Domain names are only sent to if the resolver has them cached. Otherwise, we start resolving the name (one
+    // name at a time per association) and drop the datagram, as if it got lost on its way.
+    if (assoc->resolverWaiter != NULL)
+        return -1;
+
+    struct addrinfo* addresses = NULL;
+    int gaiStatus;
+    int status = resolverLookup(&assoc->worker->resolverClient, header.hostname, AF_UNSPEC, header.port, onResolved, assoc, &assoc->resolverWaiter, &addresses, &gaiStatus);
+    if (status <= 0 || gaiStatus != 0)
+        return -1;
+
+    toMappedAddress(addresses->ai_addr, destination);
+    resolverFreeAddresses(addresses);
+    if (verdict == ACL_NO_MATCH && aclCheckAddress(client, (struct sockaddr*)destination, metrics) != ACL_ALLOW)
+        return -1;
+    return consumed;
+}
+
+/**
+ * Writes the header of a reply to the client right before the reply's data, and returns the header's length.
+ */
+static size_t writeReplyHeader(const struct sockaddr_in6* source, uint8_t* data) {
+    if (IN6_IS_ADDR_V4MAPPED(&source->sin6_addr)) {
+        uint8_t* header = data - 10;
+        memcpy(header, "\x00\x00\x00\x01", 4);
+        memcpy(header + 4, &source->sin6_addr.s6_addr[12], 4);
+        memcpy(header + 8, &source->sin6_port, 2);
+        return 10;
+    }
+
+    uint8_t* header = data - 22;
+    memcpy(header, "\x00\x00\x00\x04", 4);
+    memcpy(header + 4, &source->sin6_addr, 16);
+    memcpy(header + 20, &source->sin6_port, 2);
+    return 22;
+}
+
+/**
+ * Decides what to do with a received datagram, and if it must be relayed, adds it to the batch to send. Returns 1
+ * if it was added, or 0 if it must be dropped.
+ */
+static int prepareDatagram(struct UdpAssociation* assoc, struct UdpBatch* batch, int index, int sendIndex) {
+    const struct sockaddr_in6* source = &batch->sources[index];
+    uint8_t* data = batch->buffers[index] + UDP_HEADROOM;
+    size_t length = batch->received[index].msg_len;
+
+    if (batch->received[index].msg_hdr.msg_flags & MSG_TRUNC)
+        return 0;
+
+    // Until we know the client's address, the first datagram from its IP (and port, if it told us) is the client's.
+    int fromClient;
+    if (assoc->clientAddressKnown) {
+        fromClient = source->sin6_port == assoc->clientAddress.sin6_port && IN6_ARE_ADDR_EQUAL(&source->sin6_addr, &assoc->clientAddress.sin6_addr);
+    } else if (IN6_ARE_ADDR_EQUAL(&source->sin6_addr, &assoc->clientIp) && (assoc->requestedPort == 0 || source->sin6_port == assoc->requestedPort)) {
+        assoc->clientAddress = *source;
+        assoc->clientAddressKnown = 1;
+        fromClient = 1;
+    } else {
+        // Nobody to send a reply to yet.
+        return 0;
+    }
+
+    struct mmsghdr* message = &batch->toSend[sendIndex];
+    struct iovec* iov = &batch->toSendIov[sendIndex];
+    if (fromClient) {
+        int headerLength = getDestination(assoc, data, length, &batch->destinations[sendIndex]);
+        if (headerLength < 0)
+            return 0;
+        iov->iov_base = data + headerLength;
+        iov->iov_len = length - headerLength;
+    } else {
+        size_t headerLength = writeReplyHeader(source, data);
+        batch->destinations[sendIndex] = assoc->clientAddress;
+        iov->iov_base = data - headerLength;
+        iov->iov_len = length + headerLength;
+    }
+
+    memset(&message->msg_hdr, 0, sizeof(message->msg_hdr));
+    message->msg_hdr.msg_name = &batch->destinations[sendIndex];
+    message->msg_hdr.msg_namelen = sizeof(struct sockaddr_in6);
+    message->msg_hdr.msg_iov = iov;
+    message->msg_hdr.msg_iovlen = 1;
+    batch->toClient[sendIndex] = !fromClient;
+    return 1;
+}
+
+/**
+ * Sends the batch's datagrams. A datagram that can't be sent right now is dropped, same as a router would.
+ */
+static void sendBatch(struct UdpAssociation* assoc, struct UdpBatch* batch, int count) {
+    struct Metrics* metrics = &assoc->worker->metrics;
+    int sent = 0;
+    while (sent < count) {
+        int nowSent = sendmmsg(assoc->socket, batch->toSend + sent, count - sent, MSG_DONTWAIT);
+        if (nowSent < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                metricsAdd(&metrics->udpDatagramsDropped, count - sent);
+                return;
+            }
+
+            // Errors are only reported for the first datagram (for example, an ICMP error from an earlier datagram
+            // to that host), so we skip it and go on with the rest.
+            logDebug("UDP association failed to send a datagram: %s", strerror(errno));
+            metricsAdd(&metrics->udpDatagramsDropped, 1);
+            sent++;
+            continue;
+        }
+
+        for (int i = sent; i < sent + nowSent; i++)
+            metricsAdd(batch->toClient[i] ? &metrics->udpDatagramsRemoteToClient : &metrics->udpDatagramsClientToRemote, 1);
+        sent += nowSent;
+    }
+}
+
+static void udpSocketHandler(int fd, uint32_t events, void* data) {
+    struct UdpAssociation* assoc = (struct UdpAssociation*)data;
+    struct UdpBatch* batch = threadBatch;
+
+    for (int round = 0; round < UDP_MAX_BATCHES_PER_EVENT; round++) {
+        for (int i = 0; i < UDP_BATCH_SIZE; i++) {
+            batch->receivedIov[i].iov_base = batch->buffers[i] + UDP_HEADROOM;
+            batch->receivedIov[i].iov_len = UDP_MAX_DATAGRAM;
+            memset(&batch->received[i].msg_hdr, 0, sizeof(struct msghdr));
+            batch->received[i].msg_hdr.msg_name = &batch->sources[i];
+            batch->received[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in6);
+            batch->received[i].msg_hdr.msg_iov = &batch->receivedIov[i];
+            batch->received[i].msg_hdr.msg_iovlen = 1;
+        }
+
+        int received = recvmmsg(fd, batch->received, UDP_BATCH_SIZE, MSG_DONTWAIT, NULL);
+        if (received < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                logErrno(LOG_LEVEL_DEBUG, "UDP association failed to recvmmsg()");
+            return;
+        }
+
+        int toSend = 0;
+        for (int i = 0; i < received; i++)
+            toSend += prepareDatagram(assoc, batch, i, toSend);
+
+        metricsAdd(&assoc->worker->metrics.udpDatagramsDropped, received - toSend);
+        sendBatch(assoc, batch, toSend);
+        if (toSend > 0)
+            assoc->lastActivity = getMonotonicMillis();
+
+        if (received < UDP_BATCH_SIZE)
+            return;
+    }
+}
+
+int udpAssociationOpen(struct UdpAssociation* assoc, struct Worker* worker, int controlSocket, const struct Socks5Request* request, struct sockaddr_storage* boundAddress) {
+    memset(assoc, 0, sizeof(struct UdpAssociation));
+    assoc->worker = worker;
+    assoc->socket = -1;
+
+    if (getBatch() == NULL) {
+        logError("Failed to allocate memory for UDP datagrams");
+        return -1;
+    }
+
+    // The client's datagrams must come from the same IP as its TCP connection. The RFC also lets the client tell us
+    // the address it will send from; we only use the port, since the client might not know the IP we'll see.
+    struct sockaddr_storage address;
+    socklen_t addressLength = sizeof(address);
+    if (getpeername(controlSocket, (struct sockaddr*)&address, &addressLength) < 0) {
+        logErrno(LOG_LEVEL_ERROR, "getpeername()");
+        return -1;
+    }
+    struct sockaddr_in6 clientAddress;
+    toMappedAddress((struct sockaddr*)&address, &clientAddress);
+    assoc->clientIp = clientAddress.sin6_addr;
+    assoc->requestedPort = htons(request->port);
+
+    // The socket is dual-stack and bound to every address, so it can send to IPv4 and IPv6 hosts alike.
+    assoc->socket = socket(AF_INET6, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_UDP);
+    if (assoc->socket < 0) {
+        logErrno(LOG_LEVEL_ERROR, "UDP socket()");
+        return -1;
+    }
+
+    int zero = 0;
+    setsockopt(assoc->socket, IPPROTO_IPV6, IPV6_V6ONLY, &zero, sizeof(zero));
+
+    struct sockaddr_in6 anyAddress;
+    memset(&anyAddress, 0, sizeof(anyAddress));
+    anyAddress.sin6_family = AF_INET6;
+    anyAddress.sin6_addr = in6addr_any;
+    struct sockaddr_in6 udpAddress;
+    socklen_t udpAddressLength = sizeof(udpAddress);
+    if (bind(assoc->socket, (struct sockaddr*)&anyAddress, sizeof(anyAddress)) < 0 || getsockname(assoc->socket, (struct sockaddr*)&udpAddress, &udpAddressLength) < 0) {
+        logErrno(LOG_LEVEL_ERROR, "Failed to bind UDP socket");
+        close(assoc->socket);
+        return -1;
+    }
+
+    // The client must send its datagrams to the address it reached us at through TCP, at the UDP socket's port.
+    addressLength = sizeof(address);
+    if (getsockname(controlSocket, (struct sockaddr*)&address, &addressLength) < 0) {
+        logErrno(LOG_LEVEL_ERROR, "getsockname()");
+        close(assoc->socket);
+        return -1;
+    }
+    struct sockaddr_in6 localAddress;
+    toMappedAddress((struct sockaddr*)&address, &localAddress);
+    localAddress.sin6_port = udpAddress.sin6_port;
+
+    memset(boundAddress, 0, sizeof(struct sockaddr_storage));
+    if (IN6_IS_ADDR_V4MAPPED(&localAddress.sin6_addr)) {
+        struct sockaddr_in* ipv4 = (struct sockaddr_in*)boundAddress;
+        ipv4->sin_family = AF_INET;
+        ipv4->sin_port = localAddress.sin6_port;
+        memcpy(&ipv4->sin_addr, &localAddress.sin6_addr.s6_addr[12], 4);
+    } else {
+        memcpy(boundAddress, &localAddress, sizeof(localAddress));
+    }
+
+    if (selectorAdd(worker->selector, assoc->socket, EPOLLIN, udpSocketHandler, assoc) != 0) {
+        logErrno(LOG_LEVEL_ERROR, "Failed to register UDP socket in selector");
+        close(assoc->socket);
+        return -1;
+    }
+
+    assoc->lastActivity = getMonotonicMillis();
+    metricsAddGauge(&worker->metrics.udpAssociationsActive, 1);
+    return 0;
+}
+
+void udpAssociationClose(struct UdpAssociation* assoc) {
+    selectorRemove(assoc->worker->selector, assoc->socket);
+    close(assoc->socket);
+
+    if (assoc->resolverWaiter != NULL)
+        resolverCancel(assoc->resolverWaiter);
+
+    metricsAddGauge(&assoc->worker->metrics.udpAssociationsActive, -1);
+}
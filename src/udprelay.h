@@ -0,0 +1,64 @@
+#ifndef _UDPRELAY_H_
+#define _UDPRELAY_H_
+
+#include <netinet/in.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+#include "parser.h"
+#include "resolver.h"
+#include "worker.h"
+
+/**
+ * A UDP association relays datagrams between a client and any remote hosts, on behalf of a client that sent
+ * a UDP ASSOCIATE request. Each association has its own UDP socket: the client sends its datagrams there,
+ * each one preceded by a header naming its destination, and we send them on from the same socket. Datagrams
+ * arriving from anywhere else are replies, which we send to the client preceded by a header naming their source.
+ *
+ * Only datagrams coming from the client's IP address (and port, if the client told us which one it would use)
+ * are relayed to remote hosts. The first of them fixes the client's address, and replies are sent there.
+ *
+ * Datagrams are received and sent in batches with recvmmsg() and sendmmsg(), so a busy association costs two
+ * system calls per batch instead of two per datagram.
+ *
+ * The association lives as long as the TCP connection of the UDP ASSOCIATE request, and is closed with it.
+ */
+struct UdpAssociation {
+    struct Worker* worker;
+    int socket;
+
+    // The client's IP address (the one of its TCP connection, IPv4 addresses being IPv4-mapped), and the port it
+    // said it would send from, in network order, or 0 if it didn't say.
+    struct in6_addr clientIp;
+    uint16_t requestedPort;
+
+    // Where the client's datagrams come from, once we got the first one.
+    struct sockaddr_in6 clientAddress;
+    int clientAddressKnown;
+
+    // A lookup in progress for a domain name the client sent datagrams to.
+    struct ResolverWaiter* resolverWaiter;
+
+    // When a datagram was last relayed (in milliseconds, from getMonotonicMillis()), so the association's TCP
+    // connection isn't closed for being idle while the association is in use.
+    uint64_t lastActivity;
+};
+
+/**
+ * Opens a UDP association for a client whose UDP ASSOCIATE request came through controlSocket, and registers its
+ * socket in the worker's selector. The address the client must send its datagrams to is stored in boundAddress.
+ * Returns 0 if successful, or -1 if an error occurred.
+ */
+int udpAssociationOpen(struct UdpAssociation* assoc, struct Worker* worker, int controlSocket, const struct Socks5Request* request, struct sockaddr_storage* boundAddress);
+
+/**
+ * Closes the association's socket and cancels any lookup in progress.
+ */
+void udpAssociationClose(struct UdpAssociation* assoc);
+
+/**
+ * Frees the calling worker's batch, once it closed all its associations and won't open any more.
+ */
+void udpAssociationFreeBatch();
+
+#endif
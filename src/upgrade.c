@@ -0,0 +1,289 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "logger.h"
+#include "upgrade.h"
+
+// The new process finds its end of the Unix socket through this environment variable.
+#define UPGRADE_ENVIRONMENT_VARIABLE "MEDIAS_UPGRADE_FD"
+
+// SCM_RIGHTS can only carry so many descriptors in a single message, so they're sent in batches.
+#define UPGRADE_FDS_PER_MESSAGE 64
+
+// How long the new process has to start accepting connections before we give up on it.
+#define UPGRADE_READY_TIMEOUT_MILLIS 30000
+
+// What the new process sends back once it's accepting.
+#define UPGRADE_READY_BYTE 'R'
+
+extern char** environ;
+
+/**
+ * Every message carries the totals, along with a batch of the descriptors: first all the listeners, in order, and
+ * then the admin listener's, if there is one.
+ */
+struct UpgradeMessage {
+    uint32_t listenerCount;
+    uint32_t hasAdminSocket;
+};
+
+// In a process started by a hot upgrade, its end of the Unix socket, until it lets the previous process know it's
+// accepting.
+static int inheritedChannel = -1;
+
+static int sendSockets(int channel, const struct UpgradeSockets* sockets) {
+    int fds[UPGRADE_MAX_LISTENERS + 1];
+    int total = 0;
+    for (int i = 0; i < sockets->listenerCount; i++)
+        fds[total++] = sockets->listeners[i];
+    if (sockets->adminSocket >= 0)
+        fds[total++] = sockets->adminSocket;
+
+    struct UpgradeMessage message = {.listenerCount = sockets->listenerCount, .hasAdminSocket = sockets->adminSocket >= 0};
+    int sent = 0;
+    do {
+        int batch = total - sent < UPGRADE_FDS_PER_MESSAGE ? total - sent : UPGRADE_FDS_PER_MESSAGE;
+
+        union {
+            char buffer[CMSG_SPACE(sizeof(int) * UPGRADE_FDS_PER_MESSAGE)];
+            struct cmsghdr align;
+        } control;
+        memset(&control, 0, sizeof(control));
+
+        struct iovec iov = {.iov_base = &message, .iov_len = sizeof(message)};
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        if (batch > 0) {
+            msg.msg_control = control.buffer;
+            msg.msg_controllen = CMSG_SPACE(sizeof(int) * batch);
+            struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+            cmsg->cmsg_level = SOL_SOCKET;
+            cmsg->cmsg_type = SCM_RIGHTS;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(int) * batch);
+            memcpy(CMSG_DATA(cmsg), fds + sent, sizeof(int) * batch);
+        }
+
+        if (sendmsg(channel, &msg, MSG_NOSIGNAL) < 0) {
+            logErrno(LOG_LEVEL_ERROR, "Failed to send passive sockets to the new process");
+            return -1;
+        }
+        sent += batch;
+    } while (sent < total);
+
+    return 0;
+}
+
+static int receiveSockets(int channel, struct UpgradeSockets* sockets) {
+    int fds[UPGRADE_MAX_LISTENERS + 1];
+    int received = 0;
+    int total = -1;
+
+    do {
+        struct UpgradeMessage message;
+        union {
+            char buffer[CMSG_SPACE(sizeof(int) * UPGRADE_FDS_PER_MESSAGE)];
+            struct cmsghdr align;
+        } control;
+
+        struct iovec iov = {.iov_base = &message, .iov_len = sizeof(message)};
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control.buffer;
+        msg.msg_controllen = sizeof(control.buffer);
+
+        ssize_t length = recvmsg(channel, &msg, MSG_CMSG_CLOEXEC);
+        if (length != sizeof(message) || (msg.msg_flags & MSG_CTRUNC)) {
+            if (length < 0)
+                logErrno(LOG_LEVEL_ERROR, "Failed to receive passive sockets from the previous process");
+            else
+                logError("Got a malformed message from the previous process");
+            goto fail;
+        }
+
+        if (total < 0) {
+            if (message.listenerCount > UPGRADE_MAX_LISTENERS || message.hasAdminSocket > 1) {
+                logError("The previous process sent too many passive sockets");
+                goto fail;
+            }
+            total = message.listenerCount + message.hasAdminSocket;
+            sockets->listenerCount = message.listenerCount;
+            sockets->adminSocket = message.hasAdminSocket ? 0 : -1;
+        }
+
+        for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+                continue;
+
+            int count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            for (int i = 0; i < count; i++) {
+                int fd;
+                memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+                if (received < total)
+                    fds[received++] = fd;
+                else
+                    close(fd);
+            }
+        }
+    } while (received < total);
+
+    for (int i = 0; i < sockets->listenerCount; i++)
+        sockets->listeners[i] = fds[i];
+    if (sockets->adminSocket >= 0)
+        sockets->adminSocket = fds[sockets->listenerCount];
+    return 0;
+
+fail:
+    for (int i = 0; i < received; i++)
+        close(fds[i]);
+    return -1;
+}
+
+int upgradeInherit(struct UpgradeSockets* sockets) {
+    sockets->listenerCount = 0;
+    sockets->adminSocket = -1;
+
+    const char* value = getenv(UPGRADE_ENVIRONMENT_VARIABLE);
+    if (value == NULL)
+        return 0;
+
+    // Whatever we start later on mustn't think it's part of an upgrade too.
+    int channel = atoi(value);
+    unsetenv(UPGRADE_ENVIRONMENT_VARIABLE);
+    if (channel < 0 || fcntl(channel, F_SETFD, FD_CLOEXEC) != 0) {
+        logError("Invalid %s, not starting as a hot upgrade", UPGRADE_ENVIRONMENT_VARIABLE);
+        return -1;
+    }
+
+    if (receiveSockets(channel, sockets) != 0) {
+        close(channel);
+        return -1;
+    }
+
+    inheritedChannel = channel;
+    logInfo("Took over %d passive socket%s from the previous process", sockets->listenerCount, sockets->listenerCount == 1 ? "" : "s");
+    return 1;
+}
+
+void upgradeReady() {
+    if (inheritedChannel < 0)
+        return;
+
+    char ready = UPGRADE_READY_BYTE;
+    if (send(inheritedChannel, &ready, 1, MSG_NOSIGNAL) != 1)
+        logErrno(LOG_LEVEL_WARN, "Failed to let the previous process know we're accepting");
+    close(inheritedChannel);
+    inheritedChannel = -1;
+}
+
+/**
+ * Waits for the new process to let us know it's accepting. If it fails to start, it exits and its end of the
+ * channel is closed, so we find out right away.
+ */
+static int waitForReady(int channel) {
+    struct pollfd pfd = {.fd = channel, .events = POLLIN};
+    int ready;
+    while ((ready = poll(&pfd, 1, UPGRADE_READY_TIMEOUT_MILLIS)) < 0 && errno == EINTR)
+        ;
+    if (ready <= 0) {
+        logError("The new process didn't start accepting in time");
+        return -1;
+    }
+
+    char byte;
+    if (recv(channel, &byte, 1, 0) != 1 || byte != UPGRADE_READY_BYTE) {
+        logError("The new process failed to start");
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Copies our environment with the variable that tells the new process where its end of the channel is.
+ */
+static char** buildEnvironment(const char* variable) {
+    size_t count = 0;
+    while (environ[count] != NULL)
+        count++;
+
+    char** environment = malloc((count + 2) * sizeof(char*));
+    if (environment == NULL)
+        return NULL;
+
+    size_t length = 0;
+    size_t prefixLength = strlen(UPGRADE_ENVIRONMENT_VARIABLE "=");
+    for (size_t i = 0; i < count; i++) {
+        if (strncmp(environ[i], UPGRADE_ENVIRONMENT_VARIABLE "=", prefixLength) != 0)
+            environment[length++] = environ[i];
+    }
+    environment[length++] = (char*)variable;
+    environment[length] = NULL;
+    return environment;
+}
+
+int upgradeStart(const char* argv[], const struct UpgradeSockets* sockets) {
+    // A sequenced packet socket keeps the batches of descriptors apart.
+    int channel[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, channel) != 0) {
+        logErrno(LOG_LEVEL_ERROR, "Failed to create the hot upgrade channel");
+        return -1;
+    }
+
+    // Only the new process's end must survive the exec. Nothing else in this process ever starts a program, so
+    // clearing close-on-exec here can't leak it anywhere else.
+    char variable[64];
+    snprintf(variable, sizeof(variable), "%s=%d", UPGRADE_ENVIRONMENT_VARIABLE, channel[1]);
+    char** environment = buildEnvironment(variable);
+    if (environment == NULL || fcntl(channel[1], F_SETFD, 0) != 0) {
+        logErrno(LOG_LEVEL_ERROR, "Failed to prepare the new process");
+        free(environment);
+        close(channel[0]);
+        close(channel[1]);
+        return -1;
+    }
+
+    // The new process must start with no signals blocked, no matter which of our threads starts it.
+    posix_spawnattr_t attributes;
+    posix_spawnattr_init(&attributes);
+    sigset_t noSignals;
+    sigemptyset(&noSignals);
+    posix_spawnattr_setsigmask(&attributes, &noSignals);
+    posix_spawnattr_setflags(&attributes, POSIX_SPAWN_SETSIGMASK);
+
+    pid_t pid;
+    int error = posix_spawnp(&pid, argv[0], NULL, &attributes, (char* const*)argv, environment);
+    posix_spawnattr_destroy(&attributes);
+    free(environment);
+    close(channel[1]);
+    if (error != 0) {
+        logError("Failed to start %s: %s", argv[0], strerror(error));
+        close(channel[0]);
+        return -1;
+    }
+
+    logInfo("Started process %d, handing over %d passive socket%s", (int)pid, sockets->listenerCount, sockets->listenerCount == 1 ? "" : "s");
+    if (sendSockets(channel[0], sockets) != 0 || waitForReady(channel[0]) != 0) {
+        // SIGTERM only reaches the new process once it's waiting for signals, which it may never get to.
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+        close(channel[0]);
+        return -1;
+    }
+
+    close(channel[0]);
+    return 0;
+}
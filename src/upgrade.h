@@ -0,0 +1,50 @@
+#ifndef _UPGRADE_H_
+#define _UPGRADE_H_
+
+/**
+ * Hot upgrades replace the running server with a new one (usually a new binary installed at the same path)
+ * without refusing a single connection. On SIGUSR2, the running process starts its executable again, with the same
+ * arguments, and hands it its passive sockets over a Unix socket with SCM_RIGHTS. The new process starts its
+ * workers on those very sockets instead of binding new ones, so the connections waiting in their accept queues are
+ * never lost, and tells the old process when it's accepting. Only then the old process stops accepting and drains:
+ * it keeps serving the connections it already has until they finish or --drain-timeout expires, and exits.
+ *
+ * If the new process fails to start, or doesn't get to accepting in time, it's killed and the old process goes on
+ * serving as if nothing happened.
+ */
+
+// The most passive sockets handed over, the admin listener's aside: enough for every worker's socket for every
+// listen address.
+#define UPGRADE_MAX_LISTENERS (1024 * 16)
+
+/**
+ * The passive sockets handed over in a hot upgrade.
+ */
+struct UpgradeSockets {
+    // The workers' passive sockets. The new process tells which is which by the addresses they're bound to.
+    int listeners[UPGRADE_MAX_LISTENERS];
+    int listenerCount;
+
+    // The admin listener's passive socket, or -1 if there's none.
+    int adminSocket;
+};
+
+/**
+ * If this process was started by a hot upgrade, receives the passive sockets from the previous process. Returns
+ * 1 if it was, 0 if this is a regular start, or -1 if an error occurred.
+ */
+int upgradeInherit(struct UpgradeSockets* sockets);
+
+/**
+ * Lets the previous process know that this one is accepting connections, if it was started by a hot upgrade.
+ */
+void upgradeReady();
+
+/**
+ * Starts a new process running the executable at argv[0] with the given arguments, hands it the given passive
+ * sockets, and waits for it to be accepting connections. Returns 0 if it is, or -1 if the new process couldn't take
+ * over (in which case it's been killed).
+ */
+int upgradeStart(const char* argv[], const struct UpgradeSockets* sockets);
+
+#endif
@@ -0,0 +1,225 @@
+#include "uring.h"
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+static int sysIoUringSetup(unsigned entries, struct io_uring_params* params) {
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int sysIoUringEnter(int fd, unsigned toSubmit, unsigned minComplete, unsigned flags, void* arg, size_t argSize) {
+    return (int)syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags, arg, argSize);
+}
+
+static int sysIoUringRegister(int fd, unsigned opcode, void* arg, unsigned argCount) {
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, argCount);
+}
+
+int uringInit(struct Uring* ring, unsigned entries) {
+    memset(ring, 0, sizeof(struct Uring));
+
+    // Cooperative task running avoids interrupting the worker to run completions, since it only looks at them
+    // when it enters the kernel anyway. Older kernels don't know about it, so we retry without it.
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_COOP_TASKRUN;
+    params.cq_entries = entries * 2;
+    ring->fd = sysIoUringSetup(entries, &params);
+    if (ring->fd < 0 && errno == EINVAL) {
+        memset(&params, 0, sizeof(params));
+        params.flags = IORING_SETUP_CQSIZE;
+        params.cq_entries = entries * 2;
+        ring->fd = sysIoUringSetup(entries, &params);
+    }
+    if (ring->fd < 0)
+        return -1;
+
+    // We need both rings in a single mapping, CQEs kept around instead of dropped when the completion queue
+    // overflows, and timeouts on io_uring_enter(). These are all from kernel 5.11 or earlier.
+    unsigned requiredFeatures = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG;
+    if ((params.features & requiredFeatures) != requiredFeatures) {
+        close(ring->fd);
+        errno = ENOSYS;
+        return -1;
+    }
+
+    size_t sqSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cqSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->ringMemorySize = sqSize > cqSize ? sqSize : cqSize;
+    ring->ringMemory = mmap(NULL, ring->ringMemorySize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->ringMemory == MAP_FAILED) {
+        close(ring->fd);
+        return -1;
+    }
+
+    ring->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        munmap(ring->ringMemory, ring->ringMemorySize);
+        close(ring->fd);
+        return -1;
+    }
+
+    char* memory = ring->ringMemory;
+    ring->sqHead = (unsigned*)(memory + params.sq_off.head);
+    ring->sqTail = (unsigned*)(memory + params.sq_off.tail);
+    ring->sqArray = (unsigned*)(memory + params.sq_off.array);
+    ring->sqMask = *(unsigned*)(memory + params.sq_off.ring_mask);
+    ring->sqEntries = params.sq_entries;
+    ring->cqHead = (unsigned*)(memory + params.cq_off.head);
+    ring->cqTail = (unsigned*)(memory + params.cq_off.tail);
+    ring->cqMask = *(unsigned*)(memory + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(memory + params.cq_off.cqes);
+
+    // Each slot of the submission queue always points to the SQE with its same index.
+    for (unsigned i = 0; i < ring->sqEntries; i++)
+        ring->sqArray[i] = i;
+
+    return 0;
+}
+
+void uringDestroy(struct Uring* ring) {
+    munmap(ring->sqes, ring->sqesSize);
+    munmap(ring->ringMemory, ring->ringMemorySize);
+    close(ring->fd);
+}
+
+int uringSupportsOp(struct Uring* ring, int opcode) {
+    size_t probeSize = sizeof(struct io_uring_probe) + IORING_OP_LAST * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe* probe = calloc(1, probeSize);
+    if (probe == NULL)
+        return 0;
+
+    int supported = sysIoUringRegister(ring->fd, IORING_REGISTER_PROBE, probe, IORING_OP_LAST) == 0 && opcode <= probe->last_op && (probe->ops[opcode].flags & IO_URING_OP_SUPPORTED);
+    free(probe);
+    return supported;
+}
+
+int uringInitBufferRing(struct Uring* ring, struct UringBufferRing* buffers, unsigned short group, unsigned count, unsigned bufferSize) {
+    memset(buffers, 0, sizeof(struct UringBufferRing));
+
+    // The ring has to be page aligned, which mmap() takes care of.
+    buffers->ringSize = count * sizeof(struct io_uring_buf);
+    buffers->ring = mmap(NULL, buffers->ringSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buffers->ring == MAP_FAILED)
+        return -1;
+
+    buffers->buffersSize = (size_t)count * bufferSize;
+    buffers->buffers = mmap(NULL, buffers->buffersSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buffers->buffers == MAP_FAILED) {
+        munmap(buffers->ring, buffers->ringSize);
+        return -1;
+    }
+
+    struct io_uring_buf_reg registration;
+    memset(&registration, 0, sizeof(registration));
+    registration.ring_addr = (unsigned long long)(uintptr_t)buffers->ring;
+    registration.ring_entries = count;
+    registration.bgid = group;
+    if (sysIoUringRegister(ring->fd, IORING_REGISTER_PBUF_RING, &registration, 1) != 0) {
+        munmap(buffers->buffers, buffers->buffersSize);
+        munmap(buffers->ring, buffers->ringSize);
+        return -1;
+    }
+
+    buffers->count = count;
+    buffers->bufferSize = bufferSize;
+    buffers->group = group;
+    for (unsigned i = 0; i < count; i++)
+        uringRecycleBuffer(buffers, (unsigned short)i);
+    return 0;
+}
+
+void uringDestroyBufferRing(struct UringBufferRing* buffers) {
+    munmap(buffers->buffers, buffers->buffersSize);
+    munmap(buffers->ring, buffers->ringSize);
+}
+
+void uringRecycleBuffer(struct UringBufferRing* buffers, unsigned short id) {
+    struct io_uring_buf* buffer = &buffers->ring->bufs[buffers->tail & (buffers->count - 1)];
+    buffer->addr = (unsigned long long)(uintptr_t)uringGetBuffer(buffers, id);
+    buffer->len = buffers->bufferSize;
+    buffer->bid = id;
+
+    // The kernel only looks at the buffer once the tail moved past it.
+    buffers->tail++;
+    __atomic_store_n(&buffers->ring->tail, buffers->tail, __ATOMIC_RELEASE);
+}
+
+int uringReserveSqes(struct Uring* ring, unsigned count) {
+    if (ring->sqEntries - (*ring->sqTail - __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE)) >= count)
+        return 0;
+
+    if (uringSubmitAndWait(ring, 0, 0) != 0)
+        return -1;
+    if (ring->sqEntries - (*ring->sqTail - __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE)) < count) {
+        errno = EBUSY;
+        return -1;
+    }
+    return 0;
+}
+
+struct io_uring_sqe* uringGetSqe(struct Uring* ring) {
+    unsigned tail = *ring->sqTail;
+    if (tail - __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE) == ring->sqEntries) {
+        if (uringSubmitAndWait(ring, 0, 0) != 0)
+            return NULL;
+    }
+
+    struct io_uring_sqe* sqe = &ring->sqes[tail & ring->sqMask];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+
+    // The SQE is published right away. The kernel doesn't look at it until we call io_uring_enter(), and by
+    // then the caller has filled it in.
+    __atomic_store_n(ring->sqTail, tail + 1, __ATOMIC_RELEASE);
+    ring->toSubmit++;
+    return sqe;
+}
+
+int uringSubmitAndWait(struct Uring* ring, int waitCompletions, int timeoutMillis) {
+    while (1) {
+        unsigned flags = 0;
+        unsigned minComplete = 0;
+        struct __kernel_timespec timeout;
+        struct io_uring_getevents_arg arg;
+        memset(&arg, 0, sizeof(arg));
+
+        if (waitCompletions) {
+            flags |= IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+            minComplete = 1;
+            if (timeoutMillis >= 0) {
+                timeout.tv_sec = timeoutMillis / 1000;
+                timeout.tv_nsec = (long long)(timeoutMillis % 1000) * 1000000;
+                arg.ts = (unsigned long long)(uintptr_t)&timeout;
+            }
+        }
+
+        int result = sysIoUringEnter(ring->fd, ring->toSubmit, minComplete, flags, waitCompletions ? &arg : NULL, waitCompletions ? sizeof(arg) : 0);
+        if (result >= 0) {
+            ring->toSubmit -= result;
+            return 0;
+        }
+
+        // Timing out or being interrupted while waiting isn't an error, there's just nothing to handle yet. EBUSY
+        // means CQEs overflowed, so the caller has to consume some before we can submit more.
+        if (errno == ETIME || errno == EINTR || errno == EBUSY)
+            return 0;
+        if (errno != EAGAIN)
+            return -1;
+    }
+}
+
+int uringNextCqe(struct Uring* ring, struct io_uring_cqe* cqe) {
+    unsigned head = *ring->cqHead;
+    if (head == __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE))
+        return 0;
+
+    *cqe = ring->cqes[head & ring->cqMask];
+    __atomic_store_n(ring->cqHead, head + 1, __ATOMIC_RELEASE);
+    return 1;
+}
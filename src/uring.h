@@ -0,0 +1,114 @@
+#ifndef _URING_H_
+#define _URING_H_
+
+#include <linux/io_uring.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * A minimal io_uring wrapper, talking to the kernel with the raw system calls. The submission and completion
+ * queues are shared memory: we fill in submission queue entries (SQEs) and publish them by moving the queue's
+ * tail, and the kernel posts completion queue entries (CQEs) that we consume by moving the completion queue's
+ * head. SQEs are only handed to the kernel by uringSubmitAndWait(), so many of them go in a single system call.
+ */
+struct Uring {
+    int fd;
+
+    unsigned* sqHead;
+    unsigned* sqTail;
+    unsigned* sqArray;
+    unsigned sqMask;
+    unsigned sqEntries;
+    struct io_uring_sqe* sqes;
+
+    // SQEs published in the queue but not yet submitted with io_uring_enter().
+    unsigned toSubmit;
+
+    unsigned* cqHead;
+    unsigned* cqTail;
+    unsigned cqMask;
+    struct io_uring_cqe* cqes;
+
+    void* ringMemory;
+    size_t ringMemorySize;
+    size_t sqesSize;
+};
+
+/**
+ * A ring of buffers provided to the kernel. Requests that ask for one (with IOSQE_BUFFER_SELECT and the ring's
+ * group) only pick a buffer once they have data for it, so requests waiting for data don't hold any memory. The
+ * completion tells which buffer was picked, and it stays ours until it's given back with uringRecycleBuffer().
+ */
+struct UringBufferRing {
+    struct io_uring_buf_ring* ring;
+    size_t ringSize;
+    uint8_t* buffers;
+    size_t buffersSize;
+    unsigned count;
+    unsigned bufferSize;
+    unsigned short tail;
+    unsigned short group;
+};
+
+/**
+ * Creates an io_uring with the given amount of submission queue entries (and twice as many completion queue
+ * entries). Returns 0 if successful, or -1 if io_uring isn't available (errno is set).
+ */
+int uringInit(struct Uring* ring, unsigned entries);
+
+void uringDestroy(struct Uring* ring);
+
+/**
+ * Returns whether the kernel supports the given operation.
+ */
+int uringSupportsOp(struct Uring* ring, int opcode);
+
+/**
+ * Creates a ring of the given amount (a power of two) of buffers of the given size, all provided to the kernel, and
+ * registers it as the given buffer group. Returns 0 if successful, or -1 if an error occurred (kernels before 5.19
+ * don't support buffer rings).
+ */
+int uringInitBufferRing(struct Uring* ring, struct UringBufferRing* buffers, unsigned short group, unsigned count, unsigned bufferSize);
+
+/**
+ * Frees up a buffer ring. The io_uring it was registered on must have been destroyed first.
+ */
+void uringDestroyBufferRing(struct UringBufferRing* buffers);
+
+/**
+ * Returns the buffer with the given id.
+ */
+static inline uint8_t* uringGetBuffer(const struct UringBufferRing* buffers, unsigned short id) {
+    return buffers->buffers + (size_t)id * buffers->bufferSize;
+}
+
+/**
+ * Provides a buffer picked by a request to the kernel again.
+ */
+void uringRecycleBuffer(struct UringBufferRing* buffers, unsigned short id);
+
+/**
+ * Makes sure the submission queue has room for the given amount of SQEs, submitting the pending ones if needed, so
+ * SQEs linked together end up in the same submission. Returns 0 if successful, or -1 if an error occurred.
+ */
+int uringReserveSqes(struct Uring* ring, unsigned count);
+
+/**
+ * Returns a cleared SQE to fill in, which is submitted by the next uringSubmitAndWait(). If the submission
+ * queue is full, the pending SQEs are submitted first. Returns NULL if that failed.
+ */
+struct io_uring_sqe* uringGetSqe(struct Uring* ring);
+
+/**
+ * Submits all the pending SQEs and, if waitCompletions is set, waits until at least one CQE is available or
+ * timeoutMillis milliseconds passed (-1 waits forever). Returns 0 if successful, or -1 if an error occurred.
+ */
+int uringSubmitAndWait(struct Uring* ring, int waitCompletions, int timeoutMillis);
+
+/**
+ * Takes the next available CQE out of the completion queue, copying it into cqe. Returns 1 if there was one,
+ * or 0 if the completion queue is empty.
+ */
+int uringNextCqe(struct Uring* ring, struct io_uring_cqe* cqe);
+
+#endif
@@ -1,8 +1,10 @@
 #include "util.h"
 #include <arpa/inet.h>
+#include <ctype.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 const char* printFamily(struct addrinfo* aip) {
     switch (aip->ai_family) {
@@ -49,24 +51,26 @@ const char* printProtocol(struct addrinfo* aip) {
     return "unknown";
 }
 
-void printFlags(struct addrinfo* aip) {
-    printf("flags");
+char* printFlags(const struct addrinfo* aip, char flags[]) {
+    strcpy(flags, "flags");
     if (aip->ai_flags == 0) {
-        printf(" 0");
+        strcat(flags, " 0");
     } else {
         if (aip->ai_flags & AI_PASSIVE)
-            printf(" passive");
+            strcat(flags, " passive");
         if (aip->ai_flags & AI_CANONNAME)
-            printf(" canon");
+            strcat(flags, " canon");
         if (aip->ai_flags & AI_NUMERICHOST)
-            printf(" numhost");
+            strcat(flags, " numhost");
         if (aip->ai_flags & AI_NUMERICSERV)
-            printf(" numserv");
+            strcat(flags, " numserv");
         if (aip->ai_flags & AI_V4MAPPED)
-            printf(" v4mapped");
+            strcat(flags, " v4mapped");
         if (aip->ai_flags & AI_ALL)
-            printf(" all");
+            strcat(flags, " all");
     }
+
+    return flags;
 }
 
 char* printAddressPort(const struct addrinfo* aip, char addr[]) {
@@ -139,3 +143,137 @@ int sockAddrsEqual(const struct sockaddr* addr1, const struct sockaddr* addr2) {
     } else
         return 0;
 }
+
+int parseAddressPrefix(const char* text, uint8_t address[16], int* prefixLength) {
+    char buffer[INET6_ADDRSTRLEN + 8];
+    if (strlen(text) >= sizeof(buffer))
+        return AF_UNSPEC;
+    strcpy(buffer, text);
+
+    char* slash = strchr(buffer, '/');
+    if (slash != NULL)
+        *slash = '\0';
+
+    int family, maxLength;
+    if (inet_pton(AF_INET, buffer, address) == 1) {
+        family = AF_INET;
+        maxLength = 32;
+    } else if (inet_pton(AF_INET6, buffer, address) == 1) {
+        family = AF_INET6;
+        maxLength = 128;
+    } else {
+        return AF_UNSPEC;
+    }
+
+    long length = maxLength;
+    if (slash != NULL) {
+        char* end;
+        length = strtol(slash + 1, &end, 10);
+        if (end == slash + 1 || *end != '\0' || length < 0 || length > maxLength)
+            return AF_UNSPEC;
+    }
+    *prefixLength = (int)length;
+    return family;
+}
+
+int parseMappedPrefix(const char* text, uint8_t mapped[16], int* prefixLength) {
+    uint8_t address[16];
+    int length;
+    int family = parseAddressPrefix(text, address, &length);
+    if (family == AF_UNSPEC)
+        return -1;
+
+    // Los prefijos IPv4 tambien cubren los 96 bits con los que empiezan todas las direcciones IPv4-mapped.
+    if (family == AF_INET) {
+        mapIpv4Address(address, mapped);
+        length += 96;
+    } else {
+        memcpy(mapped, address, 16);
+    }
+    *prefixLength = length;
+    return 0;
+}
+
+int addressPrefixMatches(const uint8_t* prefix, const uint8_t* address, int prefixLength) {
+    int bytes = prefixLength >> 3;
+    if (memcmp(prefix, address, bytes) != 0)
+        return 0;
+    int bits = prefixLength & 7;
+    if (bits == 0)
+        return 1;
+    uint8_t mask = (uint8_t)(0xFF << (8 - bits));
+    return (prefix[bytes] & mask) == (address[bytes] & mask);
+}
+
+void mapIpv4Address(const uint8_t* ipv4, uint8_t mapped[16]) {
+    memset(mapped, 0, 10);
+    mapped[10] = 0xFF;
+    mapped[11] = 0xFF;
+    memcpy(mapped + 12, ipv4, 4);
+}
+
+int sockAddrToMapped(const struct sockaddr* address, uint8_t mapped[16]) {
+    if (address->sa_family == AF_INET) {
+        mapIpv4Address((const uint8_t*)&((const struct sockaddr_in*)address)->sin_addr, mapped);
+    } else if (address->sa_family == AF_INET6) {
+        memcpy(mapped, &((const struct sockaddr_in6*)address)->sin6_addr, 16);
+    } else {
+        memset(mapped, 0, 16);
+        return -1;
+    }
+    return 0;
+}
+
+int sockAddrKeyBytes(const struct sockaddr* address, const uint8_t** bytes) {
+    if (address->sa_family == AF_INET) {
+        *bytes = (const uint8_t*)&((const struct sockaddr_in*)address)->sin_addr;
+        return 4;
+    } else if (address->sa_family == AF_INET6) {
+        const struct in6_addr* address6 = &((const struct sockaddr_in6*)address)->sin6_addr;
+        int mapped = IN6_IS_ADDR_V4MAPPED(address6);
+        *bytes = mapped ? address6->s6_addr + 12 : address6->s6_addr;
+        return mapped ? 4 : 16;
+    }
+    return 0;
+}
+
+int normalizeDomainName(const char* text, char* name) {
+    if (strncmp(text, "*.", 2) == 0)
+        text += 2;
+    else if (text[0] == '.')
+        text++;
+
+    size_t length = strlen(text);
+    if (length > 0 && text[length - 1] == '.')
+        length--;
+    if (length == 0 || length > 255 || text[length - 1] == '.')
+        return -1;
+
+    for (size_t i = 0; i < length; i++) {
+        char c = (char)tolower((unsigned char)text[i]);
+        if (!isalnum((unsigned char)c) && c != '-' && c != '_' && c != '.')
+            return -1;
+        if (c == '.' && (i == 0 || name[i - 1] == '.'))
+            return -1;
+        name[i] = c;
+    }
+    name[length] = '\0';
+    return 0;
+}
+
+uint64_t getMonotonicMillis() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+uint64_t getMonotonicMicros() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+uint64_t getMonotonicNanos() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
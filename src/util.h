@@ -2,6 +2,8 @@
 #define _UTIL_H_
 
 #include <netdb.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <sys/socket.h>
 
 int printSocketAddress(const struct sockaddr* address, char* addrBuffer);
@@ -9,10 +11,64 @@ int printSocketAddress(const struct sockaddr* address, char* addrBuffer);
 const char* printFamily(struct addrinfo* aip);
 const char* printType(struct addrinfo* aip);
 const char* printProtocol(struct addrinfo* aip);
-void printFlags(struct addrinfo* aip);
+// Escribe los flags de aip en flags, que debe tener lugar para PRINT_FLAGS_LENGTH caracteres
+#define PRINT_FLAGS_LENGTH 64
+char* printFlags(const struct addrinfo* aip, char flags[]);
 char* printAddressPort(const struct addrinfo* aip, char addr[]);
 
 // Determina si dos sockets son iguales (misma direccion y puerto)
 int sockAddrsEqual(const struct sockaddr* addr1, const struct sockaddr* addr2);
 
+// Parsea una direccion IPv4 o IPv6 con un /largo opcional, guardando la direccion en address (4 o 16 bytes) y el largo
+// del prefijo en prefixLength. Devuelve la familia (AF_INET o AF_INET6), o AF_UNSPEC si no es un prefijo valido
+int parseAddressPrefix(const char* text, uint8_t address[16], int* prefixLength);
+
+// Lo mismo que parseAddressPrefix(), pero guardando los prefijos IPv4 como IPv4-mapped (con 96 bits mas de largo).
+// Devuelve 0 si tuvo exito, o -1 si no es un prefijo valido
+int parseMappedPrefix(const char* text, uint8_t mapped[16], int* prefixLength);
+
+// Determina si los primeros prefixLength bits de address son los de prefix
+int addressPrefixMatches(const uint8_t* prefix, const uint8_t* address, int prefixLength);
+
+// Guarda una direccion IPv4 como una direccion IPv6 IPv4-mapped (::ffff:a.b.c.d)
+void mapIpv4Address(const uint8_t* ipv4, uint8_t mapped[16]);
+
+// Guarda la direccion de un socket IPv4 o IPv6 como una direccion IPv6, las IPv4 como IPv4-mapped. Devuelve 0 si tuvo
+// exito, o -1 (dejando mapped en ceros) si el socket no es de ninguna de las dos familias
+int sockAddrToMapped(const struct sockaddr* address, uint8_t mapped[16]);
+
+// Guarda en bytes un puntero a los bytes de la direccion de un socket IPv4 o IPv6, los de la direccion IPv4 si es
+// IPv4-mapped, para usarlos como clave. Devuelve cuantos son (4 o 16), o 0 si el socket no es de ninguna de las dos
+// familias
+int sockAddrKeyBytes(const struct sockaddr* address, const uint8_t** bytes);
+
+// Normaliza un nombre de dominio: en minusculas, sin un "*." o "." al principio ni un "." al final. name debe tener
+// lugar para 256 caracteres. Devuelve 0 si tuvo exito, o -1 si no es un nombre de dominio valido
+int normalizeDomainName(const char* text, char* name);
+
+// El valor inicial de un hash FNV-1a de 32 bits
+#define FNV1A_INITIAL 2166136261u
+
+// Continua un hash FNV-1a de 32 bits con los bytes de data
+static inline uint32_t fnv1aUpdate(uint32_t hash, const void* data, size_t length) {
+    const uint8_t* bytes = (const uint8_t*)data;
+    for (size_t i = 0; i < length; i++)
+        hash = (hash ^ bytes[i]) * 16777619u;
+    return hash;
+}
+
+// Calcula el hash FNV-1a de 32 bits de data
+static inline uint32_t fnv1a(const void* data, size_t length) {
+    return fnv1aUpdate(FNV1A_INITIAL, data, length);
+}
+
+// Obtiene el tiempo actual en milisegundos, segun un reloj monotonico (no afectado por cambios en la hora del sistema)
+uint64_t getMonotonicMillis();
+
+// Lo mismo que getMonotonicMillis(), pero en microsegundos
+uint64_t getMonotonicMicros();
+
+// Lo mismo que getMonotonicMillis(), pero en nanosegundos
+uint64_t getMonotonicNanos();
+
 #endif
@@ -0,0 +1,395 @@
+#include "worker.h"
+#include "accounting.h"
+#include "admission.h"
+#include "credentials.h"
+#include "logger.h"
+#include "socks5.h"
+#include "timeline.h"
+#include "udprelay.h"
+#include "util.h"
+#include <errno.h>
+#include <netinet/in.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+
+#define MAX_IDLE_PIPES 256
+
+// How many objects each chunk of the worker's slabs holds. The first chunk of each is allocated when the worker
+// starts, so the first connections never go to malloc().
+#define CONNECTION_SLAB_CHUNK 256
+#define PARENT_HANDSHAKE_SLAB_CHUNK 64
+#define UDP_ASSOCIATION_SLAB_CHUNK 16
+#define ACCOUNTING_SLAB_CHUNK 64
+#define TIMELINE_SLAB_CHUNK 16
+
+// How often a worker measures its event loop's lag, and checks whether to accept connections again while it doesn't.
+#define ADMISSION_INTERVAL_MILLIS 10
+
+/**
+ * Frees the pipes and slabs of a worker that failed to start.
+ */
+static void destroyPools(struct Worker* worker) {
+    pipePoolDestroy(&worker->pipePool);
+    slabDestroy(&worker->connectionSlab);
+    slabDestroy(&worker->parentHandshakeSlab);
+    slabDestroy(&worker->udpAssociationSlab);
+    slabDestroy(&worker->accountingSlab);
+    slabDestroy(&worker->timelineSlab);
+}
+
+/**
+ * Logs the local address of a passive socket, for nothing more than printing it out.
+ */
+static void logServerSocket(struct Worker* worker, int serverSocket, const char* action) {
+    struct sockaddr_storage boundAddress;
+    socklen_t boundAddressLen = sizeof(boundAddress);
+    if (getsockname(serverSocket, (struct sockaddr*)&boundAddress, &boundAddressLen) >= 0) {
+        char addrBuffer[128];
+        printSocketAddress((struct sockaddr*)&boundAddress, addrBuffer);
+        logInfo("Worker %d %s %s", worker->id, action, addrBuffer);
+    } else
+        logErrno(LOG_LEVEL_WARN, "Failed to getsockname()");
+}
+
+/**
+ * Creates one of the worker's passive sockets, bound to the given address with SO_REUSEPORT so every worker can have
+ * its own. Returns the socket, or -1 if an error occurred.
+ */
+static int createServerSocket(struct Worker* worker, const struct ListenAddress* listenAddress) {
+    int family = listenAddress->address.ss_family;
+    int serverSocket = socket(family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_TCP);
+    if (serverSocket < 0) {
+        logErrno(LOG_LEVEL_ERROR, "socket()");
+        return -1;
+    }
+
+    // Let every worker bind its own socket to the same address and port.
+    int one = 1;
+    if (setsockopt(serverSocket, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) != 0) {
+        logErrno(LOG_LEVEL_ERROR, "setsockopt(SO_REUSEPORT)");
+        close(serverSocket);
+        return -1;
+    }
+
+    // IPv6 has backwards compatibility with IPv4, so by listening on IPv6 we can also handle incoming IPv4
+    // connections ;) Unless IPv4 is listened on separately.
+    int v6Only = listenAddress->v6Only;
+    if (family == AF_INET6 && setsockopt(serverSocket, IPPROTO_IPV6, IPV6_V6ONLY, &v6Only, sizeof(v6Only)) != 0)
+        logErrno(LOG_LEVEL_WARN, "setsockopt(IPV6_V6ONLY)");
+
+    // Options set on the passive socket are inherited by the sockets accepted from it.
+    if (socketOptionsApply(serverSocket, &worker->args->clientSocketOptions, 1) != 0)
+        logErrno(LOG_LEVEL_WARN, "Failed to apply the client socket options");
+
+    if (bind(serverSocket, (struct sockaddr*)&listenAddress->address, listenAddress->addressLength) != 0) {
+        logErrno(LOG_LEVEL_ERROR, "bind()");
+        close(serverSocket);
+        return -1;
+    }
+
+    if (listen(serverSocket, worker->args->backlog) != 0) {
+        logErrno(LOG_LEVEL_ERROR, "listen()");
+        close(serverSocket);
+        return -1;
+    }
+
+    logServerSocket(worker, serverSocket, "binding to");
+    return serverSocket;
+}
+
+static void acceptHandler(int clientSocket, void* data);
+
+/**
+ * Takes the passive sockets out of the selector, so connections wait in the kernel's queue until we take them back
+ * with resumeAccepting(), and counts the pause in the given metric. Does nothing once the worker stopped accepting for
+ * good.
+ */
+static void pauseAccepting(struct Worker* worker, _Atomic uint64_t* pauses) {
+    if (worker->acceptPaused || worker->serverSocketCount == 0)
+        return;
+
+    for (int i = 0; i < worker->serverSocketCount; i++)
+        selectorRemove(worker->selector, worker->serverSockets[i]);
+    worker->acceptPaused = 1;
+    metricsAdd(pauses, 1);
+    logDebug("Worker %d paused accepting connections", worker->id);
+
+    if (!worker->admissionTimer.scheduled)
+        timerSchedule(&worker->admissionTimer, ADMISSION_INTERVAL_MILLIS);
+}
+
+static void resumeAccepting(struct Worker* worker) {
+    if (!worker->acceptPaused)
+        return;
+
+    worker->acceptPaused = 0;
+    for (int i = 0; i < worker->serverSocketCount; i++) {
+        if (selectorAddAcceptor(worker->selector, worker->serverSockets[i], acceptHandler, worker) != 0)
+            logErrno(LOG_LEVEL_ERROR, "Failed to register passive socket in selector");
+    }
+    logDebug("Worker %d resumed accepting connections", worker->id);
+}
+
+/**
+ * Measures how late the event loop runs this timer (which it would run right on time if it wasn't busy), and pauses
+ * or resumes accepting connections depending on that and on how many handshakes are in progress.
+ */
+static void admissionTimerExpired(void* data) {
+    struct Worker* worker = (struct Worker*)data;
+
+    int maxLoopLag = worker->args->maxLoopLag;
+    if (maxLoopLag > 0) {
+        uint64_t now = getMonotonicMicros();
+        uint64_t deadline = worker->admissionTimer.deadline * 1000;
+        int64_t lag = now > deadline ? (int64_t)(now - deadline) : 0;
+
+        // A single slow turn of the loop shouldn't shed load, so the lag is smoothed over the last few measures.
+        int64_t smoothed = atomic_load_explicit(&worker->metrics.loopLagMicros, memory_order_relaxed);
+        smoothed += (lag - smoothed) / 8;
+        atomic_store_explicit(&worker->metrics.loopLagMicros, smoothed, memory_order_relaxed);
+
+        int lagging = smoothed > (int64_t)maxLoopLag * 1000;
+        if (lagging != worker->loopLagging)
+            logInfo("Worker %d event loop %s (lag %ld us)", worker->id, lagging ? "is lagging, shedding load" : "caught up", (long)smoothed);
+        worker->loopLagging = lagging;
+    }
+
+    if (worker->loopLagging || admissionHandshakesFull())
+        pauseAccepting(worker, &worker->metrics.acceptPauses);
+    else
+        resumeAccepting(worker);
+
+    if (maxLoopLag > 0 || worker->acceptPaused)
+        timerSchedule(&worker->admissionTimer, ADMISSION_INTERVAL_MILLIS);
+}
+
+/**
+ * Hands each connection accepted on the passive socket to the socks5 state machine.
+ */
+static void acceptHandler(int clientSocket, void* data) {
+    struct Worker* worker = (struct Worker*)data;
+
+    // Out of file descriptors (or memory), the connection stays ready in the kernel's queue, so we stop accepting
+    // until the admission timer tries again, hopefully after some connections closed.
+    if (clientSocket < 0) {
+        if (!worker->acceptFailing)
+            logWarn("Worker %d failed to accept a connection, pausing: %s", worker->id, strerror(errno));
+        worker->acceptFailing = 1;
+        pauseAccepting(worker, &worker->metrics.acceptFailurePauses);
+        return;
+    }
+
+    if (worker->acceptFailing) {
+        logInfo("Worker %d is accepting connections again", worker->id);
+        worker->acceptFailing = 0;
+    }
+
+    // The client's address is looked up here if it's logged, accounted for or picks the tunnels sampled for timelines,
+    // and then handed to the connection so it doesn't have to look it up again.
+    struct sockaddr_storage clientAddress;
+    int addressKnown = 0;
+    if (logEnabled(LOG_LEVEL_INFO) || accountingEnabled() || timelineNeedsClientAddress()) {
+        socklen_t clientAddressLen = sizeof(clientAddress);
+        addressKnown = getpeername(clientSocket, (struct sockaddr*)&clientAddress, &clientAddressLen) == 0;
+
+        if (logEnabled(LOG_LEVEL_INFO)) {
+            char addrBuffer[128];
+            if (addressKnown)
+                printSocketAddress((struct sockaddr*)&clientAddress, addrBuffer);
+            else
+                strcpy(addrBuffer, "[unknown]");
+            logInfo("New connection from %s", addrBuffer);
+        }
+    }
+
+    handleClient(worker, clientSocket, addressKnown ? &clientAddress : NULL);
+
+    // Once as many connections as allowed are in their handshake, the rest wait in the kernel's queue.
+    if (admissionHandshakesFull())
+        pauseAccepting(worker, &worker->metrics.acceptPauses);
+}
+
+/**
+ * Unregisters (if they were registered) and closes all of the worker's passive sockets.
+ */
+static void closeServerSockets(struct Worker* worker) {
+    for (int i = 0; i < worker->serverSocketCount; i++) {
+        if (worker->serverSockets[i] >= 0) {
+            if (!worker->acceptPaused)
+                selectorRemove(worker->selector, worker->serverSockets[i]);
+            close(worker->serverSockets[i]);
+        }
+    }
+    worker->serverSocketCount = 0;
+    worker->acceptPaused = 0;
+}
+
+/**
+ * Handles the requests other threads make to the worker through its control eventfd.
+ */
+static void controlHandler(int fd, uint32_t events, void* data) {
+    struct Worker* worker = (struct Worker*)data;
+
+    uint64_t count;
+    if (read(fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+        logErrno(LOG_LEVEL_ERROR, "Failed to read worker control eventfd");
+
+    // Once another process took over the passive sockets, we stop accepting from them and just let the connections
+    // we already have finish. The sockets stay open in the other process, so no client is refused.
+    if (atomic_load(&worker->stopAccepting) && worker->serverSocketCount > 0) {
+        closeServerSockets(worker);
+        logInfo("Worker %d stopped accepting connections", worker->id);
+    }
+
+    // When the process exits, the connections still open are closed here, on the worker's own thread, so they're all
+    // accounted for before the accounting log is finished.
+    if (atomic_load(&worker->shutdown) && !worker->finished) {
+        closeServerSockets(worker);
+        closeAllConnections(worker);
+        worker->finished = 1;
+        logInfo("Worker %d shut down", worker->id);
+    }
+}
+
+static void* workerThread(void* arg) {
+    struct Worker* worker = (struct Worker*)arg;
+
+    if (worker->cpu >= 0) {
+        cpu_set_t cpuSet;
+        CPU_ZERO(&cpuSet);
+        CPU_SET(worker->cpu, &cpuSet);
+        int error = pthread_setaffinity_np(pthread_self(), sizeof(cpuSet), &cpuSet);
+        if (error != 0)
+            logWarn("Failed to pin worker %d to CPU %d: %s", worker->id, worker->cpu, strerror(error));
+    }
+
+    // Handle incomming connections. Every socket is non-blocking, so a single thread can serve many clients
+    // at once: we just wait for any of the sockets to be ready and let its handler continue from there. We never
+    // wait past the next timer, and run the timers that expired after handling the sockets.
+    while (!worker->finished) {
+        if (selectorSelect(worker->selector, timerWheelTimeout(&worker->timers)) < 0) {
+            logErrno(LOG_LEVEL_ERROR, "selectorSelect()");
+            exit(1);
+        }
+        timerWheelAdvance(&worker->timers);
+    }
+
+    udpAssociationFreeBatch();
+    return NULL;
+}
+
+int workerStart(struct Worker* worker) {
+    worker->selector = selectorCreate(worker->args->ioEngine);
+    if (worker->selector == NULL) {
+        logErrno(LOG_LEVEL_ERROR, "selectorCreate()");
+        return -1;
+    }
+
+    if (worker->args->ioEngine == SELECTOR_BACKEND_IO_URING && selectorGetBackend(worker->selector) != SELECTOR_BACKEND_IO_URING)
+        logWarn("Worker %d: io_uring is not available, falling back to epoll", worker->id);
+
+    if (resolverClientInit(&worker->resolverClient, worker->selector) != 0) {
+        logErrno(LOG_LEVEL_ERROR, "resolverClientInit()");
+        selectorDestroy(worker->selector);
+        return -1;
+    }
+
+    atomic_init(&worker->stopAccepting, 0);
+    atomic_init(&worker->shutdown, 0);
+    worker->finished = 0;
+    worker->connections = NULL;
+    worker->controlFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (worker->controlFd < 0 || selectorAdd(worker->selector, worker->controlFd, EPOLLIN, controlHandler, worker) != 0) {
+        logErrno(LOG_LEVEL_ERROR, "Failed to set up worker control eventfd");
+        selectorDestroy(worker->selector);
+        return -1;
+    }
+
+    if (credentialCacheInit(&worker->credentialCache, worker->selector) != 0) {
+        logError("Failed to register credential cache");
+        selectorDestroy(worker->selector);
+        return -1;
+    }
+
+    timerWheelInit(&worker->timers);
+    shaperQueueInit(&worker->shaperQueue, &worker->timers);
+    parentBalancerInit(&worker->parentBalancer);
+    sourcePoolInit(&worker->sourcePool, worker->args->sourceAddresses, worker->args->sourceAddressCount, worker->args->sourceSelection, &worker->metrics);
+
+    bufferPoolInit(&worker->bufferPool, &worker->timers, &worker->metrics);
+
+    worker->acceptPaused = worker->loopLagging = worker->acceptFailing = 0;
+    timerInit(&worker->admissionTimer, &worker->timers, admissionTimerExpired, worker);
+    if (worker->args->maxLoopLag > 0)
+        timerSchedule(&worker->admissionTimer, ADMISSION_INTERVAL_MILLIS);
+
+    if (pipePoolInit(&worker->pipePool, worker->args->useSplice ? MAX_IDLE_PIPES : 0) != 0) {
+        logErrno(LOG_LEVEL_ERROR, "pipePoolInit()");
+        selectorDestroy(worker->selector);
+        return -1;
+    }
+
+    memset(&worker->connectionSlab, 0, sizeof(worker->connectionSlab));
+    memset(&worker->parentHandshakeSlab, 0, sizeof(worker->parentHandshakeSlab));
+    memset(&worker->udpAssociationSlab, 0, sizeof(worker->udpAssociationSlab));
+    memset(&worker->accountingSlab, 0, sizeof(worker->accountingSlab));
+    memset(&worker->timelineSlab, 0, sizeof(worker->timelineSlab));
+    if (slabInit(&worker->connectionSlab, sizeof(struct Socks5Connection), CONNECTION_SLAB_CHUNK) != 0 || slabInit(&worker->parentHandshakeSlab, sizeof(struct ParentHandshake), PARENT_HANDSHAKE_SLAB_CHUNK) != 0 || slabInit(&worker->udpAssociationSlab, sizeof(struct UdpAssociation), UDP_ASSOCIATION_SLAB_CHUNK) != 0 || (accountingEnabled() && slabInit(&worker->accountingSlab, sizeof(struct AccountingRecord), ACCOUNTING_SLAB_CHUNK) != 0) || (timelineEnabled() && slabInit(&worker->timelineSlab, sizeof(struct Timeline), TIMELINE_SLAB_CHUNK) != 0)) {
+        logError("Failed to allocate memory for worker %d's connections", worker->id);
+        destroyPools(worker);
+        selectorDestroy(worker->selector);
+        return -1;
+    }
+
+    // After a hot upgrade, the worker keeps accepting from the passive sockets the previous process handed over.
+    worker->serverSocketCount = worker->args->listenAddressCount;
+    for (int i = 0; i < worker->serverSocketCount; i++) {
+        if (worker->serverSockets[i] >= 0)
+            logServerSocket(worker, worker->serverSockets[i], "took over");
+        else
+            worker->serverSockets[i] = createServerSocket(worker, &worker->args->listenAddresses[i]);
+
+        if (worker->serverSockets[i] < 0 || selectorAddAcceptor(worker->selector, worker->serverSockets[i], acceptHandler, worker) != 0) {
+            if (worker->serverSockets[i] >= 0)
+                logErrno(LOG_LEVEL_ERROR, "Failed to register passive socket in selector");
+            closeServerSockets(worker);
+            destroyPools(worker);
+            selectorDestroy(worker->selector);
+            return -1;
+        }
+    }
+
+    int error = pthread_create(&worker->thread, NULL, workerThread, worker);
+    if (error != 0) {
+        logError("Failed to create thread for worker %d: %s", worker->id, strerror(error));
+        closeServerSockets(worker);
+        destroyPools(worker);
+        selectorDestroy(worker->selector);
+        return -1;
+    }
+
+    return 0;
+}
+
+void workerStopAccepting(struct Worker* worker) {
+    atomic_store(&worker->stopAccepting, 1);
+    uint64_t one = 1;
+    if (write(worker->controlFd, &one, sizeof(one)) < 0)
+        logErrno(LOG_LEVEL_ERROR, "Failed to notify worker");
+}
+
+void workerShutdown(struct Worker* worker) {
+    atomic_store(&worker->shutdown, 1);
+    uint64_t one = 1;
+    if (write(worker->controlFd, &one, sizeof(one)) < 0)
+        logErrno(LOG_LEVEL_ERROR, "Failed to notify worker");
+}
+
+int64_t workerActiveConnections(struct Worker* worker) {
+    return atomic_load_explicit(&worker->metrics.connectionsActive, memory_order_relaxed);
+}
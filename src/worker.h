@@ -0,0 +1,125 @@
+#ifndef _WORKER_H_
+#define _WORKER_H_
+
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "args.h"
+#include "bufferpool.h"
+#include "credentials.h"
+#include "metrics.h"
+#include "parents.h"
+#include "pipepool.h"
+#include "resolver.h"
+#include "selector.h"
+#include "shaper.h"
+#include "slab.h"
+#include "sourcepool.h"
+#include "timerwheel.h"
+
+/**
+ * A worker is a thread running its own event loop. Each worker has its own passive socket for each listen address
+ * (bound to the same address with SO_REUSEPORT, so the kernel spreads incoming connections among them) and its own
+ * selector, so a client connection is handled start to finish by a single worker and workers never have to
+ * share anything or take any locks.
+ */
+struct Worker {
+    int id;
+
+    // The CPU this worker's thread is pinned to, or -1 if it's not pinned.
+    int cpu;
+
+    const struct ServerArgs* args;
+
+    pthread_t thread;
+    struct Selector* selector;
+
+    // The passive sockets, one for each listen address (in the same order), and none once the worker stopped
+    // accepting. Those set before starting the worker (to sockets inherited from the previous process in a hot
+    // upgrade) are used instead of creating them, and the rest must be -1.
+    int serverSockets[MAX_LISTEN_ADDRESSES];
+    int serverSocketCount;
+
+    // Whether the passive sockets are out of the selector for admission control: while too many handshakes are in
+    // progress, or the event loop lags. The timer checks again every so often whether to take them back, and
+    // measures the lag by how late it runs.
+    int acceptPaused;
+    int loopLagging;
+    struct Timer admissionTimer;
+
+    // Whether accepting failed for lack of file descriptors (or memory), which also pauses accepting until the
+    // timer tries again. Only the first failure is logged, until a connection is accepted again.
+    int acceptFailing;
+
+    // Other threads write to this eventfd to have the worker look at the requests they left for it, like
+    // stopAccepting and shutdown. Once it shut down, the worker's thread ends.
+    int controlFd;
+    atomic_int stopAccepting;
+    atomic_int shutdown;
+    int finished;
+
+    // The worker's open client connections.
+    struct Socks5Connection* connections;
+
+    // The pipes used by this worker's tunnels to relay data with splice().
+    struct PipePool pipePool;
+
+    // The buffers this worker's tunnels relay data through, and its handshakes are read into.
+    struct BufferPool bufferPool;
+
+    // Where this worker's connections, and the parts of them only some connections need, are allocated from.
+    struct Slab connectionSlab;
+    struct Slab parentHandshakeSlab;
+    struct Slab udpAssociationSlab;
+    struct Slab accountingSlab;
+    struct Slab timelineSlab;
+
+    // How many of this worker's tunnels were counted towards the timelines' sample rate.
+    uint64_t timelineCounter;
+
+    // The local addresses this worker's connections to destinations come from.
+    struct SourcePool sourcePool;
+
+    // How this worker's tunnels are spread among the parent proxies, if there are any.
+    struct ParentBalancer parentBalancer;
+
+    // The timers of this worker's connections (and everything else on its event loop that waits for some time).
+    struct TimerWheel timers;
+
+    // Through this the resolver threads hand this worker the results of its DNS lookups.
+    struct ResolverClient resolverClient;
+
+    // The credentials this worker verified recently, if clients authenticate with username and password.
+    struct CredentialCache credentialCache;
+
+    // The tunnel directions of this worker waiting for their rate limits to have tokens again.
+    struct ShaperQueue shaperQueue;
+
+    // Counters and latency histograms for this worker's connections, only updated by this worker's thread.
+    struct Metrics metrics;
+};
+
+/**
+ * Creates the worker's passive sockets (except those already set) and selector, then starts its thread. Returns 0 if
+ * successful, or -1 if an error occurred.
+ */
+int workerStart(struct Worker* worker);
+
+/**
+ * Asks the worker to close its passive sockets, while it keeps serving the connections it already has. May be called
+ * from any thread.
+ */
+void workerStopAccepting(struct Worker* worker);
+
+/**
+ * Asks the worker to close its passive sockets and all its connections, accounting for them, and then end its thread,
+ * which can be joined once it did. May be called from any thread.
+ */
+void workerShutdown(struct Worker* worker);
+
+/**
+ * Returns how many client connections the worker has open. May be called from any thread.
+ */
+int64_t workerActiveConnections(struct Worker* worker);
+
+#endif
@@ -0,0 +1,302 @@
+/**
+ * Reads the accounting log files medias writes with --accounting-log, and either converts their records to CSV or
+ * JSON lines, or adds them up by client address, user, destination host or worker.
+ *
+ * Files still being written can be read too: only the records their header counts are read, which are always
+ * complete.
+ */
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "accounting.h"
+#include "util.h"
+
+static const char* closeReasonNames[ACCOUNTING_CLOSE_REASON_COUNT] = {"done", "error", "handshake_timeout", "idle_timeout", "shutdown"};
+
+enum OutputFormat {
+    OUTPUT_CSV,
+    OUTPUT_JSON
+};
+
+enum SummaryKey {
+    SUMMARY_NONE,
+    SUMMARY_CLIENT,
+    SUMMARY_USER,
+    SUMMARY_HOST,
+    SUMMARY_WORKER
+};
+
+/**
+ * The totals of the records with the same key, in an open addressing hash table.
+ */
+struct Summary {
+    char* key;
+    uint64_t connections;
+    uint64_t failed;
+    uint64_t bytesClientToRemote;
+    uint64_t bytesRemoteToClient;
+    uint64_t relayMicros;
+};
+
+static struct Summary* summaries = NULL;
+static size_t summaryCapacity = 0;
+static size_t summaryCount = 0;
+
+static void printUsage(const char* programName) {
+    fprintf(stderr, "Usage: %s [-j] [-s client|user|host|worker] <file>...\n"
+                    "\n"
+                    "Prints the records of medias accounting log files, one per line as CSV (with a header line).\n"
+                    "  -j          Print the records as JSON lines instead.\n"
+                    "  -s <key>    Add up the records by client address, user, destination host or worker instead,\n"
+                    "              printing the connections, failed requests, bytes each way and relay time of each.\n",
+            programName);
+}
+
+static const char* formatAddress(const struct AccountingAddress* address, char* buffer) {
+    if (address->family == 4)
+        inet_ntop(AF_INET, address->address, buffer, INET6_ADDRSTRLEN);
+    else if (address->family == 6)
+        inet_ntop(AF_INET6, address->address, buffer, INET6_ADDRSTRLEN);
+    else
+        buffer[0] = '\0';
+    return buffer;
+}
+
+/**
+ * Prints a string from a record, which may hold any bytes a client sent, quoted as a CSV field or a JSON string.
+ */
+static void printString(const char* text, size_t length, enum OutputFormat format) {
+    putchar('"');
+    for (size_t i = 0; i < length; i++) {
+        unsigned char c = (unsigned char)text[i];
+        if (format == OUTPUT_CSV && c == '"')
+            fputs("\"\"", stdout);
+        else if (format == OUTPUT_CSV)
+            putchar(c);
+        else if (c == '"' || c == '\\')
+            printf("\\%c", c);
+        else if (c < 0x20 || c >= 0x7f)
+            printf("\\u%04x", c);
+        else
+            putchar(c);
+    }
+    putchar('"');
+}
+
+static void printCsvHeader() {
+    printf("accepted_at,closed_at,worker,client,client_port,command,atyp,host,port,remote,remote_port,parent,user,rep,"
+           "close_reason,auth_us,request_us,dns_us,connect_us,relay_us,bytes_client_to_remote,bytes_remote_to_client\n");
+}
+
+static void printRecord(const struct AccountingRecord* record, enum OutputFormat format) {
+    char client[INET6_ADDRSTRLEN];
+    char remote[INET6_ADDRSTRLEN];
+    formatAddress(&record->client, client);
+    formatAddress(&record->remote, remote);
+    const char* closeReason = record->closeReason < ACCOUNTING_CLOSE_REASON_COUNT ? closeReasonNames[record->closeReason] : "unknown";
+    int parent = record->parent == ACCOUNTING_NO_PARENT ? -1 : record->parent;
+    int replyCode = record->replyCode == ACCOUNTING_NO_REPLY ? -1 : record->replyCode;
+
+    if (format == OUTPUT_CSV) {
+        printf("%lu.%06lu,%lu.%06lu,%u,%s,%u,%u,%u,", (unsigned long)(record->acceptedAt / 1000000), (unsigned long)(record->acceptedAt % 1000000), (unsigned long)(record->closedAt / 1000000), (unsigned long)(record->closedAt % 1000000), record->worker, client, record->client.port, record->command, record->addressType);
+        printString(record->host, record->hostLength, format);
+        printf(",%u,%s,%u,%d,", record->port, remote, record->remote.port, parent);
+        printString(record->user, record->userLength, format);
+        printf(",%d,%s", replyCode, closeReason);
+        for (int phase = 0; phase < ACCOUNTING_PHASES; phase++)
+            printf(",%lu", (unsigned long)record->phaseMicros[phase]);
+        printf(",%lu,%lu\n", (unsigned long)record->bytesClientToRemote, (unsigned long)record->bytesRemoteToClient);
+        return;
+    }
+
+    printf("{\"accepted_at\": %lu, \"closed_at\": %lu, \"worker\": %u, \"client\": \"%s\", \"client_port\": %u, \"command\": %u, \"atyp\": %u, \"host\": ", (unsigned long)record->acceptedAt, (unsigned long)record->closedAt, record->worker, client, record->client.port, record->command, record->addressType);
+    printString(record->host, record->hostLength, format);
+    printf(", \"port\": %u, \"remote\": \"%s\", \"remote_port\": %u, \"parent\": %d, \"user\": ", record->port, remote, record->remote.port, parent);
+    printString(record->user, record->userLength, format);
+    printf(", \"rep\": %d, \"close_reason\": \"%s\", \"phase_us\": [", replyCode, closeReason);
+    for (int phase = 0; phase < ACCOUNTING_PHASES; phase++)
+        printf("%s%lu", phase == 0 ? "" : ", ", (unsigned long)record->phaseMicros[phase]);
+    printf("], \"bytes_client_to_remote\": %lu, \"bytes_remote_to_client\": %lu}\n", (unsigned long)record->bytesClientToRemote, (unsigned long)record->bytesRemoteToClient);
+}
+
+/**
+ * Returns the totals for the given key, adding them if they're not there yet. Returns NULL if there's not enough
+ * memory.
+ */
+static struct Summary* findSummary(const char* key) {
+    // At most half the slots are used, so probes stay short (and there's always an empty slot to end them).
+    if (summaryCount * 2 >= summaryCapacity) {
+        size_t newCapacity = summaryCapacity == 0 ? 1024 : summaryCapacity * 2;
+        struct Summary* newSummaries = calloc(newCapacity, sizeof(struct Summary));
+        if (newSummaries == NULL)
+            return NULL;
+        for (size_t i = 0; i < summaryCapacity; i++) {
+            if (summaries[i].key == NULL)
+                continue;
+            size_t position = fnv1a(summaries[i].key, strlen(summaries[i].key)) & (newCapacity - 1);
+            while (newSummaries[position].key != NULL)
+                position = (position + 1) & (newCapacity - 1);
+            newSummaries[position] = summaries[i];
+        }
+        free(summaries);
+        summaries = newSummaries;
+        summaryCapacity = newCapacity;
+    }
+
+    size_t position = fnv1a(key, strlen(key)) & (summaryCapacity - 1);
+    for (; summaries[position].key != NULL; position = (position + 1) & (summaryCapacity - 1)) {
+        if (strcmp(summaries[position].key, key) == 0)
+            return &summaries[position];
+    }
+
+    summaries[position].key = strdup(key);
+    if (summaries[position].key == NULL)
+        return NULL;
+    summaryCount++;
+    return &summaries[position];
+}
+
+static int addToSummary(const struct AccountingRecord* record, enum SummaryKey summaryKey) {
+    char key[ACCOUNTING_HOST_LENGTH + 1];
+    if (summaryKey == SUMMARY_CLIENT) {
+        formatAddress(&record->client, key);
+    } else if (summaryKey == SUMMARY_USER) {
+        memcpy(key, record->user, record->userLength);
+        key[record->userLength] = '\0';
+    } else if (summaryKey == SUMMARY_HOST) {
+        memcpy(key, record->host, record->hostLength);
+        key[record->hostLength] = '\0';
+    } else {
+        snprintf(key, sizeof(key), "%u", record->worker);
+    }
+
+    struct Summary* summary = findSummary(key);
+    if (summary == NULL) {
+        perror("Failed to add up records");
+        return -1;
+    }
+
+    summary->connections++;
+    if (record->replyCode != 0)
+        summary->failed++;
+    summary->bytesClientToRemote += record->bytesClientToRemote;
+    summary->bytesRemoteToClient += record->bytesRemoteToClient;
+    summary->relayMicros += record->phaseMicros[ACCOUNTING_PHASES - 1];
+    return 0;
+}
+
+static void printSummaries(enum SummaryKey summaryKey, enum OutputFormat format) {
+    static const char* keyNames[] = {"", "client", "user", "host", "worker"};
+    if (format == OUTPUT_CSV)
+        printf("%s,connections,failed,bytes_client_to_remote,bytes_remote_to_client,relay_seconds\n", keyNames[summaryKey]);
+
+    for (size_t i = 0; i < summaryCapacity; i++) {
+        struct Summary* summary = &summaries[i];
+        if (summary->key == NULL)
+            continue;
+
+        if (format == OUTPUT_CSV) {
+            printString(summary->key, strlen(summary->key), format);
+            printf(",%lu,%lu,%lu,%lu,%.6f\n", (unsigned long)summary->connections, (unsigned long)summary->failed, (unsigned long)summary->bytesClientToRemote, (unsigned long)summary->bytesRemoteToClient, summary->relayMicros / 1e6);
+        } else {
+            printf("{\"%s\": ", keyNames[summaryKey]);
+            printString(summary->key, strlen(summary->key), format);
+            printf(", \"connections\": %lu, \"failed\": %lu, \"bytes_client_to_remote\": %lu, \"bytes_remote_to_client\": %lu, \"relay_seconds\": %.6f}\n", (unsigned long)summary->connections, (unsigned long)summary->failed, (unsigned long)summary->bytesClientToRemote, (unsigned long)summary->bytesRemoteToClient, summary->relayMicros / 1e6);
+        }
+    }
+}
+
+/**
+ * Prints or adds up the records of a file. Returns 0 if successful, or -1 if the file couldn't be read.
+ */
+static int readFile(const char* path, enum OutputFormat format, enum SummaryKey summaryKey) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat status;
+    if (fd < 0 || fstat(fd, &status) != 0) {
+        perror(path);
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+
+    if ((size_t)status.st_size < sizeof(struct AccountingHeader)) {
+        fprintf(stderr, "%s: not an accounting log\n", path);
+        close(fd);
+        return -1;
+    }
+
+    void* mapping = mmap(NULL, status.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        perror(path);
+        return -1;
+    }
+
+    const struct AccountingHeader* header = mapping;
+    uint64_t recordCount = __atomic_load_n(&header->recordCount, __ATOMIC_ACQUIRE);
+    int result = 0;
+    if (memcmp(header->magic, ACCOUNTING_MAGIC, sizeof(header->magic)) != 0 || header->version != ACCOUNTING_VERSION || header->recordSize != sizeof(struct AccountingRecord)) {
+        fprintf(stderr, "%s: not an accounting log of this version\n", path);
+        result = -1;
+    } else if (sizeof(struct AccountingHeader) + recordCount * sizeof(struct AccountingRecord) > (uint64_t)status.st_size) {
+        fprintf(stderr, "%s: truncated\n", path);
+        result = -1;
+    } else {
+        const struct AccountingRecord* records = (const struct AccountingRecord*)(header + 1);
+        for (uint64_t i = 0; i < recordCount && result == 0; i++) {
+            if (summaryKey == SUMMARY_NONE)
+                printRecord(&records[i], format);
+            else
+                result = addToSummary(&records[i], summaryKey);
+        }
+    }
+
+    munmap(mapping, status.st_size);
+    return result;
+}
+
+int main(int argc, char* argv[]) {
+    enum OutputFormat format = OUTPUT_CSV;
+    enum SummaryKey summaryKey = SUMMARY_NONE;
+    int c;
+    while ((c = getopt(argc, argv, "js:h")) != -1) {
+        if (c == 'j') {
+            format = OUTPUT_JSON;
+        } else if (c == 's' && strcmp(optarg, "client") == 0) {
+            summaryKey = SUMMARY_CLIENT;
+        } else if (c == 's' && strcmp(optarg, "user") == 0) {
+            summaryKey = SUMMARY_USER;
+        } else if (c == 's' && strcmp(optarg, "host") == 0) {
+            summaryKey = SUMMARY_HOST;
+        } else if (c == 's' && strcmp(optarg, "worker") == 0) {
+            summaryKey = SUMMARY_WORKER;
+        } else {
+            printUsage(argv[0]);
+            return c == 'h' ? 0 : 1;
+        }
+    }
+
+    if (optind == argc) {
+        printUsage(argv[0]);
+        return 1;
+    }
+
+    if (summaryKey == SUMMARY_NONE && format == OUTPUT_CSV)
+        printCsvHeader();
+
+    int failed = 0;
+    for (int i = optind; i < argc; i++)
+        failed |= readFile(argv[i], format, summaryKey) != 0;
+
+    if (summaryKey != SUMMARY_NONE)
+        printSummaries(summaryKey, format);
+    return failed;
+}
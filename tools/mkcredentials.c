@@ -0,0 +1,201 @@
+/**
+ * Builds the credential index the server loads with --users, from a text file with one "username:password" per
+ * line (lines that are empty or start with '#' are skipped). Each password is stored as its PBKDF2-HMAC-SHA256
+ * with a random salt.
+ *
+ * The index is written to a temporary file which is then renamed over the output, so a running server reloading
+ * it (on SIGHUP) always finds either the previous index or the new one, never a partially written one.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/random.h>
+#include <unistd.h>
+
+#include "credentials.h"
+
+#define DEFAULT_ITERATIONS 1000
+
+struct User {
+    char* username;
+    size_t usernameLength;
+    uint32_t hash;
+    struct CredentialEntry entry;
+};
+
+static void printUsage(const char* programName) {
+    fprintf(stderr, "Usage: %s [-i <iterations>] <users.txt> <index>\n"
+                    "\n"
+                    "Builds a credential index for medias --users from a file with one username:password per line.\n"
+                    "  -i <iterations>   PBKDF2 iterations per password (default: %d). More iterations make stolen\n"
+                    "                    indexes harder to crack, and each uncached authentication slower.\n",
+            programName, DEFAULT_ITERATIONS);
+}
+
+static void freeUsers(struct User* users, long count) {
+    for (long i = 0; i < count; i++)
+        free(users[i].username);
+    free(users);
+}
+
+/**
+ * Reads the users from the input file. Returns the amount of users read, or -1 (having freed them) if the file
+ * is invalid.
+ */
+static long readUsers(FILE* input, struct User** users, uint32_t iterations) {
+    size_t capacity = 0;
+    long count = 0;
+    char* line = NULL;
+    size_t lineCapacity = 0;
+    ssize_t lineLength;
+    long lineNumber = 0;
+
+    while ((lineLength = getline(&line, &lineCapacity, input)) >= 0) {
+        lineNumber++;
+        while (lineLength > 0 && (line[lineLength - 1] == '\n' || line[lineLength - 1] == '\r'))
+            line[--lineLength] = '\0';
+        if (lineLength == 0 || line[0] == '#')
+            continue;
+
+        char* separator = strchr(line, ':');
+        size_t usernameLength = separator == NULL ? 0 : (size_t)(separator - line);
+        size_t passwordLength = separator == NULL ? 0 : strlen(separator + 1);
+        if (separator == NULL || usernameLength == 0 || usernameLength > 255 || passwordLength == 0 || passwordLength > 255) {
+            fprintf(stderr, "Line %ld: expected username:password, each between 1 and 255 bytes long\n", lineNumber);
+            free(line);
+            freeUsers(*users, count);
+            return -1;
+        }
+
+        if ((size_t)count == capacity) {
+            capacity = capacity == 0 ? 1024 : capacity * 2;
+            struct User* newUsers = realloc(*users, capacity * sizeof(struct User));
+            if (newUsers == NULL) {
+                perror("realloc()");
+                free(line);
+                freeUsers(*users, count);
+                return -1;
+            }
+            *users = newUsers;
+        }
+
+        struct User* user = &(*users)[count++];
+        user->username = strndup(line, usernameLength);
+        user->usernameLength = usernameLength;
+        user->hash = credentialHash(line, usernameLength);
+        if (user->username == NULL || getrandom(user->entry.salt, CREDENTIAL_SALT_LENGTH, 0) != CREDENTIAL_SALT_LENGTH) {
+            perror("Failed to prepare user");
+            free(line);
+            freeUsers(*users, count);
+            return -1;
+        }
+        sha256Pbkdf2(separator + 1, passwordLength, user->entry.salt, CREDENTIAL_SALT_LENGTH, iterations, user->entry.key);
+    }
+
+    free(line);
+    return count;
+}
+
+int main(int argc, char* argv[]) {
+    uint32_t iterations = DEFAULT_ITERATIONS;
+    int c;
+    while ((c = getopt(argc, argv, "i:h")) != -1) {
+        if (c == 'i' && atol(optarg) > 0) {
+            iterations = (uint32_t)atol(optarg);
+        } else {
+            printUsage(argv[0]);
+            return c == 'h' ? 0 : 1;
+        }
+    }
+
+    if (argc - optind != 2) {
+        printUsage(argv[0]);
+        return 1;
+    }
+    const char* inputPath = argv[optind];
+    const char* outputPath = argv[optind + 1];
+
+    FILE* input = fopen(inputPath, "r");
+    if (input == NULL) {
+        perror(inputPath);
+        return 1;
+    }
+    struct User* users = NULL;
+    long userCount = readUsers(input, &users, iterations);
+    fclose(input);
+    if (userCount < 0)
+        return 1;
+
+    // At most half the slots are used, so probes stay short (and there's always an empty slot to end them).
+    uint32_t slotCount = 16;
+    while (slotCount < userCount * 2)
+        slotCount *= 2;
+
+    struct CredentialSlot* slots = calloc(slotCount, sizeof(struct CredentialSlot));
+    if (slots == NULL) {
+        perror("calloc()");
+        freeUsers(users, userCount);
+        return 1;
+    }
+
+    uint32_t usernamesLength = 0;
+    for (long i = 0; i < userCount; i++) {
+        struct User* user = &users[i];
+        user->entry.usernameOffset = usernamesLength;
+        user->entry.usernameLength = user->usernameLength;
+        usernamesLength += user->usernameLength;
+
+        uint32_t position = user->hash & (slotCount - 1);
+        for (;; position = (position + 1) & (slotCount - 1)) {
+            if (slots[position].entry == 0)
+                break;
+            struct User* other = &users[slots[position].entry - 1];
+            if (other->hash == user->hash && other->usernameLength == user->usernameLength && memcmp(other->username, user->username, user->usernameLength) == 0) {
+                fprintf(stderr, "Duplicate user: %s\n", user->username);
+                free(slots);
+                freeUsers(users, userCount);
+                return 1;
+            }
+        }
+        slots[position].hash = user->hash;
+        slots[position].entry = i + 1;
+    }
+
+    struct CredentialIndexHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CREDENTIAL_INDEX_MAGIC, sizeof(header.magic));
+    header.version = CREDENTIAL_INDEX_VERSION;
+    header.iterations = iterations;
+    header.slotCount = slotCount;
+    header.entryCount = userCount;
+    header.usernamesLength = usernamesLength;
+
+    char temporaryPath[4096];
+    snprintf(temporaryPath, sizeof(temporaryPath), "%s.tmp", outputPath);
+    FILE* output = fopen(temporaryPath, "wb");
+    if (output == NULL) {
+        perror(temporaryPath);
+        free(slots);
+        freeUsers(users, userCount);
+        return 1;
+    }
+
+    int failed = fwrite(&header, sizeof(header), 1, output) != 1 || fwrite(slots, sizeof(struct CredentialSlot), slotCount, output) != slotCount;
+    for (long i = 0; !failed && i < userCount; i++)
+        failed = fwrite(&users[i].entry, sizeof(struct CredentialEntry), 1, output) != 1;
+    for (long i = 0; !failed && i < userCount; i++)
+        failed = fwrite(users[i].username, 1, users[i].usernameLength, output) != users[i].usernameLength;
+    if (fflush(output) != 0 || fsync(fileno(output)) != 0)
+        failed = 1;
+    free(slots);
+    freeUsers(users, userCount);
+    if (fclose(output) != 0 || failed || rename(temporaryPath, outputPath) != 0) {
+        perror(outputPath);
+        unlink(temporaryPath);
+        return 1;
+    }
+
+    printf("Wrote %ld users to %s (%u slots, %u iterations)\n", userCount, outputPath, slotCount, iterations);
+    return 0;
+}